@@ -1,4 +1,5 @@
 #include <kelimelik.h>
+#include <kelimelik-game-module.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
@@ -15,17 +16,15 @@ int main(int argc, char **argv) {
 	}
 	int fd;
 	kelimelik_connection_new(&fd);
-	kelimelik_packet *packet;
-	kelimelik_packet_new_v1(&packet, "GameModule_requestLogin", 3);
-	kelimelik_packet_set_uint32(packet, 0, atoi(argv[1]));
-	kelimelik_packet_set_string_v1(packet, 1, argv[2]);
-	kelimelik_packet_set_uint32(packet, 2, 238);
-	void *encoded_packet;
-	size_t encoded_packet_length;
-	kelimelik_packet_encode(packet, &encoded_packet, &encoded_packet_length);
-	kelimelik_packet_free(packet);
-	send(fd, encoded_packet, encoded_packet_length, 0);
-	free(encoded_packet);
+	game_module_request_login login = {
+		.uid = atoi(argv[1]),
+		.password = KELIMELIK_SCHEMA_STRING(argv[2]),
+		.version = 238
+	};
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	game_module_request_login_encode(&login, &buffer);
+	send(fd, buffer.bytes, buffer.length, 0);
+	kelimelik_buffer_free(&buffer);
 	kelimelik_parser *parser;
 	kelimelik_parser_new(&parser);
 	char *email_address = NULL;
@@ -33,43 +32,52 @@ int main(int argc, char **argv) {
 	uint32_t win_ratio = 0;
 	uint32_t won = 0;
 	uint32_t total = 0;
-	while (1) {
-		uint8_t val;
-		if (recv(fd, &val, 1, 0) != 1) {
+	bool done = false;
+	while (!done) {
+		uint8_t received[4096];
+		ssize_t received_length = recv(fd, received, sizeof(received), 0);
+		if (received_length <= 0) {
 			fprintf(stderr, "recv() failed.\n");
 			return EXIT_FAILURE;
 		}
-		kelimelik_packet *new_packet;
-		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance_single(parser, val, &new_packet)));
-		if (new_packet) {
-			if (!strcmp((char *)new_packet->header->string, "GameModule_loginRefused")) {
+		const kelimelik_frame *frames;
+		size_t frame_count;
+		kelimelik_parser_advance_frames(parser, received, received_length, &frames, &frame_count);
+		for (size_t i=0; (i<frame_count) && !done; i++) {
+			const kelimelik_frame *frame = &frames[i];
+			game_module_login_accepted accepted;
+			game_module_user_profile profile;
+			game_module_login_refused refused;
+			if (!KELIMELIK_IS_ERROR(game_module_login_refused_decode(frame->bytes, frame->length, &refused))) {
 				fprintf(stderr, "Login refused.\n");
 				return EXIT_FAILURE;
 			}
-			else if (!strcmp((char *)new_packet->header->string, "GameModule_loginAccepted")) {
+			else if (!KELIMELIK_IS_ERROR(game_module_login_accepted_decode(frame->bytes, frame->length, &accepted))) {
 				if (email_address) {
 					free(email_address);
 				}
-				email_address = malloc(new_packet->objects[3].string->length + 1 + new_packet->objects[1].string->length + 1);
+				email_address = malloc(accepted.email_address.length + 1 + accepted.username.length + 1);
 				if (!email_address) {
 					perror("malloc");
 					return EXIT_FAILURE;
 				}
-				username = email_address + new_packet->objects[3].string->length + 1;
-				memcpy(email_address, new_packet->objects[3].string->string, new_packet->objects[3].string->length + 1);
-				memcpy(username, new_packet->objects[1].string->string, new_packet->objects[1].string->length + 1);
+				username = email_address + accepted.email_address.length + 1;
+				memcpy(email_address, accepted.email_address.bytes, accepted.email_address.length);
+				email_address[accepted.email_address.length] = 0;
+				memcpy(username, accepted.username.bytes, accepted.username.length);
+				username[accepted.username.length] = 0;
 			}
-			else if (!strcmp((char *)new_packet->header->string, "GameModule_userProfile")) {
-				win_ratio = new_packet->objects[5].uint32;
-				won = new_packet->objects[2].uint32;
-				total = new_packet->objects[1].uint32;
+			else if (!KELIMELIK_IS_ERROR(game_module_user_profile_decode(frame->bytes, frame->length, &profile))) {
+				win_ratio = profile.win_ratio;
+				won = profile.won_games;
+				total = profile.total_games;
 			}
-			//char *description = kelimelik_packet_description(new_packet);
-			//printf("Received packet: %s\n", description);
-			//free(description);
-			if (strcmp((char *)new_packet->header->string, "GameModule_userPurchaseData") == 0) {
+			else if (
+				(frame->header_length == (sizeof(GAME_MODULE_USER_PURCHASE_DATA_HEADER) - 1)) &&
+				!memcmp(frame->header, GAME_MODULE_USER_PURCHASE_DATA_HEADER, frame->header_length)
+			) {
 				// This is the last packet
-				break;
+				done = true;
 			}
 		}
 	}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <string.h>
+#include <kelimelik.h>
+
+// Prints every packet with the given header from a capture file, optionally
+// only for a single connection. Uses the header index, so only the matching
+// frames are decoded. Captures without a header index are indexed first.
+
+int main(int argc, char **argv) {
+	if ((argc < 3) || (argc > 4)) {
+		fprintf(stderr, "Usage: %s <capture> <header> [connection-id]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	uint32_t connection_id = (argc == 4) ? strtoul(argv[3], NULL, 10) : KELIMELIK_CAPTURE_ANY_CONNECTION;
+	kelimelik_capture *capture;
+	kelimelik_error error = kelimelik_capture_open(&capture, argv[1]);
+	const kelimelik_capture_index_entry *entries;
+	size_t entry_count;
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_capture_query(capture, argv[2], connection_id, &entries, &entry_count);
+		if (error.kelimelik_errno == KELIMELIK_ERROR_INVALID_CAPTURE) {
+			fprintf(stderr, "The capture has no header index, building it...\n");
+			kelimelik_capture_close(capture);
+			error = kelimelik_capture_build_index(argv[1]);
+			if (!KELIMELIK_IS_ERROR(error)) {
+				error = kelimelik_capture_open(&capture, argv[1]);
+			}
+			if (!KELIMELIK_IS_ERROR(error)) {
+				error = kelimelik_capture_query(capture, argv[2], connection_id, &entries, &entry_count);
+			}
+		}
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		fprintf(stderr, "Failed to query the capture: %s\n", kelimelik_strerror(error));
+		return EXIT_FAILURE;
+	}
+	kelimelik_parser *parser;
+	kelimelik_parser_new(&parser);
+	for (size_t i=0; i<entry_count; i++) {
+		kelimelik_capture_frame frame;
+		kelimelik_capture_get_frame(capture, entries[i].frame_index, &frame);
+		kelimelik_packet **packets;
+		size_t packet_count;
+		kelimelik_parser_advance(parser, (uint8_t *)frame.bytes, frame.length, &packets, &packet_count);
+		for (size_t j=0; j<packet_count; j++) {
+			char *description = kelimelik_packet_description(packets[j]);
+			printf("[%llu] [#%u] [%s] %s\n",
+				(unsigned long long)frame.timestamp,
+				frame.connection_id,
+				(frame.direction == KELIMELIK_DIRECTION_SERVER_TO_CLIENT) ? "Server" : "Client",
+				description
+			);
+			free(description);
+		}
+	}
+	printf("%zu matching frames\n", entry_count);
+	kelimelik_parser_free(parser);
+	kelimelik_capture_close(capture);
+	return EXIT_SUCCESS;
+}
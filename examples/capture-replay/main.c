@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <kelimelik.h>
+
+// Replays a capture file written by the proxy through a parser. By default
+// only the decoding throughput is printed, which makes captures usable as
+// benchmark inputs. With -v, every decoded packet is printed as well.
+
+static size_t packet_count = 0;
+static bool verbose = false;
+
+static void replay_callback(const kelimelik_capture_frame *frame, kelimelik_packet *packet, void *context) {
+	packet_count++;
+	if (verbose) {
+		char *description = kelimelik_packet_description(packet);
+		printf("[%llu] [#%u] [%s] %s\n",
+			(unsigned long long)frame->timestamp,
+			frame->connection_id,
+			(frame->direction == KELIMELIK_DIRECTION_SERVER_TO_CLIENT) ? "Server" : "Client",
+			description
+		);
+		free(description);
+	}
+}
+
+int main(int argc, char **argv) {
+	if ((argc < 2) || ((argc == 3) && strcmp(argv[1], "-v")) || (argc > 3)) {
+		fprintf(stderr, "Usage: %s [-v] <capture>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	verbose = (argc == 3);
+	kelimelik_capture *capture;
+	kelimelik_error error = kelimelik_capture_open(&capture, argv[argc-1]);
+	if (KELIMELIK_IS_ERROR(error)) {
+		fprintf(stderr, "Failed to open the capture: %s\n", kelimelik_strerror(error));
+		return EXIT_FAILURE;
+	}
+	size_t byte_count = 0;
+	for (size_t i=0; i<kelimelik_capture_frame_count(capture); i++) {
+		kelimelik_capture_frame frame;
+		kelimelik_capture_get_frame(capture, i, &frame);
+		byte_count += frame.length;
+	}
+	kelimelik_parser *parser;
+	kelimelik_parser_new(&parser);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = kelimelik_capture_replay(capture, parser, replay_callback, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	kelimelik_parser_free(parser);
+	if (KELIMELIK_IS_ERROR(error)) {
+		fprintf(stderr, "Replay failed: %s\n", kelimelik_strerror(error));
+	}
+	double seconds = (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+	printf(
+		"Frames ........ %zu\n"
+		"Packets ....... %zu\n"
+		"Bytes ......... %zu\n"
+		"Time .......... %.3f s\n"
+		"Throughput .... %.1f MB/s, %.0f packets/s\n",
+		kelimelik_capture_frame_count(capture), packet_count, byte_count, seconds,
+		(seconds > 0) ? (byte_count / seconds / 1e6) : 0.0,
+		(seconds > 0) ? (packet_count / seconds) : 0.0
+	);
+	kelimelik_capture_close(capture);
+	return KELIMELIK_IS_ERROR(error) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <kelimelik.hpp>
+
+// Shows how to use the C++ wrapper. Reads frames from stdin, for example the
+// output of json-encode, and prints every word list response without
+// copying any of the strings:
+//
+//   ./json-encode < fixtures.jsonl | ./cpp-wrapper
+//
+// Without input, a word list is built, encoded and decoded again.
+
+static constexpr char word_list_format[] = "Sq";
+
+static void print_packet(kelimelik::packet_view packet) {
+	if (!packet.matches(word_list_format)) {
+		std::printf("%.*s (%u objects)\n", (int)packet.header().size(), packet.header().data(), packet.size());
+		return;
+	}
+	kelimelik::typed<word_list_format> word_list(packet);
+	kelimelik::string_list words = word_list.get<0>();
+	std::printf("%.*s: %zu words, version %llu\n", (int)packet.header().size(), packet.header().data(), words.size(), (unsigned long long)word_list.get<1>());
+	for (std::string_view word : words) {
+		std::printf("  %.*s\n", (int)word.size(), word.data());
+	}
+}
+
+int main() {
+	try {
+		kelimelik::parser parser;
+		if (!isatty(STDIN_FILENO)) {
+			uint8_t buffer[1 << 16];
+			ssize_t length;
+			while ((length = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+				for (kelimelik::packet_view packet : parser.advance(buffer, length)) {
+					print_packet(packet);
+				}
+			}
+			return EXIT_SUCCESS;
+		}
+
+		// Build a word list, send it through the parser and keep the result
+		// past the next call
+		kelimelik::packet packet("wordList", 2);
+		packet.set_strings(0, { "KELIME", "OYUN" });
+		packet.set_uint64(1, 3);
+		packet.freeze();
+		kelimelik::span<const uint8_t> wire = packet.wire();
+		kelimelik::packet decoded;
+		for (kelimelik::packet_view view : parser.advance(wire.data(), wire.size())) {
+			decoded = view.retain();
+		}
+		parser.advance(nullptr, 0);
+		print_packet(decoded);
+	}
+	catch (const kelimelik::error &error) {
+		std::fprintf(stderr, "%s\n", error.what());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
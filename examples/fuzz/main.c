@@ -0,0 +1,773 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <kelimelik.h>
+
+// Differential fuzzer for the decoders. Every input is treated as a stream of
+// frames and decoded by every decoder: the parser with each of its options,
+// framing followed by kelimelik_frame_decode(), the stream handler and a
+// decode pipeline. Every packet they return is encoded again, and the
+// results have to be the same bytes as the ones from the plain parser. The
+// parsers are also fed the input in many different chunks, which must not
+// change anything either.
+//
+// Without arguments, random packets are generated from a fixed seed and
+// checked, first as they are and then with random mutations. Encoding the
+// generated packets and decoding them again must give the same packets. The
+// decode throughput of every decoder is printed at the end:
+//
+//   ./fuzz [iterations] [seed]
+//
+// The same checks can be run by libFuzzer:
+//
+//   clang -g -O1 -fsanitize=fuzzer,address -DKELIMELIK_LIBFUZZER -Iheaders examples/fuzz/main.c src/*.c -o fuzz
+//   ./fuzz corpus/
+//
+// The trusted decoder is only used for inputs that the plain parser accepted
+// completely, since it may read past malformed frames.
+
+#define FUZZ_MAX_FRAME_SIZE (1 << 20)
+#define FUZZ_MAX_SPLITS 256
+#define FUZZ_RANDOM_CHUNKINGS 16
+
+enum fuzz_decoder {
+	FUZZ_PARSER,
+	FUZZ_KEEP_WIRE,
+	FUZZ_LAZY,
+	FUZZ_TRUSTED,
+	FUZZ_INTERNED,
+	FUZZ_FRAMES,
+	FUZZ_STREAM,
+	FUZZ_PIPELINE,
+	FUZZ_DECODER_COUNT
+};
+
+static const char *decoder_names[FUZZ_DECODER_COUNT] = {
+	"parser",
+	"keep-wire",
+	"lazy",
+	"trusted",
+	"interned",
+	"frames",
+	"stream",
+	"pipeline"
+};
+
+// Time spent in each decoder on whole inputs, including encoding the packets
+// again for the comparison
+struct fuzz_throughput {
+	double seconds;
+	size_t bytes;
+};
+
+static struct fuzz_throughput throughput[FUZZ_DECODER_COUNT];
+static kelimelik_pipeline *pipeline;
+static const kelimelik_parser_limits limits = { .max_frame_size = FUZZ_MAX_FRAME_SIZE };
+
+static double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + (time.tv_nsec / 1e9);
+}
+
+static void fail(const uint8_t *bytes, size_t length, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "fuzz: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, " (input of %zu bytes)\n", length);
+	va_end(args);
+	abort();
+}
+
+static void ignore_log(enum kelimelik_log_level level, const char *message, void *context) {}
+
+// Deterministic xorshift generator, so that every run checks the same inputs
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t hash_bytes(const uint8_t *bytes, size_t length) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i=0; i<length; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+	}
+	return hash | 1;
+}
+
+// How an input is cut into the chunks that are passed to a parser. split
+// cuts it in two, fixed cuts it into chunks of the same length, and seed cuts
+// it into chunks of random lengths. All zero passes the input at once.
+struct fuzz_chunking {
+	size_t split;
+	size_t fixed;
+	uint64_t seed;
+};
+
+static size_t next_chunk(const struct fuzz_chunking *chunking, uint64_t *state, size_t offset, size_t remaining) {
+	size_t length = remaining;
+	if (chunking->split) {
+		length = (offset < chunking->split) ? (chunking->split - offset) : remaining;
+	}
+	else if (chunking->fixed) {
+		length = chunking->fixed;
+	}
+	else if (chunking->seed) {
+		length = 1 + (next_random(state) % 64);
+	}
+	return (length > remaining) ? remaining : length;
+}
+
+// Appends a decoded packet in wire format
+static void append_packet(kelimelik_packet *packet, kelimelik_buffer *out, const char *decoder) {
+	if (KELIMELIK_IS_ERROR(kelimelik_packet_materialize(packet))) {
+		// Lazy packets that turn out to be malformed, which the other decoders
+		// skip
+		return;
+	}
+	kelimelik_error error = kelimelik_packet_encode_v2(packet, out);
+	if (KELIMELIK_IS_ERROR(error)) {
+		fail(NULL, out->length, "%s: can't encode a decoded packet: %s", decoder, kelimelik_strerror(error));
+	}
+}
+
+// Decodes the input with a parser and appends every packet to out. Returns
+// the last error.
+static kelimelik_error parse(
+	int options,
+	kelimelik_intern_pool *pool,
+	const struct fuzz_chunking *chunking,
+	const uint8_t *bytes,
+	size_t length,
+	kelimelik_buffer *out
+) {
+	kelimelik_counting_allocator counter;
+	kelimelik_counting_allocator_init(&counter, NULL);
+	kelimelik_parser *parser;
+	kelimelik_error last_error = kelimelik_parser_new_v2(&parser, &counter.allocator);
+	if (KELIMELIK_IS_ERROR(last_error)) {
+		fail(bytes, length, "can't create a parser: %s", kelimelik_strerror(last_error));
+	}
+	kelimelik_parser_set_options(parser, options);
+	kelimelik_parser_set_limits(parser, &limits);
+	kelimelik_parser_set_intern_pool(parser, pool);
+	uint64_t state = chunking->seed;
+	for (size_t offset=0; offset<length;) {
+		size_t chunk_length = next_chunk(chunking, &state, offset, length - offset);
+		kelimelik_packet **packets;
+		size_t count;
+		kelimelik_error error = kelimelik_parser_advance(parser, (uint8_t *)bytes + offset, chunk_length, &packets, &count);
+		if (KELIMELIK_IS_ERROR(error)) {
+			last_error = error;
+		}
+		for (size_t i=0; i<count; i++) {
+			append_packet(packets[i], out, "parser");
+		}
+		offset += chunk_length;
+	}
+	kelimelik_parser_free(parser);
+	if (counter.bytes_in_use || counter.allocation_count) {
+		fail(bytes, length, "parser with options %d leaked %zu bytes", options, counter.bytes_in_use);
+	}
+	if (pool && kelimelik_intern_pool_count(pool)) {
+		fail(bytes, length, "parser leaked %zu interned strings", kelimelik_intern_pool_count(pool));
+	}
+	return last_error;
+}
+
+// Splits the input into frames first and decodes each of them separately
+static void parse_frames(const struct fuzz_chunking *chunking, const uint8_t *bytes, size_t length, kelimelik_buffer *out) {
+	kelimelik_parser *parser;
+	kelimelik_error error = kelimelik_parser_new(&parser);
+	if (KELIMELIK_IS_ERROR(error)) {
+		fail(bytes, length, "can't create a parser: %s", kelimelik_strerror(error));
+	}
+	kelimelik_parser_set_limits(parser, &limits);
+	uint64_t state = chunking->seed;
+	for (size_t offset=0; offset<length;) {
+		size_t chunk_length = next_chunk(chunking, &state, offset, length - offset);
+		const kelimelik_frame *frames;
+		size_t count;
+		kelimelik_parser_advance_frames(parser, (uint8_t *)bytes + offset, chunk_length, &frames, &count);
+		for (size_t i=0; i<count; i++) {
+			kelimelik_packet *packet;
+			if (!KELIMELIK_IS_ERROR(kelimelik_frame_decode(&frames[i], NULL, &packet))) {
+				append_packet(packet, out, "frames");
+				kelimelik_packet_free(packet);
+			}
+		}
+		offset += chunk_length;
+	}
+	kelimelik_parser_free(parser);
+}
+
+// Builds the wire format of every streamed frame from the callbacks. The
+// frame at the end of the input may never be finished.
+struct fuzz_stream {
+	kelimelik_buffer *out;
+	size_t frame_start;
+	bool in_frame;
+};
+
+static void append_integer(kelimelik_buffer *out, uint64_t value, int size) {
+	uint8_t bytes[8];
+	for (int i=0; i<size; i++) {
+		bytes[i] = (uint8_t)(value >> ((size - i - 1) * 8));
+	}
+	kelimelik_buffer_append(out, bytes, size);
+}
+
+static void append_string(kelimelik_buffer *out, const kelimelik_string *string) {
+	append_integer(out, string->length, 2);
+	kelimelik_buffer_append(out, string->string, string->length);
+}
+
+static void stream_begin(void *context, const kelimelik_frame *frame) {
+	struct fuzz_stream *stream = context;
+	stream->frame_start = stream->out->length;
+	stream->in_frame = true;
+	append_integer(stream->out, 0, 4);
+	append_integer(stream->out, frame->header_length, 2);
+	kelimelik_buffer_append(stream->out, frame->header, frame->header_length);
+	append_integer(stream->out, frame->object_count, 1);
+}
+
+static void stream_object(void *context, uint8_t index, const kelimelik_object *object) {
+	struct fuzz_stream *stream = context;
+	append_integer(stream->out, object->type, 1);
+	switch (object->type) {
+		case KELIMELIK_OBJECT_UINT8:
+			append_integer(stream->out, object->uint8, 1);
+			break;
+		case KELIMELIK_OBJECT_UINT32:
+			append_integer(stream->out, object->uint32, 4);
+			break;
+		case KELIMELIK_OBJECT_UINT64:
+			append_integer(stream->out, object->uint64, 8);
+			break;
+		case KELIMELIK_OBJECT_STRING:
+			append_string(stream->out, object->string);
+			break;
+		default:
+			fail(NULL, 0, "stream: unexpected object type %d", object->type);
+	}
+}
+
+static void stream_array_begin(void *context, uint8_t index, enum kelimelik_object_type item_type, uint32_t item_count) {
+	struct fuzz_stream *stream = context;
+	append_integer(stream->out, KELIMELIK_OBJECT_ARRAY, 1);
+	append_integer(stream->out, item_count, 4);
+	append_integer(stream->out, item_type, 1);
+}
+
+static void stream_array_items(void *context, uint8_t index, const kelimelik_array *items, uint32_t first_item) {
+	struct fuzz_stream *stream = context;
+	for (uint32_t i=0; i<items->item_count; i++) {
+		switch (items->type) {
+			case KELIMELIK_OBJECT_UINT8:
+				append_integer(stream->out, items->uint8s[i], 1);
+				break;
+			case KELIMELIK_OBJECT_UINT32:
+				append_integer(stream->out, items->uint32s[i], 4);
+				break;
+			case KELIMELIK_OBJECT_UINT64:
+				append_integer(stream->out, items->uint64s[i], 8);
+				break;
+			default:
+				append_string(stream->out, items->strings[i]);
+				break;
+		}
+	}
+}
+
+static void stream_end(void *context, kelimelik_error error) {
+	struct fuzz_stream *stream = context;
+	if (!stream->in_frame) {
+		// Frames with a broken header end without beginning
+		return;
+	}
+	stream->in_frame = false;
+	if (KELIMELIK_IS_ERROR(error)) {
+		stream->out->length = stream->frame_start;
+		return;
+	}
+	uint32_t size = htonl((uint32_t)(stream->out->length - stream->frame_start - 4));
+	memcpy(stream->out->bytes + stream->frame_start, &size, 4);
+}
+
+static void parse_stream(const struct fuzz_chunking *chunking, const uint8_t *bytes, size_t length, kelimelik_buffer *out) {
+	struct fuzz_stream stream = { .out = out };
+	kelimelik_stream_handler handler = {
+		.begin = stream_begin,
+		.object = stream_object,
+		.array_begin = stream_array_begin,
+		.array_items = stream_array_items,
+		.end = stream_end,
+		.context = &stream
+	};
+	kelimelik_parser *parser;
+	kelimelik_error error = kelimelik_parser_new(&parser);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_parser_set_stream_handler(parser, &handler, 0);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		fail(bytes, length, "can't create a streaming parser: %s", kelimelik_strerror(error));
+	}
+	kelimelik_parser_set_limits(parser, &limits);
+	uint64_t state = chunking->seed;
+	for (size_t offset=0; offset<length;) {
+		size_t chunk_length = next_chunk(chunking, &state, offset, length - offset);
+		kelimelik_packet **packets;
+		size_t count;
+		kelimelik_parser_advance(parser, (uint8_t *)bytes + offset, chunk_length, &packets, &count);
+		if (count) {
+			fail(bytes, length, "stream: %zu frames weren't streamed", count);
+		}
+		offset += chunk_length;
+	}
+	if (stream.in_frame) {
+		out->length = stream.frame_start;
+	}
+	kelimelik_parser_free(parser);
+}
+
+// Frames of a connection are delivered one at a time and in order, so the
+// callback can append to the connection's buffer without a lock
+static void pipeline_callback(void *connection_context, const kelimelik_frame *frame, kelimelik_packet *packet, kelimelik_error error, void *context) {
+	if (packet) {
+		append_packet(packet, connection_context, "pipeline");
+	}
+}
+
+static void parse_pipeline(const uint8_t *bytes, size_t length, kelimelik_buffer *out) {
+	kelimelik_error error = { .kelimelik_errno = KELIMELIK_SUCCESS };
+	if (!pipeline) {
+		error = kelimelik_pipeline_new(&pipeline, 2, NULL, pipeline_callback, NULL);
+		if (!KELIMELIK_IS_ERROR(error)) {
+			kelimelik_pipeline_set_limits(pipeline, &limits);
+		}
+	}
+	kelimelik_pipeline_connection *connection;
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_pipeline_connection_new(pipeline, &connection, out);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		fail(bytes, length, "can't create a pipeline: %s", kelimelik_strerror(error));
+	}
+	kelimelik_pipeline_submit(connection, (uint8_t *)bytes, length);
+	kelimelik_pipeline_connection_free(connection);
+	kelimelik_pipeline_flush(pipeline);
+}
+
+static void compare(const kelimelik_buffer *expected, const kelimelik_buffer *actual, const char *decoder, const struct fuzz_chunking *chunking, const uint8_t *bytes, size_t length) {
+	if ((expected->length != actual->length) || (expected->length && memcmp(expected->bytes, actual->bytes, expected->length))) {
+		fail(bytes, length, "%s decoded %zu bytes of packets instead of %zu (split %zu, fixed %zu, seed %llu)",
+			decoder, actual->length, expected->length, chunking->split, chunking->fixed, (unsigned long long)chunking->seed);
+	}
+}
+
+// Decodes bytes with every decoder and checks that they agree
+static void fuzz_one(const uint8_t *bytes, size_t length) {
+	static const struct fuzz_chunking whole = { 0 };
+	kelimelik_buffer expected = KELIMELIK_BUFFER_INITIALIZER;
+	kelimelik_buffer actual = KELIMELIK_BUFFER_INITIALIZER;
+	double start = now();
+	kelimelik_error error = parse(0, NULL, &whole, bytes, length, &expected);
+	throughput[FUZZ_PARSER].seconds += now() - start;
+	throughput[FUZZ_PARSER].bytes += length;
+
+	// Decoded packets encode to frames that decode to the same packets
+	kelimelik_buffer_reset(&actual);
+	parse(0, NULL, &whole, expected.bytes, expected.length, &actual);
+	compare(&expected, &actual, "re-encoding", &whole, bytes, length);
+
+	// Every decoder on the whole input
+	kelimelik_intern_pool *pool;
+	if (KELIMELIK_IS_ERROR(kelimelik_intern_pool_new(&pool, NULL))) {
+		fail(bytes, length, "can't create an intern pool");
+	}
+	for (int decoder=FUZZ_KEEP_WIRE; decoder<FUZZ_DECODER_COUNT; decoder++) {
+		if ((decoder == FUZZ_TRUSTED) && KELIMELIK_IS_ERROR(error)) {
+			continue;
+		}
+		kelimelik_buffer_reset(&actual);
+		start = now();
+		switch (decoder) {
+			case FUZZ_KEEP_WIRE:
+				parse(KELIMELIK_PARSER_KEEP_WIRE, NULL, &whole, bytes, length, &actual);
+				break;
+			case FUZZ_LAZY:
+				parse(KELIMELIK_PARSER_LAZY, NULL, &whole, bytes, length, &actual);
+				break;
+			case FUZZ_TRUSTED:
+				parse(KELIMELIK_PARSER_TRUSTED, NULL, &whole, bytes, length, &actual);
+				break;
+			case FUZZ_INTERNED:
+				parse(0, pool, &whole, bytes, length, &actual);
+				break;
+			case FUZZ_FRAMES:
+				parse_frames(&whole, bytes, length, &actual);
+				break;
+			case FUZZ_STREAM:
+				parse_stream(&whole, bytes, length, &actual);
+				break;
+			case FUZZ_PIPELINE:
+				parse_pipeline(bytes, length, &actual);
+				break;
+		}
+		throughput[decoder].seconds += now() - start;
+		throughput[decoder].bytes += length;
+		compare(&expected, &actual, decoder_names[decoder], &whole, bytes, length);
+	}
+	kelimelik_intern_pool_free(pool);
+
+	// Chunkings: two chunks at every split point near the start, chunks of a
+	// few fixed lengths and chunks of random lengths
+	struct fuzz_chunking chunkings[FUZZ_MAX_SPLITS + 8 + FUZZ_RANDOM_CHUNKINGS];
+	size_t chunking_count = 0;
+	for (size_t split=1; (split < length) && (split <= FUZZ_MAX_SPLITS); split++) {
+		chunkings[chunking_count++] = (struct fuzz_chunking){ .split = split };
+	}
+	for (size_t fixed=1; fixed<=128; fixed*=2) {
+		chunkings[chunking_count++] = (struct fuzz_chunking){ .fixed = fixed };
+	}
+	uint64_t seed = hash_bytes(bytes, length);
+	for (int i=0; i<FUZZ_RANDOM_CHUNKINGS; i++) {
+		chunkings[chunking_count++] = (struct fuzz_chunking){ .seed = next_random(&seed) | 1 };
+	}
+	for (size_t i=0; i<chunking_count; i++) {
+		kelimelik_buffer_reset(&actual);
+		parse(0, NULL, &chunkings[i], bytes, length, &actual);
+		compare(&expected, &actual, "parser", &chunkings[i], bytes, length);
+
+		// The other framing code is only checked with the random chunkings
+		if (!chunkings[i].seed) {
+			continue;
+		}
+		kelimelik_buffer_reset(&actual);
+		parse(KELIMELIK_PARSER_LAZY, NULL, &chunkings[i], bytes, length, &actual);
+		compare(&expected, &actual, "lazy", &chunkings[i], bytes, length);
+		kelimelik_buffer_reset(&actual);
+		parse_frames(&chunkings[i], bytes, length, &actual);
+		compare(&expected, &actual, "frames", &chunkings[i], bytes, length);
+		kelimelik_buffer_reset(&actual);
+		parse_stream(&chunkings[i], bytes, length, &actual);
+		compare(&expected, &actual, "stream", &chunkings[i], bytes, length);
+	}
+	kelimelik_buffer_free(&expected);
+	kelimelik_buffer_free(&actual);
+}
+
+static void print_throughput(void) {
+	printf("%-10s %12s %12s\n", "decoder", "MB/s", "inputs (MB)");
+	for (int i=0; i<FUZZ_DECODER_COUNT; i++) {
+		if (throughput[i].seconds > 0) {
+			printf("%-10s %12.1f %12.1f\n", decoder_names[i], (throughput[i].bytes / 1e6) / throughput[i].seconds, throughput[i].bytes / 1e6);
+		}
+	}
+}
+
+#ifdef KELIMELIK_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *bytes, size_t length) {
+	static bool initialized = false;
+	if (!initialized) {
+		kelimelik_set_log_sink(ignore_log, NULL);
+		atexit(print_throughput);
+		initialized = true;
+	}
+	fuzz_one(bytes, length);
+	return 0;
+}
+
+#else
+
+// Random packets. Strings and arrays are sometimes long enough to spill out
+// of inline storage or to be streamed in several chunks.
+static size_t random_length(uint64_t *state, size_t usual, size_t rare) {
+	return (next_random(state) % 16) ? (next_random(state) % (usual + 1)) : (next_random(state) % (rare + 1));
+}
+
+static void random_string(uint64_t *state, char *string, size_t length) {
+	for (size_t i=0; i<length; i++) {
+		string[i] = 'A' + (next_random(state) % 26);
+	}
+	string[length] = 0;
+}
+
+static kelimelik_array *random_array(uint64_t *state) {
+	static const enum kelimelik_object_type types[] = { KELIMELIK_OBJECT_UINT8, KELIMELIK_OBJECT_UINT32, KELIMELIK_OBJECT_UINT64, KELIMELIK_OBJECT_STRING };
+	enum kelimelik_object_type type = types[next_random(state) % 4];
+	size_t count = random_length(state, 16, 5000);
+	kelimelik_array *array = NULL;
+	kelimelik_error error;
+	if (type == KELIMELIK_OBJECT_STRING) {
+		char **strings = malloc((count + 1) * sizeof(*strings));
+		for (size_t i=0; i<count; i++) {
+			size_t length = random_length(state, 12, 300);
+			strings[i] = malloc(length + 1);
+			random_string(state, strings[i], length);
+		}
+		error = kelimelik_string_array_new_v2(&array, (const char **)strings, count);
+		for (size_t i=0; i<count; i++) {
+			free(strings[i]);
+		}
+		free(strings);
+	}
+	else {
+		uint64_t *values = malloc((count + 1) * sizeof(*values));
+		for (size_t i=0; i<count; i++) {
+			values[i] = next_random(state);
+		}
+		if (type == KELIMELIK_OBJECT_UINT8) {
+			uint8_t *uint8s = (uint8_t *)values;
+			for (size_t i=0; i<count; i++) {
+				uint8s[i] = (uint8_t)values[i];
+			}
+			error = kelimelik_uint8_array_new(&array, uint8s, count);
+		}
+		else if (type == KELIMELIK_OBJECT_UINT32) {
+			uint32_t *uint32s = (uint32_t *)values;
+			for (size_t i=0; i<count; i++) {
+				uint32s[i] = (uint32_t)values[i];
+			}
+			error = kelimelik_uint32_array_new(&array, uint32s, count);
+		}
+		else {
+			error = kelimelik_uint64_array_new(&array, values, count);
+		}
+		free(values);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		fail(NULL, 0, "can't create an array: %s", kelimelik_strerror(error));
+	}
+	return array;
+}
+
+static kelimelik_packet *random_packet(uint64_t *state) {
+	char header[301];
+	random_string(state, header, random_length(state, 24, 300));
+	uint8_t object_count = (uint8_t)random_length(state, 8, 255);
+	kelimelik_packet *packet;
+	if (KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, header, object_count))) {
+		fail(NULL, 0, "can't create a packet");
+	}
+	for (uint8_t i=0; i<object_count; i++) {
+		char string[301];
+		switch (next_random(state) % 5) {
+			case 0:
+				kelimelik_packet_set_uint8(packet, i, (uint8_t)next_random(state));
+				break;
+			case 1:
+				kelimelik_packet_set_uint32(packet, i, (uint32_t)next_random(state));
+				break;
+			case 2:
+				kelimelik_packet_set_uint64(packet, i, next_random(state));
+				break;
+			case 3:
+				random_string(state, string, random_length(state, 24, 300));
+				kelimelik_packet_set_string_v1(packet, i, string);
+				break;
+			default:
+				kelimelik_packet_set_array(packet, i, random_array(state));
+				break;
+		}
+	}
+	return packet;
+}
+
+static uint32_t read_uint32(const uint8_t *bytes) {
+	uint32_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return ntohl(value);
+}
+
+// Finds the item counts of the arrays in the frames, up to the first frame
+// that isn't well-formed.
+static size_t find_array_counts(const kelimelik_buffer *buffer, size_t *offsets, size_t max_offsets) {
+	const uint8_t *bytes = buffer->bytes;
+	size_t found = 0;
+	for (size_t frame=0; (buffer->length - frame) >= 7;) {
+		size_t end = frame + 4 + read_uint32(bytes + frame);
+		if (end > buffer->length) {
+			break;
+		}
+		size_t offset = frame + 6 + ((bytes[frame + 4] << 8) | bytes[frame + 5]);
+		uint8_t object_count = (offset < end) ? bytes[offset++] : 0;
+		for (uint8_t i=0; (i<object_count) && (offset<end); i++) {
+			switch (bytes[offset++]) {
+				case KELIMELIK_OBJECT_UINT8: offset += 1; break;
+				case KELIMELIK_OBJECT_UINT32: offset += 4; break;
+				case KELIMELIK_OBJECT_UINT64: offset += 8; break;
+				case KELIMELIK_OBJECT_STRING:
+					offset += ((end - offset) < 2) ? (end - offset) : (2 + ((bytes[offset] << 8) | bytes[offset + 1]));
+					break;
+				case KELIMELIK_OBJECT_ARRAY: {
+					if ((end - offset) < 5) {
+						offset = end;
+						break;
+					}
+					if (found < max_offsets) {
+						offsets[found++] = offset;
+					}
+					size_t item_count = read_uint32(bytes + offset);
+					uint8_t item_type = bytes[offset + 4];
+					offset += 5;
+					if (item_type == KELIMELIK_OBJECT_STRING) {
+						for (size_t j=0; (j<item_count) && ((offset + 2) <= end); j++) {
+							offset += 2 + ((bytes[offset] << 8) | bytes[offset + 1]);
+						}
+					}
+					else if (item_type == KELIMELIK_OBJECT_UINT8) offset += item_count;
+					else if (item_type == KELIMELIK_OBJECT_UINT32) offset += item_count * 4;
+					else if (item_type == KELIMELIK_OBJECT_UINT64) offset += item_count * 8;
+					else offset = end;
+					break;
+				}
+				default:
+					offset = end;
+					break;
+			}
+		}
+		frame = end;
+	}
+	return found;
+}
+
+// Array counts that are too big for the frame. Adding 2^30 or 2^29 to the
+// real count gives the same number of bytes when the multiplication by the
+// item size wraps around in 32 bits.
+static void mutate_array_count(uint64_t *state, kelimelik_buffer *buffer) {
+	static const uint32_t added[] = { 1U << 29, 1U << 30, 1U << 31, 3U << 29, 3U << 30 };
+	static const uint32_t fixed[] = { 1U << 29, (1U << 29) + 1, 1U << 30, (1U << 30) + 1, UINT32_MAX, UINT32_MAX - 1 };
+	size_t offsets[64];
+	size_t found = find_array_counts(buffer, offsets, 64);
+	if (!found) {
+		return;
+	}
+	size_t offset = offsets[next_random(state) % found];
+	uint32_t count = read_uint32(buffer->bytes + offset);
+	if (next_random(state) % 2) {
+		count += added[next_random(state) % (sizeof(added) / sizeof(*added))];
+	}
+	else {
+		count = fixed[next_random(state) % (sizeof(fixed) / sizeof(*fixed))];
+	}
+	count = htonl(count);
+	memcpy(buffer->bytes + offset, &count, sizeof(count));
+}
+
+// Byte flips, truncation, duplicated ranges, big size prefixes and array
+// counts that don't fit the frame
+static void mutate(uint64_t *state, kelimelik_buffer *buffer) {
+	if (!buffer->length) {
+		return;
+	}
+	size_t offset = next_random(state) % buffer->length;
+	switch (next_random(state) % 5) {
+		case 0:
+			for (int i=0; i<4; i++) {
+				buffer->bytes[next_random(state) % buffer->length] ^= 1 << (next_random(state) % 8);
+			}
+			break;
+		case 1:
+			buffer->length = offset;
+			break;
+		case 2: {
+			size_t length = 1 + (next_random(state) % 32);
+			if (length > (buffer->length - offset)) {
+				length = buffer->length - offset;
+			}
+			uint8_t copy[32];
+			memcpy(copy, buffer->bytes + offset, length);
+			kelimelik_buffer_append(buffer, copy, length);
+			break;
+		}
+		case 3:
+			buffer->bytes[offset] = (uint8_t)next_random(state);
+			break;
+		default:
+			mutate_array_count(state, buffer);
+			break;
+	}
+}
+
+// Inputs that once made the decoders disagree. They are checked before the
+// random ones.
+static const struct {
+	const char *bytes;
+	size_t length;
+} regressions[] = {
+	// A uint32 array of 0x40000001 items with the bytes of one item, which
+	// was decoded as a single item because count * 4 wrapped around
+	{ "\x00\x00\x00\x0E" "\x00\x01" "A" "\x01" "\x08\x40\x00\x00\x01\x00" "\x00\x00\x00\x2A", 18 },
+
+	// The same with a uint64 array of 0x20000001 items
+	{ "\x00\x00\x00\x12" "\x00\x01" "A" "\x01" "\x08\x20\x00\x00\x01\x03" "\x00\x00\x00\x00\x00\x00\x00\x2A", 22 },
+
+	// An array of an unknown item type, which was decoded as a string array
+	// without room for the strings
+	{ "\x00\x00\x00\x0F" "\x00\x03" "Bad" "\x01" "\x08\x00\x00\x00\x01\x06" "\x00\x01" "A", 19 }
+};
+
+int main(int argc, char **argv) {
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200;
+	uint64_t state = (argc > 2) ? (strtoull(argv[2], NULL, 0) | 1) : 0x6B656C696D656C69ULL;
+	kelimelik_set_log_sink(ignore_log, NULL);
+	kelimelik_buffer input = KELIMELIK_BUFFER_INITIALIZER;
+	kelimelik_buffer encoded = KELIMELIK_BUFFER_INITIALIZER;
+	size_t packet_total = 0;
+	for (size_t i=0; i<(sizeof(regressions) / sizeof(*regressions)); i++) {
+		fuzz_one((const uint8_t *)regressions[i].bytes, regressions[i].length);
+	}
+	for (unsigned long iteration=0; iteration<iterations; iteration++) {
+		// A few packets back to back
+		kelimelik_buffer_reset(&input);
+		int packet_count = 1 + (next_random(&state) % 4);
+		for (int i=0; i<packet_count; i++) {
+			kelimelik_packet *packet = random_packet(&state);
+			kelimelik_buffer_reset(&encoded);
+			if (KELIMELIK_IS_ERROR(kelimelik_packet_encode_v2(packet, &encoded))) {
+				fail(NULL, 0, "can't encode a random packet");
+			}
+			kelimelik_packet_free(packet);
+
+			// Generated packets survive a round trip
+			kelimelik_packet *decoded;
+			kelimelik_frame frame = { .bytes = encoded.bytes, .length = encoded.length };
+			kelimelik_error error = kelimelik_frame_decode(&frame, NULL, &decoded);
+			if (KELIMELIK_IS_ERROR(error)) {
+				fail(encoded.bytes, encoded.length, "can't decode a random packet: %s", kelimelik_strerror(error));
+			}
+			size_t length = input.length;
+			kelimelik_packet_encode_v2(decoded, &input);
+			kelimelik_packet_free(decoded);
+			if (((input.length - length) != encoded.length) || memcmp(input.bytes + length, encoded.bytes, encoded.length)) {
+				fail(encoded.bytes, encoded.length, "random packet changed after a round trip");
+			}
+		}
+		packet_total += packet_count;
+		fuzz_one(input.bytes, input.length);
+		for (int i=0; i<4; i++) {
+			mutate(&state, &input);
+			fuzz_one(input.bytes, input.length);
+		}
+	}
+	printf("%lu inputs with %zu packets checked\n", iterations * 5, packet_total);
+	print_throughput();
+	kelimelik_buffer_free(&input);
+	kelimelik_buffer_free(&encoded);
+	if (pipeline) {
+		kelimelik_pipeline_free(pipeline);
+	}
+	return 0;
+}
+
+#endif
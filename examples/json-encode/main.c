@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <string.h>
+#include <kelimelik.h>
+
+// Reads JSON packet descriptions from stdin, one per line, and writes the
+// encoded frames to stdout. Useful for turning JSON fixtures into raw
+// traffic, for example:
+//
+//   ./json-encode < fixtures.jsonl | nc localhost 443
+
+int main(int argc, char **argv) {
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t line_length;
+	size_t line_number = 0;
+	int status = EXIT_SUCCESS;
+	while ((line_length = getline(&line, &line_capacity, stdin)) != -1) {
+		line_number++;
+		if ((line_length == 0) || (line[0] == '\n')) {
+			continue;
+		}
+		kelimelik_error error = kelimelik_json_to_wire(line, line_length, &buffer);
+		if (KELIMELIK_IS_ERROR(error)) {
+			fprintf(stderr, "Line %zu: %s\n", line_number, kelimelik_strerror(error));
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		// Write in batches to avoid a write for every frame
+		if (buffer.length >= (1 << 16)) {
+			fwrite(buffer.bytes, 1, buffer.length, stdout);
+			kelimelik_buffer_reset(&buffer);
+		}
+	}
+	fwrite(buffer.bytes, 1, buffer.length, stdout);
+	kelimelik_buffer_free(&buffer);
+	free(line);
+	return status;
+}
@@ -2,12 +2,15 @@
 #include <poll.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <signal.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
 #include <kelimelik.h>
+#include <kelimelik-game-module.h>
 
 static int empty_fd;
 static struct pollfd *poll_fds;
@@ -15,10 +18,88 @@ static struct {
 	int fd;
 	bool is_server;
 	int peer_index;
+	uint32_t session_id;
 	kelimelik_parser *parser;
+
+	// Tracks the memory used by the connection's parser and packets. This is
+	// allocated separately since the connections array is reallocated.
+	kelimelik_counting_allocator *memory;
 } *connections;
 static int allocated_connection_count = 2;
 static int connection_count = 0;
+static uint32_t session_count = 0;
+static kelimelik_capture_writer *capture_writer = NULL;
+static kelimelik_logger *logger = NULL;
+
+// Shared by the parsers of every connection. The proxy is single-threaded,
+// so one pool is enough.
+static kelimelik_pool *pool = NULL;
+
+// Every parser gets the same limits, and frames that are still being
+// received may take up at most 64 MB in total across all connections.
+static kelimelik_parser_group *parser_group = NULL;
+static const kelimelik_parser_limits parser_limits = {
+	.max_frame_size = 1 << 20,
+	.max_array_items = 1 << 16,
+	.max_buffered_bytes = 2 << 20
+};
+
+// Per-header traffic counters and request/response latencies. They are
+// written to stats_path every stats_interval seconds and to every client
+// that connects to the Unix socket at stats_socket_path.
+static kelimelik_traffic_stats *traffic_stats = NULL;
+static const char *stats_path = NULL;
+static unsigned long stats_interval = 10;
+static const char *stats_socket_path = NULL;
+static int stats_socket = -1;
+
+// Frames that arrive in one piece are forwarded straight from here.
+static uint8_t receive_buffer[1 << 16];
+
+static void handle_interrupt(int signal) {
+	// Does nothing. The signal interrupts poll(), which ends the main loop.
+}
+
+static uint64_t monotonic_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// Writes the stats to a temporary file first, so readers never see a
+// partially written file.
+static void write_stats_file(void) {
+	char temporary_path[PATH_MAX];
+	snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", stats_path);
+	FILE *file = fopen(temporary_path, "w");
+	if (!file) {
+		kelimelik_logger_message(logger, KELIMELIK_LOG_ERROR, "Failed to open %s", temporary_path);
+		return;
+	}
+	kelimelik_error error = kelimelik_traffic_stats_write(traffic_stats, file);
+	if (fclose(file) || KELIMELIK_IS_ERROR(error) || rename(temporary_path, stats_path)) {
+		kelimelik_logger_message(logger, KELIMELIK_LOG_ERROR, "Failed to write %s", stats_path);
+		unlink(temporary_path);
+	}
+}
+
+// Answers every client waiting on the stats socket with the current stats.
+static void serve_stats_socket(void) {
+	struct pollfd stats_poll_fd = { .fd = stats_socket, .events = POLLIN };
+	while (poll(&stats_poll_fd, 1, 0) == 1) {
+		int fd = accept(stats_socket, NULL, NULL);
+		if (fd == -1) {
+			break;
+		}
+		FILE *file = fdopen(fd, "w");
+		if (!file) {
+			close(fd);
+			break;
+		}
+		kelimelik_traffic_stats_write(traffic_stats, file);
+		fclose(file);
+	}
+}
 
 static void initialize_connection(int client_fd) {
 	// Establish the Kelimelik connection
@@ -54,14 +135,25 @@ static void initialize_connection(int client_fd) {
 	}
 
 	// Connection structure setup
+	session_count++;
 	connections[server_index].fd = server_fd;
 	connections[server_index].is_server = true;
 	connections[server_index].peer_index = client_index;
-	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&(connections[server_index].parser))));
+	connections[server_index].session_id = session_count;
+	connections[server_index].memory = malloc(sizeof(kelimelik_counting_allocator));
+	kelimelik_counting_allocator_init(connections[server_index].memory, kelimelik_pool_allocator(pool));
+	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&(connections[server_index].parser), &connections[server_index].memory->allocator)));
+	kelimelik_parser_set_limits(connections[server_index].parser, &parser_limits);
+	kelimelik_parser_set_group(connections[server_index].parser, parser_group);
 	connections[client_index].fd = client_fd;
 	connections[client_index].is_server = false;
 	connections[client_index].peer_index = server_index;
-	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&(connections[client_index].parser))));
+	connections[client_index].session_id = session_count;
+	connections[client_index].memory = malloc(sizeof(kelimelik_counting_allocator));
+	kelimelik_counting_allocator_init(connections[client_index].memory, kelimelik_pool_allocator(pool));
+	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&(connections[client_index].parser), &connections[client_index].memory->allocator)));
+	kelimelik_parser_set_limits(connections[client_index].parser, &parser_limits);
+	kelimelik_parser_set_group(connections[client_index].parser, parser_group);
 
 	// Poll structure setup
 	poll_fds[server_index+1].fd = server_fd;
@@ -71,6 +163,79 @@ static void initialize_connection(int client_fd) {
 }
 
 int main(int argc, char **argv) {
+	// Packets and messages are logged from a background thread so that
+	// writing to stdout never blocks the proxy.
+	assert(!KELIMELIK_IS_ERROR(kelimelik_logger_new(&logger, stdout, 0)));
+	kelimelik_set_log_sink(kelimelik_logger_sink, logger);
+	assert(!KELIMELIK_IS_ERROR(kelimelik_pool_new(&pool, NULL, 0)));
+	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_group_new(&parser_group, 64 << 20)));
+
+	// Options:
+	//   -s <header>:<n>  Only log one in every n packets with the header
+	//   -d               Log debug messages too
+	//   -l <req>:<resp>  Measure the latency between the two headers
+	//   -o <path>        Write traffic stats to the file periodically
+	//   -i <seconds>     How often to write the stats file, 10 by default
+	//   -u <path>        Send traffic stats to clients of this Unix socket
+	// If a path is given after the options, every received packet is also
+	// written to a capture file.
+	assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_new(&traffic_stats, NULL)));
+	int option;
+	while ((option = getopt(argc, argv, "s:dl:o:i:u:")) != -1) {
+		switch (option) {
+			case 's': {
+				char *separator = strrchr(optarg, ':');
+				if (!separator) {
+					fprintf(stderr, "Invalid sampling option: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				*separator = 0;
+				kelimelik_logger_set_sampling(logger, optarg, strtoul(separator + 1, NULL, 10));
+				break;
+			}
+			case 'd':
+				kelimelik_logger_set_level(logger, KELIMELIK_LOG_DEBUG);
+				break;
+			case 'l': {
+				char *separator = strchr(optarg, ':');
+				if (!separator) {
+					fprintf(stderr, "Invalid latency option: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				*separator = 0;
+				kelimelik_error error = kelimelik_traffic_stats_add_pair(traffic_stats, optarg, separator + 1);
+				if (KELIMELIK_IS_ERROR(error)) {
+					fprintf(stderr, "Invalid latency option: %s\n", kelimelik_strerror(error));
+					return EXIT_FAILURE;
+				}
+				break;
+			}
+			case 'o':
+				stats_path = optarg;
+				break;
+			case 'i':
+				stats_interval = strtoul(optarg, NULL, 10);
+				if (!stats_interval) {
+					fprintf(stderr, "Invalid stats interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'u':
+				stats_socket_path = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-s header:n]... [-l request:response]... [-o stats] [-i seconds] [-u socket] [capture]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc) {
+		kelimelik_error error = kelimelik_capture_writer_new(&capture_writer, argv[optind]);
+		if (KELIMELIK_IS_ERROR(error)) {
+			fprintf(stderr, "Failed to create the capture file: %s\n", kelimelik_strerror(error));
+			return EXIT_FAILURE;
+		}
+	}
+
 	// Create a socket for incoming connections.
 	int accept_socket = socket(PF_INET, SOCK_STREAM, 0);
 	assert(accept_socket != -1);
@@ -78,6 +243,9 @@ int main(int argc, char **argv) {
 	// Ignore SIGPIPE
 	signal(SIGPIPE, SIG_IGN);
 
+	// Stop on SIGINT so that the capture file can be closed properly
+	signal(SIGINT, handle_interrupt);
+
 	// Create an empty file descriptor
 	{
 		int pipe_fds[2];
@@ -107,6 +275,20 @@ int main(int argc, char **argv) {
 		assert(listen(accept_socket, 64) != -1);
 	}
 
+	if (stats_socket_path) {
+		struct sockaddr_un stats_address = { .sun_family = AF_UNIX };
+		if (strlen(stats_socket_path) >= sizeof(stats_address.sun_path)) {
+			fprintf(stderr, "Stats socket path is too long: %s\n", stats_socket_path);
+			return EXIT_FAILURE;
+		}
+		strcpy(stats_address.sun_path, stats_socket_path);
+		unlink(stats_socket_path);
+		stats_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		assert(stats_socket != -1);
+		assert(bind(stats_socket, (struct sockaddr *)&stats_address, sizeof(stats_address)) != -1);
+		assert(listen(stats_socket, 8) != -1);
+	}
+
 	poll_fds = malloc(sizeof(*poll_fds) * 3);
 	connections = malloc(sizeof(*connections) * 2);
 	connections[0].fd = -1;
@@ -114,10 +296,21 @@ int main(int argc, char **argv) {
 	poll_fds[0].fd = accept_socket;
 	poll_fds[0].events = POLLIN;
 
+	// The stats socket isn't part of poll_fds, so it is checked at least once
+	// a second instead, along with the time of the next stats file.
+	uint64_t next_stats_time = monotonic_time() + (stats_interval * 1000000000);
+	int poll_timeout = (stats_socket_path || stats_path) ? 1000 : -1;
 	int poll_count;
-	while ((poll_count = poll(poll_fds, allocated_connection_count+1, -1)) > 0) {
+	while ((poll_count = poll(poll_fds, allocated_connection_count+1, poll_timeout)) >= 0) {
+		if (stats_socket != -1) {
+			serve_stats_socket();
+		}
+		if (stats_path && (monotonic_time() >= next_stats_time)) {
+			write_stats_file();
+			next_stats_time = monotonic_time() + (stats_interval * 1000000000);
+		}
 		while (poll(poll_fds, 1, 0)) {
-			printf("New connection\n");
+			kelimelik_logger_message(logger, KELIMELIK_LOG_INFO, "New connection");
 			int fd = accept(accept_socket, NULL, NULL);
 			initialize_connection(fd);
 			poll_count = 0;
@@ -130,45 +323,69 @@ int main(int argc, char **argv) {
 			poll_count--;
 			if (poll_fds[i].revents & POLLIN) {
 				do {
-					uint8_t byte;
-					if (recv(poll_fds[i].fd, &byte, 1, 0) != 1) {
+					ssize_t received = recv(poll_fds[i].fd, receive_buffer, sizeof(receive_buffer), 0);
+					if (received <= 0) {
 						break;
 					}
-					kelimelik_packet *packet;
-					kelimelik_parser_advance_single(connections[i-1].parser, byte, &packet);
-					if (packet) {
-						char *description = kelimelik_packet_description(packet);
-						printf("[%s] [#%d] Received: %s\n",
-							connections[i-1].is_server ? "Server" : "Client",
-							poll_fds[i].fd,
-							description
-						);
-						free(description);
-						void *encoded_packet;
-						if (!strcmp((char *)packet->header->string, "GameModule_userPurchaseData")) {
+
+					// Frames are only split, not decoded. Everything except
+					// the packet modified below is forwarded as it was
+					// received, straight from the receive buffer.
+					const kelimelik_frame *frames;
+					size_t frame_count;
+					uint64_t receive_time = monotonic_time();
+					kelimelik_parser_advance_frames(connections[i-1].parser, receive_buffer, received, &frames, &frame_count);
+					enum kelimelik_direction direction = connections[i-1].is_server ? KELIMELIK_DIRECTION_SERVER_TO_CLIENT : KELIMELIK_DIRECTION_CLIENT_TO_SERVER;
+					for (size_t j=0; j<frame_count; j++) {
+						const kelimelik_frame *frame = &frames[j];
+						kelimelik_logger_frame(logger, KELIMELIK_LOG_INFO, connections[i-1].session_id, direction, frame);
+						kelimelik_traffic_stats_frame(traffic_stats, connections[i-1].session_id, direction, frame, receive_time);
+						if (capture_writer) {
+							kelimelik_capture_writer_add_v1(
+								capture_writer,
+								connections[i-1].session_id,
+								direction,
+								frame->bytes,
+								frame->length
+							);
+						}
+						if (
+							(frame->header_length == (sizeof(GAME_MODULE_USER_PURCHASE_DATA_HEADER) - 1)) &&
+							!memcmp(frame->header, GAME_MODULE_USER_PURCHASE_DATA_HEADER, frame->header_length)
+						) {
 							// Modify the purchase data to make the number of coins
 							// shown in the client -100. This is used to verify that
 							// the proxy works. This value is verified by the server
 							// so this hack cannot be used to buy anything with
-							// unlimited coins.
-							assert(packet->object_count == 8);
-							assert(packet->objects[7].type == KELIMELIK_OBJECT_UINT32);
-							kelimelik_packet_set_uint32(packet, 7, (uint32_t)-100);
+							// unlimited coins. This is the only kind of packet that
+							// gets decoded.
+							game_module_user_purchase_data purchase_data;
+							uint64_t start_time = monotonic_time();
+							kelimelik_error error = game_module_user_purchase_data_decode(frame->bytes, frame->length, &purchase_data);
+							assert(!KELIMELIK_IS_ERROR(error));
+							kelimelik_traffic_stats_decode_time(traffic_stats, frame->header, frame->header_length, monotonic_time() - start_time);
+							purchase_data.coins = (uint32_t)-100;
+							kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+							buffer.allocator = &connections[i-1].memory->allocator;
+							start_time = monotonic_time();
+							error = game_module_user_purchase_data_encode(&purchase_data, &buffer);
+							kelimelik_traffic_stats_encode_time(traffic_stats, frame->header, frame->header_length, monotonic_time() - start_time);
+							if (KELIMELIK_IS_ERROR(error)) {
+								fprintf(stderr, "Encode error: %s\n", kelimelik_strerror(error));
+								assert(0);
+							}
+							send(connections[connections[i-1].peer_index].fd, buffer.bytes, buffer.length, 0);
+							kelimelik_buffer_free(&buffer);
 						}
-						size_t encoded_packet_len;
-						kelimelik_error error = kelimelik_packet_encode(packet, &encoded_packet, &encoded_packet_len);
-						if (KELIMELIK_IS_ERROR(error)) {
-							fprintf(stderr, "Encode error: %s\n", kelimelik_strerror(error));
-							assert(0);
+						else {
+							send(connections[connections[i-1].peer_index].fd, frame->bytes, frame->length, 0);
 						}
-						send(connections[connections[i-1].peer_index].fd, encoded_packet, encoded_packet_len, 0);
-						free(encoded_packet);
-						printf("Transmitted this data to #%d.\n\n", connections[connections[i-1].peer_index].fd);
+						kelimelik_logger_message(logger, KELIMELIK_LOG_DEBUG, "Transmitted this data to #%d.", connections[connections[i-1].peer_index].fd);
 					}
 				} while (poll(&poll_fds[i], 1, 0) == 1); 
 			}
 			if (poll_fds[i].revents & POLLHUP) {
-				printf("%s #%d disconnected, closing connection to %s #%d\n",
+				kelimelik_logger_message(logger, KELIMELIK_LOG_INFO, "%s #%d disconnected, closing connection to %s #%d",
 					connections[i-1].is_server ? "Server" : "Client",
 					connections[i-1].fd,
 					connections[i-1].is_server ? "client" : "server",
@@ -176,15 +393,56 @@ int main(int argc, char **argv) {
 				);
 				close(connections[i-1].fd);
 				close(connections[connections[i-1].peer_index].fd);
-				kelimelik_parser_free(connections[i-1].parser);
-				kelimelik_parser_free(connections[connections[i-1].peer_index].parser);
+				kelimelik_traffic_stats_end_connection(traffic_stats, connections[i-1].session_id);
+				for (int j=0; j<2; j++) {
+					int index = j ? connections[i-1].peer_index : (i-1);
+					kelimelik_parser_free(connections[index].parser);
+					kelimelik_logger_message(logger, KELIMELIK_LOG_DEBUG, "%s of session %u used at most %zu bytes",
+						connections[index].is_server ? "Server" : "Client",
+						connections[index].session_id,
+						connections[index].memory->peak_bytes
+					);
+					free(connections[index].memory);
+				}
 				connections[i-1].fd = -1;
 				connections[connections[i-1].peer_index].fd = -1;
 				poll_fds[i].fd = empty_fd;
 				poll_fds[connections[i-1].peer_index + 1].fd = empty_fd;
+				if (capture_writer) {
+					kelimelik_capture_writer_flush(capture_writer);
+				}
 				break;
 			}
 		}
 	}
+	for (int i=0; i<allocated_connection_count; i++) {
+		if (connections[i].fd != -1) {
+			close(connections[i].fd);
+			kelimelik_parser_free(connections[i].parser);
+			free(connections[i].memory);
+		}
+	}
+	kelimelik_parser_stats stats;
+	kelimelik_parser_group_get_stats(parser_group, &stats);
+	kelimelik_logger_message(logger, KELIMELIK_LOG_INFO, "Skipped frames: %llu too big, %llu with too big arrays, %llu over budget",
+		(unsigned long long)stats.frames_too_big,
+		(unsigned long long)stats.arrays_too_big,
+		(unsigned long long)stats.over_budget
+	);
+	kelimelik_parser_group_free(parser_group);
+	kelimelik_pool_free(pool);
+	if (stats_path) {
+		write_stats_file();
+	}
+	if (stats_socket != -1) {
+		close(stats_socket);
+		unlink(stats_socket_path);
+	}
+	kelimelik_traffic_stats_free(traffic_stats);
+	if (capture_writer) {
+		kelimelik_capture_writer_close(capture_writer);
+	}
+	kelimelik_set_log_sink(NULL, NULL);
+	kelimelik_logger_free(logger);
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <kelimelik.h>
+
+// Sends big string array responses over a loopback TCP connection through a
+// send queue, once with regular copy sends and once with MSG_ZEROCOPY, and
+// prints the throughput of both. For example:
+//
+//   ./send-bench [packet count] [strings per packet] [zerocopy threshold]
+
+struct receiver {
+	int fd;
+	size_t expected;
+};
+
+// Reads and throws away everything the sender writes
+static void *receive_thread(void *context) {
+	struct receiver *receiver = context;
+	static uint8_t buffer[1 << 16];
+	size_t received = 0;
+	while (received < receiver->expected) {
+		ssize_t length = read(receiver->fd, buffer, sizeof(buffer));
+		if (length <= 0) {
+			break;
+		}
+		received += length;
+	}
+	return NULL;
+}
+
+static double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + (time.tv_nsec / 1e9);
+}
+
+static int run(const char *name, kelimelik_packet *packet, size_t packet_count, size_t threshold) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t address_length = sizeof(address);
+	if ((listener == -1) || bind(listener, (struct sockaddr *)&address, sizeof(address)) || listen(listener, 1)) {
+		perror("listen");
+		return 1;
+	}
+	getsockname(listener, (struct sockaddr *)&address, &address_length);
+	int sender = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sender, (struct sockaddr *)&address, sizeof(address))) {
+		perror("connect");
+		return 1;
+	}
+	struct receiver receiver = {
+		.fd = accept(listener, NULL, NULL),
+		.expected = packet_count * packet->encoded_size
+	};
+	pthread_t thread;
+	pthread_create(&thread, NULL, receive_thread, &receiver);
+
+	kelimelik_send_queue *queue;
+	kelimelik_error error = kelimelik_send_queue_new(&queue, sender, NULL);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_send_queue_set_zerocopy(queue, threshold);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		fprintf(stderr, "%s: %s\n", name, kelimelik_strerror(error));
+		return 1;
+	}
+
+	// Keep a bounded number of bytes queued, like a server would
+	double start = now();
+	size_t queued = 0;
+	while ((queued < packet_count) || kelimelik_send_queue_pending_bytes(queue)) {
+		while ((queued < packet_count) && (kelimelik_send_queue_pending_bytes(queue) < (4 << 20))) {
+			kelimelik_send_queue_push(queue, packet);
+			queued++;
+		}
+		error = kelimelik_send_queue_flush(queue);
+		if (KELIMELIK_IS_ERROR(error)) {
+			fprintf(stderr, "%s: %s\n", name, kelimelik_strerror(error));
+			return 1;
+		}
+		if (kelimelik_send_queue_pending_bytes(queue)) {
+			struct pollfd poll_fd = { .fd = sender, .events = POLLOUT };
+			poll(&poll_fd, 1, 100);
+		}
+	}
+	pthread_join(thread, NULL);
+	double elapsed = now() - start;
+
+	// Wait for the kernel to give back every pinned packet
+	while (kelimelik_send_queue_pinned_bytes(queue)) {
+		struct pollfd poll_fd = { .fd = sender, .events = 0 };
+		poll(&poll_fd, 1, 10);
+		kelimelik_send_queue_flush(queue);
+	}
+	kelimelik_send_queue_stats stats;
+	kelimelik_send_queue_get_stats(queue, &stats);
+	printf(
+		"%-9s %8.1f MB/s  %llu copy sends, %llu zerocopy sends (%llu copied by the kernel)\n",
+		name,
+		(stats.bytes_sent / elapsed) / (1024 * 1024),
+		(unsigned long long)stats.copy_sends,
+		(unsigned long long)stats.zerocopy_sends,
+		(unsigned long long)stats.zerocopy_copied
+	);
+	kelimelik_send_queue_free(queue);
+	close(sender);
+	close(receiver.fd);
+	close(listener);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t packet_count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+	size_t string_count = (argc > 2) ? strtoul(argv[2], NULL, 10) : 4096;
+	size_t threshold = (argc > 3) ? strtoul(argv[3], NULL, 10) : 16384;
+
+	// A response with a big string array, like a word list
+	const char **strings = malloc(string_count * sizeof(*strings));
+	for (size_t i=0; i<string_count; i++) {
+		strings[i] = "KELIMELIK";
+	}
+	kelimelik_packet *packet;
+	kelimelik_array *array;
+	kelimelik_error error = kelimelik_packet_new_v1(&packet, "wordList", 1);
+	if (!KELIMELIK_IS_ERROR(error)) error = kelimelik_string_array_new_v2(&array, strings, string_count);
+	if (!KELIMELIK_IS_ERROR(error)) error = kelimelik_packet_set_array(packet, 0, array);
+	if (!KELIMELIK_IS_ERROR(error)) error = kelimelik_packet_freeze(packet);
+	free(strings);
+	if (KELIMELIK_IS_ERROR(error)) {
+		fprintf(stderr, "Couldn't create the packet: %s\n", kelimelik_strerror(error));
+		return EXIT_FAILURE;
+	}
+	printf("%zu packets of %u bytes\n", packet_count, packet->encoded_size);
+	int status = run("copy", packet, packet_count, 0);
+	status |= run("zerocopy", packet, packet_count, threshold);
+	kelimelik_packet_release(packet);
+	return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
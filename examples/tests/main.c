@@ -1,7 +1,206 @@
 #include <stdio.h>
 #include <kelimelik.h>
+#include <kelimelik-game-module.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <time.h>
+
+// Collects what a stream handler receives
+struct stream_test {
+	int frames;
+	int ends;
+	size_t frame_length;
+	uint32_t uint8_value;
+	char string[16];
+	uint32_t item_count;
+	uint32_t next_item;
+	uint64_t item_sum;
+	uint32_t chunks;
+	uint32_t string_items;
+	bool strings_ok;
+};
+
+static void stream_test_begin(void *context, const kelimelik_frame *frame) {
+	struct stream_test *test = context;
+	assert(!frame->bytes && (frame->header_length == 6) && !memcmp(frame->header, "Stream", 6));
+	test->frames++;
+	test->frame_length = frame->length;
+}
+
+static void stream_test_object(void *context, uint8_t index, const kelimelik_object *object) {
+	struct stream_test *test = context;
+	if (object->type == KELIMELIK_OBJECT_UINT8) {
+		test->uint8_value = object->uint8;
+	}
+	else {
+		assert(object->type == KELIMELIK_OBJECT_STRING);
+		memcpy(test->string, object->string->string, object->string->length + 1);
+	}
+}
+
+static void stream_test_array_begin(void *context, uint8_t index, enum kelimelik_object_type item_type, uint32_t item_count) {
+	struct stream_test *test = context;
+	if (item_type == KELIMELIK_OBJECT_UINT32) {
+		test->item_count = item_count;
+	}
+}
+
+static void stream_test_array_items(void *context, uint8_t index, const kelimelik_array *items, uint32_t first_item) {
+	struct stream_test *test = context;
+	if (items->type == KELIMELIK_OBJECT_STRING) {
+		for (uint32_t i=0; i<items->item_count; i++) {
+			test->strings_ok = test->strings_ok && (items->strings[i]->length == 3) && !memcmp(items->strings[i]->string, "abc", 4);
+		}
+		test->string_items += items->item_count;
+		return;
+	}
+	assert(first_item == test->next_item);
+	for (uint32_t i=0; i<items->item_count; i++) {
+		test->item_sum += items->uint32s[i];
+	}
+	test->next_item += items->item_count;
+	test->chunks++;
+}
+
+static void stream_test_end(void *context, kelimelik_error error) {
+	struct stream_test *test = context;
+	assert(!KELIMELIK_IS_ERROR(error));
+	test->ends++;
+}
+
+// Checks that a pipeline delivers the frames of a connection in order and
+// one at a time
+struct pipeline_test {
+	uint32_t next;
+	uint32_t errors;
+	_Atomic int active;
+	bool ordered;
+};
+
+static void pipeline_test_callback(void *connection_context, const kelimelik_frame *frame, kelimelik_packet *packet, kelimelik_error error, void *context) {
+	struct pipeline_test *test = connection_context;
+	test->ordered = test->ordered && (atomic_fetch_add(&test->active, 1) == 0);
+	if ((test->next % 500) == 499) {
+		test->ordered = test->ordered && !packet && (error.kelimelik_errno == KELIMELIK_ERROR_INVALID_TYPE);
+		test->ordered = test->ordered && (frame->header_length == 3) && !memcmp(frame->header, "Bad", 3);
+		test->errors++;
+	}
+	else {
+		test->ordered = test->ordered && packet && (packet->objects[0].uint32 == test->next);
+	}
+	test->next++;
+	atomic_fetch_sub(&test->active, 1);
+	(*(_Atomic uint32_t *)context)++;
+}
+
+// Encodes a frozen packet that is shared with other threads, then drops the
+// thread's reference
+static void *shared_packet_thread(void *context) {
+	kelimelik_packet *packet = context;
+	for (int i=0; i<1000; i++) {
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert((encoded_size == 23) && !memcmp((uint8_t *)encoded + 4, "\x00\x05" "Event", 7));
+		free(encoded);
+	}
+	kelimelik_packet_release(packet);
+	return NULL;
+}
+
+// Interns and releases the same words over and over, so that strings are
+// created and freed while other threads look them up
+static void *intern_test_thread(void *context) {
+	kelimelik_intern_pool *pool = context;
+	kelimelik_string *strings[64];
+	for (int i=0; i<200; i++) {
+		for (int j=0; j<64; j++) {
+			char word[16];
+			int length = snprintf(word, sizeof(word), "word%d", j);
+			assert(!KELIMELIK_IS_ERROR(kelimelik_intern_string(pool, word, length, &strings[j])));
+			assert((strings[j]->length == length) && !strcmp((const char *)strings[j]->string, word));
+		}
+		for (int j=0; j<64; j++) {
+			kelimelik_interned_release(strings[j]);
+		}
+	}
+	return NULL;
+}
+
+// Two log sinks that check they got their own context while the sink is
+// swapped between them
+static _Atomic int log_sink_mismatches;
+
+static void log_sink_test_first(enum kelimelik_log_level level, const char *message, void *context) {
+	if (*(int *)context != 1) log_sink_mismatches++;
+}
+
+static void log_sink_test_second(enum kelimelik_log_level level, const char *message, void *context) {
+	if (*(int *)context != 2) log_sink_mismatches++;
+}
+
+// Logs parser errors until the sink test is over
+static void *log_sink_test_thread(void *context) {
+	kelimelik_parser *parser;
+	assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&parser)));
+	while (!atomic_load((_Atomic bool *)context)) {
+		kelimelik_packet **new_packets;
+		size_t count;
+		kelimelik_parser_advance(parser, (uint8_t *)"\x00\x00\x00\x05" "\x00\x01" "X" "\x01" "\x09", 9, &new_packets, &count);
+	}
+	kelimelik_parser_free(parser);
+	return NULL;
+}
+
+// Forwards to a counting allocator, but fails blocks of at least fail_size
+// bytes unless fail_size is 0
+struct failing_allocator {
+	kelimelik_allocator allocator;
+	kelimelik_counting_allocator *parent;
+	size_t fail_size;
+};
+
+static void *failing_allocate(void *context, size_t size) {
+	struct failing_allocator *self = context;
+	if (self->fail_size && (size >= self->fail_size)) return NULL;
+	return self->parent->allocator.allocate(self->parent->allocator.context, size);
+}
+
+static void *failing_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+	struct failing_allocator *self = context;
+	if (self->fail_size && (new_size >= self->fail_size)) return NULL;
+	return self->parent->allocator.reallocate(self->parent->allocator.context, pointer, old_size, new_size);
+}
+
+static void failing_release(void *context, void *pointer, size_t size) {
+	struct failing_allocator *self = context;
+	self->parent->allocator.release(self->parent->allocator.context, pointer, size);
+}
+
+// Counts allocations and forwards them to another allocator. reallocate is
+// left NULL, like in pools, so every grow is an allocation.
+struct call_counting_allocator {
+	kelimelik_allocator allocator;
+	const kelimelik_allocator *parent;
+	size_t allocations;
+};
+
+static void *call_counting_allocate(void *context, size_t size) {
+	struct call_counting_allocator *self = context;
+	self->allocations++;
+	return self->parent->allocate(self->parent->context, size);
+}
+
+static void call_counting_release(void *context, void *pointer, size_t size) {
+	struct call_counting_allocator *self = context;
+	self->parent->release(self->parent->context, pointer, size);
+}
 
 int main(int argc, char **argv) {
 	// Parser tests
@@ -47,6 +246,10 @@ int main(int argc, char **argv) {
 		assert(strcmp((char *)new_packet->objects[0].array->strings[2]->string, "Testing") == 0);
 		assert(strcmp((char *)new_packet->objects[0].array->strings[3]->string, "the") == 0);
 		assert(strcmp((char *)new_packet->objects[0].array->strings[4]->string, "library") == 0);
+
+		// String arrays are packed into a single block
+		assert(new_packet->objects[0].array->storage == KELIMELIK_STORAGE_INLINE);
+		assert((uint8_t *)new_packet->objects[0].array->strings[1] == (uint8_t *)new_packet->objects[0].array->strings[0] + 8);
 		assert(new_packet->objects[2].type == KELIMELIK_OBJECT_UINT64);
 		assert(new_packet->objects[2].uint64 == 0x0102030405060708);
 		for (int i=0; i<5; i++) {
@@ -62,8 +265,1448 @@ int main(int argc, char **argv) {
 		kelimelik_packet_encode(new_packet, &re_encoded, &re_encoded_size);
 		assert(memcmp(re_encoded, input, size) == 0);
 		free(re_encoded);
+
+		// Arrays of unknown item types are rejected
+		const char *unknown_items = (
+			"\x00\x00\x00\x0F"
+			"\x00\x03" "Bad" // Header
+			"\x01" // Object count
+			"\x08\x00\x00\x00\x01\x06" // ?[1]
+			"\x00\x01" "A"
+		);
+		error = kelimelik_parser_advance(parser, (uint8_t *)unknown_items, 19, &new_packets, &count);
+		assert((count == 0) && (error.kelimelik_errno == KELIMELIK_ERROR_INVALID_TYPE));
+
+		// Array sizes don't wrap around, so huge counts are rejected instead
+		// of being read as a smaller array
+		const char *huge_count = (
+			"\x00\x00\x00\x0E"
+			"\x00\x01" "A" // Header
+			"\x01" // Object count
+			"\x08\x40\x00\x00\x01\x00" // uint32[0x40000001]
+			"\x00\x00\x00\x2A"
+		);
+		error = kelimelik_parser_advance(parser, (uint8_t *)huge_count, 18, &new_packets, &count);
+		assert((count == 0) && (error.kelimelik_errno == KELIMELIK_ERROR_INVALID_ARGUMENT));
 		kelimelik_parser_free(parser);
 		printf("Parser tests passed\n");
 	}
+
+	// Capture tests
+	{
+		char path[] = "/tmp/kelimelik-capture-XXXXXX";
+		close(mkstemp(path));
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "CaptureTest", 2)));
+		kelimelik_packet_set_uint32(packet, 0, 1234);
+		kelimelik_packet_set_string_v1(packet, 1, "Captured");
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+
+		// Write the same frame three times, once without closing the writer
+		for (int closed=1; closed>=0; closed--) {
+			kelimelik_capture_writer *writer;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_capture_writer_new(&writer, path)));
+			for (uint32_t i=0; i<3; i++) {
+				kelimelik_capture_frame frame = {
+					.timestamp = 1000 + i,
+					.connection_id = 7 + (i == 2),
+					.direction = (i & 1),
+					.length = encoded_size,
+					.bytes = encoded
+				};
+				assert(!KELIMELIK_IS_ERROR(kelimelik_capture_writer_add_v2(writer, &frame)));
+			}
+			if (closed) {
+				assert(!KELIMELIK_IS_ERROR(kelimelik_capture_writer_close(writer)));
+			}
+			else {
+				assert(!KELIMELIK_IS_ERROR(kelimelik_capture_writer_flush(writer)));
+			}
+			kelimelik_capture *capture;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_capture_open(&capture, path)));
+			assert(kelimelik_capture_frame_count(capture) == 3);
+			kelimelik_capture_frame frame;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_capture_get_frame(capture, 1, &frame)));
+			assert(frame.timestamp == 1001);
+			assert(frame.connection_id == 7);
+			assert(frame.direction == KELIMELIK_DIRECTION_SERVER_TO_CLIENT);
+			assert(frame.length == encoded_size);
+			assert(memcmp(frame.bytes, encoded, encoded_size) == 0);
+			const kelimelik_capture_index_entry *entries;
+			size_t entry_count;
+			kelimelik_error error = kelimelik_capture_query(capture, "CaptureTest", 7, &entries, &entry_count);
+			if (closed) {
+				assert(!KELIMELIK_IS_ERROR(error));
+				assert(entry_count == 2);
+				assert((entries[0].frame_index == 0) && (entries[1].frame_index == 1));
+				assert(!KELIMELIK_IS_ERROR(kelimelik_capture_query(capture, "CaptureTest", KELIMELIK_CAPTURE_ANY_CONNECTION, &entries, &entry_count)));
+				assert(entry_count == 3);
+				assert(!KELIMELIK_IS_ERROR(kelimelik_capture_query(capture, "Missing", KELIMELIK_CAPTURE_ANY_CONNECTION, &entries, &entry_count)));
+				assert(entry_count == 0);
+			}
+			else {
+				// Unclosed captures don't have a header index
+				assert(error.kelimelik_errno == KELIMELIK_ERROR_INVALID_CAPTURE);
+			}
+			kelimelik_parser *parser;
+			kelimelik_parser_new(&parser);
+			assert(!KELIMELIK_IS_ERROR(kelimelik_capture_replay(capture, parser, NULL, NULL)));
+			kelimelik_parser_free(parser);
+			kelimelik_capture_close(capture);
+			if (!closed) {
+				kelimelik_capture_writer_close(writer);
+			}
+		}
+
+		// Rebuilding the index of a complete capture shouldn't change anything
+		assert(!KELIMELIK_IS_ERROR(kelimelik_capture_build_index(path)));
+		kelimelik_capture *capture;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_capture_open(&capture, path)));
+		assert(kelimelik_capture_frame_count(capture) == 3);
+		const kelimelik_capture_index_entry *entries;
+		size_t entry_count;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_capture_query(capture, "CaptureTest", 8, &entries, &entry_count)));
+		assert((entry_count == 1) && (entries[0].frame_index == 2));
+		kelimelik_capture_close(capture);
+		free(encoded);
+		unlink(path);
+		printf("Capture tests passed\n");
+	}
+
+	// JSON tests
+	{
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Json\"Test", 4)));
+		kelimelik_packet_set_uint8(packet, 0, 255);
+		kelimelik_packet_set_string_v1(packet, 1, "a\\b\n\x01\xc3\xbc");
+		kelimelik_packet_set_uint64(packet, 2, 18446744073709551615ULL);
+		const char *strings[] = { "x", "", NULL };
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v1(&array, strings)));
+		kelimelik_packet_set_array(packet, 3, array);
+		const char *expected = (
+			"{\"header\":\"Json\\\"Test\",\"data\":["
+			"{\"type\":\"uint8\",\"value\":255},"
+			"{\"type\":\"string\",\"value\":\"a\\\\b\\n\\u0001\xc3\xbc\"},"
+			"{\"type\":\"uint64\",\"value\":18446744073709551615},"
+			"{\"type\":\"array\",\"item_type\":\"string\",\"value\":[\"x\",\"\"]}"
+			"]}"
+		);
+		kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+		for (int i=0; i<2; i++) {
+			// The second iteration reuses the buffer
+			kelimelik_buffer_reset(&buffer);
+			assert(!KELIMELIK_IS_ERROR(kelimelik_packet_write_json_v1(packet, &buffer, KELIMELIK_JSON_COMPACT)));
+			assert(buffer.length == strlen(expected));
+			assert(memcmp(buffer.bytes, expected, buffer.length) == 0);
+		}
+
+		// Parse the JSON back and compare the encoded packets
+		void *encoded, *re_encoded;
+		size_t encoded_size, re_encoded_size;
+		kelimelik_packet *parsed_packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v3(&parsed_packet, (char *)buffer.bytes, buffer.length)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(parsed_packet, &re_encoded, &re_encoded_size)));
+		assert((encoded_size == re_encoded_size) && (memcmp(encoded, re_encoded, encoded_size) == 0));
+		free(re_encoded);
+		kelimelik_packet_free(parsed_packet);
+
+		// Bytes that aren't valid UTF-8 are escaped and survive the round trip
+		kelimelik_packet *invalid_utf8;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&invalid_utf8, "Utf8", 1)));
+		kelimelik_packet_set_string_v1(invalid_utf8, 0, "\xff" "a\xc3\xbc" "\xed\xa0\x80" "\xf0\x9f\x98\x80" "\xc3");
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_write_json_v1(invalid_utf8, &buffer, KELIMELIK_JSON_COMPACT)));
+		const char *escaped = (
+			"{\"header\":\"Utf8\",\"data\":[{\"type\":\"string\",\"value\":"
+			"\"\\udcffa\xc3\xbc\\udced\\udca0\\udc80\xf0\x9f\x98\x80\\udcc3\"}]}"
+		);
+		assert((buffer.length == strlen(escaped)) && (memcmp(buffer.bytes, escaped, buffer.length) == 0));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v3(&parsed_packet, (char *)buffer.bytes, buffer.length)));
+		void *utf8_encoded;
+		size_t utf8_encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(invalid_utf8, &utf8_encoded, &utf8_encoded_size)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(parsed_packet, &re_encoded, &re_encoded_size)));
+		assert((utf8_encoded_size == re_encoded_size) && (memcmp(utf8_encoded, re_encoded, re_encoded_size) == 0));
+		free(utf8_encoded);
+		free(re_encoded);
+		kelimelik_packet_free(parsed_packet);
+		kelimelik_packet_free(invalid_utf8);
+
+		// Other lone surrogates are still rejected
+		const char *lone_surrogate = "{\"header\": \"\\udc41\", \"data\": []}";
+		assert(KELIMELIK_IS_ERROR(kelimelik_packet_new_v3(&parsed_packet, lone_surrogate, strlen(lone_surrogate))));
+
+		// Key order, whitespace and escapes may differ
+		const char *reordered = (
+			"{ \"data\" : [ {\"value\" : 255 , \"type\": \"uint8\"} ], \"ignored\": [1, {\"a\": null}], "
+			"\"header\": \"\\u0041\\ud83d\\ude00\" }\n"
+		);
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_json_to_wire(reordered, strlen(reordered), &buffer)));
+		const char *reordered_wire = "\x00\x00\x00\x0a\x00\x05" "A\xf0\x9f\x98\x80" "\x01\x01\xff";
+		assert((buffer.length == 14) && (memcmp(buffer.bytes, reordered_wire, 14) == 0));
+		reordered = (
+			"{\"header\": \"A\", \"data\": [{\"value\": [\"x\", \"\"], \"item_type\": \"string\", \"type\": \"array\"}, "
+			"{\"type\": \"array\", \"value\": [7], \"item_type\": \"uint8\"}]}"
+		);
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_json_to_wire(reordered, strlen(reordered), &buffer)));
+		reordered_wire = (
+			"\x00\x00\x00\x16\x00\x01" "A\x02"
+			"\x08\x00\x00\x00\x02\x07\x00\x01x\x00\x00"
+			"\x08\x00\x00\x00\x01\x01\x07"
+		);
+		assert((buffer.length == 26) && (memcmp(buffer.bytes, reordered_wire, 26) == 0));
+
+		// Values of unknown keys must still be valid JSON, and the types
+		// can't be given twice
+		const char *invalid_values[] = {
+			"{\"x\": , \"header\": \"X\", \"data\": []}",
+			"{\"x\": nul, \"header\": \"X\", \"data\": []}",
+			"{\"x\": 1e, \"header\": \"X\", \"data\": []}",
+			"{\"x\": abc, \"header\": \"X\", \"data\": []}",
+			"{\"header\": \"X\", \"data\": [{\"value\": 1, \"type\": \"uint8\", \"type\": \"uint32\"}]}",
+			"{\"header\": \"X\", \"data\": [], \"header\": \"Y\"}",
+			"{\"data\": [], \"header\": \"X\", \"data\": [{\"type\": \"uint8\", \"value\": 1}]}",
+			"{\"header\": \"X\", \"data\": [{\"value\": 1, \"type\": \"array\"}]}"
+		};
+		for (size_t i=0; i<(sizeof(invalid_values) / sizeof(*invalid_values)); i++) {
+			assert(KELIMELIK_IS_ERROR(kelimelik_json_to_wire(invalid_values[i], strlen(invalid_values[i]), &buffer)));
+		}
+		const char *valid_values = "{\"x\": [-0.5e+3, true, false, null, 12], \"header\": \"X\", \"data\": []}";
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_json_to_wire(valid_values, strlen(valid_values), &buffer)));
+		assert(buffer.length == 8);
+
+		// Invalid input leaves the buffer untouched
+		const char *invalid = "{\"header\": \"X\", \"data\": [{\"type\": \"uint8\", \"value\": 256}]}";
+		kelimelik_error error = kelimelik_json_to_wire(invalid, strlen(invalid), &buffer);
+		assert(error.kelimelik_errno == KELIMELIK_ERROR_INVALID_JSON);
+		assert(buffer.length == 8);
+		free(encoded);
+		kelimelik_buffer_free(&buffer);
+		char *description = kelimelik_packet_description(packet);
+		assert(description != NULL);
+		assert(strstr(description, "\"value\": 255") != NULL);
+		free(description);
+		kelimelik_packet_free(packet);
+		printf("JSON tests passed\n");
+	}
+
+	// Logger tests
+	{
+		FILE *file = tmpfile();
+		assert(file != NULL);
+		kelimelik_logger *logger;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_logger_new(&logger, file, 16)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_logger_set_sampling(logger, "Sampled", 2)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_logger_set_sampling(logger, "Muted", 0)));
+		const char *headers[] = { "Sampled", "Muted", "Logged" };
+		for (int i=0; i<3; i++) {
+			kelimelik_packet *packet;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, headers[i], 1)));
+			kelimelik_packet_set_uint32(packet, 0, 42);
+			for (int j=0; j<4; j++) {
+				kelimelik_logger_packet(logger, KELIMELIK_LOG_INFO, 1, KELIMELIK_DIRECTION_CLIENT_TO_SERVER, packet);
+			}
+			kelimelik_packet_free(packet);
+		}
+
+		// Both headers have the same hash, but only one of them is muted
+		assert(!KELIMELIK_IS_ERROR(kelimelik_logger_set_sampling(logger, "HqGnS", 0)));
+		const char *colliding_headers[] = { "HqGnS", "HIaZa" };
+		for (int i=0; i<2; i++) {
+			kelimelik_packet *packet;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, colliding_headers[i], 0)));
+			kelimelik_logger_packet(logger, KELIMELIK_LOG_INFO, 1, KELIMELIK_DIRECTION_CLIENT_TO_SERVER, packet);
+			kelimelik_packet_free(packet);
+		}
+		kelimelik_logger_message(logger, KELIMELIK_LOG_DEBUG, "Below the level");
+		kelimelik_set_log_sink(kelimelik_logger_sink, logger);
+		kelimelik_logger_set_level(logger, KELIMELIK_LOG_DEBUG);
+		kelimelik_logger_message(logger, KELIMELIK_LOG_DEBUG, "Message %d", 1);
+		kelimelik_set_log_sink(NULL, NULL);
+		kelimelik_logger_free(logger);
+
+		// 2 sampled packets, 4 logged packets, the colliding header and a
+		// message
+		rewind(file);
+		char line[512];
+		int counts[5] = { 0 };
+		while (fgets(line, sizeof(line), file)) {
+			if (strstr(line, "] Sampled (19 bytes, 1 objects) [uint32 42]")) counts[0]++;
+			else if (strstr(line, "] Logged (18 bytes, 1 objects) [uint32 42]")) counts[1]++;
+			else if (strstr(line, "[DEBUG] Message 1")) counts[2]++;
+			else if (strstr(line, "] HIaZa (")) counts[3]++;
+			else counts[4]++;
+		}
+		assert((counts[0] == 2) && (counts[1] == 4) && (counts[2] == 1) && (counts[3] == 1) && (counts[4] == 0));
+		fclose(file);
+
+		// A sink is never called with the context of another sink
+		int first = 1, second = 2;
+		_Atomic bool done = false;
+		pthread_t thread;
+		assert(!pthread_create(&thread, NULL, log_sink_test_thread, &done));
+		for (int i=0; i<100000; i++) {
+			kelimelik_set_log_sink(log_sink_test_first, &first);
+			kelimelik_set_log_sink(log_sink_test_second, &second);
+		}
+		atomic_store(&done, true);
+		pthread_join(thread, NULL);
+		kelimelik_set_log_sink(NULL, NULL);
+		assert(log_sink_mismatches == 0);
+		printf("Logger tests passed\n");
+	}
+
+	// Stats tests
+	{
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_histogram *histogram, *other;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_histogram_new(&histogram, &counter.allocator)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_histogram_new(&other, &counter.allocator)));
+		assert(kelimelik_histogram_percentile(histogram, 50) == 0);
+		for (uint64_t i=1; i<=1000; i++) {
+			kelimelik_histogram_record(histogram, i);
+			kelimelik_histogram_record(other, i * 1000000);
+		}
+		assert((kelimelik_histogram_count(histogram) == 1000) && (kelimelik_histogram_max(histogram) == 1000));
+		assert(kelimelik_histogram_mean(histogram) == 500.5);
+		assert(kelimelik_histogram_percentile(histogram, 0) == 1);
+		assert(kelimelik_histogram_percentile(histogram, 100) == 1000);
+
+		// Percentiles are within 1/64 of the exact value
+		uint64_t value = kelimelik_histogram_percentile(histogram, 50);
+		assert((value >= 500) && (value < (500 + (500 / 64) + 1)));
+		value = kelimelik_histogram_percentile(other, 99);
+		assert((value >= 990000000) && (value < (990000000 + (990000000 / 64))));
+		kelimelik_histogram_merge(histogram, other);
+		assert(kelimelik_histogram_count(histogram) == 2000);
+		assert(kelimelik_histogram_max(histogram) == 1000000000);
+		value = kelimelik_histogram_percentile(histogram, 50);
+		assert((value >= 1000) && (value < (1000 + (1000 / 64) + 1)));
+		kelimelik_histogram_reset(histogram);
+		assert((kelimelik_histogram_count(histogram) == 0) && (kelimelik_histogram_percentile(histogram, 99) == 0));
+		kelimelik_histogram_record(histogram, UINT64_MAX);
+		assert(kelimelik_histogram_max(histogram) == ((UINT64_C(1) << 44) - 1));
+		kelimelik_histogram_free(histogram);
+		kelimelik_histogram_free(other);
+
+		// Responses answer the oldest request of the same connection
+		kelimelik_traffic_stats *stats;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_new(&stats, &counter.allocator)));
+		assert(KELIMELIK_IS_ERROR(kelimelik_traffic_stats_add_pair(stats, NULL, "Response")));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_add_pair(stats, "Request", "Response")));
+		const kelimelik_frame request = { .length = 20, .header = (const uint8_t *)"Request", .header_length = 7 };
+		const kelimelik_frame response = { .length = 100, .header = (const uint8_t *)"Response", .header_length = 8 };
+		kelimelik_traffic_stats_frame(stats, 1, KELIMELIK_DIRECTION_CLIENT_TO_SERVER, &request, 100);
+		kelimelik_traffic_stats_frame(stats, 2, KELIMELIK_DIRECTION_CLIENT_TO_SERVER, &request, 150);
+		kelimelik_traffic_stats_frame(stats, 1, KELIMELIK_DIRECTION_CLIENT_TO_SERVER, &request, 200);
+		kelimelik_traffic_stats_frame(stats, 3, KELIMELIK_DIRECTION_SERVER_TO_CLIENT, &response, 300);
+		kelimelik_traffic_stats_frame(stats, 1, KELIMELIK_DIRECTION_SERVER_TO_CLIENT, &response, 2100);
+		kelimelik_traffic_stats_frame(stats, 1, KELIMELIK_DIRECTION_SERVER_TO_CLIENT, &response, 4200);
+		kelimelik_traffic_stats_end_connection(stats, 2);
+		kelimelik_traffic_stats_decode_time(stats, "Response", 8, 3000);
+		kelimelik_traffic_stats_encode_time(stats, "Other", 5, 5000);
+		FILE *file = tmpfile();
+		assert(file != NULL);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_write(stats, file)));
+		kelimelik_traffic_stats_free(stats);
+		assert(counter.allocation_count == 0);
+
+		// A pair whose histogram can't be allocated leaves the pairs as they
+		// were
+		struct failing_allocator failing = {
+			.allocator = { failing_allocate, failing_reallocate, failing_release, &failing },
+			.parent = &counter
+		};
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_new(&stats, &failing.allocator)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_add_pair(stats, "A", "B")));
+		failing.fail_size = 4096;
+		assert(KELIMELIK_IS_ERROR(kelimelik_traffic_stats_add_pair(stats, "C", "D")));
+		failing.fail_size = 0;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_traffic_stats_add_pair(stats, "E", "F")));
+		kelimelik_traffic_stats_free(stats);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+
+		// Latencies of 2 and 4 us, and the request of connection 2 was never
+		// answered
+		rewind(file);
+		char line[512];
+		int counts[4] = { 0 };
+		while (fgets(line, sizeof(line), file)) {
+			char header[64];
+			unsigned long long packets[2], bytes[2];
+			double decode_time, encode_time;
+			if (strstr(line, "latency Request -> Response (us): 1 unanswered, 2 samples, mean 3.0, p50 2.0, ") && strstr(line, "max 4.0\n")) {
+				counts[0]++;
+			}
+			else if (sscanf(line, "%63s %llu %llu %llu %llu %lf %lf", header, &packets[0], &bytes[0], &packets[1], &bytes[1], &decode_time, &encode_time) == 7) {
+				if (!strcmp(header, "Request")) {
+					assert((packets[0] == 3) && (bytes[0] == 60) && (packets[1] == 0));
+					counts[1]++;
+				}
+				else if (!strcmp(header, "Response")) {
+					assert((packets[0] == 0) && (packets[1] == 3) && (bytes[1] == 300) && (decode_time == 3.0));
+					counts[2]++;
+				}
+				else if (!strcmp(header, "Other")) {
+					assert((packets[0] == 0) && (packets[1] == 0) && (encode_time == 5.0));
+					counts[3]++;
+				}
+			}
+		}
+		assert((counts[0] == 1) && (counts[1] == 1) && (counts[2] == 1) && (counts[3] == 1));
+		fclose(file);
+		printf("Stats tests passed\n");
+	}
+
+	// Allocator tests
+	{
+		// Packets from a parser are attributed to the parser's allocator
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		const char *input = (
+			"\x00\x00\x00\x1b"
+			"\x00\x05" "Alloc" // Header
+			"\x02" // Object count
+			"\x08\x00\x00\x00\x02\x07" // String[2]
+			"\x00\x01" "a"
+			"\x00\x03" "bcd"
+			"\x07\x00\x02" "ef" // String
+		);
+		kelimelik_packet **new_packets;
+		size_t count = 0;
+		kelimelik_parser_advance(parser, (uint8_t *)input, 31, &new_packets, &count);
+		assert(count == 1);
+		assert(new_packets[0]->allocator == &counter.allocator);
+		assert((counter.bytes_in_use > 0) && (counter.peak_bytes >= counter.bytes_in_use));
+
+		// Encoding into a buffer uses the buffer's allocator
+		kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+		buffer.allocator = &counter.allocator;
+		size_t before = counter.bytes_in_use;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode_v2(new_packets[0], &buffer)));
+		assert(counter.bytes_in_use == (before + buffer.capacity));
+		assert((buffer.length == 31) && (memcmp(buffer.bytes, input, 31) == 0));
+		kelimelik_buffer_free(&buffer);
+
+		// Arrays created with the packet's allocator can be stored in it
+		const char *integers = "\x00\x00\x00\x08" "\x00\x01" "B" "\x02" "\x01\x05" "\x01\x06";
+		kelimelik_parser_advance(parser, (uint8_t *)integers, 12, &new_packets, &count);
+		assert(count == 1);
+		const uint32_t values[] = { 1, 2, 3 };
+		kelimelik_array *values_array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_array_new_v2(&values_array, &counter.allocator, KELIMELIK_OBJECT_UINT32, values, sizeof(values))));
+		assert(values_array->item_count == 3);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_array(new_packets[0], 0, values_array)));
+		const char *word_bytes[] = { "KELIME!", "OYUN" };
+		const size_t word_lengths[] = { 6, 4 };
+		kelimelik_array *words;
+		assert(KELIMELIK_IS_ERROR(kelimelik_string_array_new_v5(&words, &counter.allocator, word_bytes, NULL, 2)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v5(&words, &counter.allocator, word_bytes, word_lengths, 2)));
+		assert((words->item_count == 2) && !strcmp((char *)words->strings[0]->string, "KELIME"));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_array(new_packets[0], 1, words)));
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+
+		// Objects created while a global allocator is set keep using it
+		kelimelik_counting_allocator global_counter;
+		kelimelik_counting_allocator_init(&global_counter, NULL);
+		kelimelik_set_allocator(&global_counter.allocator);
+		assert(kelimelik_get_allocator() == &global_counter.allocator);
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Global", 2)));
+		const char *strings[] = { "x", "yz", NULL };
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v1(&array, strings)));
+		kelimelik_packet_set_array(packet, 0, array);
+		kelimelik_packet_set_string_v1(packet, 1, "Test");
+		kelimelik_set_allocator(NULL);
+		assert(kelimelik_get_allocator() == &kelimelik_default_allocator);
+		assert(global_counter.allocation_count == 4);
+		kelimelik_packet_free(packet);
+		assert((global_counter.bytes_in_use == 0) && (global_counter.allocation_count == 0));
+		printf("Allocator tests passed\n");
+	}
+
+	// Pool tests
+	{
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_pool *pool;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_pool_new(&pool, &counter.allocator, 0)));
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, kelimelik_pool_allocator(pool))));
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "PoolTest", 3)));
+		const char *strings[] = { "a", "bc", "def", NULL };
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v1(&array, strings)));
+		kelimelik_packet_set_array(packet, 0, array);
+		kelimelik_packet_set_string_v1(packet, 1, "Pooled");
+		uint8_t large[2000] = { 0 };
+		assert(!KELIMELIK_IS_ERROR(kelimelik_uint8_array_new(&array, large, sizeof(large))));
+		kelimelik_packet_set_array(packet, 2, array);
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+
+		// After warming up, decoding doesn't allocate from the parent
+		size_t allocation_count = 0;
+		for (int i=0; i<100; i++) {
+			kelimelik_packet **new_packets;
+			size_t count;
+			kelimelik_parser_advance(parser, encoded, encoded_size, &new_packets, &count);
+			assert((count == 1) && (new_packets[0]->objects[2].array->item_count == 2000));
+			assert(strcmp((char *)new_packets[0]->objects[0].array->strings[2]->string, "def") == 0);
+			if (i == 2) {
+				allocation_count = counter.allocation_count;
+			}
+		}
+		assert(counter.allocation_count == allocation_count);
+		kelimelik_parser_free(parser);
+		kelimelik_pool_free(pool);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		free(encoded);
+		printf("Pool tests passed\n");
+	}
+
+	// Inline string tests
+	{
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		const char *input = (
+			"\x00\x00\x00\x2a"
+			"\x00\x06" "Inline" // Header
+			"\x03" // Object count
+			"\x07\x00\x05" "short" // String
+			"\x07\x00\x14" "a much longer string" // String
+			"\x01\x07" // UInt8
+		);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		kelimelik_packet **new_packets;
+		size_t count = 0;
+		kelimelik_parser_advance(parser, (uint8_t *)input, 46, &new_packets, &count);
+		assert(count == 1);
+		kelimelik_packet *packet = new_packets[0];
+
+		// The parser and its packets array, the packet and the long string
+		assert(counter.allocation_count == 4);
+		assert(packet->header_storage == KELIMELIK_STORAGE_INLINE);
+		assert(strcmp((char *)packet->header->string, "Inline") == 0);
+		assert(packet->objects[0].storage == KELIMELIK_STORAGE_INLINE);
+		assert(packet->objects[1].storage == KELIMELIK_STORAGE_HEAP);
+		const uint8_t *bytes;
+		uint16_t length;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_string(packet, 0, &bytes, &length)));
+		assert((length == 5) && (memcmp(bytes, "short", 6) == 0));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_string(packet, 1, &bytes, &length)));
+		assert((length == 20) && (memcmp(bytes, "a much longer string", 21) == 0));
+		assert(KELIMELIK_IS_ERROR(kelimelik_packet_get_string(packet, 2, &bytes, &length)));
+
+		// Replacing a value with a short string reuses the arena
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_string_v1(packet, 2, "new")));
+		assert((packet->objects[2].storage == KELIMELIK_STORAGE_INLINE) && (counter.allocation_count == 4));
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert((encoded_size == 50) && (memcmp((uint8_t *)encoded + 44, "\x07\x00\x03" "new", 6) == 0));
+		free(encoded);
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Inline string tests passed\n");
+	}
+
+	// Encoded size tests
+	{
+		const char *input = (
+			"\x00\x00\x00\x14"
+			"\x00\x04" "Size" // Header
+			"\x03" // Object count
+			"\x07\x00\x03" "abc" // String
+			"\x01\x07" // UInt8
+			"\x00\x00\x00\x00\x01" // UInt32
+		);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&parser)));
+		kelimelik_parser_set_options(parser, KELIMELIK_PARSER_KEEP_WIRE);
+		kelimelik_packet **new_packets;
+		size_t count = 0;
+		kelimelik_parser_advance(parser, (uint8_t *)input, 24, &new_packets, &count);
+		assert(count == 1);
+		kelimelik_packet *packet = new_packets[0];
+		assert((packet->encoded_size == 24) && (packet->wire != NULL));
+		assert(memcmp(packet->wire, input, 24) == 0);
+
+		// Setters update the size and drop the wire bytes
+		kelimelik_packet_set_uint32(packet, 1, 7);
+		assert((packet->encoded_size == 27) && (packet->wire == NULL));
+		kelimelik_packet_set_string_v1(packet, 0, "a longer string value");
+		assert(packet->encoded_size == 45);
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert(encoded_size == 45);
+		kelimelik_packet_invalidate(packet);
+		void *re_encoded;
+		size_t re_encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &re_encoded, &re_encoded_size)));
+		assert((re_encoded_size == 45) && (memcmp(encoded, re_encoded, 45) == 0));
+		assert(packet->encoded_size == 45);
+		free(encoded);
+		free(re_encoded);
+
+		// Packets created from scratch get their size once it is needed
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Size", 1)));
+		assert(packet->encoded_size == 0);
+		kelimelik_packet_set_uint8(packet, 0, 1);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert((encoded_size == 13) && (packet->encoded_size == 13));
+		kelimelik_packet_set_uint64(packet, 0, 1);
+		assert(packet->encoded_size == 20);
+		free(encoded);
+		kelimelik_packet_free(packet);
+		kelimelik_parser_free(parser);
+		printf("Encoded size tests passed\n");
+	}
+
+	// Lazy decode tests
+	{
+		const char *input = (
+			"\x00\x00\x00\x14"
+			"\x00\x04" "Lazy" // Header
+			"\x03" // Object count
+			"\x07\x00\x03" "abc" // String
+			"\x01\x07" // UInt8
+			"\x00\x00\x00\x00\x01" // UInt32
+		);
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		kelimelik_parser_set_options(parser, KELIMELIK_PARSER_LAZY);
+		kelimelik_packet **new_packets;
+		size_t count = 0;
+		kelimelik_parser_advance(parser, (uint8_t *)input, 24, &new_packets, &count);
+		assert(count == 1);
+		kelimelik_packet *packet = new_packets[0];
+		assert(packet->lazy && (packet->wire != NULL) && (packet->encoded_size == 24));
+		assert((packet->header->length == 4) && !memcmp(packet->header->string, "Lazy", 4));
+
+		// Forwarding a packet doesn't decode it
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert((encoded_size == 24) && !memcmp(encoded, input, 24));
+		assert(packet->lazy);
+		free(encoded);
+
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_materialize(packet)));
+		assert(!packet->lazy && (packet->wire != NULL) && (packet->encoded_size == 24));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_verify_packet(packet, "sbd")));
+		assert((packet->objects[1].uint8 == 7) && (packet->objects[2].uint32 == 1));
+		const uint8_t *bytes;
+		uint16_t length;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_string(packet, 0, &bytes, &length)));
+		assert((length == 3) && !memcmp(bytes, "abc", 3));
+
+		// Setters decode the packet by themselves
+		kelimelik_parser_advance(parser, (uint8_t *)input, 24, &new_packets, &count);
+		assert((count == 1) && new_packets[0]->lazy);
+		packet = new_packets[0];
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_uint32(packet, 2, 9)));
+		assert(!packet->lazy && (packet->wire == NULL) && (packet->encoded_size == 24));
+		assert((packet->objects[0].type == KELIMELIK_OBJECT_STRING) && (packet->objects[2].uint32 == 9));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		assert((encoded_size == 24) && !memcmp(encoded, input, 19));
+		assert(!memcmp((uint8_t *)encoded + 19, "\x00\x00\x00\x00\x09", 5));
+		free(encoded);
+
+		// Truncated objects are only noticed once the packet is decoded
+		const char *truncated = (
+			"\x00\x00\x00\x0B"
+			"\x00\x04" "Lazy" // Header
+			"\x02" // Object count
+			"\x01\x07" // UInt8
+			"\x07" // String without a length
+		);
+		kelimelik_parser_advance(parser, (uint8_t *)truncated, 15, &new_packets, &count);
+		assert((count == 1) && new_packets[0]->lazy);
+		packet = new_packets[0];
+		assert(KELIMELIK_IS_ERROR(kelimelik_packet_materialize(packet)));
+		assert(packet->lazy && (packet->objects[0].type == KELIMELIK_OBJECT_UNSPECIFIED));
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Lazy decode tests passed\n");
+	}
+
+	// Trusted decode tests
+	{
+		const char *words[] = { "KELIME", "", "OYUN" };
+		kelimelik_packet *packet;
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Trusted", 7)));
+		kelimelik_packet_set_uint8(packet, 0, 1);
+		kelimelik_packet_set_uint32(packet, 1, 2);
+		kelimelik_packet_set_uint64(packet, 2, 3);
+		kelimelik_packet_set_string_v1(packet, 3, "four");
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v2(&array, words, 3)));
+		kelimelik_packet_set_array(packet, 4, array);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_uint64_array_new(&array, (uint64_t[]){ 5, 6 }, 2)));
+		kelimelik_packet_set_array(packet, 5, array);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_uint8_array_new(&array, (uint8_t[]){ 7 }, 1)));
+		kelimelik_packet_set_array(packet, 6, array);
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+
+		// Both decoders give the same packet
+		kelimelik_intern_pool *pool;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_intern_pool_new(&pool, NULL)));
+		for (int i=0; i<3; i++) {
+			kelimelik_parser *parser;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&parser)));
+			kelimelik_parser_set_options(parser, i ? KELIMELIK_PARSER_TRUSTED : 0);
+			if (i == 2) {
+				kelimelik_parser_set_intern_pool(parser, pool);
+			}
+			kelimelik_packet **new_packets;
+			size_t count = 0;
+			kelimelik_parser_advance(parser, encoded, encoded_size, &new_packets, &count);
+			assert(count == 1);
+			packet = new_packets[0];
+			assert(!KELIMELIK_IS_ERROR(kelimelik_verify_packet(packet, "bdqsSQB")));
+			assert(packet->encoded_size == encoded_size);
+			assert((packet->objects[2].uint64 == 3) && !strcmp((char *)packet->objects[3].string->string, "four"));
+			assert((packet->objects[4].array->item_count == 3) && !strcmp((char *)packet->objects[4].array->strings[2]->string, "OYUN"));
+			assert((packet->objects[5].array->uint64s[1] == 6) && (packet->objects[6].array->uint8s[0] == 7));
+			void *reencoded;
+			size_t reencoded_size;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &reencoded, &reencoded_size)));
+			assert((reencoded_size == encoded_size) && !memcmp(reencoded, encoded, encoded_size));
+			free(reencoded);
+			kelimelik_parser_free(parser);
+		}
+		assert(kelimelik_intern_pool_count(pool) == 0);
+		kelimelik_intern_pool_free(pool);
+
+		// Arrays over the limit are still rejected
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new(&parser)));
+		kelimelik_parser_set_options(parser, KELIMELIK_PARSER_TRUSTED);
+		kelimelik_parser_set_limits(parser, &(kelimelik_parser_limits){ .max_array_items = 2 });
+		kelimelik_packet **new_packets;
+		size_t count = 0;
+		kelimelik_error error = kelimelik_parser_advance(parser, encoded, encoded_size, &new_packets, &count);
+		assert((count == 0) && (error.kelimelik_errno == KELIMELIK_ERROR_LIMIT_EXCEEDED));
+		kelimelik_parser_free(parser);
+		free(encoded);
+		printf("Trusted decode tests passed\n");
+	}
+
+	// Frame tests
+	{
+		const char *input = (
+			"\x00\x00\x00\x0C"
+			"\x00\x05" "Frame" // Header
+			"\x02" // Object count
+			"\x01\x07" // UInt8
+			"\x01\x08" // UInt8
+			"\x00\x00\x00\x09"
+			"\x00\x04" "Next" // Header
+			"\x01" // Object count
+			"\x01\x09" // UInt8
+		);
+		kelimelik_frame frame;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_frame_peek_header(input, 29, &frame)));
+		assert((frame.bytes == (const uint8_t *)input) && (frame.length == 16));
+		assert((frame.header_length == 5) && !memcmp(frame.header, "Frame", 5));
+		assert(frame.object_count == 2);
+		kelimelik_error error = kelimelik_frame_peek_header(input, 10, &frame);
+		assert((error.kelimelik_errno == KELIMELIK_ERROR_INVALID_ARGUMENT) && (frame.length == 16));
+		error = kelimelik_frame_peek_header(input, 2, &frame);
+		assert(KELIMELIK_IS_ERROR(error) && (frame.length == 0));
+
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		uint8_t bytes[29];
+		memcpy(bytes, input, 29);
+
+		// Whole frames point into the input
+		const kelimelik_frame *frames;
+		size_t count;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance_frames(parser, bytes, 29, &frames, &count)));
+		assert((count == 2) && (frames[0].bytes == bytes) && (frames[1].bytes == (bytes + 16)));
+		assert((frames[1].length == 13) && (frames[1].header_length == 4) && !memcmp(frames[1].header, "Next", 4));
+
+		// Frames that are split are copied
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance_frames(parser, bytes, 20, &frames, &count)));
+		assert((count == 1) && (frames[0].bytes == bytes));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance_frames(parser, bytes + 20, 9, &frames, &count)));
+		assert((count == 1) && (frames[0].bytes != (bytes + 16)) && !memcmp(frames[0].bytes, bytes + 16, 13));
+
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_frame_decode(&frames[0], &counter.allocator, &packet)));
+		assert((packet->object_count == 1) && (packet->objects[0].uint8 == 9));
+		assert(packet->encoded_size == 13);
+		kelimelik_packet_free(packet);
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Frame tests passed\n");
+	}
+
+	// Stream tests
+	{
+		// A frame with a UInt32 array that is bigger than a chunk, followed
+		// by a small frame that is buffered as usual
+		uint32_t item_count = 200000;
+		size_t frame_length = 4 + 2 + 6 + 1 + 7 + (1 + 4 + 1 + (item_count * 4)) + (1 + 4 + 1 + (3 * 5)) + 2;
+		uint8_t *input = malloc(frame_length + 13);
+		uint8_t *cursor = input;
+		*(uint32_t *)cursor = htonl(frame_length - 4); cursor += 4;
+		memcpy(cursor, "\x00\x06" "Stream" "\x04", 9); cursor += 9;
+		memcpy(cursor, "\x07\x00\x04" "name", 7); cursor += 7;
+		memcpy(cursor, "\x08", 1); cursor += 1;
+		*(uint32_t *)cursor = htonl(item_count); cursor += 4;
+		*(cursor++) = 0x00;
+		uint64_t expected_sum = 0;
+		for (uint32_t i=0; i<item_count; i++) {
+			*(uint32_t *)cursor = htonl(i * 3);
+			expected_sum += i * 3;
+			cursor += 4;
+		}
+		memcpy(cursor, "\x08\x00\x00\x00\x03\x07", 6); cursor += 6;
+		for (int i=0; i<3; i++) {
+			memcpy(cursor, "\x00\x03" "abc", 5); cursor += 5;
+		}
+		memcpy(cursor, "\x01\x2A", 2); cursor += 2;
+		memcpy(cursor, "\x00\x00\x00\x09" "\x00\x04" "Next" "\x01" "\x01\x09", 13); cursor += 13;
+		assert(cursor == (input + frame_length + 13));
+
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		struct stream_test test = { .strings_ok = true };
+		kelimelik_stream_handler handler = {
+			.begin = stream_test_begin,
+			.object = stream_test_object,
+			.array_begin = stream_test_array_begin,
+			.array_items = stream_test_array_items,
+			.end = stream_test_end,
+			.context = &test
+		};
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_set_stream_handler(parser, &handler, 1024)));
+
+		// Feed the frames in small pieces
+		size_t offset = 0;
+		size_t packet_count = 0;
+		while (offset < (frame_length + 13)) {
+			size_t part = ((frame_length + 13 - offset) < 1000) ? (frame_length + 13 - offset) : 1000;
+			kelimelik_packet **new_packets;
+			size_t count;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, input + offset, part, &new_packets, &count)));
+			if (count) {
+				assert((count == 1) && (new_packets[0]->objects[0].uint8 == 9));
+				packet_count++;
+			}
+			offset += part;
+		}
+		assert((test.frames == 1) && (test.ends == 1) && (packet_count == 1));
+		assert(test.frame_length == frame_length);
+		assert(!strcmp(test.string, "name") && (test.uint8_value == 42));
+		assert((test.item_count == item_count) && (test.next_item == item_count) && (test.item_sum == expected_sum));
+		assert(test.chunks == 13);
+		assert((test.string_items == 3) && test.strings_ok);
+
+		// The frame was never buffered as a whole
+		assert(counter.peak_bytes < (256 * 1024));
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		free(input);
+
+		// A big string array streamed through a pool doesn't copy the
+		// scratch buffer for every item
+		item_count = 5000;
+		frame_length = 4 + 2 + 6 + 1 + (1 + 4 + 1 + (item_count * 5));
+		input = malloc(frame_length);
+		cursor = input;
+		*(uint32_t *)cursor = htonl(frame_length - 4); cursor += 4;
+		memcpy(cursor, "\x00\x06" "Stream" "\x01", 9); cursor += 9;
+		memcpy(cursor, "\x08", 1); cursor += 1;
+		*(uint32_t *)cursor = htonl(item_count); cursor += 4;
+		*(cursor++) = 0x07;
+		for (uint32_t i=0; i<item_count; i++) {
+			memcpy(cursor, "\x00\x03" "abc", 5); cursor += 5;
+		}
+		assert(cursor == (input + frame_length));
+		kelimelik_pool *pool;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_pool_new(&pool, &counter.allocator, 0)));
+		struct call_counting_allocator calls = {
+			.allocator = { call_counting_allocate, NULL, call_counting_release, &calls },
+			.parent = kelimelik_pool_allocator(pool)
+		};
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &calls.allocator)));
+		memset(&test, 0, sizeof(test));
+		test.strings_ok = true;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_set_stream_handler(parser, &handler, 1024)));
+		kelimelik_packet **new_packets;
+		size_t count;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, input, frame_length, &new_packets, &count)));
+		assert(!count && (test.frames == 1) && (test.ends == 1));
+		assert((test.string_items == item_count) && test.strings_ok);
+		assert(calls.allocations < 100);
+		kelimelik_parser_free(parser);
+		kelimelik_pool_free(pool);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		free(input);
+		printf("Stream tests passed\n");
+	}
+
+	// Limit tests
+	{
+		const char *small = (
+			"\x00\x00\x00\x09"
+			"\x00\x04" "Tiny" // Header
+			"\x01" // Object count
+			"\x01\x07" // UInt8
+		);
+		const char *big = (
+			"\x00\x00\x00\x0F"
+			"\x00\x03" "Big" // Header
+			"\x01" // Object count
+			"\x08\x00\x00\x00\x03\x01" // UInt8[3]
+			"\x01\x02\x03"
+		);
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		kelimelik_parser_limits limits = { .max_frame_size = 16 };
+		kelimelik_parser_set_limits(parser, &limits);
+		uint8_t input[32];
+		memcpy(input, big, 19);
+		memcpy(input + 19, small, 13);
+
+		// Frames that are too big are skipped without stopping the parser
+		kelimelik_packet **new_packets;
+		size_t count;
+		kelimelik_error error = kelimelik_parser_advance(parser, input, 32, &new_packets, &count);
+		assert((error.kelimelik_errno == KELIMELIK_ERROR_LIMIT_EXCEEDED) && (error.details == KELIMELIK_LIMIT_FRAME_SIZE));
+		assert((count == 1) && (new_packets[0]->header->length == 4));
+		kelimelik_parser_stats stats;
+		kelimelik_parser_get_stats(parser, &stats);
+		assert((stats.frames_too_big == 1) && (stats.arrays_too_big == 0) && (stats.over_budget == 0));
+
+		// Huge size prefixes are never allocated
+		size_t bytes_in_use = counter.bytes_in_use;
+		error = kelimelik_parser_advance(parser, (uint8_t *)"\xFF\xFF\xFF\x00" "abc", 7, &new_packets, &count);
+		assert(KELIMELIK_IS_ERROR(error) && (count == 0));
+		assert(counter.bytes_in_use <= bytes_in_use);
+		kelimelik_parser_free(parser);
+
+		// Arrays
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		limits = (kelimelik_parser_limits){ .max_array_items = 2 };
+		kelimelik_parser_set_limits(parser, &limits);
+		error = kelimelik_parser_advance(parser, input, 32, &new_packets, &count);
+		assert((error.kelimelik_errno == KELIMELIK_ERROR_LIMIT_EXCEEDED) && (error.details == KELIMELIK_LIMIT_ARRAY_ITEMS));
+		assert(count == 1);
+		kelimelik_parser_get_stats(parser, &stats);
+		assert((stats.frames_too_big == 0) && (stats.arrays_too_big == 1));
+		kelimelik_parser_free(parser);
+
+		// Groups share a budget between parsers
+		kelimelik_parser_group *group;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_group_new(&group, 24)));
+		kelimelik_parser *first, *second;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&first, &counter.allocator)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&second, &counter.allocator)));
+		kelimelik_parser_set_group(first, group);
+		kelimelik_parser_set_group(second, group);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(first, input, 10, &new_packets, &count)) && (count == 0));
+		assert(kelimelik_parser_group_buffered_bytes(group) == 19);
+		error = kelimelik_parser_advance(second, input + 19, 13, &new_packets, &count);
+		assert((error.kelimelik_errno == KELIMELIK_ERROR_LIMIT_EXCEEDED) && (error.details == KELIMELIK_LIMIT_BUFFERED_BYTES));
+		assert(count == 0);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(first, input + 10, 22, &new_packets, &count)) && (count == 2));
+		assert(kelimelik_parser_group_buffered_bytes(group) == 0);
+		kelimelik_parser_group_get_stats(group, &stats);
+		assert(stats.over_budget == 1);
+		kelimelik_parser_free(first);
+		kelimelik_parser_free(second);
+		kelimelik_parser_group_free(group);
+
+		// Every packet from a call stays valid, and the packets array
+		// shrinks again after a burst
+		uint8_t burst[13 * 100];
+		for (int i=0; i<100; i++) {
+			memcpy(burst + (i * 13), small, 13);
+		}
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, burst, sizeof(burst), &new_packets, &count)));
+		assert(count == 100);
+		for (int i=0; i<100; i++) {
+			assert(new_packets[i]->objects[0].uint8 == 7);
+		}
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, burst, 13, &new_packets, &count)) && (count == 1));
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Limit tests passed\n");
+	}
+
+	// Pipeline tests
+	{
+		// Every connection sends 2000 frames with its index, and every
+		// 500th frame has an invalid type
+		uint32_t frame_count = 2000;
+		uint8_t *input = malloc(frame_count * 15);
+		for (uint32_t i=0; i<frame_count; i++) {
+			uint8_t *frame = input + (i * 15);
+			if ((i % 500) == 499) {
+				memcpy(frame, "\x00\x00\x00\x0B" "\x00\x03" "Bad" "\x01" "\x63", 11);
+			}
+			else {
+				memcpy(frame, "\x00\x00\x00\x0B" "\x00\x03" "Seq" "\x01" "\x00", 11);
+			}
+			*(uint32_t *)(frame + 11) = htonl(i);
+		}
+
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		_Atomic uint32_t delivered = 0;
+		kelimelik_pipeline *pipeline;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_pipeline_new(&pipeline, 4, &counter.allocator, pipeline_test_callback, &delivered)));
+		struct pipeline_test tests[3];
+		kelimelik_pipeline_connection *connections[3];
+		for (int i=0; i<3; i++) {
+			tests[i] = (struct pipeline_test){ .ordered = true };
+			assert(!KELIMELIK_IS_ERROR(kelimelik_pipeline_connection_new(pipeline, &connections[i], &tests[i])));
+		}
+
+		// Interleave the connections and split frames between calls
+		size_t offsets[3] = { 0, 0, 0 };
+		size_t total = frame_count * 15;
+		while ((offsets[0] < total) || (offsets[1] < total) || (offsets[2] < total)) {
+			for (int i=0; i<3; i++) {
+				size_t part = 7 + (i * 31);
+				if ((total - offsets[i]) < part) {
+					part = total - offsets[i];
+				}
+				if (part) {
+					kelimelik_pipeline_submit(connections[i], input + offsets[i], part);
+					offsets[i] += part;
+				}
+			}
+		}
+		kelimelik_pipeline_flush(pipeline);
+		assert(delivered == (frame_count * 3));
+		for (int i=0; i<3; i++) {
+			assert(tests[i].ordered && (tests[i].next == frame_count) && (tests[i].errors == 4));
+		}
+
+		// Frames that are still queued are delivered after their
+		// connection is freed
+		tests[0] = (struct pipeline_test){ .ordered = true };
+		assert(!KELIMELIK_IS_ERROR(kelimelik_pipeline_submit(connections[0], input, 15 * 400)));
+		for (int i=0; i<3; i++) {
+			kelimelik_pipeline_connection_free(connections[i]);
+		}
+		kelimelik_pipeline_free(pipeline);
+		assert(tests[0].ordered && (tests[0].next == 400));
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		free(input);
+		printf("Pipeline tests passed\n");
+	}
+
+	// Shared packet tests
+	{
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_set_allocator(&counter.allocator);
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Event", 2)));
+		kelimelik_set_allocator(NULL);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_uint32(packet, 0, 77)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_string_v1(packet, 1, "abc")));
+
+		// Frozen packets keep a single encoding and can't be changed
+		const uint8_t *wire;
+		size_t wire_length;
+		assert(KELIMELIK_IS_ERROR(kelimelik_packet_get_wire(packet, &wire, &wire_length)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_freeze(packet)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_wire(packet, &wire, &wire_length)));
+		assert((wire_length == 23) && !memcmp(wire, "\x00\x00\x00\x13" "\x00\x05" "Event" "\x02" "\x00\x00\x00\x00\x4D" "\x07\x00\x03" "abc", 23));
+		assert(kelimelik_packet_set_uint32(packet, 0, 78).kelimelik_errno == KELIMELIK_ERROR_FROZEN);
+		assert(kelimelik_packet_set_string_v1(packet, 1, "def").kelimelik_errno == KELIMELIK_ERROR_FROZEN);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_freeze(packet)));
+
+		// Clones are independent of the original
+		kelimelik_packet *clone;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_clone(packet, &counter.allocator, &clone)));
+		assert(!clone->frozen && (clone->objects[0].uint32 == 77));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_uint32(clone, 0, 78)));
+		assert((packet->objects[0].uint32 == 77) && (packet->wire == wire));
+		kelimelik_packet_free(clone);
+
+		// Every thread gets a reference, and the last one frees the packet
+		pthread_t threads[4];
+		for (int i=0; i<4; i++) {
+			assert(kelimelik_packet_retain(packet) == packet);
+			assert(!pthread_create(&threads[i], NULL, shared_packet_thread, packet));
+		}
+		kelimelik_packet_release(packet);
+		for (int i=0; i<4; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+
+		// Parser packets can be kept past the next call
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		kelimelik_packet **new_packets;
+		size_t count;
+		uint8_t frame[] = "\x00\x00\x00\x09" "\x00\x04" "Keep" "\x01" "\x01\x05";
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, frame, 13, &new_packets, &count)) && (count == 1));
+		kelimelik_packet *kept = kelimelik_packet_retain(new_packets[0]);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, frame, 13, &new_packets, &count)) && (count == 1));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, frame, 4, &new_packets, &count)) && (count == 0));
+		assert((kept->objects[0].uint8 == 5) && (kept->header->length == 4));
+		kelimelik_packet_release(kept);
+		kelimelik_parser_free(parser);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Shared packet tests passed\n");
+	}
+
+	// Broadcast tests
+	{
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		int sockets[3][2];
+		kelimelik_send_queue *queues[3];
+		for (int i=0; i<3; i++) {
+			assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_new(&queues[i], sockets[i][0], &counter.allocator)));
+		}
+		kelimelik_set_allocator(&counter.allocator);
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Lobby", 1)));
+		kelimelik_set_allocator(NULL);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_string_v1(packet, 0, "Tournament starts")));
+
+		// The packet is encoded once and every queue holds a reference
+		assert(!KELIMELIK_IS_ERROR(kelimelik_broadcast(packet, queues, 3)));
+		assert(packet->frozen && (packet->references == 4));
+		size_t allocation_count = counter.allocation_count;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_broadcast(packet, queues, 3)));
+		assert(counter.allocation_count == allocation_count);
+		kelimelik_packet_release(packet);
+		for (int i=0; i<3; i++) {
+			assert(kelimelik_send_queue_pending_bytes(queues[i]) == (2 * 32));
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_flush(queues[i])));
+			assert(kelimelik_send_queue_pending_bytes(queues[i]) == 0);
+			uint8_t received[64];
+			assert(read(sockets[i][1], received, sizeof(received)) == 64);
+			assert(!memcmp(received + 4, "\x00\x05" "Lobby" "\x01" "\x07\x00\x11" "Tournament starts", 28));
+			assert(!memcmp(received, received + 32, 32));
+		}
+
+		// Flushing stops when the socket is full and continues later
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, "Big", 1)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_uint32(packet, 0, 7)));
+		for (int i=0; i<20000; i++) {
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_push(queues[0], packet)));
+		}
+		kelimelik_packet_release(packet);
+		size_t total = 20000 * 15;
+		size_t received_total = 0;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_flush(queues[0])));
+		assert(kelimelik_send_queue_pending_bytes(queues[0]) > 0);
+		while (received_total < total) {
+			uint8_t received[4096];
+			ssize_t length = read(sockets[0][1], received, sizeof(received));
+			assert(length > 0);
+			received_total += length;
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_flush(queues[0])));
+		}
+		assert((received_total == total) && (kelimelik_send_queue_pending_bytes(queues[0]) == 0));
+		for (int i=0; i<3; i++) {
+			kelimelik_send_queue_free(queues[i]);
+			close(sockets[i][0]);
+			close(sockets[i][1]);
+		}
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Broadcast tests passed\n");
+	}
+
+	// Zerocopy tests
+	{
+		// MSG_ZEROCOPY needs a TCP socket
+		int listener = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+		socklen_t address_length = sizeof(address);
+		assert(!bind(listener, (struct sockaddr *)&address, sizeof(address)) && !listen(listener, 1));
+		assert(!getsockname(listener, (struct sockaddr *)&address, &address_length));
+		int sender = socket(AF_INET, SOCK_STREAM, 0);
+		assert(!connect(sender, (struct sockaddr *)&address, sizeof(address)));
+		int receiver = accept(listener, NULL, NULL);
+		assert(receiver != -1);
+
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_send_queue *queue;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_new(&queue, sender, &counter.allocator)));
+		kelimelik_error error = kelimelik_send_queue_set_zerocopy(queue, 4096);
+		bool zerocopy = !KELIMELIK_IS_ERROR(error);
+		assert(zerocopy || (error.kelimelik_errno == KELIMELIK_ERROR_NOT_IMPLEMENTED));
+
+		// Big string arrays go out with MSG_ZEROCOPY, the small packets in
+		// between are still copied
+		const char *strings[2048];
+		for (int i=0; i<2048; i++) {
+			strings[i] = "a string in a big response";
+		}
+		kelimelik_set_allocator(&counter.allocator);
+		kelimelik_packet *big, *small;
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&big, "Words", 1)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v2(&array, strings, 2048)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_array(big, 0, array)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&small, "Tick", 1)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_set_uint8(small, 0, 1)));
+		kelimelik_set_allocator(NULL);
+		size_t total = 0;
+		for (int i=0; i<20; i++) {
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_push(queue, big)));
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_push(queue, small)));
+			total += big->encoded_size + small->encoded_size;
+		}
+		const uint8_t *big_wire, *small_wire;
+		size_t big_length, small_length;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_wire(big, &big_wire, &big_length)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_get_wire(small, &small_wire, &small_length)));
+
+		// Check the stream on the other side while flushing
+		uint8_t *received = malloc(total);
+		size_t received_total = 0;
+		while (received_total < total) {
+			assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_flush(queue)));
+			ssize_t length = read(receiver, received + received_total, total - received_total);
+			assert(length > 0);
+			received_total += length;
+		}
+		for (size_t offset=0; offset<total; offset += big_length + small_length) {
+			assert(!memcmp(received + offset, big_wire, big_length));
+			assert(!memcmp(received + offset + big_length, small_wire, small_length));
+		}
+		free(received);
+		kelimelik_packet_release(big);
+		kelimelik_packet_release(small);
+
+		// Pinned packets are released once the kernel is done with them
+		kelimelik_send_queue_stats stats;
+		kelimelik_send_queue_get_stats(queue, &stats);
+		assert(stats.bytes_sent == total);
+		if (zerocopy) {
+			assert(stats.zerocopy_sends >= 20);
+			for (int i=0; (i<1000) && kelimelik_send_queue_pinned_bytes(queue); i++) {
+				nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+				assert(!KELIMELIK_IS_ERROR(kelimelik_send_queue_flush(queue)));
+			}
+			assert(kelimelik_send_queue_pinned_bytes(queue) == 0);
+		}
+		assert(stats.copy_sends > 0);
+		kelimelik_send_queue_free(queue);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		close(sender);
+		close(receiver);
+		close(listener);
+		printf("Zerocopy tests passed\n");
+	}
+
+	// Intern pool tests
+	{
+		const char *input = (
+			"\x00\x00\x00\x2D"
+			"\x00\x04Word" // Header
+			"\x02" // Object count
+			"\x07\x00\x09Kelimelik" // String
+			"\x08\x00\x00\x00\x03\x07" // String[3]
+			"\x00\x05" "apple"
+			"\x00\x04" "pear"
+			"\x00\x05" "apple"
+		);
+		kelimelik_counting_allocator counter;
+		kelimelik_counting_allocator_init(&counter, NULL);
+		kelimelik_intern_pool *pool;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_intern_pool_new(&pool, &counter.allocator)));
+		kelimelik_parser *parser;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_new_v2(&parser, &counter.allocator)));
+		kelimelik_parser_set_intern_pool(parser, pool);
+
+		// Repeated strings are the same string, in and across packets
+		uint8_t frames[49 * 2];
+		memcpy(frames, input, 49);
+		memcpy(frames + 49, input, 49);
+		kelimelik_packet **new_packets;
+		size_t count;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_parser_advance(parser, frames, sizeof(frames), &new_packets, &count)) && (count == 2));
+		kelimelik_packet *first = new_packets[0];
+		kelimelik_packet *second = new_packets[1];
+		kelimelik_packet_retain(first);
+		kelimelik_packet_retain(second);
+		assert(first->objects[0].storage == KELIMELIK_STORAGE_INTERNED);
+		assert(!strcmp((const char *)first->objects[0].string->string, "Kelimelik"));
+		assert(first->objects[0].string == second->objects[0].string);
+		kelimelik_array *array = first->objects[1].array;
+		assert((array->item_count == 3) && (array->storage == KELIMELIK_STORAGE_INTERNED));
+		assert(!strcmp((const char *)array->strings[1]->string, "pear"));
+		assert(array->strings[0] == array->strings[2]);
+		assert(array->strings[0] == second->objects[1].array->strings[0]);
+		assert(kelimelik_intern_pool_count(pool) == 3);
+
+		// Interned packets encode to the same bytes
+		void *encoded;
+		size_t encoded_size;
+		kelimelik_packet_invalidate(first);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(first, &encoded, &encoded_size)));
+		assert((encoded_size == 49) && !memcmp(encoded, input, 49));
+		free(encoded);
+
+		// Strings stay in the pool until their last reference is gone
+		kelimelik_string *kelimelik;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_intern_string(pool, "Kelimelik", 9, &kelimelik)));
+		assert(kelimelik == first->objects[0].string);
+		kelimelik_parser_free(parser);
+		kelimelik_packet_release(first);
+		kelimelik_packet_release(second);
+		assert(kelimelik_intern_pool_count(pool) == 1);
+		kelimelik_interned_release(kelimelik);
+		assert(kelimelik_intern_pool_count(pool) == 0);
+
+		// Threads share the pool
+		pthread_t threads[4];
+		for (int i=0; i<4; i++) {
+			assert(!pthread_create(&threads[i], NULL, intern_test_thread, pool));
+		}
+		for (int i=0; i<4; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		assert(kelimelik_intern_pool_count(pool) == 0);
+		kelimelik_intern_pool_free(pool);
+		assert((counter.bytes_in_use == 0) && (counter.allocation_count == 0));
+		printf("Intern pool tests passed\n");
+	}
+
+	// Schema tests
+	{
+		// Generated encoders write the same bytes as packets
+		kelimelik_packet *packet;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, GAME_MODULE_REQUEST_LOGIN_HEADER, 3)));
+		kelimelik_packet_set_uint32(packet, 0, 123456);
+		kelimelik_packet_set_string_v1(packet, 1, "password");
+		kelimelik_packet_set_uint32(packet, 2, 238);
+		void *encoded;
+		size_t encoded_size;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+		game_module_request_login login = {
+			.uid = 123456,
+			.password = KELIMELIK_SCHEMA_STRING("password"),
+			.version = 238
+		};
+		kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+		assert(game_module_request_login_encoded_size(&login) == encoded_size);
+		assert(!KELIMELIK_IS_ERROR(game_module_request_login_encode(&login, &buffer)));
+		assert((buffer.length == encoded_size) && !memcmp(buffer.bytes, encoded, encoded_size));
+
+		// Decoded strings point into the frame
+		game_module_request_login decoded;
+		assert(!KELIMELIK_IS_ERROR(game_module_request_login_decode(encoded, encoded_size, &decoded)));
+		assert((decoded.uid == 123456) && (decoded.version == 238));
+		assert((decoded.password.length == 8) && !memcmp(decoded.password.bytes, "password", 8));
+		assert((decoded.password.bytes > (uint8_t *)encoded) && (decoded.password.bytes < ((uint8_t *)encoded + encoded_size)));
+
+		// Other messages and broken frames are rejected
+		game_module_user_profile profile;
+		kelimelik_error error = game_module_user_profile_decode(encoded, encoded_size, &profile);
+		assert(error.kelimelik_errno == KELIMELIK_ERROR_DIFFERENT_FORMAT);
+		error = game_module_request_login_decode(encoded, encoded_size - 1, &decoded);
+		assert(error.kelimelik_errno == KELIMELIK_ERROR_DIFFERENT_FORMAT);
+		((uint8_t *)encoded)[encoded_size - 5] = KELIMELIK_OBJECT_UINT64;
+		error = game_module_request_login_decode(encoded, encoded_size, &decoded);
+		assert(error.kelimelik_errno == KELIMELIK_ERROR_DIFFERENT_FORMAT);
+		free(encoded);
+
+		// Unknown objects are passed through as they are
+		const char *words[] = { "A", "BC" };
+		kelimelik_array *array;
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, GAME_MODULE_USER_PURCHASE_DATA_HEADER, 8)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_string_array_new_v2(&array, words, 2)));
+		kelimelik_packet_set_array(packet, 0, array);
+		kelimelik_packet_set_uint8(packet, 1, 1);
+		kelimelik_packet_set_uint64(packet, 2, 2);
+		kelimelik_packet_set_string_v1(packet, 3, "three");
+		assert(!KELIMELIK_IS_ERROR(kelimelik_uint32_array_new(&array, (uint32_t[]){ 4, 5 }, 2)));
+		kelimelik_packet_set_array(packet, 4, array);
+		kelimelik_packet_set_uint32(packet, 5, 6);
+		kelimelik_packet_set_uint32(packet, 6, 7);
+		kelimelik_packet_set_uint32(packet, 7, 500);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+		game_module_user_purchase_data purchase;
+		assert(!KELIMELIK_IS_ERROR(game_module_user_purchase_data_decode(encoded, encoded_size, &purchase)));
+		assert((purchase.coins == 500) && (purchase.unknown1.length == 2));
+		purchase.coins = (uint32_t)-100;
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(game_module_user_purchase_data_encode(&purchase, &buffer)));
+		assert((buffer.length == encoded_size) && !memcmp(buffer.bytes, encoded, encoded_size - 4));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_frame_decode(&(kelimelik_frame){ .bytes = buffer.bytes, .length = buffer.length }, NULL, &packet)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_verify_packet(packet, "SbqsDddd")));
+		assert((packet->objects[7].uint32 == (uint32_t)-100) && (packet->objects[4].array->uint32s[1] == 5));
+		kelimelik_packet_free(packet);
+
+		free(encoded);
+
+		// Messages that allow more objects keep the rest
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_new_v1(&packet, GAME_MODULE_LOGIN_ACCEPTED_HEADER, 6)));
+		kelimelik_packet_set_uint32(packet, 0, 1);
+		kelimelik_packet_set_string_v1(packet, 1, "user");
+		kelimelik_packet_set_uint8(packet, 2, 2);
+		kelimelik_packet_set_string_v1(packet, 3, "user@example.com");
+		kelimelik_packet_set_uint64(packet, 4, 3);
+		kelimelik_packet_set_string_v1(packet, 5, "rest");
+		assert(!KELIMELIK_IS_ERROR(kelimelik_packet_encode(packet, &encoded, &encoded_size)));
+		kelimelik_packet_free(packet);
+		game_module_login_accepted accepted;
+		assert(!KELIMELIK_IS_ERROR(game_module_login_accepted_decode(encoded, encoded_size, &accepted)));
+		assert((accepted.username.length == 4) && !memcmp(accepted.username.bytes, "user", 4));
+		assert((accepted.rest_count == 2) && (accepted.rest.length == (9 + 7)));
+		accepted.username = KELIMELIK_SCHEMA_STRING("renamed");
+		kelimelik_buffer_reset(&buffer);
+		assert(!KELIMELIK_IS_ERROR(game_module_login_accepted_encode(&accepted, &buffer)));
+		free(encoded);
+		assert(!KELIMELIK_IS_ERROR(kelimelik_frame_decode(&(kelimelik_frame){ .bytes = buffer.bytes, .length = buffer.length }, NULL, &packet)));
+		assert(!KELIMELIK_IS_ERROR(kelimelik_verify_packet(packet, "dsbsqs")));
+		assert(!strcmp((char *)packet->objects[1].string->string, "renamed"));
+		assert(!strcmp((char *)packet->objects[5].string->string, "rest"));
+		kelimelik_packet_free(packet);
+		kelimelik_buffer_free(&buffer);
+		printf("Schema tests passed\n");
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,546 @@
+// Generated by tools/schema-gen from game-module.schema. Don't edit.
+
+#ifndef __KELIMELIK_GAME_MODULE_H
+#define __KELIMELIK_GAME_MODULE_H
+
+#ifndef KELIMELIK_SCHEMA_PRELUDE
+#define KELIMELIK_SCHEMA_PRELUDE
+
+#include <kelimelik.h>
+#include <string.h>
+
+// A string in wire format. It isn't null terminated.
+typedef struct {
+	const uint8_t *bytes;
+	uint16_t length;
+} kelimelik_schema_string;
+
+#define KELIMELIK_SCHEMA_STRING(c_string) ((kelimelik_schema_string){ (const uint8_t *)(c_string), (uint16_t)strlen(c_string) })
+
+// The items of an array in wire format, so integers are big endian and
+// strings are prefixed with their length. length is in bytes.
+typedef struct {
+	const uint8_t *bytes;
+	uint32_t count;
+	size_t length;
+} kelimelik_schema_array;
+
+// Objects that are passed through as they are, including the type byte.
+typedef struct {
+	const uint8_t *bytes;
+	size_t length;
+} kelimelik_schema_raw;
+
+#define KELIMELIK_SCHEMA_RESULT(value) ((kelimelik_error){ .kelimelik_errno = (value) })
+
+static inline uint16_t kelimelik_schema_get_u16(const uint8_t *bytes) {
+	return ((uint16_t)bytes[0] << 8) | bytes[1];
+}
+
+static inline uint32_t kelimelik_schema_get_u32(const uint8_t *bytes) {
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static inline uint64_t kelimelik_schema_get_u64(const uint8_t *bytes) {
+	return ((uint64_t)kelimelik_schema_get_u32(bytes) << 32) | kelimelik_schema_get_u32(bytes + 4);
+}
+
+static inline void kelimelik_schema_put_u16(uint8_t *bytes, uint16_t value) {
+	bytes[0] = value >> 8;
+	bytes[1] = value;
+}
+
+static inline void kelimelik_schema_put_u32(uint8_t *bytes, uint32_t value) {
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+}
+
+static inline void kelimelik_schema_put_u64(uint8_t *bytes, uint64_t value) {
+	kelimelik_schema_put_u32(bytes, value >> 32);
+	kelimelik_schema_put_u32(bytes + 4, value);
+}
+
+// Items of integer arrays
+static inline uint8_t kelimelik_schema_uint8_at(const kelimelik_schema_array *array, uint32_t index) {
+	return array->bytes[index];
+}
+
+static inline uint32_t kelimelik_schema_uint32_at(const kelimelik_schema_array *array, uint32_t index) {
+	return kelimelik_schema_get_u32(array->bytes + ((size_t)index * 4));
+}
+
+static inline uint64_t kelimelik_schema_uint64_at(const kelimelik_schema_array *array, uint32_t index) {
+	return kelimelik_schema_get_u64(array->bytes + ((size_t)index * 8));
+}
+
+// Walks the items of a string array. cursor starts at array->bytes and is
+// moved to the next string.
+static inline kelimelik_schema_string kelimelik_schema_next_string(const uint8_t **cursor) {
+	kelimelik_schema_string string = { *cursor + 2, kelimelik_schema_get_u16(*cursor) };
+	*cursor += 2 + string.length;
+	return string;
+}
+
+// Returns the end of count strings in wire format, or NULL if they don't fit.
+static inline const uint8_t *kelimelik_schema_skip_strings(const uint8_t *bytes, const uint8_t *end, uint32_t count) {
+	for (uint32_t i=0; i<count; i++) {
+		if ((end - bytes) < 2) return NULL;
+		size_t length = kelimelik_schema_get_u16(bytes);
+		bytes += 2;
+		if ((size_t)(end - bytes) < length) return NULL;
+		bytes += length;
+	}
+	return bytes;
+}
+
+// Returns the end of an object of any type, or NULL if it doesn't fit.
+static inline const uint8_t *kelimelik_schema_skip_object(const uint8_t *bytes, const uint8_t *end) {
+	if (bytes >= end) return NULL;
+	size_t size;
+	switch (*(bytes++)) {
+		case KELIMELIK_OBJECT_UINT8: size = 1; break;
+		case KELIMELIK_OBJECT_UINT32: size = 4; break;
+		case KELIMELIK_OBJECT_UINT64: size = 8; break;
+		case KELIMELIK_OBJECT_STRING:
+			return kelimelik_schema_skip_strings(bytes, end, 1);
+		case KELIMELIK_OBJECT_ARRAY: {
+			if ((end - bytes) < 5) return NULL;
+			uint32_t count = kelimelik_schema_get_u32(bytes);
+			uint8_t item_type = bytes[4];
+			bytes += 5;
+			switch (item_type) {
+				case KELIMELIK_OBJECT_UINT8: size = 1; break;
+				case KELIMELIK_OBJECT_UINT32: size = 4; break;
+				case KELIMELIK_OBJECT_UINT64: size = 8; break;
+				case KELIMELIK_OBJECT_STRING:
+					return kelimelik_schema_skip_strings(bytes, end, count);
+				default:
+					return NULL;
+			}
+			if (((size_t)(end - bytes) / size) < count) return NULL;
+			return bytes + ((size_t)count * size);
+		}
+		default:
+			return NULL;
+	}
+	if ((size_t)(end - bytes) < size) return NULL;
+	return bytes + size;
+}
+
+#endif
+
+#define GAME_MODULE_REQUEST_LOGIN_HEADER "GameModule_requestLogin"
+
+typedef struct {
+	uint32_t uid;
+	kelimelik_schema_string password;
+	uint32_t version;
+} game_module_request_login;
+
+// Decodes a whole frame, including the size prefix. Returns
+// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.
+static inline kelimelik_error game_module_request_login_decode(const uint8_t *frame, size_t length, game_module_request_login *out) {
+	const uint8_t *end = frame + length;
+	if (
+		(length < 30) ||
+		(kelimelik_schema_get_u32(frame) != (length - 4)) ||
+		memcmp(frame + 4, "\x00\x17" "GameModule_requestLogin" "\x03", 26)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	const uint8_t *bytes = frame + 30;
+	if (
+		((end - bytes) < 5) ||
+		(bytes[0] != KELIMELIK_OBJECT_UINT32)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->uid = kelimelik_schema_get_u32(bytes + 1);
+	bytes += 5;
+	if (((end - bytes) < 3) || (bytes[0] != KELIMELIK_OBJECT_STRING)) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->password.length = kelimelik_schema_get_u16(bytes + 1);
+	out->password.bytes = bytes + 3;
+	if ((size_t)(end - out->password.bytes) < out->password.length) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	bytes = out->password.bytes + out->password.length;
+	if (
+		((end - bytes) < 5) ||
+		(bytes[0] != KELIMELIK_OBJECT_UINT32)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->version = kelimelik_schema_get_u32(bytes + 1);
+	bytes += 5;
+	if (bytes != end) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+static inline size_t game_module_request_login_encoded_size(const game_module_request_login *message) {
+	return 43 + message->password.length;
+}
+
+// Appends the frame to the buffer.
+static inline kelimelik_error game_module_request_login_encode(const game_module_request_login *message, kelimelik_buffer *buffer) {
+	size_t size = game_module_request_login_encoded_size(message);
+	kelimelik_error error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *bytes = buffer->bytes + buffer->length;
+	kelimelik_schema_put_u32(bytes, size - 4);
+	memcpy(bytes + 4, "\x00\x17" "GameModule_requestLogin" "\x03", 26);
+	bytes[30] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 31, message->uid);
+	bytes[35] = KELIMELIK_OBJECT_STRING;
+	kelimelik_schema_put_u16(bytes + 36, message->password.length);
+	memcpy(bytes + 38, message->password.bytes, message->password.length);
+	bytes += 38 + message->password.length;
+	bytes[0] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 1, message->version);
+	buffer->length += size;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+#define GAME_MODULE_LOGIN_ACCEPTED_HEADER "GameModule_loginAccepted"
+
+typedef struct {
+	kelimelik_schema_raw unknown0;
+	kelimelik_schema_string username;
+	kelimelik_schema_raw unknown2;
+	kelimelik_schema_string email_address;
+
+	// The objects after the known ones
+	uint8_t rest_count;
+	kelimelik_schema_raw rest;
+} game_module_login_accepted;
+
+// Decodes a whole frame, including the size prefix. Returns
+// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.
+static inline kelimelik_error game_module_login_accepted_decode(const uint8_t *frame, size_t length, game_module_login_accepted *out) {
+	const uint8_t *end = frame + length;
+	if (
+		(length < 31) ||
+		(kelimelik_schema_get_u32(frame) != (length - 4)) ||
+		memcmp(frame + 4, "\x00\x18" "GameModule_loginAccepted", 26) ||
+		(frame[30] < 4)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	const uint8_t *bytes = frame + 31;
+	out->unknown0.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown0.length = bytes - out->unknown0.bytes;
+	if (((end - bytes) < 3) || (bytes[0] != KELIMELIK_OBJECT_STRING)) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->username.length = kelimelik_schema_get_u16(bytes + 1);
+	out->username.bytes = bytes + 3;
+	if ((size_t)(end - out->username.bytes) < out->username.length) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	bytes = out->username.bytes + out->username.length;
+	out->unknown2.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown2.length = bytes - out->unknown2.bytes;
+	if (((end - bytes) < 3) || (bytes[0] != KELIMELIK_OBJECT_STRING)) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->email_address.length = kelimelik_schema_get_u16(bytes + 1);
+	out->email_address.bytes = bytes + 3;
+	if ((size_t)(end - out->email_address.bytes) < out->email_address.length) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	bytes = out->email_address.bytes + out->email_address.length;
+	out->rest_count = frame[30] - 4;
+	out->rest.bytes = bytes;
+	out->rest.length = end - bytes;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+static inline size_t game_module_login_accepted_encoded_size(const game_module_login_accepted *message) {
+	return 37 + message->unknown0.length + message->username.length + message->unknown2.length + message->email_address.length + message->rest.length;
+}
+
+// Appends the frame to the buffer.
+static inline kelimelik_error game_module_login_accepted_encode(const game_module_login_accepted *message, kelimelik_buffer *buffer) {
+	size_t size = game_module_login_accepted_encoded_size(message);
+	kelimelik_error error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *bytes = buffer->bytes + buffer->length;
+	kelimelik_schema_put_u32(bytes, size - 4);
+	memcpy(bytes + 4, "\x00\x18" "GameModule_loginAccepted" "\x04", 27);
+	bytes[30] += message->rest_count;
+	memcpy(bytes + 31, message->unknown0.bytes, message->unknown0.length);
+	bytes += 31 + message->unknown0.length;
+	bytes[0] = KELIMELIK_OBJECT_STRING;
+	kelimelik_schema_put_u16(bytes + 1, message->username.length);
+	memcpy(bytes + 3, message->username.bytes, message->username.length);
+	bytes += 3 + message->username.length;
+	memcpy(bytes, message->unknown2.bytes, message->unknown2.length);
+	bytes += message->unknown2.length;
+	bytes[0] = KELIMELIK_OBJECT_STRING;
+	kelimelik_schema_put_u16(bytes + 1, message->email_address.length);
+	memcpy(bytes + 3, message->email_address.bytes, message->email_address.length);
+	bytes += 3 + message->email_address.length;
+	memcpy(bytes, message->rest.bytes, message->rest.length);
+	buffer->length += size;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+#define GAME_MODULE_LOGIN_REFUSED_HEADER "GameModule_loginRefused"
+
+typedef struct {
+	// The objects after the known ones
+	uint8_t rest_count;
+	kelimelik_schema_raw rest;
+} game_module_login_refused;
+
+// Decodes a whole frame, including the size prefix. Returns
+// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.
+static inline kelimelik_error game_module_login_refused_decode(const uint8_t *frame, size_t length, game_module_login_refused *out) {
+	const uint8_t *end = frame + length;
+	if (
+		(length < 30) ||
+		(kelimelik_schema_get_u32(frame) != (length - 4)) ||
+		memcmp(frame + 4, "\x00\x17" "GameModule_loginRefused", 25)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	const uint8_t *bytes = frame + 30;
+	out->rest_count = frame[29];
+	out->rest.bytes = bytes;
+	out->rest.length = end - bytes;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+static inline size_t game_module_login_refused_encoded_size(const game_module_login_refused *message) {
+	return 30 + message->rest.length;
+}
+
+// Appends the frame to the buffer.
+static inline kelimelik_error game_module_login_refused_encode(const game_module_login_refused *message, kelimelik_buffer *buffer) {
+	size_t size = game_module_login_refused_encoded_size(message);
+	kelimelik_error error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *bytes = buffer->bytes + buffer->length;
+	kelimelik_schema_put_u32(bytes, size - 4);
+	memcpy(bytes + 4, "\x00\x17" "GameModule_loginRefused" "\x00", 26);
+	bytes[29] += message->rest_count;
+	memcpy(bytes + 30, message->rest.bytes, message->rest.length);
+	buffer->length += size;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+#define GAME_MODULE_USER_PROFILE_HEADER "GameModule_userProfile"
+
+typedef struct {
+	kelimelik_schema_raw unknown0;
+	uint32_t total_games;
+	uint32_t won_games;
+	kelimelik_schema_raw unknown3;
+	kelimelik_schema_raw unknown4;
+	uint32_t win_ratio;
+
+	// The objects after the known ones
+	uint8_t rest_count;
+	kelimelik_schema_raw rest;
+} game_module_user_profile;
+
+// Decodes a whole frame, including the size prefix. Returns
+// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.
+static inline kelimelik_error game_module_user_profile_decode(const uint8_t *frame, size_t length, game_module_user_profile *out) {
+	const uint8_t *end = frame + length;
+	if (
+		(length < 29) ||
+		(kelimelik_schema_get_u32(frame) != (length - 4)) ||
+		memcmp(frame + 4, "\x00\x16" "GameModule_userProfile", 24) ||
+		(frame[28] < 6)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	const uint8_t *bytes = frame + 29;
+	out->unknown0.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown0.length = bytes - out->unknown0.bytes;
+	if (
+		((end - bytes) < 10) ||
+		(bytes[0] != KELIMELIK_OBJECT_UINT32) ||
+		(bytes[5] != KELIMELIK_OBJECT_UINT32)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->total_games = kelimelik_schema_get_u32(bytes + 1);
+	out->won_games = kelimelik_schema_get_u32(bytes + 6);
+	bytes += 10;
+	out->unknown3.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown3.length = bytes - out->unknown3.bytes;
+	out->unknown4.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown4.length = bytes - out->unknown4.bytes;
+	if (
+		((end - bytes) < 5) ||
+		(bytes[0] != KELIMELIK_OBJECT_UINT32)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->win_ratio = kelimelik_schema_get_u32(bytes + 1);
+	bytes += 5;
+	out->rest_count = frame[28] - 6;
+	out->rest.bytes = bytes;
+	out->rest.length = end - bytes;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+static inline size_t game_module_user_profile_encoded_size(const game_module_user_profile *message) {
+	return 44 + message->unknown0.length + message->unknown3.length + message->unknown4.length + message->rest.length;
+}
+
+// Appends the frame to the buffer.
+static inline kelimelik_error game_module_user_profile_encode(const game_module_user_profile *message, kelimelik_buffer *buffer) {
+	size_t size = game_module_user_profile_encoded_size(message);
+	kelimelik_error error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *bytes = buffer->bytes + buffer->length;
+	kelimelik_schema_put_u32(bytes, size - 4);
+	memcpy(bytes + 4, "\x00\x16" "GameModule_userProfile" "\x06", 25);
+	bytes[28] += message->rest_count;
+	memcpy(bytes + 29, message->unknown0.bytes, message->unknown0.length);
+	bytes += 29 + message->unknown0.length;
+	bytes[0] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 1, message->total_games);
+	bytes[5] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 6, message->won_games);
+	memcpy(bytes + 10, message->unknown3.bytes, message->unknown3.length);
+	bytes += 10 + message->unknown3.length;
+	memcpy(bytes, message->unknown4.bytes, message->unknown4.length);
+	bytes += message->unknown4.length;
+	bytes[0] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 1, message->win_ratio);
+	memcpy(bytes + 5, message->rest.bytes, message->rest.length);
+	buffer->length += size;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+#define GAME_MODULE_USER_PURCHASE_DATA_HEADER "GameModule_userPurchaseData"
+
+typedef struct {
+	kelimelik_schema_raw unknown0;
+	kelimelik_schema_raw unknown1;
+	kelimelik_schema_raw unknown2;
+	kelimelik_schema_raw unknown3;
+	kelimelik_schema_raw unknown4;
+	kelimelik_schema_raw unknown5;
+	kelimelik_schema_raw unknown6;
+	uint32_t coins;
+} game_module_user_purchase_data;
+
+// Decodes a whole frame, including the size prefix. Returns
+// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.
+static inline kelimelik_error game_module_user_purchase_data_decode(const uint8_t *frame, size_t length, game_module_user_purchase_data *out) {
+	const uint8_t *end = frame + length;
+	if (
+		(length < 34) ||
+		(kelimelik_schema_get_u32(frame) != (length - 4)) ||
+		memcmp(frame + 4, "\x00\x1B" "GameModule_userPurchaseData" "\x08", 30)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	const uint8_t *bytes = frame + 34;
+	out->unknown0.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown0.length = bytes - out->unknown0.bytes;
+	out->unknown1.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown1.length = bytes - out->unknown1.bytes;
+	out->unknown2.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown2.length = bytes - out->unknown2.bytes;
+	out->unknown3.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown3.length = bytes - out->unknown3.bytes;
+	out->unknown4.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown4.length = bytes - out->unknown4.bytes;
+	out->unknown5.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown5.length = bytes - out->unknown5.bytes;
+	out->unknown6.bytes = bytes;
+	if (!(bytes = kelimelik_schema_skip_object(bytes, end))) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->unknown6.length = bytes - out->unknown6.bytes;
+	if (
+		((end - bytes) < 5) ||
+		(bytes[0] != KELIMELIK_OBJECT_UINT32)
+	) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	out->coins = kelimelik_schema_get_u32(bytes + 1);
+	bytes += 5;
+	if (bytes != end) {
+		return KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT);
+	}
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+static inline size_t game_module_user_purchase_data_encoded_size(const game_module_user_purchase_data *message) {
+	return 39 + message->unknown0.length + message->unknown1.length + message->unknown2.length + message->unknown3.length + message->unknown4.length + message->unknown5.length + message->unknown6.length;
+}
+
+// Appends the frame to the buffer.
+static inline kelimelik_error game_module_user_purchase_data_encode(const game_module_user_purchase_data *message, kelimelik_buffer *buffer) {
+	size_t size = game_module_user_purchase_data_encoded_size(message);
+	kelimelik_error error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *bytes = buffer->bytes + buffer->length;
+	kelimelik_schema_put_u32(bytes, size - 4);
+	memcpy(bytes + 4, "\x00\x1B" "GameModule_userPurchaseData" "\x08", 30);
+	memcpy(bytes + 34, message->unknown0.bytes, message->unknown0.length);
+	bytes += 34 + message->unknown0.length;
+	memcpy(bytes, message->unknown1.bytes, message->unknown1.length);
+	bytes += message->unknown1.length;
+	memcpy(bytes, message->unknown2.bytes, message->unknown2.length);
+	bytes += message->unknown2.length;
+	memcpy(bytes, message->unknown3.bytes, message->unknown3.length);
+	bytes += message->unknown3.length;
+	memcpy(bytes, message->unknown4.bytes, message->unknown4.length);
+	bytes += message->unknown4.length;
+	memcpy(bytes, message->unknown5.bytes, message->unknown5.length);
+	bytes += message->unknown5.length;
+	memcpy(bytes, message->unknown6.bytes, message->unknown6.length);
+	bytes += message->unknown6.length;
+	bytes[0] = KELIMELIK_OBJECT_UINT32;
+	kelimelik_schema_put_u32(bytes + 1, message->coins);
+	buffer->length += size;
+	return KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);
+}
+
+#endif
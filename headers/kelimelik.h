@@ -6,12 +6,37 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct kelimelik_packet kelimelik_packet;
 typedef struct kelimelik_string kelimelik_string;
 typedef struct kelimelik_array kelimelik_array;
 typedef struct kelimelik_error kelimelik_error;
 typedef struct kelimelik_object kelimelik_object;
 typedef struct kelimelik_parser kelimelik_parser;
+typedef struct kelimelik_buffer kelimelik_buffer;
+typedef struct kelimelik_logger kelimelik_logger;
+typedef struct kelimelik_capture kelimelik_capture;
+typedef struct kelimelik_capture_writer kelimelik_capture_writer;
+typedef struct kelimelik_capture_frame kelimelik_capture_frame;
+typedef struct kelimelik_capture_index_entry kelimelik_capture_index_entry;
+typedef struct kelimelik_allocator kelimelik_allocator;
+typedef struct kelimelik_counting_allocator kelimelik_counting_allocator;
+typedef struct kelimelik_pool kelimelik_pool;
+typedef struct kelimelik_frame kelimelik_frame;
+typedef struct kelimelik_stream_handler kelimelik_stream_handler;
+typedef struct kelimelik_parser_limits kelimelik_parser_limits;
+typedef struct kelimelik_parser_stats kelimelik_parser_stats;
+typedef struct kelimelik_parser_group kelimelik_parser_group;
+typedef struct kelimelik_pipeline kelimelik_pipeline;
+typedef struct kelimelik_pipeline_connection kelimelik_pipeline_connection;
+typedef struct kelimelik_send_queue kelimelik_send_queue;
+typedef struct kelimelik_send_queue_stats kelimelik_send_queue_stats;
+typedef struct kelimelik_intern_pool kelimelik_intern_pool;
+typedef struct kelimelik_histogram kelimelik_histogram;
+typedef struct kelimelik_traffic_stats kelimelik_traffic_stats;
 
 #define KELIMELIK_IS_ERROR(kelimelik_error) (kelimelik_error.kelimelik_errno != KELIMELIK_SUCCESS)
 
@@ -20,29 +45,54 @@ typedef struct kelimelik_parser kelimelik_parser;
 #define free(x) do { fprintf(stderr, "==> free(%p);\n", x); free(x); } while(0)
 #endif
 
+// Declared outside of kelimelik_error so that C++ code sees the values at
+// namespace scope as well.
+enum kelimelik_errno {
+	// Success
+	KELIMELIK_SUCCESS = 0,
+
+	// Syscall errors
+	KELIMELIK_ERROR_socket = -1,
+	KELIMELIK_ERROR_gethostbyname = -2,
+	KELIMELIK_ERROR_connect = -3,
+	KELIMELIK_ERROR_malloc = -4,
+	KELIMELIK_ERROR_open = -5,
+	KELIMELIK_ERROR_fstat = -6,
+	KELIMELIK_ERROR_mmap = -7,
+	KELIMELIK_ERROR_fwrite = -8,
+	KELIMELIK_ERROR_write = -9,
+	KELIMELIK_ERROR_pthread_create = -10,
+	KELIMELIK_ERROR_sendmsg = -11,
+	KELIMELIK_ERROR_setsockopt = -12,
+
+	// Other errors
+	KELIMELIK_ERROR_UNSPECIFIED_TYPES = 1,
+	KELIMELIK_ERROR_INVALID_ARGUMENT = 2,
+	KELIMELIK_ERROR_INVALID_TYPE = 3,
+	KELIMELIK_ERROR_NOT_IMPLEMENTED = 4,
+	KELIMELIK_ERROR_INVALID_FORMAT = 5,
+	KELIMELIK_ERROR_DIFFERENT_FORMAT = 6,
+	KELIMELIK_ERROR_INVALID_CAPTURE = 7,
+	KELIMELIK_ERROR_INVALID_JSON = 8,
+
+	// The details are a kelimelik_limit value.
+	KELIMELIK_ERROR_LIMIT_EXCEEDED = 9,
+	KELIMELIK_ERROR_FROZEN = 10
+};
+
 struct kelimelik_error {
 	union {
 		int syscall_errno;
 		int details;
 	};
-	enum kelimelik_errno {
-		// Success
-		KELIMELIK_SUCCESS = 0,
-
-		// Syscall errors
-		KELIMELIK_ERROR_socket = -1,
-		KELIMELIK_ERROR_gethostbyname = -2,
-		KELIMELIK_ERROR_connect = -3,
-		KELIMELIK_ERROR_malloc = -4,
-
-		// Other errors
-		KELIMELIK_ERROR_UNSPECIFIED_TYPES = 1,
-		KELIMELIK_ERROR_INVALID_ARGUMENT = 2,
-		KELIMELIK_ERROR_INVALID_TYPE = 3,
-		KELIMELIK_ERROR_NOT_IMPLEMENTED = 4,
-		KELIMELIK_ERROR_INVALID_FORMAT = 5,
-		KELIMELIK_ERROR_DIFFERENT_FORMAT = 6
-	} kelimelik_errno;
+	enum kelimelik_errno kelimelik_errno;
+};
+
+// The limit that caused a KELIMELIK_ERROR_LIMIT_EXCEEDED error.
+enum kelimelik_limit {
+	KELIMELIK_LIMIT_FRAME_SIZE = 0,
+	KELIMELIK_LIMIT_ARRAY_ITEMS = 1,
+	KELIMELIK_LIMIT_BUFFERED_BYTES = 2
 };
 
 enum kelimelik_object_type {
@@ -91,6 +141,12 @@ struct kelimelik_array {
 	// protocol.
 	uint32_t item_count;
 
+	// For string arrays, a kelimelik_storage value. Inline strings are packed
+	// back to back after the strings table, in the same block as the array,
+	// and take up blob_size bytes. Never free them separately.
+	uint8_t storage;
+	uint32_t blob_size;
+
 	// The values in the array. Only one of these arrays contain valid
 	// data. This depends on the type element of the struct.
 	union {
@@ -113,18 +169,47 @@ struct kelimelik_string {
 	const uint8_t string[];
 };
 
+// Where the value of an object or the header of a packet is stored.
+enum kelimelik_storage {
+	// The value is a separate allocation owned by the packet.
+	KELIMELIK_STORAGE_HEAP = 0,
+
+	// The value is stored inside the packet's own block and is freed
+	// together with it. Never free inline values yourself.
+	KELIMELIK_STORAGE_INLINE = 1,
+
+	// The value is a reference to a string in a kelimelik_intern_pool and
+	// is released when the packet is freed. Interned strings with the same
+	// contents are the same string, so they can be compared by pointer.
+	KELIMELIK_STORAGE_INTERNED = 2
+};
+
+// Strings up to this many bytes are stored inline in decoded packets.
+#define KELIMELIK_INLINE_STRING_MAX 15
+
+// Objects are 16 bytes and are always stored in arrays, so iterate over them
+// by index. Older code that walks objects through the next and first
+// pointers can define KELIMELIK_OBJECT_LINKS to bring them back, which makes
+// every object 32 bytes. It has to be defined the same way for the library
+// and for everything that uses it, since it changes the layout of packets.
 struct kelimelik_object {
 	// Type of the object. If the value of this property is
-	// KELIMELIK_OBJECT_UNSPECIFIED, then the values of the properties
-	// other than "next" and "first" are undefined.
+	// KELIMELIK_OBJECT_UNSPECIFIED, then the value of the object is
+	// undefined.
 	enum kelimelik_object_type type;
 
+	// A kelimelik_storage value. Strings are always accessed the same way
+	// through the string property, no matter where they are stored.
+	uint8_t storage;
+
+#ifdef KELIMELIK_OBJECT_LINKS
 	// For objects in a packet or an array, the next object. If this
 	// is the last object, this value is NULL.
 	kelimelik_object *next;
 
 	// For objects in a packet or an array, the first object.
 	kelimelik_object *first;
+#endif
 
 	union {
 		// String value. Only valid if type is KELIMELIK_OBJECT_STRING.
@@ -153,10 +238,262 @@ struct kelimelik_packet {
 	// objects is limited to 255 by the server implementation.
 	uint8_t object_count;
 
+	// A kelimelik_storage value for the header.
+	uint8_t header_storage;
+
+	// Short strings are stored after the objects, in the same block as the
+	// packet. These are the number of bytes reserved for them and the number
+	// of bytes that are in use.
+	uint16_t string_arena_size;
+	uint16_t string_arena_used;
+
+	// True while the objects of a packet from a lazy parser haven't been
+	// decoded yet. Call kelimelik_packet_materialize() before accessing the
+	// objects directly. Library functions do this by themselves.
+	bool lazy;
+
+	// Set by kelimelik_packet_freeze(). Frozen packets can't be changed and
+	// always have their wire bytes, so they can be shared between threads.
+	bool frozen;
+
+	// The size of the encoded packet including the size prefix, or 0 if it
+	// isn't known yet. Decoded packets get it from the frame, and the setters
+	// keep it up to date.
+	uint32_t encoded_size;
+
+	// Updated atomically by kelimelik_packet_retain() and
+	// kelimelik_packet_release(). New packets start with one reference.
+	uint32_t references;
+
+	// The frame the packet was decoded from, if the parser was created with
+	// KELIMELIK_PARSER_KEEP_WIRE. It is encoded_size bytes long. Encoding an
+	// unchanged packet copies these bytes, and they are dropped as soon as
+	// the packet is changed through a setter.
+	const uint8_t *wire;
+
+	// The allocator the packet, its header and its objects were allocated
+	// with. Everything is freed with this allocator by kelimelik_packet_free().
+	const kelimelik_allocator *allocator;
+
 	// Contains object_count items.
 	kelimelik_object objects[0];
 };
 
+// A raw frame whose header has been located without decoding the packet.
+// Nothing is copied, every pointer points into the frame itself.
+struct kelimelik_frame {
+	// The whole frame, including the 4-byte size prefix.
+	const uint8_t *bytes;
+	uint32_t length;
+
+	// The header, which is not null terminated.
+	const uint8_t *header;
+	uint16_t header_length;
+
+	// The number of objects that follow the header. They aren't checked.
+	uint8_t object_count;
+};
+
+// Receives frames that are too big to be buffered, see
+// kelimelik_parser_set_stream_handler(). Everything passed to these functions
+// is only valid until they return. Any of them may be NULL.
+struct kelimelik_stream_handler {
+	// A new frame. frame->bytes is NULL, since the frame is never in memory
+	// as a whole.
+	void (*begin)(void *context, const kelimelik_frame *frame);
+
+	// An object that isn't an array.
+	void (*object)(void *context, uint8_t index, const kelimelik_object *object);
+
+	// An array object. Its items follow in one or more chunks, and first_item
+	// is the index of the first item of a chunk in the whole array.
+	void (*array_begin)(void *context, uint8_t index, enum kelimelik_object_type item_type, uint32_t item_count);
+	void (*array_items)(void *context, uint8_t index, const kelimelik_array *items, uint32_t first_item);
+
+	// The end of the frame. If the frame turned out to be malformed, the rest
+	// of it is skipped and error says why.
+	void (*end)(void *context, kelimelik_error error);
+
+	void *context;
+};
+
+// Limits for a parser. 0 means no limit. Frames that exceed a limit are
+// skipped without being buffered, and the advance functions return a
+// KELIMELIK_ERROR_LIMIT_EXCEEDED error.
+struct kelimelik_parser_limits {
+	// The biggest frame that is accepted, including the size prefix. This
+	// applies to streamed frames too.
+	uint32_t max_frame_size;
+
+	// The most items an array may have. Packets from a lazy parser are only
+	// checked against the other limits.
+	uint32_t max_array_items;
+
+	// The most bytes that may be held in buffers for frames that are still
+	// being received.
+	size_t max_buffered_bytes;
+};
+
+// The number of frames that were skipped because of each limit.
+struct kelimelik_parser_stats {
+	uint64_t frames_too_big;
+	uint64_t arrays_too_big;
+	uint64_t over_budget;
+};
+
+// Counters for a send queue, see kelimelik_send_queue_get_stats().
+struct kelimelik_send_queue_stats {
+	uint64_t bytes_sent;
+	uint64_t copy_sends;
+	uint64_t zerocopy_sends;
+
+	// Zerocopy sends where the kernel ended up copying the bytes anyway, for
+	// example on loopback.
+	uint64_t zerocopy_copied;
+};
+
+// A growable byte buffer. Functions that write into a buffer append to it, so
+// the same buffer can be reset and reused to avoid allocating every time.
+// Initialize buffers with KELIMELIK_BUFFER_INITIALIZER.
+struct kelimelik_buffer {
+	uint8_t *bytes;
+	size_t length;
+	size_t capacity;
+
+	// The allocator used for bytes. NULL uses the global allocator.
+	const kelimelik_allocator *allocator;
+};
+
+#define KELIMELIK_BUFFER_INITIALIZER { NULL, 0, 0, NULL }
+
+// A memory allocator. Every block is freed with the size it was allocated
+// with, so allocators that don't keep a header for every allocation (bump
+// allocators, pools) can be used. reallocate may be NULL, in which case
+// blocks are moved with allocate(), memcpy() and release().
+struct kelimelik_allocator {
+	void *(*allocate)(void *context, size_t size);
+	void *(*reallocate)(void *context, void *pointer, size_t old_size, size_t new_size);
+	void (*release)(void *context, void *pointer, size_t size);
+	void *context;
+};
+
+// Forwards to another allocator while keeping track of how much memory is in
+// use, for example to attribute memory to a single connection. Pass
+// &counter->allocator wherever an allocator is expected. The counters are
+// updated atomically and can be read from any thread.
+struct kelimelik_counting_allocator {
+	kelimelik_allocator allocator;
+	const kelimelik_allocator *parent;
+	size_t bytes_in_use;
+	size_t peak_bytes;
+	size_t allocation_count; // Blocks that haven't been freed yet
+};
+
+// Flags for kelimelik_packet_write_json_*(). Compact output has no
+// whitespace at all; pretty output puts every object on its own line.
+#define KELIMELIK_JSON_COMPACT 0
+#define KELIMELIK_JSON_PRETTY 1
+
+enum kelimelik_log_level {
+	KELIMELIK_LOG_DEBUG = 0,
+	KELIMELIK_LOG_INFO = 1,
+	KELIMELIK_LOG_WARNING = 2,
+	KELIMELIK_LOG_ERROR = 3
+};
+
+// Receives diagnostic messages from the library. The message is only valid
+// until the sink returns. Sinks may be called from any thread.
+typedef void (*kelimelik_log_sink)(enum kelimelik_log_level level, const char *message, void *context);
+
+// The direction a captured frame travelled in. Values are stored in capture
+// files, so don't renumber them.
+enum kelimelik_direction {
+	KELIMELIK_DIRECTION_CLIENT_TO_SERVER = 0,
+	KELIMELIK_DIRECTION_SERVER_TO_CLIENT = 1
+};
+
+// A single raw frame in a capture file. Frames are stored exactly as they
+// were sent over the wire, including the 4-byte packet size prefix.
+struct kelimelik_capture_frame {
+	// Nanoseconds since 00:00:00 UTC on 1 January 1970.
+	uint64_t timestamp;
+
+	// Caller-assigned identifier for the connection the frame belongs to.
+	// Both directions of a proxied connection usually share the same ID.
+	uint32_t connection_id;
+
+	enum kelimelik_direction direction;
+
+	// The length of the frame in bytes, including the size prefix.
+	uint32_t length;
+
+	// The frame itself. For frames returned by a kelimelik_capture, this
+	// points into the mapped file and is valid until the capture is closed.
+	const uint8_t *bytes;
+};
+
+// Passed to kelimelik_capture_query() to match every connection.
+#define KELIMELIK_CAPTURE_ANY_CONNECTION UINT32_MAX
+
+// An entry in the header index of a capture file. Entries are sorted by
+// header, then by connection ID, then by frame index, so all frames with the
+// same header and connection ID are next to each other. header_id is only
+// meaningful within a single capture file.
+struct kelimelik_capture_index_entry {
+	uint32_t header_id;
+	uint32_t connection_id;
+
+	// Pass this to kelimelik_capture_get_frame() to get the frame.
+	uint64_t frame_index;
+};
+
+// Called by kelimelik_capture_replay() for every packet decoded from a
+// capture. The packet is owned by the parser and is only valid until the
+// callback returns.
+typedef void (*kelimelik_capture_callback)(
+	const kelimelik_capture_frame *frame,
+	kelimelik_packet *packet,
+	void *context
+);
+
+// Called by the workers of a pipeline for every frame it received, see
+// kelimelik_pipeline_new(). packet is NULL if the frame couldn't be decoded,
+// in which case error says why. The frame and the packet are owned by the
+// pipeline and are only valid until the callback returns, but the packet can
+// be retained.
+typedef void (*kelimelik_pipeline_callback)(
+	void *connection_context,
+	const kelimelik_frame *frame,
+	kelimelik_packet *packet,
+	kelimelik_error error,
+	void *context
+);
+
+// Allocators. Every allocation made by the library goes through the global
+// allocator unless a different one is passed to a constructor. The allocator
+// must stay valid until everything allocated with it is freed, and changing
+// the global allocator doesn't affect objects that were already created.
+// Passing NULL restores the default allocator, which uses malloc().
+extern const kelimelik_allocator kelimelik_default_allocator;
+void kelimelik_set_allocator(const kelimelik_allocator *allocator);
+const kelimelik_allocator *kelimelik_get_allocator(void);
+
+// Initializes a counting allocator. A NULL parent uses the global allocator
+// at the time of the call.
+void kelimelik_counting_allocator_init(kelimelik_counting_allocator *self, const kelimelik_allocator *parent);
+
+// Pools keep freed blocks on freelists bucketed by size, so packets, strings,
+// arrays and frame buffers of the same size are reused instead of going back
+// to the parent allocator. Once a pool has warmed up, a parser that uses it
+// doesn't touch the parent allocator anymore. Pools are not thread-safe; use
+// one pool per thread. At most max_cached_bytes of large blocks are kept on
+// the freelists, 0 uses a default of 1 MB. Everything allocated from the pool
+// must be freed before the pool itself is freed.
+kelimelik_error kelimelik_pool_new(kelimelik_pool **out, const kelimelik_allocator *parent, size_t max_cached_bytes);
+const kelimelik_allocator *kelimelik_pool_allocator(kelimelik_pool *self);
+void kelimelik_pool_trim(kelimelik_pool *self); // Gives cached large blocks back to the parent
+void kelimelik_pool_free(kelimelik_pool *self);
+
 // Creates a new kelimelik_string with the specified null-terminated C string. The
 // string is copied.
 kelimelik_error kelimelik_string_new_v1(kelimelik_string **out, const char *string);
@@ -167,11 +504,19 @@ kelimelik_error kelimelik_string_new_v1(kelimelik_string **out, const char *stri
 // is not '\0'.
 kelimelik_error kelimelik_string_new_v2(kelimelik_string **out, void *bytes, size_t len);
 
-// Calls free().
+// Same as kelimelik_string_new_v2(), but uses the given allocator. Use this to
+// create strings for packets that use a different allocator than the global
+// one, such as packets created by a parser with its own allocator.
+kelimelik_error kelimelik_string_new_v3(kelimelik_string **out, const kelimelik_allocator *allocator, const void *bytes, size_t len);
+
+// Frees the string with the global allocator.
 void kelimelik_string_free(kelimelik_string *string);
 
 // Objects
+kelimelik_error kelimelik_objects_free_v2(kelimelik_object *objects, size_t count);
+#ifdef KELIMELIK_OBJECT_LINKS
 kelimelik_error kelimelik_objects_free(kelimelik_object *first_object);
+#endif
 kelimelik_error kelimelik_object_free(kelimelik_object *object);
 
 // Arrays
@@ -184,32 +529,211 @@ kelimelik_error kelimelik_uint8_array_new(kelimelik_array **out, const uint8_t *
 kelimelik_error kelimelik_uint32_array_new(kelimelik_array **out, const uint32_t *values, const size_t count);
 kelimelik_error kelimelik_uint64_array_new(kelimelik_array **out, const uint64_t *values, const size_t count);
 kelimelik_error kelimelik_array_new(kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t size_in_bytes);
+
+// Same as kelimelik_array_new(), but uses the given allocator, so the array
+// can be stored in packets that use a different allocator than the global
+// one.
+kelimelik_error kelimelik_array_new_v2(
+	kelimelik_array **out,
+	const kelimelik_allocator *allocator,
+	enum kelimelik_object_type type,
+	const void *values,
+	const size_t size_in_bytes
+);
+
+// Creates a string array from byte ranges with the given allocator. The
+// strings are copied into the array's block and don't have to be null
+// terminated.
+kelimelik_error kelimelik_string_array_new_v5(
+	kelimelik_array **out,
+	const kelimelik_allocator *allocator,
+	const char *const *strings,
+	const size_t *lengths,
+	const size_t count
+);
 kelimelik_error kelimelik_uint_array_new(kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t count);
 
-// Packets
+// Buffers
+kelimelik_error kelimelik_buffer_reserve(kelimelik_buffer *self, size_t additional);
+kelimelik_error kelimelik_buffer_append(kelimelik_buffer *self, const void *bytes, size_t length);
+void kelimelik_buffer_reset(kelimelik_buffer *self); // Keeps the memory for reuse
+void kelimelik_buffer_free(kelimelik_buffer *self);
+
+// Packets. Strings and arrays stored in a packet are owned by the packet and
+// are freed with the packet's allocator, so they must have been created with
+// the same allocator. Packets are reference counted; kelimelik_packet_free()
+// is the same as kelimelik_packet_release() and only frees the packet once
+// the last reference is gone.
 void kelimelik_packet_free(kelimelik_packet *packet);
+
+// Takes another reference to the packet and returns it. Packets returned by
+// parsers and pipelines can be retained to keep them after they would
+// otherwise be freed. Retaining and releasing is thread-safe, but only frozen
+// packets may be used from several threads.
+kelimelik_packet *kelimelik_packet_retain(kelimelik_packet *packet);
+void kelimelik_packet_release(kelimelik_packet *packet);
+
+// Makes the packet immutable and encodes it once. Afterwards the setters fail
+// with KELIMELIK_ERROR_FROZEN and the packet is never written to again, so a
+// single encoding can be shared by every recipient on any thread. Objects
+// must not be changed directly either. Freezing a frozen packet does nothing.
+kelimelik_error kelimelik_packet_freeze(kelimelik_packet *packet);
+
+// Gets the wire bytes of a frozen packet, including the size prefix. The
+// bytes are owned by the packet and are valid as long as it is.
+kelimelik_error kelimelik_packet_get_wire(kelimelik_packet *packet, const uint8_t **bytes, size_t *length);
+
+// Creates a deep copy of the packet with the given allocator, NULL uses the
+// global allocator. The copy is neither frozen nor shared.
+kelimelik_error kelimelik_packet_clone(kelimelik_packet *packet, const kelimelik_allocator *allocator, kelimelik_packet **out);
+
+// Returns a pretty-printed JSON description of the packet. The returned
+// string must be freed with free().
 char *kelimelik_packet_description(kelimelik_packet *self);
+
+// Writes a JSON description of the packet in linear time. Strings are
+// escaped, so the output is always valid JSON. Bytes that aren't valid UTF-8
+// are escaped as lone surrogates from \udc80 to \udcff, which
+// kelimelik_packet_new_v3() and kelimelik_json_to_wire() turn back into the
+// same bytes. v1 appends to a buffer, v2 writes to a FILE and v3 writes to a
+// file descriptor.
+kelimelik_error kelimelik_packet_write_json_v1(kelimelik_packet *self, kelimelik_buffer *buffer, int flags);
+kelimelik_error kelimelik_packet_write_json_v2(kelimelik_packet *self, FILE *file, int flags);
+kelimelik_error kelimelik_packet_write_json_v3(kelimelik_packet *self, int fd, int flags);
 kelimelik_error kelimelik_verify_packet(kelimelik_packet *self, const char *format);
 kelimelik_error kelimelik_packet_new_v1(kelimelik_packet **out, const char *header, uint8_t size);
 kelimelik_error kelimelik_packet_new_v2(kelimelik_packet **out, kelimelik_string *header, uint8_t size);
+
+// Creates a packet from a JSON description in the format written by
+// kelimelik_packet_write_json_*(). The JSON doesn't have to be null
+// terminated.
+kelimelik_error kelimelik_packet_new_v3(kelimelik_packet **out, const char *json, size_t length);
 kelimelik_error kelimelik_packet_set_uint64(kelimelik_packet *packet, uint8_t index, uint64_t value);
 kelimelik_error kelimelik_packet_set_uint32(kelimelik_packet *packet, uint8_t index, uint32_t value);
 kelimelik_error kelimelik_packet_set_uint16(kelimelik_packet *packet, uint8_t index, uint16_t value);
 kelimelik_error kelimelik_packet_set_uint8(kelimelik_packet *packet, uint8_t index, uint8_t value);
 kelimelik_error kelimelik_packet_set_string_v1(kelimelik_packet *packet, uint8_t index, const char *string);
 kelimelik_error kelimelik_packet_set_string_v2(kelimelik_packet *packet, uint8_t index, kelimelik_string *string);
+
+// Same as kelimelik_packet_set_string_v2(), but the string must come from
+// kelimelik_intern_string(). The packet takes over the reference.
+kelimelik_error kelimelik_packet_set_interned_string(kelimelik_packet *packet, uint8_t index, kelimelik_string *string);
 kelimelik_error kelimelik_packet_set_array(kelimelik_packet *packet, uint8_t index, kelimelik_array *array);
+
+// Decodes the objects of a packet from a lazy parser. Does nothing for
+// packets whose objects are already decoded. On failure the packet stays
+// lazy and can still be forwarded or freed.
+kelimelik_error kelimelik_packet_materialize(kelimelik_packet *packet);
+
+// Packets cache their encoded size and may keep their wire bytes. Call this
+// after changing objects directly instead of through the setters, including
+// changes to the items of an array in the packet. Does nothing for frozen
+// packets.
+void kelimelik_packet_invalidate(kelimelik_packet *packet);
+
+// Gets the bytes and the length of a string object, wherever it is stored.
+kelimelik_error kelimelik_packet_get_string(kelimelik_packet *packet, uint8_t index, const uint8_t **bytes, uint16_t *length);
+
+// The returned bytes must be freed with free().
 kelimelik_error kelimelik_packet_encode(kelimelik_packet *packet, void **out_bytes, size_t *out_len);
 
+// Appends the encoded packet to the buffer, using the buffer's allocator.
+kelimelik_error kelimelik_packet_encode_v2(kelimelik_packet *packet, kelimelik_buffer *buffer);
+
+// Locates the header of the frame at the beginning of bytes. Fails with
+// KELIMELIK_ERROR_INVALID_ARGUMENT for argument 1 if the frame isn't complete
+// yet, in which case frame->length is the length of the whole frame if at
+// least the size prefix is available and 0 otherwise.
+kelimelik_error kelimelik_frame_peek_header(const void *bytes, size_t length, kelimelik_frame *frame);
+
+// Decodes a frame into a new packet created with the given allocator. NULL
+// uses the global allocator. Free the packet with kelimelik_packet_free().
+kelimelik_error kelimelik_frame_decode(const kelimelik_frame *frame, const kelimelik_allocator *allocator, kelimelik_packet **out);
+
+// Converts a JSON packet description directly into wire format and appends
+// the frame to the buffer, without creating a packet. On failure the buffer
+// is left as it was and the error details contain the offset of the invalid
+// input.
+kelimelik_error kelimelik_json_to_wire(const char *json, size_t length, kelimelik_buffer *buffer);
+
 // Errors
-const char *kelimelik_strerror(kelimelik_error error); // Not thread-safe
+const char *kelimelik_strerror(kelimelik_error error); // Valid until the next call on the same thread
 char *kelimelik_strerror_buf(kelimelik_error error, char *buffer, size_t len); // Is thread-safe
 
 // Connections
 kelimelik_error kelimelik_connection_new(int *fd_out);
 
+// Send queues hold packets that are waiting to be written to a socket. The
+// queue keeps a reference to every packet and writes their wire bytes
+// directly with scatter/gather I/O, so queuing a packet doesn't copy it.
+// Packets are frozen when they are queued. Queues are thread-safe, so other
+// threads can queue packets while the thread that owns the socket flushes.
+kelimelik_error kelimelik_send_queue_new(kelimelik_send_queue **out, int fd, const kelimelik_allocator *allocator);
+kelimelik_error kelimelik_send_queue_push(kelimelik_send_queue *self, kelimelik_packet *packet);
+
+// Writes as much as the socket accepts without blocking. Succeeds if the
+// socket would block, in which case the rest stays queued for the next call.
+kelimelik_error kelimelik_send_queue_flush(kelimelik_send_queue *self);
+
+// The number of bytes that haven't been written yet.
+size_t kelimelik_send_queue_pending_bytes(kelimelik_send_queue *self);
+
+// Packets whose remaining bytes are at least threshold bytes long are sent
+// on their own with MSG_ZEROCOPY, so the kernel reads them from the packet
+// instead of copying them. Such packets stay pinned after they were written
+// until the kernel reports that it is done with them, which flushing checks
+// for. Smaller packets are still copied. 0 turns zerocopy sends off. Fails
+// with KELIMELIK_ERROR_NOT_IMPLEMENTED on systems without MSG_ZEROCOPY, and
+// for sockets that don't support it, such as Unix domain sockets.
+kelimelik_error kelimelik_send_queue_set_zerocopy(kelimelik_send_queue *self, size_t threshold);
+
+// The number of bytes that were written with MSG_ZEROCOPY and are still in
+// use by the kernel.
+size_t kelimelik_send_queue_pinned_bytes(kelimelik_send_queue *self);
+void kelimelik_send_queue_get_stats(kelimelik_send_queue *self, kelimelik_send_queue_stats *stats);
+
+// Releases every packet that is still queued or pinned. The socket isn't
+// closed. Flush until nothing is pinned first if the packets might be reused
+// or changed while the kernel is still sending them.
+void kelimelik_send_queue_free(kelimelik_send_queue *self);
+
+// Encodes the packet once and queues the same bytes on every queue. The
+// queues aren't flushed. If the packet can't be queued on some of them, it is
+// still queued on the others and the last error is returned.
+kelimelik_error kelimelik_broadcast(kelimelik_packet *packet, kelimelik_send_queue **queues, size_t queue_count);
+
 // Parsers
 kelimelik_error kelimelik_parser_new(kelimelik_parser **out);
+
+// Creates a parser that allocates the parser itself, its frame buffers and
+// every packet it creates with the given allocator. NULL uses the global
+// allocator at the time of the call.
+kelimelik_error kelimelik_parser_new_v2(kelimelik_parser **out, const kelimelik_allocator *allocator);
+
+// Parser options, see kelimelik_parser_set_options().
+//   KELIMELIK_PARSER_KEEP_WIRE: Packets keep the frame they were decoded from
+//     so that they can be resent without encoding them again. Costs no
+//     extra copies, but the frame stays in memory as long as the packet.
+//   KELIMELIK_PARSER_LAZY: Only the header of every packet is decoded, and
+//     the objects are decoded from the frame when they are first used. Packets
+//     that are forwarded without being looked at are never decoded. Implies
+//     KELIMELIK_PARSER_KEEP_WIRE.
+//   KELIMELIK_PARSER_TRUSTED: Objects are decoded without checking them
+//     against the length of the frame, which is only checked once the whole
+//     packet is decoded. Frames that aren't what they claim to be can make the
+//     decoder read past them, so only use this for peers that are trusted,
+//     such as our own backend. Lazy packets are always materialized with the
+//     checks.
+#define KELIMELIK_PARSER_KEEP_WIRE 1
+#define KELIMELIK_PARSER_LAZY 2
+#define KELIMELIK_PARSER_TRUSTED 4
+
+void kelimelik_parser_set_options(kelimelik_parser *self, int options);
+
+// Returns every packet that was completed by the bytes. The packets are owned
+// by the parser and are valid until the next call unless they are retained.
+// Frames that can't be decoded are skipped, and the error of the last one is
+// returned.
 kelimelik_error kelimelik_parser_advance(
 	kelimelik_parser *self,
 	uint8_t *bytes,
@@ -222,6 +746,256 @@ kelimelik_error kelimelik_parser_advance_single(
 	uint8_t byte,
 	kelimelik_packet **new_packet
 );
+
+// Framing-only mode. Splits the bytes into frames without decoding them.
+// Frames that are contained in bytes completely point into bytes, and only
+// frames that span several calls are copied. The frames are valid until the
+// next call or until bytes is reused, whichever comes first. Frames that are
+// too short to contain a header are logged and skipped.
+kelimelik_error kelimelik_parser_advance_frames(
+	kelimelik_parser *self,
+	uint8_t *bytes,
+	size_t bytes_length,
+	const kelimelik_frame **new_frames,
+	size_t *new_frames_length
+);
+
+// Frames bigger than threshold bytes, including the size prefix, are decoded
+// as they arrive and delivered to the handler instead of being buffered, so
+// the memory used by the parser stays bounded. Array items are delivered in
+// chunks of about 64 KB. Streamed frames are never returned by the advance
+// functions. The handler is copied. NULL turns streaming off.
+kelimelik_error kelimelik_parser_set_stream_handler(kelimelik_parser *self, const kelimelik_stream_handler *handler, size_t threshold);
+
+// Limits are copied. Parsers have no limits by default.
+void kelimelik_parser_set_limits(kelimelik_parser *self, const kelimelik_parser_limits *limits);
+
+// Strings and string array items of decoded packets are interned in the pool
+// instead of being copied into every packet. Lazy packets and streamed frames
+// don't use the pool. The pool must outlive every packet decoded with it.
+// NULL turns interning off.
+void kelimelik_parser_set_intern_pool(kelimelik_parser *self, kelimelik_intern_pool *pool);
+void kelimelik_parser_get_stats(kelimelik_parser *self, kelimelik_parser_stats *stats);
+
+// Parser groups share a budget of buffered bytes between many parsers, for
+// example every connection in a process, on top of the limits of each parser.
+// Parsers may be used on different threads. A group must outlive its parsers.
+kelimelik_error kelimelik_parser_group_new(kelimelik_parser_group **out, size_t max_buffered_bytes);
+void kelimelik_parser_set_group(kelimelik_parser *self, kelimelik_parser_group *group);
+size_t kelimelik_parser_group_buffered_bytes(kelimelik_parser_group *self);
+void kelimelik_parser_group_get_stats(kelimelik_parser_group *self, kelimelik_parser_stats *stats);
+void kelimelik_parser_group_free(kelimelik_parser_group *self);
 void kelimelik_parser_free(kelimelik_parser *self);
 
-#endif
\ No newline at end of file
+// Decode pipelines split the work of a parser into two stages. Bytes are
+// split into frames on the thread that submits them, which only has to look
+// at the size prefixes, and the frames are decoded on a pool of worker
+// threads. Every connection is assigned to a worker, and idle workers steal
+// frames from busy ones. Frames are still delivered to the callback in the
+// order they were received on their connection, and never more than one at a
+// time for the same connection; frames of different connections are
+// delivered concurrently. The allocator is used from every worker and must be
+// thread-safe, so pools can't be used. NULL uses the global allocator.
+kelimelik_error kelimelik_pipeline_new(
+	kelimelik_pipeline **out,
+	unsigned int worker_count,
+	const kelimelik_allocator *allocator,
+	kelimelik_pipeline_callback callback,
+	void *context
+);
+
+// Limits are copied and apply to connections created afterwards. The limit on
+// array items is checked by the workers.
+void kelimelik_pipeline_set_limits(kelimelik_pipeline *self, const kelimelik_parser_limits *limits);
+
+// Same as kelimelik_parser_set_intern_pool(), for frames that are decoded
+// after this is called.
+void kelimelik_pipeline_set_intern_pool(kelimelik_pipeline *self, kelimelik_intern_pool *pool);
+
+// Parser options for frames that are decoded after this is called. Only
+// KELIMELIK_PARSER_TRUSTED is supported, the workers always decode packets
+// completely.
+void kelimelik_pipeline_set_options(kelimelik_pipeline *self, int options);
+
+// Connections may only be used on one thread at a time. connection_context is
+// passed to the callback for every frame of the connection.
+kelimelik_error kelimelik_pipeline_connection_new(
+	kelimelik_pipeline *self,
+	kelimelik_pipeline_connection **out,
+	void *connection_context
+);
+
+// Splits the bytes into frames and queues them for the workers. Frames are
+// copied, so the bytes can be reused as soon as this returns. Returns the
+// error of the last frame that was skipped while framing.
+kelimelik_error kelimelik_pipeline_submit(kelimelik_pipeline_connection *self, uint8_t *bytes, size_t bytes_length);
+
+// Frames that were already submitted are still delivered after their
+// connection is freed.
+void kelimelik_pipeline_connection_free(kelimelik_pipeline_connection *self);
+
+// Waits until every frame submitted so far has been delivered.
+void kelimelik_pipeline_flush(kelimelik_pipeline *self);
+
+// Delivers the remaining frames and stops the workers. Every connection must
+// have been freed.
+void kelimelik_pipeline_free(kelimelik_pipeline *self);
+
+// Intern pools keep one reference-counted copy of every string, so strings
+// that repeat in many packets, like user names or words, share the same
+// memory, and two interned strings from the same pool are equal exactly when
+// they are the same pointer. Pools are sharded by hash and may be used from
+// any number of threads. The allocator must be thread-safe if they are.
+kelimelik_error kelimelik_intern_pool_new(kelimelik_intern_pool **out, const kelimelik_allocator *allocator);
+
+// Returns the interned copy of the bytes with a new reference to it. Interned
+// strings must never be changed or freed with kelimelik_string_free().
+kelimelik_error kelimelik_intern_string(kelimelik_intern_pool *self, const void *bytes, uint16_t length, kelimelik_string **out);
+kelimelik_string *kelimelik_interned_retain(kelimelik_string *string);
+void kelimelik_interned_release(kelimelik_string *string);
+
+// The number of different strings in the pool.
+size_t kelimelik_intern_pool_count(kelimelik_intern_pool *self);
+
+// Every interned string must have been released.
+void kelimelik_intern_pool_free(kelimelik_intern_pool *self);
+
+// Logging. Diagnostics from the library are written to stderr unless a
+// different sink is set. Passing NULL restores the default sink. Messages
+// that are being logged on other threads while the sink changes may still go
+// to the old sink, along with its old context.
+void kelimelik_set_log_sink(kelimelik_log_sink sink, void *context);
+
+// Asynchronous loggers. Packets and messages are copied into compact records
+// on a per-thread lock-free ring, and a background thread formats them and
+// writes them to the file. Logging never blocks; records are dropped if a
+// ring is full and the number of dropped records is logged instead. The ring
+// capacity must be a power of two, or 0 for the default.
+kelimelik_error kelimelik_logger_new(kelimelik_logger **out, FILE *file, size_t ring_capacity);
+void kelimelik_logger_set_level(kelimelik_logger *self, enum kelimelik_log_level level);
+
+// Only logs one in every one_in packets with the given header. 0 disables
+// logging for the header completely and 1 logs every packet again.
+kelimelik_error kelimelik_logger_set_sampling(kelimelik_logger *self, const char *header, uint32_t one_in);
+void kelimelik_logger_packet(
+	kelimelik_logger *self,
+	enum kelimelik_log_level level,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	kelimelik_packet *packet
+);
+
+// Logs a frame from a parser in framing-only mode. Only the header, the size
+// and the number of objects are recorded.
+void kelimelik_logger_frame(
+	kelimelik_logger *self,
+	enum kelimelik_log_level level,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const kelimelik_frame *frame
+);
+void kelimelik_logger_message(kelimelik_logger *self, enum kelimelik_log_level level, const char *format, ...);
+
+// A kelimelik_log_sink that forwards library diagnostics to the logger
+// passed as the context.
+void kelimelik_logger_sink(enum kelimelik_log_level level, const char *message, void *context);
+
+// Writes out every remaining record before freeing the logger. No other
+// thread may use the logger while this is running.
+void kelimelik_logger_free(kelimelik_logger *self);
+
+// Latency histograms. Values are grouped into buckets that are at most 1/64
+// of the value wide, so percentiles are off by less than 1.6%. Values above
+// 2^44 are recorded as 2^44 - 1. Recording is lock-free, and any number of
+// threads may record into or merge into the same histogram.
+kelimelik_error kelimelik_histogram_new(kelimelik_histogram **out, const kelimelik_allocator *allocator);
+void kelimelik_histogram_record(kelimelik_histogram *self, uint64_t value);
+
+// Adds every value recorded in other to self.
+void kelimelik_histogram_merge(kelimelik_histogram *self, kelimelik_histogram *other);
+void kelimelik_histogram_reset(kelimelik_histogram *self);
+uint64_t kelimelik_histogram_count(kelimelik_histogram *self);
+uint64_t kelimelik_histogram_max(kelimelik_histogram *self);
+double kelimelik_histogram_mean(kelimelik_histogram *self);
+
+// Returns the biggest value in the bucket that holds the given percentile,
+// from 0 to 100. Returns 0 if nothing was recorded.
+uint64_t kelimelik_histogram_percentile(kelimelik_histogram *self, double percentile);
+void kelimelik_histogram_free(kelimelik_histogram *self);
+
+// Traffic statistics for proxies. Counts the packets and bytes of every
+// header in both directions, the time spent decoding and encoding them, and
+// the latency between requests and their responses. A request is answered by
+// the first response with the paired header on the same connection. Times
+// are in nanoseconds from any monotonic clock. Only the histograms are
+// thread-safe; everything else must be used from one thread at a time.
+kelimelik_error kelimelik_traffic_stats_new(kelimelik_traffic_stats **out, const kelimelik_allocator *allocator);
+kelimelik_error kelimelik_traffic_stats_add_pair(kelimelik_traffic_stats *self, const char *request, const char *response);
+void kelimelik_traffic_stats_frame(
+	kelimelik_traffic_stats *self,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const kelimelik_frame *frame,
+	uint64_t time
+);
+void kelimelik_traffic_stats_decode_time(kelimelik_traffic_stats *self, const void *header, uint16_t header_length, uint64_t nanoseconds);
+void kelimelik_traffic_stats_encode_time(kelimelik_traffic_stats *self, const void *header, uint16_t header_length, uint64_t nanoseconds);
+
+// Forgets the requests of the connection that are still waiting for a
+// response. They are counted as unanswered.
+void kelimelik_traffic_stats_end_connection(kelimelik_traffic_stats *self, uint32_t connection_id);
+
+// Writes a table of the counters and the latency percentiles in microseconds.
+kelimelik_error kelimelik_traffic_stats_write(kelimelik_traffic_stats *self, FILE *file);
+void kelimelik_traffic_stats_free(kelimelik_traffic_stats *self);
+
+// Capture writers. Frames are buffered and appended to the file as they are
+// added. The frame index is written when the writer is closed; captures that
+// were never closed (for example after a crash) can still be read, but the
+// index has to be rebuilt with a linear scan when they are opened.
+kelimelik_error kelimelik_capture_writer_new(kelimelik_capture_writer **out, const char *path);
+kelimelik_error kelimelik_capture_writer_add_v1(
+	kelimelik_capture_writer *self,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const void *bytes,
+	uint32_t length
+); // Uses the current time as the timestamp
+kelimelik_error kelimelik_capture_writer_add_v2(kelimelik_capture_writer *self, const kelimelik_capture_frame *frame);
+kelimelik_error kelimelik_capture_writer_flush(kelimelik_capture_writer *self);
+kelimelik_error kelimelik_capture_writer_close(kelimelik_capture_writer *self);
+
+// Capture readers. The file is mapped into memory, so reading frames doesn't
+// copy anything.
+kelimelik_error kelimelik_capture_open(kelimelik_capture **out, const char *path);
+size_t kelimelik_capture_frame_count(kelimelik_capture *self);
+kelimelik_error kelimelik_capture_get_frame(kelimelik_capture *self, size_t index, kelimelik_capture_frame *frame);
+kelimelik_error kelimelik_capture_replay(
+	kelimelik_capture *self,
+	kelimelik_parser *parser,
+	kelimelik_capture_callback callback,
+	void *context
+);
+// Finds every frame with the given header, optionally limited to a single
+// connection. The entries point into the mapped file and are valid until the
+// capture is closed. Fails with KELIMELIK_ERROR_INVALID_CAPTURE if the file
+// has no header index.
+kelimelik_error kelimelik_capture_query(
+	kelimelik_capture *self,
+	const char *header,
+	uint32_t connection_id,
+	const kelimelik_capture_index_entry **entries,
+	size_t *entry_count
+);
+void kelimelik_capture_close(kelimelik_capture *self);
+
+// Rebuilds the indexes of an existing capture file in place. Use this for
+// captures that weren't closed properly or that were written before header
+// indexes existed. The capture must not be open while this is running.
+kelimelik_error kelimelik_capture_build_index(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
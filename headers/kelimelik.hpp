@@ -0,0 +1,512 @@
+#ifndef __KELIMELIK_HPP
+#define __KELIMELIK_HPP
+
+// Header-only C++17 wrapper around kelimelik.h. Owners are move-only and
+// free what they own, and accessors return views into the storage of the
+// packet instead of copies, so they are valid as long as the packet is.
+// Errors are thrown as kelimelik::error.
+
+#include <kelimelik.h>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if (__cplusplus >= 202002L) && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
+
+namespace kelimelik {
+
+class error : public std::runtime_error {
+public:
+	explicit error(kelimelik_error value): std::runtime_error(message(value)), value(value) {}
+	kelimelik_error value;
+
+private:
+	static std::string message(kelimelik_error value) {
+		char buffer[100];
+		return kelimelik_strerror_buf(value, buffer, sizeof(buffer));
+	}
+};
+
+inline void check(kelimelik_error value) {
+	if (KELIMELIK_IS_ERROR(value)) {
+		throw error(value);
+	}
+}
+
+namespace detail {
+	inline kelimelik_error make_error(enum kelimelik_errno value) {
+		kelimelik_error result{};
+		result.kelimelik_errno = value;
+		return result;
+	}
+
+	constexpr std::size_t length(const char *string) {
+		std::size_t length = 0;
+		while (string[length]) {
+			length++;
+		}
+		return length;
+	}
+
+	// Random access iterator for lists that only have operator[].
+	template <class List, class Value>
+	class index_iterator {
+	public:
+		using iterator_category = std::random_access_iterator_tag;
+		using value_type = Value;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = Value;
+
+		constexpr index_iterator(const List *list, std::size_t index) noexcept: list(list), index(index) {}
+		Value operator*() const { return (*list)[index]; }
+		Value operator[](difference_type offset) const { return (*list)[index + offset]; }
+		index_iterator &operator++() noexcept { index++; return *this; }
+		index_iterator operator++(int) noexcept { index_iterator old = *this; index++; return old; }
+		index_iterator &operator--() noexcept { index--; return *this; }
+		index_iterator operator--(int) noexcept { index_iterator old = *this; index--; return old; }
+		index_iterator &operator+=(difference_type offset) noexcept { index += offset; return *this; }
+		index_iterator &operator-=(difference_type offset) noexcept { index -= offset; return *this; }
+		index_iterator operator+(difference_type offset) const noexcept { return index_iterator(list, index + offset); }
+		index_iterator operator-(difference_type offset) const noexcept { return index_iterator(list, index - offset); }
+		difference_type operator-(const index_iterator &other) const noexcept { return index - other.index; }
+		bool operator==(const index_iterator &other) const noexcept { return index == other.index; }
+		bool operator!=(const index_iterator &other) const noexcept { return index != other.index; }
+		bool operator<(const index_iterator &other) const noexcept { return index < other.index; }
+
+	private:
+		const List *list;
+		std::size_t index;
+	};
+}
+
+// std::span where it's available, and a minimal replacement in C++17.
+#ifdef __cpp_lib_span
+template <class T>
+using span = std::span<T>;
+#else
+template <class T>
+class span {
+public:
+	using element_type = T;
+	using value_type = std::remove_cv_t<T>;
+	using size_type = std::size_t;
+	using iterator = T *;
+
+	constexpr span() noexcept: items(nullptr), count(0) {}
+	constexpr span(T *items, std::size_t count) noexcept: items(items), count(count) {}
+	constexpr T *data() const noexcept { return items; }
+	constexpr std::size_t size() const noexcept { return count; }
+	constexpr bool empty() const noexcept { return !count; }
+	constexpr T &operator[](std::size_t index) const noexcept { return items[index]; }
+	constexpr T *begin() const noexcept { return items; }
+	constexpr T *end() const noexcept { return items + count; }
+
+private:
+	T *items;
+	std::size_t count;
+};
+#endif
+
+inline std::string_view view(const kelimelik_string *string) noexcept {
+	return std::string_view((const char *)string->string, string->length);
+}
+
+// The items of a string array, as string views.
+class string_list {
+public:
+	using iterator = detail::index_iterator<string_list, std::string_view>;
+
+	constexpr string_list(kelimelik_string *const *items, std::size_t count) noexcept: items(items), count(count) {}
+	std::size_t size() const noexcept { return count; }
+	bool empty() const noexcept { return !count; }
+	std::string_view operator[](std::size_t index) const noexcept { return view(items[index]); }
+	iterator begin() const noexcept { return iterator(this, 0); }
+	iterator end() const noexcept { return iterator(this, count); }
+
+private:
+	kelimelik_string *const *items;
+	std::size_t count;
+};
+
+// The items of an integer array of any width, widened to 64 bits.
+class integer_list {
+public:
+	using iterator = detail::index_iterator<integer_list, uint64_t>;
+
+	explicit integer_list(const kelimelik_array *array) noexcept: array(array) {}
+	std::size_t size() const noexcept { return array->item_count; }
+	bool empty() const noexcept { return !array->item_count; }
+	uint64_t operator[](std::size_t index) const noexcept {
+		switch (array->type) {
+			case KELIMELIK_OBJECT_UINT8: return array->uint8s[index];
+			case KELIMELIK_OBJECT_UINT32: return array->uint32s[index];
+			default: return array->uint64s[index];
+		}
+	}
+	iterator begin() const noexcept { return iterator(this, 0); }
+	iterator end() const noexcept { return iterator(this, size()); }
+
+private:
+	const kelimelik_array *array;
+};
+
+// Owns a kelimelik_string that was created with the global allocator.
+class string {
+public:
+	string() noexcept: handle(nullptr) {}
+	explicit string(std::string_view value) {
+		check(kelimelik_string_new_v3(&handle, nullptr, value.data(), value.size()));
+	}
+	string(string &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+	string &operator=(string &&other) noexcept {
+		std::swap(handle, other.handle);
+		return *this;
+	}
+	string(const string &) = delete;
+	string &operator=(const string &) = delete;
+	~string() {
+		if (handle) kelimelik_string_free(handle);
+	}
+
+	kelimelik_string *get() const noexcept { return handle; }
+	std::string_view view() const noexcept { return kelimelik::view(handle); }
+	operator std::string_view() const noexcept { return view(); }
+
+	// Gives up ownership, for example to pass the string to a packet.
+	kelimelik_string *detach() noexcept { return std::exchange(handle, nullptr); }
+
+private:
+	kelimelik_string *handle;
+};
+
+class packet;
+
+// A packet that is owned by someone else, like the packets returned by a
+// parser. Views are cheap to copy.
+class packet_view {
+public:
+	packet_view() noexcept: handle(nullptr) {}
+	explicit packet_view(kelimelik_packet *packet) noexcept: handle(packet) {}
+
+	kelimelik_packet *get() const noexcept { return handle; }
+	explicit operator bool() const noexcept { return handle != nullptr; }
+	std::string_view header() const noexcept { return view(handle->header); }
+	uint8_t size() const noexcept { return handle->object_count; }
+	enum kelimelik_object_type type(uint8_t index) const { return object(index).type; }
+
+	// Returns true if the objects match a kelimelik_verify_packet() format.
+	bool matches(const char *format) const {
+		return !KELIMELIK_IS_ERROR(kelimelik_verify_packet(handle, format));
+	}
+
+	uint8_t get_uint8(uint8_t index) const { return object(index, KELIMELIK_OBJECT_UINT8).uint8; }
+	uint32_t get_uint32(uint8_t index) const { return object(index, KELIMELIK_OBJECT_UINT32).uint32; }
+	uint64_t get_uint64(uint8_t index) const { return object(index, KELIMELIK_OBJECT_UINT64).uint64; }
+	std::string_view get_string(uint8_t index) const { return view(object(index, KELIMELIK_OBJECT_STRING).string); }
+
+	// Integers of any width
+	uint64_t get_integer(uint8_t index) const {
+		const kelimelik_object &value = object(index);
+		switch (value.type) {
+			case KELIMELIK_OBJECT_UINT8: return value.uint8;
+			case KELIMELIK_OBJECT_UINT32: return value.uint32;
+			case KELIMELIK_OBJECT_UINT64: return value.uint64;
+			default: throw error(detail::make_error(KELIMELIK_ERROR_INVALID_TYPE));
+		}
+	}
+
+	span<const uint8_t> get_uint8s(uint8_t index) const {
+		const kelimelik_array *value = array(index, KELIMELIK_OBJECT_UINT8);
+		return span<const uint8_t>(value->uint8s, value->item_count);
+	}
+	span<const uint32_t> get_uint32s(uint8_t index) const {
+		const kelimelik_array *value = array(index, KELIMELIK_OBJECT_UINT32);
+		return span<const uint32_t>(value->uint32s, value->item_count);
+	}
+	span<const uint64_t> get_uint64s(uint8_t index) const {
+		const kelimelik_array *value = array(index, KELIMELIK_OBJECT_UINT64);
+		return span<const uint64_t>(value->uint64s, value->item_count);
+	}
+	string_list get_strings(uint8_t index) const {
+		const kelimelik_array *value = array(index, KELIMELIK_OBJECT_STRING);
+		return string_list(value->strings, value->item_count);
+	}
+
+	// Takes a new reference, so the packet outlives its current owner.
+	packet retain() const;
+
+protected:
+	kelimelik_packet *handle;
+
+	const kelimelik_object &object(uint8_t index) const {
+		if (index >= handle->object_count) {
+			throw error(detail::make_error(KELIMELIK_ERROR_INVALID_ARGUMENT));
+		}
+		check(kelimelik_packet_materialize(handle));
+		return handle->objects[index];
+	}
+	const kelimelik_object &object(uint8_t index, enum kelimelik_object_type type) const {
+		const kelimelik_object &value = object(index);
+		if (value.type != type) {
+			throw error(detail::make_error(KELIMELIK_ERROR_INVALID_TYPE));
+		}
+		return value;
+	}
+	const kelimelik_array *array(uint8_t index, enum kelimelik_object_type type) const {
+		const kelimelik_array *value = object(index, KELIMELIK_OBJECT_ARRAY).array;
+		if (value->type != type) {
+			throw error(detail::make_error(KELIMELIK_ERROR_INVALID_TYPE));
+		}
+		return value;
+	}
+};
+
+// Owns one reference to a packet. Strings and arrays set through the setters
+// are created with the packet's allocator.
+class packet : public packet_view {
+public:
+	packet() noexcept = default;
+	packet(std::string_view header, uint8_t size) {
+		string header_string(header);
+		check(kelimelik_packet_new_v2(&handle, header_string.get(), size));
+		header_string.detach();
+	}
+	packet(packet &&other) noexcept: packet_view(std::exchange(other.handle, nullptr)) {}
+	packet &operator=(packet &&other) noexcept {
+		std::swap(handle, other.handle);
+		return *this;
+	}
+	packet(const packet &) = delete;
+	packet &operator=(const packet &) = delete;
+	~packet() {
+		if (handle) kelimelik_packet_release(handle);
+	}
+
+	// Takes over a reference the caller owns.
+	static packet adopt(kelimelik_packet *handle) noexcept {
+		packet result;
+		result.handle = handle;
+		return result;
+	}
+
+	// Gives up the reference without releasing it.
+	kelimelik_packet *detach() noexcept { return std::exchange(handle, nullptr); }
+
+	void set_uint8(uint8_t index, uint8_t value) { check(kelimelik_packet_set_uint8(handle, index, value)); }
+	void set_uint32(uint8_t index, uint32_t value) { check(kelimelik_packet_set_uint32(handle, index, value)); }
+	void set_uint64(uint8_t index, uint64_t value) { check(kelimelik_packet_set_uint64(handle, index, value)); }
+	void set_string(uint8_t index, std::string_view value) {
+		// Checked first, so that the string can't be left without an owner
+		object_slot(index);
+		kelimelik_string *string;
+		check(kelimelik_string_new_v3(&string, handle->allocator, value.data(), value.size()));
+		check(kelimelik_packet_set_string_v2(handle, index, string));
+	}
+	void set_uint8s(uint8_t index, span<const uint8_t> values) { set_array(index, KELIMELIK_OBJECT_UINT8, values.data(), values.size()); }
+	void set_uint32s(uint8_t index, span<const uint32_t> values) { set_array(index, KELIMELIK_OBJECT_UINT32, values.data(), values.size() * 4); }
+	void set_uint64s(uint8_t index, span<const uint64_t> values) { set_array(index, KELIMELIK_OBJECT_UINT64, values.data(), values.size() * 8); }
+	void set_strings(uint8_t index, span<const std::string_view> values) {
+		object_slot(index);
+		std::vector<const char *> strings(values.size());
+		std::vector<std::size_t> lengths(values.size());
+		for (std::size_t i=0; i<values.size(); i++) {
+			strings[i] = values[i].data();
+			lengths[i] = values[i].size();
+		}
+		kelimelik_array *array;
+		check(kelimelik_string_array_new_v5(&array, handle->allocator, strings.data(), lengths.data(), values.size()));
+		check(kelimelik_packet_set_array(handle, index, array));
+	}
+	void set_strings(uint8_t index, std::initializer_list<std::string_view> values) {
+		set_strings(index, span<const std::string_view>(values.begin(), values.size()));
+	}
+
+	// After this, the packet can't be changed and can be shared between
+	// threads.
+	void freeze() { check(kelimelik_packet_freeze(handle)); }
+	span<const uint8_t> wire() const {
+		const uint8_t *bytes;
+		std::size_t length;
+		check(kelimelik_packet_get_wire(handle, &bytes, &length));
+		return span<const uint8_t>(bytes, length);
+	}
+
+private:
+	void object_slot(uint8_t index) const {
+		if (handle->frozen) {
+			throw error(detail::make_error(KELIMELIK_ERROR_FROZEN));
+		}
+		object(index);
+	}
+	void set_array(uint8_t index, enum kelimelik_object_type type, const void *values, std::size_t size) {
+		object_slot(index);
+		kelimelik_array *array;
+		check(kelimelik_array_new_v2(&array, handle->allocator, type, values, size));
+		check(kelimelik_packet_set_array(handle, index, array));
+	}
+};
+
+inline packet packet_view::retain() const {
+	return packet::adopt(kelimelik_packet_retain(handle));
+}
+
+// Typed access checked against a kelimelik_verify_packet() format at
+// compile time. The format has to be a constexpr array:
+//
+//   static constexpr char word_list[] = "Sq";
+//   kelimelik::typed<word_list> packet(view);
+//   for (std::string_view word : packet.get<0>()) { ... }
+//
+// Lowercase letters are values and uppercase letters are arrays: b is
+// uint8_t, d is uint32_t, q is uint64_t, i is an integer of any width and s
+// is a string. The packet is checked once when the typed view is created.
+namespace detail {
+	template <char Format>
+	struct format_field {
+		static_assert(Format != Format, "Unknown format character");
+	};
+	template <>
+	struct format_field<'b'> {
+		using type = uint8_t;
+		static type get(const kelimelik_object &value) noexcept { return value.uint8; }
+	};
+	template <>
+	struct format_field<'d'> {
+		using type = uint32_t;
+		static type get(const kelimelik_object &value) noexcept { return value.uint32; }
+	};
+	template <>
+	struct format_field<'q'> {
+		using type = uint64_t;
+		static type get(const kelimelik_object &value) noexcept { return value.uint64; }
+	};
+	template <>
+	struct format_field<'i'> {
+		using type = uint64_t;
+		static type get(const kelimelik_object &value) noexcept {
+			switch (value.type) {
+				case KELIMELIK_OBJECT_UINT8: return value.uint8;
+				case KELIMELIK_OBJECT_UINT32: return value.uint32;
+				default: return value.uint64;
+			}
+		}
+	};
+	template <>
+	struct format_field<'s'> {
+		using type = std::string_view;
+		static type get(const kelimelik_object &value) noexcept { return view(value.string); }
+	};
+	template <>
+	struct format_field<'B'> {
+		using type = span<const uint8_t>;
+		static type get(const kelimelik_object &value) noexcept { return type(value.array->uint8s, value.array->item_count); }
+	};
+	template <>
+	struct format_field<'D'> {
+		using type = span<const uint32_t>;
+		static type get(const kelimelik_object &value) noexcept { return type(value.array->uint32s, value.array->item_count); }
+	};
+	template <>
+	struct format_field<'Q'> {
+		using type = span<const uint64_t>;
+		static type get(const kelimelik_object &value) noexcept { return type(value.array->uint64s, value.array->item_count); }
+	};
+	template <>
+	struct format_field<'I'> {
+		using type = integer_list;
+		static type get(const kelimelik_object &value) noexcept { return type(value.array); }
+	};
+	template <>
+	struct format_field<'S'> {
+		using type = string_list;
+		static type get(const kelimelik_object &value) noexcept { return type(value.array->strings, value.array->item_count); }
+	};
+}
+
+template <const char *Format>
+class typed : public packet_view {
+public:
+	static constexpr std::size_t field_count = detail::length(Format);
+
+	explicit typed(packet_view packet): packet_view(packet) {
+		check(kelimelik_verify_packet(handle, Format));
+	}
+
+	template <std::size_t Index>
+	typename detail::format_field<Format[Index]>::type get() const noexcept {
+		static_assert(Index < field_count, "Index is out of the format");
+		return detail::format_field<Format[Index]>::get(handle->objects[Index]);
+	}
+};
+
+// The packets completed by one call to parser::advance(). They are owned by
+// the parser and are valid until the next call, unless they are retained.
+class packet_list {
+public:
+	using iterator = detail::index_iterator<packet_list, packet_view>;
+
+	packet_list(kelimelik_packet **items, std::size_t count, kelimelik_error last_error) noexcept:
+		items(items), count(count), last_error(last_error) {}
+	std::size_t size() const noexcept { return count; }
+	bool empty() const noexcept { return !count; }
+	packet_view operator[](std::size_t index) const noexcept { return packet_view(items[index]); }
+	iterator begin() const noexcept { return iterator(this, 0); }
+	iterator end() const noexcept { return iterator(this, count); }
+
+	// Frames that can't be decoded are skipped. This is the error of the
+	// last one, see kelimelik_parser_advance().
+	kelimelik_error error() const noexcept { return last_error; }
+
+private:
+	kelimelik_packet **items;
+	std::size_t count;
+	kelimelik_error last_error;
+};
+
+class parser {
+public:
+	explicit parser(const kelimelik_allocator *allocator = nullptr) {
+		check(kelimelik_parser_new_v2(&handle, allocator));
+	}
+	parser(parser &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+	parser &operator=(parser &&other) noexcept {
+		std::swap(handle, other.handle);
+		return *this;
+	}
+	parser(const parser &) = delete;
+	parser &operator=(const parser &) = delete;
+	~parser() {
+		if (handle) kelimelik_parser_free(handle);
+	}
+
+	kelimelik_parser *get() const noexcept { return handle; }
+	void set_options(int options) noexcept { kelimelik_parser_set_options(handle, options); }
+	void set_limits(const kelimelik_parser_limits &limits) noexcept { kelimelik_parser_set_limits(handle, &limits); }
+
+	// The bytes are only read.
+	packet_list advance(const void *bytes, std::size_t length) {
+		kelimelik_packet **packets = nullptr;
+		std::size_t count = 0;
+		kelimelik_error last_error = kelimelik_parser_advance(handle, (uint8_t *)bytes, length, &packets, &count);
+		return packet_list(packets, count, last_error);
+	}
+	packet_list advance(span<const uint8_t> bytes) { return advance(bytes.data(), bytes.size()); }
+
+private:
+	kelimelik_parser *handle;
+};
+
+}
+
+#endif
@@ -1,6 +1,7 @@
 #!/bin/bash
 
-examples=(account-info proxy tests)
+examples=(account-info proxy tests capture-replay capture-query json-encode send-bench fuzz)
+cpp_examples=(cpp-wrapper)
 
 if [ -z "${PWD}" ]; then
   echo "\$PWD appears to be empty/unset. This should never happen."
@@ -12,7 +13,7 @@ PROJECT_ROOT="${PWD}"
 clean_dir() {
   echo "Cleaning up..."
   pushd "${PROJECT_ROOT}/out" > /dev/null
-    rm -f ${examples[@]} *.o libkelimelik.a src headers
+    rm -f ${examples[@]} ${cpp_examples[@]} schema-gen *.o libkelimelik.a src headers
   popd > /dev/null
 }
 
@@ -23,13 +24,18 @@ trap 'a=$?; echo "[ERROR] One of the build steps failed (make.sh:${LINENO})"; cl
 mkdir -p "${PROJECT_ROOT}/out"
 cd "${PROJECT_ROOT}/out"
 
+# Build the schema generator and regenerate the message headers
+echo "Generating message headers..."
+clang -Wall -O2 ../tools/schema-gen/main.c -o schema-gen
+./schema-gen ../schema/game-module.schema ../headers/kelimelik-game-module.h
+
 # Create temporary symlinks
 ln -s ../src src
 ln -s ../headers headers
 
 # Build libkelimelik
 echo "Building libkelimelik..."
-clang -Iheaders -c src/*.c
+clang -pthread -Iheaders -c src/*.c
 
 # Remove the symlinks
 rm -f src headers
@@ -47,5 +53,11 @@ cd "${PROJECT_ROOT}"
 # Build examples
 for example in "${examples[@]}"; do
   echo "Building ${example}..."
-  clang -Wall -O2 -Iheaders examples/"${example}"/*.c "${PROJECT_ROOT}/out/libkelimelik.a" -o "${PROJECT_ROOT}/out/${example}"
-done
\ No newline at end of file
+  clang -Wall -O2 -pthread -Iheaders examples/"${example}"/*.c "${PROJECT_ROOT}/out/libkelimelik.a" -o "${PROJECT_ROOT}/out/${example}"
+done
+
+# Build C++ examples
+for example in "${cpp_examples[@]}"; do
+  echo "Building ${example}..."
+  clang++ -std=c++17 -Wall -O2 -pthread -Iheaders examples/"${example}"/*.cpp "${PROJECT_ROOT}/out/libkelimelik.a" -o "${PROJECT_ROOT}/out/${example}"
+done
@@ -0,0 +1,120 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <stdatomic.h>
+
+static void *kelimelik_default_allocate(void *context, size_t size) {
+	return malloc(size);
+}
+
+static void *kelimelik_default_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+	return realloc(pointer, new_size);
+}
+
+static void kelimelik_default_release(void *context, void *pointer, size_t size) {
+	free(pointer);
+}
+
+const kelimelik_allocator kelimelik_default_allocator = {
+	.allocate = kelimelik_default_allocate,
+	.reallocate = kelimelik_default_reallocate,
+	.release = kelimelik_default_release,
+	.context = NULL
+};
+
+static const kelimelik_allocator *_Atomic global_allocator = &kelimelik_default_allocator;
+
+void kelimelik_set_allocator(const kelimelik_allocator *allocator) {
+	atomic_store(&global_allocator, allocator ? allocator : &kelimelik_default_allocator);
+}
+
+const kelimelik_allocator *kelimelik_get_allocator(void) {
+	return atomic_load(&global_allocator);
+}
+
+const kelimelik_allocator *_kelimelik_allocator(const kelimelik_allocator *allocator) {
+	return allocator ? allocator : atomic_load(&global_allocator);
+}
+
+void *_kelimelik_allocate(const kelimelik_allocator *allocator, size_t size) {
+	allocator = _kelimelik_allocator(allocator);
+	return allocator->allocate(allocator->context, size);
+}
+
+void *_kelimelik_reallocate(const kelimelik_allocator *allocator, void *pointer, size_t old_size, size_t new_size) {
+	allocator = _kelimelik_allocator(allocator);
+	if (!pointer) {
+		return allocator->allocate(allocator->context, new_size);
+	}
+	if (allocator->reallocate) {
+		return allocator->reallocate(allocator->context, pointer, old_size, new_size);
+	}
+
+	// No reallocate function, move the block manually
+	void *new_pointer = allocator->allocate(allocator->context, new_size);
+	if (!new_pointer) {
+		return NULL;
+	}
+	memcpy(new_pointer, pointer, (old_size < new_size) ? old_size : new_size);
+	allocator->release(allocator->context, pointer, old_size);
+	return new_pointer;
+}
+
+void _kelimelik_release(const kelimelik_allocator *allocator, void *pointer, size_t size) {
+	if (!pointer) {
+		return;
+	}
+	allocator = _kelimelik_allocator(allocator);
+	allocator->release(allocator->context, pointer, size);
+}
+
+// Counting allocators. Blocks may be freed on a different thread than the
+// one that allocated them, so the counters are only touched atomically.
+
+static void kelimelik_counting_add(kelimelik_counting_allocator *self, size_t size) {
+	size_t in_use = __atomic_add_fetch(&self->bytes_in_use, size, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&self->peak_bytes, __ATOMIC_RELAXED);
+	while ((in_use > peak) && !__atomic_compare_exchange_n(
+		&self->peak_bytes, &peak, in_use, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+	));
+}
+
+static void *kelimelik_counting_allocate(void *context, size_t size) {
+	kelimelik_counting_allocator *self = context;
+	void *pointer = _kelimelik_allocate(self->parent, size);
+	if (pointer) {
+		kelimelik_counting_add(self, size);
+		__atomic_add_fetch(&self->allocation_count, 1, __ATOMIC_RELAXED);
+	}
+	return pointer;
+}
+
+static void *kelimelik_counting_reallocate(void *context, void *pointer, size_t old_size, size_t new_size) {
+	kelimelik_counting_allocator *self = context;
+	void *new_pointer = _kelimelik_reallocate(self->parent, pointer, old_size, new_size);
+	if (new_pointer) {
+		__atomic_sub_fetch(&self->bytes_in_use, old_size, __ATOMIC_RELAXED);
+		kelimelik_counting_add(self, new_size);
+	}
+	return new_pointer;
+}
+
+static void kelimelik_counting_release(void *context, void *pointer, size_t size) {
+	kelimelik_counting_allocator *self = context;
+	_kelimelik_release(self->parent, pointer, size);
+	__atomic_sub_fetch(&self->bytes_in_use, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&self->allocation_count, 1, __ATOMIC_RELAXED);
+}
+
+void kelimelik_counting_allocator_init(kelimelik_counting_allocator *self, const kelimelik_allocator *parent) {
+	self->allocator.allocate = kelimelik_counting_allocate;
+	self->allocator.reallocate = kelimelik_counting_reallocate;
+	self->allocator.release = kelimelik_counting_release;
+	self->allocator.context = self;
+
+	// Resolve the parent now so that changing the global allocator later
+	// doesn't change where existing blocks are freed
+	self->parent = _kelimelik_allocator(parent);
+	self->bytes_in_use = 0;
+	self->peak_bytes = 0;
+	self->allocation_count = 0;
+}
@@ -16,19 +16,66 @@ static int kelimelik_array_bytes_for_type(enum kelimelik_object_type type) {
 	}
 }
 
-kelimelik_error kelimelik_array_free(kelimelik_array *self) {
+kelimelik_error _kelimelik_array_free(const kelimelik_allocator *allocator, kelimelik_array *self) {
 	if (!self) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
-	if (self->type == KELIMELIK_OBJECT_STRING) {
+	if ((self->type == KELIMELIK_OBJECT_STRING) && (self->storage == KELIMELIK_STORAGE_INTERNED)) {
+		for (uint64_t i=0; i<self->item_count; i++) {
+			kelimelik_interned_release(self->strings[i]);
+		}
+	}
+	else if ((self->type == KELIMELIK_OBJECT_STRING) && (self->storage != KELIMELIK_STORAGE_INLINE)) {
 		for (uint64_t i=0; i<self->item_count; i++) {
-			kelimelik_string_free(self->strings[i]);
+			_kelimelik_string_free(allocator, self->strings[i]);
 		}
 	}
-	free(self);
+	_kelimelik_release(allocator, self, sizeof(*self) + (self->item_count * kelimelik_array_bytes_for_type(self->type)) + self->blob_size);
+	return _KELIMELIK_SUCCESS;
+}
+
+// Packed string arrays keep the string pointers, followed by every string
+// back to back, in the same block as the array:
+//
+//   [kelimelik_array][strings[0..count]][length][bytes]\0[length][bytes]\0...
+//
+// The pointer table keeps array->strings[i] working like it does for other
+// string arrays, and everything is allocated and freed at once.
+kelimelik_error _kelimelik_packed_string_array_new(const kelimelik_allocator *allocator, kelimelik_array **out, uint32_t count, size_t blob_size) {
+	if (blob_size > UINT32_MAX) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	}
+	kelimelik_array *array = _kelimelik_allocate(allocator, sizeof(*array) + (count * sizeof(kelimelik_string *)) + blob_size);
+	if (!array) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	array->type = KELIMELIK_OBJECT_STRING;
+	array->item_count = 0;
+	array->storage = KELIMELIK_STORAGE_INLINE;
+	array->blob_size = blob_size;
+	*out = array;
 	return _KELIMELIK_SUCCESS;
 }
 
+void _kelimelik_packed_string_array_push(kelimelik_array *self, uint32_t count, const void *bytes, uint16_t length) {
+	kelimelik_string *string;
+	if (self->item_count) {
+		kelimelik_string *last = self->strings[self->item_count - 1];
+		string = (kelimelik_string *)((uint8_t *)last + _KELIMELIK_INLINE_STRING_SIZE(last->length));
+	}
+	else {
+		string = (kelimelik_string *)&self->strings[count];
+	}
+	memcpy(string + 1, bytes, length);
+	((uint8_t *)(string + 1))[length] = 0;
+	string->length = length;
+	self->strings[self->item_count++] = string;
+}
+
+kelimelik_error kelimelik_array_free(kelimelik_array *self) {
+	return _kelimelik_array_free(NULL, self);
+}
+
 static size_t kelimelik_count_pointers(void **pointers) {
 	size_t count = 0;
 	while (*(pointers++)) count++;
@@ -36,20 +83,53 @@ static size_t kelimelik_count_pointers(void **pointers) {
 }
 
 kelimelik_error kelimelik_string_array_new_v2(kelimelik_array **out, const char **strings, const size_t count) {
-	if (!count) {
-		return kelimelik_array_new(out, KELIMELIK_OBJECT_STRING, NULL, 0);
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (count && !strings) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (count > UINT32_MAX) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	size_t blob_size = 0;
+	for (size_t i=0; i<count; i++) {
+		size_t length = strlen(strings[i]);
+		if (length > 0xFFFF) {
+			return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+		}
+		blob_size += _KELIMELIK_INLINE_STRING_SIZE(length);
 	}
-	kelimelik_string **kstrings = malloc(count * sizeof(*strings));
-	if (!kstrings) {
-		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	kelimelik_array *array;
+	kelimelik_error error = _kelimelik_packed_string_array_new(NULL, &array, count, blob_size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	for (size_t i=0; i<count; i++) {
+		_kelimelik_packed_string_array_push(array, count, strings[i], strlen(strings[i]));
+	}
+	*out = array;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_string_array_new_v5(
+	kelimelik_array **out,
+	const kelimelik_allocator *allocator,
+	const char *const *strings,
+	const size_t *lengths,
+	const size_t count
+) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (count && !strings) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	if (count && !lengths) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	if (count > UINT32_MAX) return _KELIMELIK_ERROR_INVALID_ARGUMENT(4);
+	size_t blob_size = 0;
+	for (size_t i=0; i<count; i++) {
+		if ((lengths[i] > 0xFFFF) || (lengths[i] && !strings[i])) {
+			return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+		}
+		blob_size += _KELIMELIK_INLINE_STRING_SIZE(lengths[i]);
 	}
-	kelimelik_error error;
+	kelimelik_array *array;
+	kelimelik_error error = _kelimelik_packed_string_array_new(allocator, &array, count, blob_size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
 	for (size_t i=0; i<count; i++) {
-		error = kelimelik_string_new_v1(&kstrings[i], strings[i]);
+		_kelimelik_packed_string_array_push(array, count, strings[i], lengths[i]);
 	}
-	error = kelimelik_string_array_new_v4(out, kstrings, count);
-	free(kstrings);
-	return error;
+	*out = array;
+	return _KELIMELIK_SUCCESS;
 }
 
 kelimelik_error kelimelik_string_array_new_v1(kelimelik_array **out, const char **strings) {
@@ -80,7 +160,7 @@ KELIMELIK_ARRAY_UINT_INITIALIZER(64)
 
 #undef KELIMELIK_ARRAY_UINT_INITIALIZER
 
-kelimelik_error kelimelik_array_new(kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t size) {
+kelimelik_error _kelimelik_array_new(const kelimelik_allocator *allocator, kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t size) {
 	if (!out) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
@@ -91,10 +171,37 @@ kelimelik_error kelimelik_array_new(kelimelik_array **out, enum kelimelik_object
 	if (len_per_item == -1) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
 	}
-	kelimelik_array *array = malloc(sizeof(*array) + size);
+
+	// Only whole items are kept, so that the array can be freed with the
+	// same size it was allocated with
+	size_t item_count = (size / len_per_item);
+	kelimelik_array *array = _kelimelik_allocate(allocator, sizeof(*array) + (item_count * len_per_item));
+	if (!array) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
 	array->type = type;
-	array->item_count = (size / len_per_item);
-	memcpy(array + 1, values, size);
+	array->item_count = item_count;
+	array->storage = KELIMELIK_STORAGE_HEAP;
+	array->blob_size = 0;
+	memcpy(array + 1, values, item_count * len_per_item);
 	*out = array;
 	return _KELIMELIK_SUCCESS;
 }
+
+kelimelik_error kelimelik_array_new(kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t size) {
+	return _kelimelik_array_new(NULL, out, type, values, size);
+}
+
+kelimelik_error kelimelik_array_new_v2(
+	kelimelik_array **out,
+	const kelimelik_allocator *allocator,
+	enum kelimelik_object_type type,
+	const void *values,
+	const size_t size
+) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (kelimelik_array_bytes_for_type(type) == -1) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	if (!values && size) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	return _kelimelik_array_new(allocator, out, type, values, size);
+}
+
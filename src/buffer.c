@@ -0,0 +1,49 @@
+#include "kelimelik-private.h"
+#include <string.h>
+
+kelimelik_error kelimelik_buffer_reserve(kelimelik_buffer *self, size_t additional) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if ((self->capacity - self->length) >= additional) {
+		return _KELIMELIK_SUCCESS;
+	}
+
+	// Grow geometrically so that appending is amortized O(1)
+	size_t capacity = self->capacity ? self->capacity : 256;
+	while ((capacity - self->length) < additional) {
+		capacity *= 2;
+	}
+
+	// Remember which allocator was used, in case the global allocator changes
+	// before the buffer is freed
+	if (!self->allocator) {
+		self->allocator = _kelimelik_allocator(NULL);
+	}
+	uint8_t *bytes = _kelimelik_reallocate(self->allocator, self->bytes, self->capacity, capacity);
+	if (!bytes) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	self->bytes = bytes;
+	self->capacity = capacity;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_buffer_append(kelimelik_buffer *self, const void *bytes, size_t length) {
+	kelimelik_error error = kelimelik_buffer_reserve(self, length);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	if (length) {
+		memcpy(self->bytes + self->length, bytes, length);
+		self->length += length;
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_buffer_reset(kelimelik_buffer *self) {
+	self->length = 0;
+}
+
+void kelimelik_buffer_free(kelimelik_buffer *self) {
+	_kelimelik_release(self->allocator, self->bytes, self->capacity);
+	self->bytes = NULL;
+	self->length = 0;
+	self->capacity = 0;
+}
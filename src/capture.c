@@ -0,0 +1,649 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Capture file layout. All integers are stored in host byte order; the
+// version field doubles as a byte order mark.
+//
+//   File header
+//   Record header, frame bytes, padding to 8 bytes   (repeated)
+//   Frame index: one uint64_t file offset per record
+//   Header table: one kelimelik_capture_header per distinct header
+//   Header names, padded to 8 bytes
+//   Header index: kelimelik_capture_index_entry items sorted by header ID,
+//     then by connection ID, then by frame index
+//   Trailer
+//
+// Everything after the records is only written when the writer is closed.
+// Files written before the header index existed end with a shorter trailer
+// that only describes the frame index; kelimelik_capture_build_index() can
+// add a header index to them.
+
+#define KELIMELIK_CAPTURE_MAGIC "KLMKCAP"
+#define KELIMELIK_CAPTURE_FRAME_INDEX_MAGIC "KLMKIDX"
+#define KELIMELIK_CAPTURE_INDEX_MAGIC "KLMKHDX"
+#define KELIMELIK_CAPTURE_VERSION 1
+#define KELIMELIK_CAPTURE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct kelimelik_capture_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+};
+
+struct kelimelik_capture_record {
+	uint64_t timestamp;
+	uint32_t connection_id;
+	uint32_t length;
+	uint8_t direction;
+	uint8_t reserved[7];
+};
+
+struct kelimelik_capture_header {
+	uint64_t name_offset;
+	uint32_t name_length;
+	uint32_t reserved;
+};
+
+struct kelimelik_capture_frame_trailer {
+	uint64_t index_offset;
+	uint64_t frame_count;
+	uint64_t reserved;
+	char magic[8];
+};
+
+struct kelimelik_capture_trailer {
+	uint64_t index_offset;
+	uint64_t frame_count;
+	uint64_t headers_offset;
+	uint64_t header_count;
+	uint64_t entries_offset;
+	uint64_t entry_count;
+	char magic[8];
+};
+
+struct kelimelik_capture_writer {
+	FILE *file;
+	uint64_t offset;
+	uint64_t *offsets;
+	kelimelik_capture_index_entry *entries;
+	size_t frame_count;
+	size_t entry_count;
+	size_t capacity;
+	struct kelimelik_header_table headers;
+};
+
+struct kelimelik_capture {
+	int fd;
+	const uint8_t *map;
+	size_t map_length;
+	const uint64_t *offsets;
+
+	// Only set if the index had to be rebuilt because the file has no
+	// trailer. Otherwise offsets points into the mapped file.
+	uint64_t *rebuilt_offsets;
+	size_t frame_count;
+
+	// Where the records end and the indexes begin.
+	uint64_t records_end;
+
+	// Header index. Only available if the file has a full trailer.
+	const struct kelimelik_capture_header *headers;
+	size_t header_count;
+	const kelimelik_capture_index_entry *entries;
+	size_t entry_count;
+};
+
+static const uint8_t kelimelik_capture_padding[8] = { 0 };
+
+static kelimelik_error kelimelik_capture_writer_write(kelimelik_capture_writer *self, const void *bytes, size_t length) {
+	if (length && (fwrite(bytes, 1, length, self->file) != length)) {
+		return _KELIMELIK_ERROR_SYSCALL(fwrite);
+	}
+	self->offset += length;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_capture_writer_new(kelimelik_capture_writer **out, const char *path) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!path) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_capture_writer *writer = calloc(1, sizeof(*writer));
+	if (!writer) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	if (!(writer->file = fopen(path, "wb"))) {
+		kelimelik_error error = _KELIMELIK_ERROR_SYSCALL(open);
+		free(writer);
+		return error;
+	}
+
+	// Frames are small and arrive one at a time, so use a large buffer to
+	// keep the number of write() calls down.
+	setvbuf(writer->file, NULL, _IOFBF, 1 << 20);
+
+	struct kelimelik_capture_file_header header = {
+		.magic = KELIMELIK_CAPTURE_MAGIC,
+		.version = KELIMELIK_CAPTURE_VERSION,
+		.flags = 0
+	};
+	kelimelik_error error = kelimelik_capture_writer_write(writer, &header, sizeof(header));
+	if (KELIMELIK_IS_ERROR(error)) {
+		fclose(writer->file);
+		free(writer);
+		return error;
+	}
+	*out = writer;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Adds a record that starts at the given offset to the in-memory indexes.
+// Frames that are too short to contain a header are only added to the
+// frame index.
+static kelimelik_error kelimelik_capture_writer_index(
+	kelimelik_capture_writer *self,
+	uint64_t record_offset,
+	uint32_t connection_id,
+	const uint8_t *bytes,
+	uint32_t length
+) {
+	if (self->frame_count == self->capacity) {
+		size_t capacity = self->capacity ? (self->capacity * 2) : 1024;
+		uint64_t *offsets = realloc(self->offsets, capacity * sizeof(*offsets));
+		if (!offsets) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		self->offsets = offsets;
+		kelimelik_capture_index_entry *entries = realloc(self->entries, capacity * sizeof(*entries));
+		if (!entries) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		self->entries = entries;
+		self->capacity = capacity;
+	}
+	kelimelik_frame frame;
+	if (!KELIMELIK_IS_ERROR(kelimelik_frame_peek_header(bytes, length, &frame))) {
+		uint32_t header_id;
+		kelimelik_error error = _kelimelik_header_table_intern(&self->headers, frame.header, frame.header_length, &header_id);
+		if (KELIMELIK_IS_ERROR(error)) return error;
+		self->entries[self->entry_count++] = (kelimelik_capture_index_entry){
+			.header_id = header_id,
+			.connection_id = connection_id,
+			.frame_index = self->frame_count
+		};
+	}
+	self->offsets[self->frame_count++] = record_offset;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_capture_writer_add_v2(kelimelik_capture_writer *self, const kelimelik_capture_frame *frame) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!frame || (frame->length && !frame->bytes)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	uint64_t record_offset = self->offset;
+
+	struct kelimelik_capture_record record = {
+		.timestamp = frame->timestamp,
+		.connection_id = frame->connection_id,
+		.length = frame->length,
+		.direction = frame->direction
+	};
+	kelimelik_error error;
+	error = kelimelik_capture_writer_write(self, &record, sizeof(record));
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_capture_writer_write(self, frame->bytes, frame->length);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_capture_writer_write(
+		self,
+		kelimelik_capture_padding,
+		KELIMELIK_CAPTURE_ALIGN(self->offset) - self->offset
+	);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// Index the record now that it has been written completely
+	return kelimelik_capture_writer_index(
+		self,
+		record_offset,
+		frame->connection_id,
+		frame->bytes,
+		frame->length
+	);
+}
+
+kelimelik_error kelimelik_capture_writer_add_v1(
+	kelimelik_capture_writer *self,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const void *bytes,
+	uint32_t length
+) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	kelimelik_capture_frame frame = {
+		.timestamp = ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec,
+		.connection_id = connection_id,
+		.direction = direction,
+		.length = length,
+		.bytes = bytes
+	};
+	return kelimelik_capture_writer_add_v2(self, &frame);
+}
+
+kelimelik_error kelimelik_capture_writer_flush(kelimelik_capture_writer *self) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (fflush(self->file) != 0) {
+		return _KELIMELIK_ERROR_SYSCALL(fwrite);
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+static int kelimelik_capture_compare_entries(const void *a_pt, const void *b_pt) {
+	const kelimelik_capture_index_entry *a = a_pt, *b = b_pt;
+	if (a->header_id != b->header_id) {
+		return (a->header_id < b->header_id) ? -1 : 1;
+	}
+	if (a->connection_id != b->connection_id) {
+		return (a->connection_id < b->connection_id) ? -1 : 1;
+	}
+	return (a->frame_index < b->frame_index) ? -1 : (a->frame_index > b->frame_index);
+}
+
+static kelimelik_error kelimelik_capture_writer_write_indexes(kelimelik_capture_writer *self) {
+	struct kelimelik_capture_trailer trailer = {
+		.index_offset = self->offset,
+		.frame_count = self->frame_count,
+		.header_count = self->headers.count,
+		.entry_count = self->entry_count,
+		.magic = KELIMELIK_CAPTURE_INDEX_MAGIC
+	};
+	kelimelik_error error;
+
+	// Frame index
+	error = kelimelik_capture_writer_write(self, self->offsets, self->frame_count * sizeof(*self->offsets));
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// Header table, followed by the names it points to
+	trailer.headers_offset = self->offset;
+	uint64_t names_offset = self->offset + (self->headers.count * sizeof(struct kelimelik_capture_header));
+	for (uint32_t id=0; id<self->headers.count; id++) {
+		uint16_t length;
+		const uint8_t *name = _kelimelik_header_table_name(&self->headers, id, &length);
+		struct kelimelik_capture_header header = {
+			.name_offset = names_offset + (name - self->headers.blob),
+			.name_length = length
+		};
+		error = kelimelik_capture_writer_write(self, &header, sizeof(header));
+		if (KELIMELIK_IS_ERROR(error)) return error;
+	}
+	error = kelimelik_capture_writer_write(self, self->headers.blob, self->headers.blob_length);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_capture_writer_write(
+		self,
+		kelimelik_capture_padding,
+		KELIMELIK_CAPTURE_ALIGN(self->offset) - self->offset
+	);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// Header index
+	qsort(self->entries, self->entry_count, sizeof(*self->entries), kelimelik_capture_compare_entries);
+	trailer.entries_offset = self->offset;
+	error = kelimelik_capture_writer_write(self, self->entries, self->entry_count * sizeof(*self->entries));
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	return kelimelik_capture_writer_write(self, &trailer, sizeof(trailer));
+}
+
+kelimelik_error kelimelik_capture_writer_close(kelimelik_capture_writer *self) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_error error = kelimelik_capture_writer_write_indexes(self);
+	if ((fclose(self->file) != 0) && !KELIMELIK_IS_ERROR(error)) {
+		error = _KELIMELIK_ERROR_SYSCALL(fwrite);
+	}
+	_kelimelik_header_table_destroy(&self->headers);
+	free(self->offsets);
+	free(self->entries);
+	free(self);
+	return error;
+}
+
+// Returns true if a complete record starts at the given offset.
+static bool kelimelik_capture_record_fits(kelimelik_capture *self, uint64_t offset, uint64_t limit) {
+	if ((offset > limit) || ((limit - offset) < sizeof(struct kelimelik_capture_record))) {
+		return false;
+	}
+	const struct kelimelik_capture_record *record = (const void *)(self->map + offset);
+	return (record->length <= (limit - offset - sizeof(*record)));
+}
+
+// Used when the capture wasn't closed properly. Every complete record is
+// indexed, and a partially written record at the end of the file is ignored.
+static kelimelik_error kelimelik_capture_rebuild_index(kelimelik_capture *self) {
+	size_t capacity = 0;
+	uint64_t offset = sizeof(struct kelimelik_capture_file_header);
+	while (kelimelik_capture_record_fits(self, offset, self->map_length)) {
+		if (self->frame_count == capacity) {
+			capacity = capacity ? (capacity * 2) : 1024;
+			uint64_t *offsets = realloc(self->rebuilt_offsets, capacity * sizeof(*offsets));
+			if (!offsets) {
+				return _KELIMELIK_ERROR_SYSCALL(malloc);
+			}
+			self->rebuilt_offsets = offsets;
+		}
+		self->rebuilt_offsets[self->frame_count++] = offset;
+		const struct kelimelik_capture_record *record = (const void *)(self->map + offset);
+		offset = KELIMELIK_CAPTURE_ALIGN(offset + sizeof(*record) + record->length);
+	}
+	self->offsets = self->rebuilt_offsets;
+	self->records_end = (offset > self->map_length) ? self->map_length : offset;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Checks that a table of count items of the given size fits between offset
+// and limit.
+static bool kelimelik_capture_table_fits(uint64_t offset, uint64_t count, size_t size, uint64_t limit) {
+	return (offset <= limit) && !(offset & 7) && (count <= ((limit - offset) / size));
+}
+
+static kelimelik_error kelimelik_capture_load_header_index(
+	kelimelik_capture *self,
+	const struct kelimelik_capture_trailer *trailer,
+	uint64_t limit
+) {
+	if (
+		!kelimelik_capture_table_fits(trailer->headers_offset, trailer->header_count, sizeof(struct kelimelik_capture_header), limit) ||
+		!kelimelik_capture_table_fits(trailer->entries_offset, trailer->entry_count, sizeof(kelimelik_capture_index_entry), limit)
+	) {
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+	}
+	self->headers = (const void *)(self->map + trailer->headers_offset);
+	self->header_count = trailer->header_count;
+	self->entries = (const void *)(self->map + trailer->entries_offset);
+	self->entry_count = trailer->entry_count;
+	for (size_t i=0; i<self->header_count; i++) {
+		if (
+			(self->headers[i].name_offset > limit) ||
+			(self->headers[i].name_length > (limit - self->headers[i].name_offset))
+		) {
+			return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+		}
+	}
+	for (size_t i=0; i<self->entry_count; i++) {
+		if (
+			(self->entries[i].frame_index >= self->frame_count) ||
+			(self->entries[i].header_id >= self->header_count)
+		) {
+			return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+		}
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+static kelimelik_error kelimelik_capture_load_index(kelimelik_capture *self) {
+	const struct kelimelik_capture_file_header *header = (const void *)self->map;
+	if (
+		(self->map_length < sizeof(*header)) ||
+		memcmp(header->magic, KELIMELIK_CAPTURE_MAGIC, sizeof(header->magic)) ||
+		(header->version != KELIMELIK_CAPTURE_VERSION)
+	) {
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+	}
+	if (self->map_length < (sizeof(*header) + sizeof(struct kelimelik_capture_frame_trailer))) {
+		return kelimelik_capture_rebuild_index(self);
+	}
+
+	// Both trailer versions start with the frame index location and end
+	// with the magic, so the magic tells them apart.
+	const char *magic = (const char *)(self->map + self->map_length - 8);
+	size_t trailer_size;
+	if (!memcmp(magic, KELIMELIK_CAPTURE_INDEX_MAGIC, 8)) {
+		trailer_size = sizeof(struct kelimelik_capture_trailer);
+	}
+	else if (!memcmp(magic, KELIMELIK_CAPTURE_FRAME_INDEX_MAGIC, 8)) {
+		trailer_size = sizeof(struct kelimelik_capture_frame_trailer);
+	}
+	else {
+		return kelimelik_capture_rebuild_index(self);
+	}
+	if (self->map_length < (sizeof(*header) + trailer_size)) {
+		return kelimelik_capture_rebuild_index(self);
+	}
+	const struct kelimelik_capture_trailer *trailer = (const void *)(
+		self->map + self->map_length - trailer_size
+	);
+	uint64_t index_end = self->map_length - trailer_size;
+	if (!kelimelik_capture_table_fits(trailer->index_offset, trailer->frame_count, sizeof(uint64_t), index_end)) {
+		return kelimelik_capture_rebuild_index(self);
+	}
+	self->offsets = (const void *)(self->map + trailer->index_offset);
+	self->frame_count = trailer->frame_count;
+	self->records_end = trailer->index_offset;
+
+	// Make sure every indexed record is inside the file, so that readers
+	// never have to check again.
+	for (size_t i=0; i<self->frame_count; i++) {
+		if (!kelimelik_capture_record_fits(self, self->offsets[i], trailer->index_offset)) {
+			return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+		}
+	}
+	if (trailer_size == sizeof(struct kelimelik_capture_trailer)) {
+		return kelimelik_capture_load_header_index(self, trailer, index_end);
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_capture_open(kelimelik_capture **out, const char *path) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!path) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_capture *capture = calloc(1, sizeof(*capture));
+	if (!capture) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	kelimelik_error error;
+	if ((capture->fd = open(path, O_RDONLY)) == -1) {
+		error = _KELIMELIK_ERROR_SYSCALL(open);
+		free(capture);
+		return error;
+	}
+	struct stat st;
+	if (fstat(capture->fd, &st) == -1) {
+		error = _KELIMELIK_ERROR_SYSCALL(fstat);
+		close(capture->fd);
+		free(capture);
+		return error;
+	}
+	capture->map_length = st.st_size;
+	if (capture->map_length < sizeof(struct kelimelik_capture_file_header)) {
+		close(capture->fd);
+		free(capture);
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 0);
+	}
+	capture->map = mmap(NULL, capture->map_length, PROT_READ, MAP_PRIVATE, capture->fd, 0);
+	if (capture->map == MAP_FAILED) {
+		error = _KELIMELIK_ERROR_SYSCALL(mmap);
+		close(capture->fd);
+		free(capture);
+		return error;
+	}
+
+	// Frames are almost always read front to back
+	madvise((void *)capture->map, capture->map_length, MADV_SEQUENTIAL);
+
+	error = kelimelik_capture_load_index(capture);
+	if (KELIMELIK_IS_ERROR(error)) {
+		kelimelik_capture_close(capture);
+		return error;
+	}
+	*out = capture;
+	return _KELIMELIK_SUCCESS;
+}
+
+size_t kelimelik_capture_frame_count(kelimelik_capture *self) {
+	return self ? self->frame_count : 0;
+}
+
+kelimelik_error kelimelik_capture_get_frame(kelimelik_capture *self, size_t index, kelimelik_capture_frame *frame) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (index >= self->frame_count) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!frame) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	const struct kelimelik_capture_record *record = (const void *)(self->map + self->offsets[index]);
+	frame->timestamp = record->timestamp;
+	frame->connection_id = record->connection_id;
+	frame->direction = record->direction;
+	frame->length = record->length;
+	frame->bytes = (const uint8_t *)(record + 1);
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_capture_replay(
+	kelimelik_capture *self,
+	kelimelik_parser *parser,
+	kelimelik_capture_callback callback,
+	void *context
+) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!parser) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_error error = _KELIMELIK_SUCCESS;
+	for (size_t i=0; i<self->frame_count; i++) {
+		kelimelik_capture_frame frame;
+		kelimelik_capture_get_frame(self, i, &frame);
+		kelimelik_packet **packets;
+		size_t packet_count;
+		error = kelimelik_parser_advance(parser, (uint8_t *)frame.bytes, frame.length, &packets, &packet_count);
+		if (KELIMELIK_IS_ERROR(error)) {
+			break;
+		}
+		if (callback) {
+			for (size_t j=0; j<packet_count; j++) {
+				callback(&frame, packets[j], context);
+			}
+		}
+	}
+	return error;
+}
+
+kelimelik_error kelimelik_capture_query(
+	kelimelik_capture *self,
+	const char *header,
+	uint32_t connection_id,
+	const kelimelik_capture_index_entry **entries,
+	size_t *entry_count
+) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!header) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!entries) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	if (!entry_count) return _KELIMELIK_ERROR_INVALID_ARGUMENT(4);
+	if (!self->entries && self->frame_count) {
+		// No header index, see kelimelik_capture_build_index()
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_CAPTURE, 1);
+	}
+	*entries = NULL;
+	*entry_count = 0;
+
+	// There are only a few hundred different headers, a linear search is fine
+	size_t header_length = strlen(header);
+	uint32_t header_id;
+	for (header_id=0; header_id<self->header_count; header_id++) {
+		if (
+			(self->headers[header_id].name_length == header_length) &&
+			!memcmp(self->map + self->headers[header_id].name_offset, header, header_length)
+		) {
+			break;
+		}
+	}
+	if (header_id == self->header_count) {
+		return _KELIMELIK_SUCCESS;
+	}
+
+	// Find the first entry that is not smaller than the key, and the first
+	// entry that is bigger than it. Searching for the whole header is done by
+	// searching for connection IDs 0 through KELIMELIK_CAPTURE_ANY_CONNECTION.
+	kelimelik_capture_index_entry keys[2] = {
+		{
+			.header_id = header_id,
+			.connection_id = (connection_id == KELIMELIK_CAPTURE_ANY_CONNECTION) ? 0 : connection_id,
+			.frame_index = 0
+		},
+		{
+			.header_id = header_id,
+			.connection_id = connection_id,
+			.frame_index = UINT64_MAX
+		}
+	};
+	size_t bounds[2];
+	for (int i=0; i<2; i++) {
+		size_t low = 0, high = self->entry_count;
+		while (low < high) {
+			size_t middle = low + ((high - low) / 2);
+			if (kelimelik_capture_compare_entries(&self->entries[middle], &keys[i]) < 0) {
+				low = middle + 1;
+			}
+			else {
+				high = middle;
+			}
+		}
+		bounds[i] = low;
+	}
+	*entries = self->entries + bounds[0];
+	*entry_count = bounds[1] - bounds[0];
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_capture_build_index(const char *path) {
+	if (!path) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_capture *capture;
+	kelimelik_error error = kelimelik_capture_open(&capture, path);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// Collect everything from the existing records while the file is still
+	// mapped, then replace everything after the records with new indexes.
+	kelimelik_capture_writer *writer = calloc(1, sizeof(*writer));
+	if (!writer) {
+		kelimelik_capture_close(capture);
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	writer->offset = capture->records_end;
+	for (size_t i=0; (i<capture->frame_count) && !KELIMELIK_IS_ERROR(error); i++) {
+		kelimelik_capture_frame frame;
+		kelimelik_capture_get_frame(capture, i, &frame);
+		error = kelimelik_capture_writer_index(
+			writer,
+			capture->offsets[i],
+			frame.connection_id,
+			frame.bytes,
+			frame.length
+		);
+	}
+	kelimelik_capture_close(capture);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		if (!(writer->file = fopen(path, "r+b"))) {
+			error = _KELIMELIK_ERROR_SYSCALL(open);
+		}
+		else if (
+			(ftruncate(fileno(writer->file), writer->offset) == -1) ||
+			(fseeko(writer->file, writer->offset, SEEK_SET) == -1)
+		) {
+			error = _KELIMELIK_ERROR_SYSCALL(fwrite);
+			fclose(writer->file);
+		}
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		_kelimelik_header_table_destroy(&writer->headers);
+		free(writer->offsets);
+		free(writer->entries);
+		free(writer);
+		return error;
+	}
+	return kelimelik_capture_writer_close(writer);
+}
+
+void kelimelik_capture_close(kelimelik_capture *self) {
+	if (!self) return;
+	if (self->map && (self->map != MAP_FAILED)) {
+		munmap((void *)self->map, self->map_length);
+	}
+	close(self->fd);
+	free(self->rebuilt_offsets);
+	free(self);
+}
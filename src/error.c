@@ -7,17 +7,31 @@ const char *other_errors[] = {
 	"Encountered an invalid type while parsing.",
 	"This function is not implemented.",
 	"Invalid format passed to kelimelik_verify_packet().",
-	"Packet format doesn't match the specified format."
+	"Packet format doesn't match the specified format.",
+	"The capture file is truncated or corrupted.",
+	"Invalid JSON at offset %d.",
+	"Exceeded parser limit %d, see enum kelimelik_limit.",
+	"The packet is frozen and can't be changed."
 };
 
 const char *function_names[] = {
 	"socket",
 	"gethostbyname",
 	"connect",
-	"malloc"
+	"malloc",
+	"open",
+	"fstat",
+	"mmap",
+	"fwrite",
+	"write",
+	"pthread_create",
+	"sendmsg",
+	"setsockopt"
 };
 
-static char error_buffer[100];
+// Every thread formats into its own buffer, so kelimelik_strerror() can be
+// called from pipeline workers and logger threads at the same time.
+static _Thread_local char error_buffer[100];
 
 char *kelimelik_strerror_buf(kelimelik_error error, char *buffer, size_t len) {
 	if (error.kelimelik_errno == 0) {
@@ -36,7 +50,7 @@ char *kelimelik_strerror_buf(kelimelik_error error, char *buffer, size_t len) {
 			buffer,
 			len,
 			"%s() failed: %s",
-			function_names[-error.kelimelik_errno+1],
+			function_names[-error.kelimelik_errno-1],
 			strerror(error.syscall_errno)
 		);
 	}
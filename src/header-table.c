@@ -0,0 +1,133 @@
+#include "kelimelik-private.h"
+#include <string.h>
+
+// FNV-1a. Headers and interned strings are short, so there is no need for
+// anything fancier.
+uint32_t _kelimelik_hash(const void *bytes, uint16_t length) {
+	const uint8_t *cursor = bytes;
+	uint32_t hash = 2166136261u;
+	for (uint16_t i=0; i<length; i++) {
+		hash = (hash ^ cursor[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Returns the bucket that either contains the given header or is the empty
+// bucket where it should be inserted.
+static uint32_t *kelimelik_header_table_bucket(
+	struct kelimelik_header_table *self,
+	const uint8_t *bytes,
+	uint16_t length,
+	uint32_t hash
+) {
+	uint32_t mask = self->bucket_count - 1;
+	for (uint32_t i=hash & mask;; i=(i+1) & mask) {
+		uint32_t *bucket = &self->buckets[i];
+		if (!*bucket) {
+			return bucket;
+		}
+		uint32_t id = *bucket - 1;
+		if (
+			(self->names[id].hash == hash) &&
+			(self->names[id].length == length) &&
+			!memcmp(self->blob + self->names[id].offset, bytes, length)
+		) {
+			return bucket;
+		}
+	}
+}
+
+static kelimelik_error kelimelik_header_table_grow(struct kelimelik_header_table *self) {
+	uint32_t bucket_count = self->bucket_count ? (self->bucket_count * 2) : 64;
+	uint32_t *buckets = calloc(bucket_count, sizeof(*buckets));
+	if (!buckets) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	free(self->buckets);
+	self->buckets = buckets;
+	self->bucket_count = bucket_count;
+	for (uint32_t id=0; id<self->count; id++) {
+		*kelimelik_header_table_bucket(
+			self,
+			self->blob + self->names[id].offset,
+			self->names[id].length,
+			self->names[id].hash
+		) = id + 1;
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+bool _kelimelik_header_table_find(struct kelimelik_header_table *self, const void *bytes, uint16_t length, uint32_t *id) {
+	if (!self->count) {
+		return false;
+	}
+	uint32_t *bucket = kelimelik_header_table_bucket(
+		self,
+		bytes,
+		length,
+		_kelimelik_hash(bytes, length)
+	);
+	if (!*bucket) {
+		return false;
+	}
+	*id = *bucket - 1;
+	return true;
+}
+
+kelimelik_error _kelimelik_header_table_intern(struct kelimelik_header_table *self, const void *bytes, uint16_t length, uint32_t *id) {
+	// Keep the load factor under 50%
+	if ((self->count * 2) >= self->bucket_count) {
+		kelimelik_error error = kelimelik_header_table_grow(self);
+		if (KELIMELIK_IS_ERROR(error)) return error;
+	}
+	uint32_t hash = _kelimelik_hash(bytes, length);
+	uint32_t *bucket = kelimelik_header_table_bucket(self, bytes, length, hash);
+	if (*bucket) {
+		*id = *bucket - 1;
+		return _KELIMELIK_SUCCESS;
+	}
+
+	// New header, copy the name
+	if (self->count == self->names_capacity) {
+		uint32_t capacity = self->names_capacity ? (self->names_capacity * 2) : 32;
+		void *names = realloc(self->names, capacity * sizeof(*self->names));
+		if (!names) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		self->names = names;
+		self->names_capacity = capacity;
+	}
+	if ((self->blob_length + length) > self->blob_capacity) {
+		size_t capacity = self->blob_capacity ? self->blob_capacity : 1024;
+		while (capacity < (self->blob_length + length)) capacity *= 2;
+		uint8_t *blob = realloc(self->blob, capacity);
+		if (!blob) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		self->blob = blob;
+		self->blob_capacity = capacity;
+	}
+	memcpy(self->blob + self->blob_length, bytes, length);
+	self->names[self->count].offset = self->blob_length;
+	self->names[self->count].length = length;
+	self->names[self->count].hash = hash;
+	self->blob_length += length;
+	*id = self->count++;
+	*bucket = *id + 1;
+	return _KELIMELIK_SUCCESS;
+}
+
+const uint8_t *_kelimelik_header_table_name(struct kelimelik_header_table *self, uint32_t id, uint16_t *length) {
+	if (id >= self->count) {
+		return NULL;
+	}
+	*length = self->names[id].length;
+	return self->blob + self->names[id].offset;
+}
+
+void _kelimelik_header_table_destroy(struct kelimelik_header_table *self) {
+	free(self->buckets);
+	free(self->names);
+	free(self->blob);
+	memset(self, 0, sizeof(*self));
+}
@@ -0,0 +1,209 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <pthread.h>
+
+// Intern pools. Strings are spread over shards by the top bits of their hash
+// so that threads interning different strings rarely wait for each other.
+// Every shard is a chained hash table with its own lock. Each interned string
+// is stored right after its entry:
+//
+//   [kelimelik_interned][length][bytes]\0
+//
+// so the entry can be found from the string when it is released.
+
+#define KELIMELIK_INTERN_SHARD_BITS 4
+#define KELIMELIK_INTERN_SHARD_COUNT (1 << KELIMELIK_INTERN_SHARD_BITS)
+#define KELIMELIK_INTERN_MIN_BUCKETS 64
+
+struct kelimelik_interned {
+	struct kelimelik_interned *next;
+	struct kelimelik_intern_shard *shard;
+	uint32_t hash;
+
+	// Only drops to 0 with the shard locked, so a string that is being
+	// freed can't be found by kelimelik_intern_string() anymore.
+	uint32_t references;
+};
+
+struct kelimelik_intern_shard {
+	kelimelik_intern_pool *pool;
+	pthread_mutex_t mutex;
+	struct kelimelik_interned **buckets;
+	uint32_t bucket_count;
+	uint32_t count;
+};
+
+struct kelimelik_intern_pool {
+	const kelimelik_allocator *allocator;
+	struct kelimelik_intern_shard shards[KELIMELIK_INTERN_SHARD_COUNT];
+};
+
+static kelimelik_string *kelimelik_interned_string(struct kelimelik_interned *entry) {
+	return (kelimelik_string *)(entry + 1);
+}
+
+static struct kelimelik_interned *kelimelik_interned_entry(kelimelik_string *string) {
+	return (struct kelimelik_interned *)string - 1;
+}
+
+static size_t kelimelik_interned_size(uint16_t length) {
+	return sizeof(struct kelimelik_interned) + _KELIMELIK_INLINE_STRING_SIZE(length);
+}
+
+kelimelik_error kelimelik_intern_pool_new(kelimelik_intern_pool **out, const kelimelik_allocator *allocator) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_intern_pool *pool = _kelimelik_allocate(allocator, sizeof(*pool));
+	if (!pool) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	pool->allocator = allocator;
+	for (int i=0; i<KELIMELIK_INTERN_SHARD_COUNT; i++) {
+		struct kelimelik_intern_shard *shard = &pool->shards[i];
+		shard->pool = pool;
+		pthread_mutex_init(&shard->mutex, NULL);
+		shard->buckets = NULL;
+		shard->bucket_count = 0;
+		shard->count = 0;
+	}
+	*out = pool;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Must be called with the shard locked. Failing to grow is fine, the chains
+// just get longer.
+static void kelimelik_intern_shard_grow(struct kelimelik_intern_shard *self) {
+	uint32_t bucket_count = self->bucket_count ? (self->bucket_count * 2) : KELIMELIK_INTERN_MIN_BUCKETS;
+	struct kelimelik_interned **buckets = _kelimelik_allocate(self->pool->allocator, bucket_count * sizeof(*buckets));
+	if (!buckets) {
+		return;
+	}
+	memset(buckets, 0, bucket_count * sizeof(*buckets));
+	for (uint32_t i=0; i<self->bucket_count; i++) {
+		struct kelimelik_interned *entry = self->buckets[i];
+		while (entry) {
+			struct kelimelik_interned *next = entry->next;
+			struct kelimelik_interned **bucket = &buckets[entry->hash & (bucket_count - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+	_kelimelik_release(self->pool->allocator, self->buckets, self->bucket_count * sizeof(*buckets));
+	self->buckets = buckets;
+	self->bucket_count = bucket_count;
+}
+
+kelimelik_error kelimelik_intern_string(kelimelik_intern_pool *self, const void *bytes, uint16_t length, kelimelik_string **out) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!bytes && length) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	uint32_t hash = _kelimelik_hash(bytes, length);
+	struct kelimelik_intern_shard *shard = &self->shards[hash >> (32 - KELIMELIK_INTERN_SHARD_BITS)];
+	pthread_mutex_lock(&shard->mutex);
+	if (shard->bucket_count) {
+		struct kelimelik_interned *entry = shard->buckets[hash & (shard->bucket_count - 1)];
+		for (; entry; entry = entry->next) {
+			kelimelik_string *string = kelimelik_interned_string(entry);
+			if ((entry->hash == hash) && (string->length == length) && !memcmp(string->string, bytes, length)) {
+				__atomic_add_fetch(&entry->references, 1, __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&shard->mutex);
+				*out = string;
+				return _KELIMELIK_SUCCESS;
+			}
+		}
+	}
+
+	// Not interned yet
+	struct kelimelik_interned *entry = _kelimelik_allocate(self->allocator, kelimelik_interned_size(length));
+	if (!entry) {
+		pthread_mutex_unlock(&shard->mutex);
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	entry->shard = shard;
+	entry->hash = hash;
+	entry->references = 1;
+	kelimelik_string *string = kelimelik_interned_string(entry);
+	string->length = length;
+	memcpy((uint8_t *)string->string, bytes, length);
+	((uint8_t *)string->string)[length] = 0;
+	if ((shard->count + 1) > ((shard->bucket_count / 4) * 3)) {
+		kelimelik_intern_shard_grow(shard);
+	}
+	if (!shard->bucket_count) {
+		pthread_mutex_unlock(&shard->mutex);
+		_kelimelik_release(self->allocator, entry, kelimelik_interned_size(length));
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	struct kelimelik_interned **bucket = &shard->buckets[hash & (shard->bucket_count - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	shard->count++;
+	pthread_mutex_unlock(&shard->mutex);
+	*out = string;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_string *kelimelik_interned_retain(kelimelik_string *string) {
+	__atomic_add_fetch(&kelimelik_interned_entry(string)->references, 1, __ATOMIC_RELAXED);
+	return string;
+}
+
+// Must be called with the shard locked.
+static void kelimelik_intern_shard_remove(struct kelimelik_intern_shard *self, struct kelimelik_interned *entry) {
+	struct kelimelik_interned **link = &self->buckets[entry->hash & (self->bucket_count - 1)];
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+	self->count--;
+	_kelimelik_release(self->pool->allocator, entry, kelimelik_interned_size(kelimelik_interned_string(entry)->length));
+}
+
+void kelimelik_interned_release(kelimelik_string *string) {
+	struct kelimelik_interned *entry = kelimelik_interned_entry(string);
+
+	// References other than the last one are dropped without the lock
+	uint32_t references = __atomic_load_n(&entry->references, __ATOMIC_RELAXED);
+	while (references > 1) {
+		if (__atomic_compare_exchange_n(&entry->references, &references, references - 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+	struct kelimelik_intern_shard *shard = entry->shard;
+	pthread_mutex_lock(&shard->mutex);
+	if (!__atomic_sub_fetch(&entry->references, 1, __ATOMIC_ACQ_REL)) {
+		kelimelik_intern_shard_remove(shard, entry);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+size_t kelimelik_intern_pool_count(kelimelik_intern_pool *self) {
+	size_t count = 0;
+	for (int i=0; i<KELIMELIK_INTERN_SHARD_COUNT; i++) {
+		pthread_mutex_lock(&self->shards[i].mutex);
+		count += self->shards[i].count;
+		pthread_mutex_unlock(&self->shards[i].mutex);
+	}
+	return count;
+}
+
+void kelimelik_intern_pool_free(kelimelik_intern_pool *self) {
+	for (int i=0; i<KELIMELIK_INTERN_SHARD_COUNT; i++) {
+		struct kelimelik_intern_shard *shard = &self->shards[i];
+		if (shard->count) {
+			_kelimelik_log(KELIMELIK_LOG_WARNING, "Freeing an intern pool with %u strings that are still in use", shard->count);
+		}
+		for (uint32_t j=0; j<shard->bucket_count; j++) {
+			struct kelimelik_interned *entry = shard->buckets[j];
+			while (entry) {
+				struct kelimelik_interned *next = entry->next;
+				_kelimelik_release(self->allocator, entry, kelimelik_interned_size(kelimelik_interned_string(entry)->length));
+				entry = next;
+			}
+		}
+		_kelimelik_release(self->allocator, shard->buckets, shard->bucket_count * sizeof(*shard->buckets));
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	_kelimelik_release(self->allocator, self, sizeof(*self));
+}
@@ -0,0 +1,692 @@
+#include "kelimelik-private.h"
+#include <string.h>
+
+// Reads the JSON format written by kelimelik_packet_write_json_*() and
+// writes the packet straight into wire format in a single pass. Lengths and
+// counts that aren't known until the end of a value are written as
+// placeholders and filled in afterwards, so the only memory used is the
+// output buffer itself.
+//
+// Keys may appear in any order. A value that comes before its "type" or
+// "item_type" is skipped and parsed once the rest of its object has been
+// read. Unknown keys are skipped, and known keys may only appear once.
+
+#define KELIMELIK_JSON_MAX_DEPTH 64
+
+struct kelimelik_json_parser {
+	const uint8_t *start;
+	const uint8_t *cursor;
+	const uint8_t *end;
+	kelimelik_buffer *out;
+	kelimelik_error error;
+};
+
+static bool kelimelik_json_fail(struct kelimelik_json_parser *self) {
+	if (!KELIMELIK_IS_ERROR(self->error)) {
+		self->error = _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_JSON, (int)(self->cursor - self->start));
+	}
+	return false;
+}
+
+static void kelimelik_json_skip_whitespace(struct kelimelik_json_parser *self) {
+	while ((self->cursor < self->end) && (
+		(*self->cursor == ' ') ||
+		(*self->cursor == '\n') ||
+		(*self->cursor == '\r') ||
+		(*self->cursor == '\t')
+	)) {
+		self->cursor++;
+	}
+}
+
+// Skips whitespace and consumes the given character if it is next.
+static bool kelimelik_json_consume(struct kelimelik_json_parser *self, uint8_t c) {
+	kelimelik_json_skip_whitespace(self);
+	if ((self->cursor < self->end) && (*self->cursor == c)) {
+		self->cursor++;
+		return true;
+	}
+	return false;
+}
+
+static bool kelimelik_json_expect(struct kelimelik_json_parser *self, uint8_t c) {
+	return kelimelik_json_consume(self, c) || kelimelik_json_fail(self);
+}
+
+static bool kelimelik_json_write(struct kelimelik_json_parser *self, const void *bytes, size_t length) {
+	kelimelik_error error = kelimelik_buffer_append(self->out, bytes, length);
+	if (KELIMELIK_IS_ERROR(error)) {
+		self->error = error;
+		return false;
+	}
+	return true;
+}
+
+// Returns the raw contents of a string without decoding it. Used for keys and
+// type names, which never contain escapes. Strings that do contain escapes are
+// returned with a NULL pointer so that they never match anything.
+static bool kelimelik_json_raw_string(struct kelimelik_json_parser *self, const uint8_t **bytes, size_t *length) {
+	if (!kelimelik_json_expect(self, '"')) {
+		return false;
+	}
+	const uint8_t *start = self->cursor;
+	bool escaped = false;
+	while (self->cursor < self->end) {
+		uint8_t c = *(self->cursor++);
+		if (c == '"') {
+			*bytes = escaped ? NULL : start;
+			*length = self->cursor - start - 1;
+			return true;
+		}
+		else if (c == '\\') {
+			escaped = true;
+			self->cursor++;
+		}
+	}
+	return kelimelik_json_fail(self);
+}
+
+static bool kelimelik_json_raw_equals(const uint8_t *bytes, size_t length, const char *string) {
+	return bytes && (strlen(string) == length) && !memcmp(bytes, string, length);
+}
+
+static int kelimelik_json_hex(uint8_t c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+static bool kelimelik_json_parse_hex4(struct kelimelik_json_parser *self, uint32_t *value) {
+	if ((self->end - self->cursor) < 4) {
+		return kelimelik_json_fail(self);
+	}
+	*value = 0;
+	for (int i=0; i<4; i++) {
+		int digit = kelimelik_json_hex(*(self->cursor++));
+		if (digit == -1) {
+			return kelimelik_json_fail(self);
+		}
+		*value = (*value << 4) | digit;
+	}
+	return true;
+}
+
+// Decodes a string and appends its bytes to the output. Unescaped runs are
+// copied in one go.
+static bool kelimelik_json_parse_string(struct kelimelik_json_parser *self, size_t *length) {
+	if (!kelimelik_json_expect(self, '"')) {
+		return false;
+	}
+	size_t start_length = self->out->length;
+	const uint8_t *run = self->cursor;
+	while (self->cursor < self->end) {
+		uint8_t c = *self->cursor;
+		if ((c != '"') && (c != '\\')) {
+			if (c < 0x20) {
+				return kelimelik_json_fail(self);
+			}
+			self->cursor++;
+			continue;
+		}
+		if (!kelimelik_json_write(self, run, self->cursor - run)) {
+			return false;
+		}
+		self->cursor++;
+		if (c == '"') {
+			*length = self->out->length - start_length;
+			return true;
+		}
+
+		// Escape sequence
+		if (self->cursor == self->end) {
+			return kelimelik_json_fail(self);
+		}
+		uint8_t escaped;
+		switch (*(self->cursor++)) {
+			case '"': escaped = '"'; break;
+			case '\\': escaped = '\\'; break;
+			case '/': escaped = '/'; break;
+			case 'b': escaped = '\b'; break;
+			case 'f': escaped = '\f'; break;
+			case 'n': escaped = '\n'; break;
+			case 'r': escaped = '\r'; break;
+			case 't': escaped = '\t'; break;
+			case 'u': {
+				uint32_t code_point;
+				if (!kelimelik_json_parse_hex4(self, &code_point)) {
+					return false;
+				}
+				if ((code_point >= 0xD800) && (code_point <= 0xDBFF)) {
+					// High surrogate, must be followed by a low surrogate
+					uint32_t low;
+					if (
+						((self->end - self->cursor) < 2) ||
+						(self->cursor[0] != '\\') ||
+						(self->cursor[1] != 'u')
+					) {
+						return kelimelik_json_fail(self);
+					}
+					self->cursor += 2;
+					if (!kelimelik_json_parse_hex4(self, &low)) {
+						return false;
+					}
+					if ((low < 0xDC00) || (low > 0xDFFF)) {
+						return kelimelik_json_fail(self);
+					}
+					code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else if ((code_point >= 0xDC80) && (code_point <= 0xDCFF)) {
+					// A byte that wasn't valid UTF-8 in the original string
+					uint8_t byte = code_point - 0xDC00;
+					if (!kelimelik_json_write(self, &byte, 1)) {
+						return false;
+					}
+					run = self->cursor;
+					continue;
+				}
+				else if ((code_point >= 0xDC00) && (code_point <= 0xDFFF)) {
+					return kelimelik_json_fail(self);
+				}
+				uint8_t utf8[4];
+				size_t utf8_length;
+				if (code_point < 0x80) {
+					utf8[0] = code_point;
+					utf8_length = 1;
+				}
+				else if (code_point < 0x800) {
+					utf8[0] = 0xC0 | (code_point >> 6);
+					utf8[1] = 0x80 | (code_point & 0x3F);
+					utf8_length = 2;
+				}
+				else if (code_point < 0x10000) {
+					utf8[0] = 0xE0 | (code_point >> 12);
+					utf8[1] = 0x80 | ((code_point >> 6) & 0x3F);
+					utf8[2] = 0x80 | (code_point & 0x3F);
+					utf8_length = 3;
+				}
+				else {
+					utf8[0] = 0xF0 | (code_point >> 18);
+					utf8[1] = 0x80 | ((code_point >> 12) & 0x3F);
+					utf8[2] = 0x80 | ((code_point >> 6) & 0x3F);
+					utf8[3] = 0x80 | (code_point & 0x3F);
+					utf8_length = 4;
+				}
+				if (!kelimelik_json_write(self, utf8, utf8_length)) {
+					return false;
+				}
+				run = self->cursor;
+				continue;
+			}
+			default:
+				self->cursor--;
+				return kelimelik_json_fail(self);
+		}
+		if (!kelimelik_json_write(self, &escaped, 1)) {
+			return false;
+		}
+		run = self->cursor;
+	}
+	return kelimelik_json_fail(self);
+}
+
+static bool kelimelik_json_parse_uint(struct kelimelik_json_parser *self, uint64_t max, uint64_t *value) {
+	kelimelik_json_skip_whitespace(self);
+	const uint8_t *start = self->cursor;
+	*value = 0;
+	while ((self->cursor < self->end) && (*self->cursor >= '0') && (*self->cursor <= '9')) {
+		uint64_t digit = *self->cursor - '0';
+		if ((*value > (max / 10)) || ((*value * 10) > (max - digit))) {
+			return kelimelik_json_fail(self);
+		}
+		*value = (*value * 10) + digit;
+		self->cursor++;
+	}
+
+	// No digits, leading zeros, fractions and exponents are all invalid here
+	if (
+		(self->cursor == start) ||
+		((*start == '0') && ((self->cursor - start) > 1)) ||
+		((self->cursor < self->end) && ((*self->cursor == '.') || ((*self->cursor | 0x20) == 'e')))
+	) {
+		return kelimelik_json_fail(self);
+	}
+	return true;
+}
+
+static bool kelimelik_json_skip_digits(struct kelimelik_json_parser *self) {
+	const uint8_t *start = self->cursor;
+	while ((self->cursor < self->end) && (*self->cursor >= '0') && (*self->cursor <= '9')) {
+		self->cursor++;
+	}
+	return (self->cursor != start) || kelimelik_json_fail(self);
+}
+
+// Skips a number with an optional sign, fraction and exponent.
+static bool kelimelik_json_skip_number(struct kelimelik_json_parser *self) {
+	if ((self->cursor < self->end) && (*self->cursor == '-')) {
+		self->cursor++;
+	}
+	if ((self->cursor < self->end) && (*self->cursor == '0')) {
+		self->cursor++;
+	}
+	else if (!kelimelik_json_skip_digits(self)) {
+		return false;
+	}
+	if ((self->cursor < self->end) && (*self->cursor == '.')) {
+		self->cursor++;
+		if (!kelimelik_json_skip_digits(self)) {
+			return false;
+		}
+	}
+	if ((self->cursor < self->end) && ((*self->cursor | 0x20) == 'e')) {
+		self->cursor++;
+		if ((self->cursor < self->end) && ((*self->cursor == '+') || (*self->cursor == '-'))) {
+			self->cursor++;
+		}
+		if (!kelimelik_json_skip_digits(self)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool kelimelik_json_skip_literal(struct kelimelik_json_parser *self, const char *literal) {
+	size_t length = strlen(literal);
+	if (((size_t)(self->end - self->cursor) < length) || memcmp(self->cursor, literal, length)) {
+		return kelimelik_json_fail(self);
+	}
+	self->cursor += length;
+	return true;
+}
+
+// Skips any value, used for unknown keys.
+static bool kelimelik_json_skip_value(struct kelimelik_json_parser *self, int depth) {
+	if (depth > KELIMELIK_JSON_MAX_DEPTH) {
+		return kelimelik_json_fail(self);
+	}
+	kelimelik_json_skip_whitespace(self);
+	if (self->cursor == self->end) {
+		return kelimelik_json_fail(self);
+	}
+	const uint8_t *bytes;
+	size_t length;
+	switch (*self->cursor) {
+		case '"':
+			return kelimelik_json_raw_string(self, &bytes, &length);
+		case '[':
+			self->cursor++;
+			if (kelimelik_json_consume(self, ']')) {
+				return true;
+			}
+			do {
+				if (!kelimelik_json_skip_value(self, depth + 1)) {
+					return false;
+				}
+			} while (kelimelik_json_consume(self, ','));
+			return kelimelik_json_expect(self, ']');
+		case '{':
+			self->cursor++;
+			if (kelimelik_json_consume(self, '}')) {
+				return true;
+			}
+			do {
+				if (
+					!kelimelik_json_raw_string(self, &bytes, &length) ||
+					!kelimelik_json_expect(self, ':') ||
+					!kelimelik_json_skip_value(self, depth + 1)
+				) {
+					return false;
+				}
+			} while (kelimelik_json_consume(self, ','));
+			return kelimelik_json_expect(self, '}');
+		case 't':
+			return kelimelik_json_skip_literal(self, "true");
+		case 'f':
+			return kelimelik_json_skip_literal(self, "false");
+		case 'n':
+			return kelimelik_json_skip_literal(self, "null");
+		default:
+			return kelimelik_json_skip_number(self);
+	}
+}
+
+static bool kelimelik_json_parse_type(struct kelimelik_json_parser *self, enum kelimelik_object_type *type) {
+	static const enum kelimelik_object_type types[] = {
+		KELIMELIK_OBJECT_UINT8,
+		KELIMELIK_OBJECT_UINT32,
+		KELIMELIK_OBJECT_UINT64,
+		KELIMELIK_OBJECT_STRING,
+		KELIMELIK_OBJECT_ARRAY
+	};
+	const uint8_t *bytes;
+	size_t length;
+	if (!kelimelik_json_raw_string(self, &bytes, &length)) {
+		return false;
+	}
+	for (size_t i=0; i<(sizeof(types) / sizeof(*types)); i++) {
+		if (kelimelik_json_raw_equals(bytes, length, _kelimelik_json_type_name(types[i]))) {
+			*type = types[i];
+			return true;
+		}
+	}
+	self->cursor -= length + 1;
+	self->error = _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
+	return false;
+}
+
+// Writes a single value of the given type. Used for both objects and array
+// items. Arrays can't contain arrays.
+static bool kelimelik_json_parse_scalar(struct kelimelik_json_parser *self, enum kelimelik_object_type type) {
+	uint64_t value;
+	switch (type) {
+		case KELIMELIK_OBJECT_UINT8: {
+			if (!kelimelik_json_parse_uint(self, UINT8_MAX, &value)) {
+				return false;
+			}
+			uint8_t encoded = value;
+			return kelimelik_json_write(self, &encoded, sizeof(encoded));
+		}
+		case KELIMELIK_OBJECT_UINT32: {
+			if (!kelimelik_json_parse_uint(self, UINT32_MAX, &value)) {
+				return false;
+			}
+			uint32_t encoded = htonl(value);
+			return kelimelik_json_write(self, &encoded, sizeof(encoded));
+		}
+		case KELIMELIK_OBJECT_UINT64: {
+			if (!kelimelik_json_parse_uint(self, UINT64_MAX, &value)) {
+				return false;
+			}
+			uint64_t encoded = htonll(value);
+			return kelimelik_json_write(self, &encoded, sizeof(encoded));
+		}
+		case KELIMELIK_OBJECT_STRING: {
+			// Length placeholder
+			uint16_t encoded = 0;
+			size_t offset = self->out->length;
+			size_t length;
+			if (
+				!kelimelik_json_write(self, &encoded, sizeof(encoded)) ||
+				!kelimelik_json_parse_string(self, &length)
+			) {
+				return false;
+			}
+			if (length > 0xFFFF) {
+				return kelimelik_json_fail(self);
+			}
+			encoded = htons(length);
+			memcpy(self->out->bytes + offset, &encoded, sizeof(encoded));
+			return true;
+		}
+		default:
+			self->error = _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
+			return false;
+	}
+}
+
+static bool kelimelik_json_parse_array(struct kelimelik_json_parser *self, enum kelimelik_object_type item_type) {
+	// Item count placeholder followed by the item type
+	uint8_t array_header[5] = { 0, 0, 0, 0, item_type };
+	size_t offset = self->out->length;
+	if (
+		!kelimelik_json_write(self, array_header, sizeof(array_header)) ||
+		!kelimelik_json_expect(self, '[')
+	) {
+		return false;
+	}
+	uint64_t count = 0;
+	if (!kelimelik_json_consume(self, ']')) {
+		do {
+			if ((count == UINT32_MAX) || !kelimelik_json_parse_scalar(self, item_type)) {
+				return kelimelik_json_fail(self);
+			}
+			count++;
+		} while (kelimelik_json_consume(self, ','));
+		if (!kelimelik_json_expect(self, ']')) {
+			return false;
+		}
+	}
+	uint32_t encoded = htonl(count);
+	memcpy(self->out->bytes + offset, &encoded, sizeof(encoded));
+	return true;
+}
+
+// Writes the type byte and the value of an object.
+static bool kelimelik_json_parse_typed_value(
+	struct kelimelik_json_parser *self,
+	enum kelimelik_object_type type,
+	enum kelimelik_object_type item_type
+) {
+	if (type == KELIMELIK_OBJECT_UNSPECIFIED) {
+		return kelimelik_json_fail(self);
+	}
+	uint8_t encoded_type = type;
+	if (!kelimelik_json_write(self, &encoded_type, sizeof(encoded_type))) {
+		return false;
+	}
+	if (type == KELIMELIK_OBJECT_ARRAY) {
+		if ((item_type == KELIMELIK_OBJECT_UNSPECIFIED) || (item_type == KELIMELIK_OBJECT_ARRAY)) {
+			return kelimelik_json_fail(self);
+		}
+		return kelimelik_json_parse_array(self, item_type);
+	}
+	return kelimelik_json_parse_scalar(self, type);
+}
+
+// Parses {"type": ..., "item_type": ..., "value": ...}. The value is parsed
+// right away if the types are already known. Otherwise it is skipped and
+// parsed once the object is closed.
+static bool kelimelik_json_parse_object(struct kelimelik_json_parser *self) {
+	enum kelimelik_object_type type = KELIMELIK_OBJECT_UNSPECIFIED;
+	enum kelimelik_object_type item_type = KELIMELIK_OBJECT_UNSPECIFIED;
+	bool has_value = false;
+	const uint8_t *deferred_value = NULL;
+	if (!kelimelik_json_expect(self, '{')) {
+		return false;
+	}
+	if (!kelimelik_json_consume(self, '}')) do {
+		const uint8_t *key;
+		size_t key_length;
+		if (!kelimelik_json_raw_string(self, &key, &key_length) || !kelimelik_json_expect(self, ':')) {
+			return false;
+		}
+		if (kelimelik_json_raw_equals(key, key_length, "type")) {
+			// The type can't change after the value was written
+			if ((type != KELIMELIK_OBJECT_UNSPECIFIED) || !kelimelik_json_parse_type(self, &type)) {
+				return kelimelik_json_fail(self);
+			}
+		}
+		else if (kelimelik_json_raw_equals(key, key_length, "item_type")) {
+			if ((item_type != KELIMELIK_OBJECT_UNSPECIFIED) || !kelimelik_json_parse_type(self, &item_type)) {
+				return kelimelik_json_fail(self);
+			}
+		}
+		else if (kelimelik_json_raw_equals(key, key_length, "value")) {
+			if (has_value) {
+				return kelimelik_json_fail(self);
+			}
+			has_value = true;
+			if (
+				(type == KELIMELIK_OBJECT_UNSPECIFIED) ||
+				((type == KELIMELIK_OBJECT_ARRAY) && (item_type == KELIMELIK_OBJECT_UNSPECIFIED))
+			) {
+				kelimelik_json_skip_whitespace(self);
+				deferred_value = self->cursor;
+				if (!kelimelik_json_skip_value(self, 0)) {
+					return false;
+				}
+			}
+			else if (!kelimelik_json_parse_typed_value(self, type, item_type)) {
+				return false;
+			}
+		}
+		else if (!kelimelik_json_skip_value(self, 0)) {
+			return false;
+		}
+	} while (kelimelik_json_consume(self, ','));
+	if (!kelimelik_json_expect(self, '}') || !(has_value || kelimelik_json_fail(self))) {
+		return false;
+	}
+	if (deferred_value) {
+		const uint8_t *object_end = self->cursor;
+		self->cursor = deferred_value;
+		if (!kelimelik_json_parse_typed_value(self, type, item_type)) {
+			return false;
+		}
+		self->cursor = object_end;
+	}
+	return true;
+}
+
+static bool kelimelik_json_parse_data(struct kelimelik_json_parser *self, uint8_t *object_count) {
+	if (!kelimelik_json_expect(self, '[')) {
+		return false;
+	}
+	*object_count = 0;
+	if (kelimelik_json_consume(self, ']')) {
+		return true;
+	}
+	do {
+		// The object count is transmitted as a single byte
+		if ((*object_count == UINT8_MAX) || !kelimelik_json_parse_object(self)) {
+			return kelimelik_json_fail(self);
+		}
+		(*object_count)++;
+	} while (kelimelik_json_consume(self, ','));
+	return kelimelik_json_expect(self, ']');
+}
+
+// Swaps bytes[0..first_length] with the bytes after it without allocating,
+// by reversing both parts and then the whole range.
+static void kelimelik_json_reverse(uint8_t *bytes, size_t length) {
+	for (size_t i=0; i<(length / 2); i++) {
+		uint8_t byte = bytes[i];
+		bytes[i] = bytes[length - i - 1];
+		bytes[length - i - 1] = byte;
+	}
+}
+
+static void kelimelik_json_rotate(uint8_t *bytes, size_t first_length, size_t second_length) {
+	kelimelik_json_reverse(bytes, first_length);
+	kelimelik_json_reverse(bytes + first_length, second_length);
+	kelimelik_json_reverse(bytes, first_length + second_length);
+}
+
+// Parses the top level object. The output is laid out as
+//
+//   size (4), header length (2), header, object count (1), objects
+//
+// If "data" comes before "header", the objects are moved once the header is
+// known.
+static bool kelimelik_json_parse_packet(struct kelimelik_json_parser *self) {
+	size_t frame_offset = self->out->length;
+	uint8_t placeholder[6] = { 0 };
+	if (!kelimelik_json_write(self, placeholder, sizeof(placeholder)) || !kelimelik_json_expect(self, '{')) {
+		return false;
+	}
+	bool has_header = false, has_data = false;
+	uint8_t object_count = 0;
+	size_t data_offset = 0;
+	if (!kelimelik_json_consume(self, '}')) do {
+		const uint8_t *key;
+		size_t key_length;
+		if (!kelimelik_json_raw_string(self, &key, &key_length) || !kelimelik_json_expect(self, ':')) {
+			return false;
+		}
+		if (kelimelik_json_raw_equals(key, key_length, "header")) {
+			if (has_header) {
+				return kelimelik_json_fail(self);
+			}
+			size_t header_offset = self->out->length;
+			size_t header_length;
+			if (!kelimelik_json_parse_string(self, &header_length)) {
+				return false;
+			}
+			if (header_length > 0xFFFF) {
+				return kelimelik_json_fail(self);
+			}
+			if (has_data) {
+				// Move the header (and the object count) in front of the objects
+				size_t data_length = header_offset - data_offset;
+				size_t moved_length = header_length + 1;
+				if (!kelimelik_json_write(self, &object_count, 1)) {
+					return false;
+				}
+				kelimelik_json_rotate(self->out->bytes + data_offset, data_length, moved_length);
+			}
+			uint16_t encoded = htons(header_length);
+			memcpy(self->out->bytes + frame_offset + 4, &encoded, sizeof(encoded));
+			has_header = true;
+		}
+		else if (kelimelik_json_raw_equals(key, key_length, "data")) {
+			if (has_data) {
+				return kelimelik_json_fail(self);
+			}
+			if (has_header && !kelimelik_json_write(self, &object_count, 1)) {
+				return false;
+			}
+			data_offset = self->out->length;
+			size_t count_offset = data_offset - 1;
+			if (!kelimelik_json_parse_data(self, &object_count)) {
+				return false;
+			}
+			if (has_header) {
+				self->out->bytes[count_offset] = object_count;
+			}
+			has_data = true;
+		}
+		else if (!kelimelik_json_skip_value(self, 0)) {
+			return false;
+		}
+	} while (kelimelik_json_consume(self, ','));
+	if (!kelimelik_json_expect(self, '}')) {
+		return false;
+	}
+	if (!has_header) {
+		return kelimelik_json_fail(self);
+	}
+	if (!has_data && !kelimelik_json_write(self, &object_count, 1)) {
+		return false;
+	}
+	size_t frame_length = self->out->length - frame_offset;
+	if ((frame_length - 4) > UINT32_MAX) {
+		return kelimelik_json_fail(self);
+	}
+	uint32_t encoded = htonl(frame_length - 4);
+	memcpy(self->out->bytes + frame_offset, &encoded, sizeof(encoded));
+
+	// Only whitespace may follow
+	kelimelik_json_skip_whitespace(self);
+	return (self->cursor == self->end) || kelimelik_json_fail(self);
+}
+
+kelimelik_error kelimelik_json_to_wire(const char *json, size_t length, kelimelik_buffer *buffer) {
+	if (!json) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!buffer) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	size_t original_length = buffer->length;
+	struct kelimelik_json_parser parser = {
+		.start = (const uint8_t *)json,
+		.cursor = (const uint8_t *)json,
+		.end = (const uint8_t *)json + length,
+		.out = buffer,
+		.error = _KELIMELIK_SUCCESS
+	};
+	if (!kelimelik_json_parse_packet(&parser)) {
+		// Don't leave a partial frame in the buffer
+		buffer->length = original_length;
+		return parser.error;
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_new_v3(kelimelik_packet **out, const char *json, size_t length) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	kelimelik_error error = kelimelik_json_to_wire(json, length, &buffer);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_parser_decode(buffer.bytes, buffer.length, out);
+	}
+	kelimelik_buffer_free(&buffer);
+	return error;
+}
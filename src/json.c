@@ -0,0 +1,368 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <unistd.h>
+
+// Packets are described using the following JSON format. Every object has a
+// type and a value, and arrays additionally have an item type.
+//
+//   {
+//     "header": "GameModule_requestLogin",
+//     "data": [
+//       {"type": "uint32", "value": 1234},
+//       {"type": "string", "value": "password"},
+//       {"type": "array", "item_type": "uint8", "value": [1, 2, 3]}
+//     ]
+//   }
+//
+// Output is written in a single pass. Everything goes through a small output
+// window that either points into a kelimelik_buffer or into a fixed chunk
+// that is flushed to a FILE or a file descriptor when it fills up, so the
+// cost is linear in the size of the output.
+
+#define KELIMELIK_JSON_CHUNK_SIZE 8192
+
+struct kelimelik_json_output {
+	// Target buffer. If this is NULL, the output is streamed to either file
+	// or fd through chunk.
+	kelimelik_buffer *buffer;
+	FILE *file;
+	int fd;
+	uint8_t *cursor;
+	uint8_t *end;
+	kelimelik_error error;
+	uint8_t chunk[KELIMELIK_JSON_CHUNK_SIZE];
+};
+
+const char *_kelimelik_json_type_name(enum kelimelik_object_type type) {
+	switch (type) {
+		case KELIMELIK_OBJECT_UINT8:
+			return "uint8";
+		case KELIMELIK_OBJECT_UINT32:
+			return "uint32";
+		case KELIMELIK_OBJECT_UINT64:
+			return "uint64";
+		case KELIMELIK_OBJECT_STRING:
+			return "string";
+		case KELIMELIK_OBJECT_ARRAY:
+			return "array";
+		case KELIMELIK_OBJECT_UNSPECIFIED:
+			return "unspecified";
+		default:
+			return "unknown";
+	}
+}
+
+static void kelimelik_json_flush(struct kelimelik_json_output *out) {
+	if (out->buffer) {
+		out->buffer->length = out->cursor - out->buffer->bytes;
+		return;
+	}
+	uint8_t *bytes = out->chunk;
+	size_t length = out->cursor - out->chunk;
+	if (out->file) {
+		if (length && (fwrite(bytes, 1, length, out->file) != length)) {
+			out->error = _KELIMELIK_ERROR_SYSCALL(fwrite);
+		}
+	}
+	else while (length) {
+		ssize_t written = write(out->fd, bytes, length);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			out->error = _KELIMELIK_ERROR_SYSCALL(write);
+			break;
+		}
+		bytes += written;
+		length -= written;
+	}
+	out->cursor = out->chunk;
+}
+
+// Makes sure that at least length bytes can be written at out->cursor. For
+// streamed output, length must not be bigger than KELIMELIK_JSON_CHUNK_SIZE.
+static bool kelimelik_json_reserve(struct kelimelik_json_output *out, size_t length) {
+	if (KELIMELIK_IS_ERROR(out->error)) {
+		return false;
+	}
+	if ((size_t)(out->end - out->cursor) >= length) {
+		return true;
+	}
+	kelimelik_json_flush(out);
+	if (out->buffer) {
+		out->error = kelimelik_buffer_reserve(out->buffer, length);
+		out->cursor = out->buffer->bytes + out->buffer->length;
+		out->end = out->buffer->bytes + out->buffer->capacity;
+	}
+	return !KELIMELIK_IS_ERROR(out->error);
+}
+
+static void kelimelik_json_write(struct kelimelik_json_output *out, const void *bytes, size_t length) {
+	while (length) {
+		size_t part = (out->buffer || (length < KELIMELIK_JSON_CHUNK_SIZE)) ? length : KELIMELIK_JSON_CHUNK_SIZE;
+		if (!kelimelik_json_reserve(out, part)) {
+			return;
+		}
+		memcpy(out->cursor, bytes, part);
+		out->cursor += part;
+		bytes = (const uint8_t *)bytes + part;
+		length -= part;
+	}
+}
+
+#define kelimelik_json_literal(out, literal) kelimelik_json_write(out, literal, sizeof(literal) - 1)
+
+static void kelimelik_json_write_uint(struct kelimelik_json_output *out, uint64_t value) {
+	uint8_t digits[20];
+	int i = sizeof(digits);
+	do {
+		digits[--i] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+	kelimelik_json_write(out, digits + i, sizeof(digits) - i);
+}
+
+// Returns the length of the UTF-8 sequence at the start of the bytes, or 0
+// if it isn't a valid one. Overlong forms, surrogates and code points past
+// U+10FFFF are invalid.
+static size_t kelimelik_json_utf8_length(const uint8_t *bytes, size_t length) {
+	uint8_t byte = bytes[0];
+	size_t sequence_length;
+	uint8_t min = 0x80, max = 0xBF;
+	if ((byte >= 0xC2) && (byte <= 0xDF)) sequence_length = 2;
+	else if ((byte >= 0xE0) && (byte <= 0xEF)) {
+		sequence_length = 3;
+		if (byte == 0xE0) min = 0xA0;
+		else if (byte == 0xED) max = 0x9F;
+	}
+	else if ((byte >= 0xF0) && (byte <= 0xF4)) {
+		sequence_length = 4;
+		if (byte == 0xF0) min = 0x90;
+		else if (byte == 0xF4) max = 0x8F;
+	}
+	else return 0;
+	if (length < sequence_length) return 0;
+	if ((bytes[1] < min) || (bytes[1] > max)) return 0;
+	for (size_t i=2; i<sequence_length; i++) {
+		if ((bytes[i] & 0xC0) != 0x80) return 0;
+	}
+	return sequence_length;
+}
+
+// Writes a quoted and escaped string. Valid UTF-8 is written as it is. Every
+// byte that isn't part of a valid sequence is written as a lone low surrogate
+// from \udc80 to \udcff, which the JSON parser turns back into the byte.
+static void kelimelik_json_write_string(struct kelimelik_json_output *out, const uint8_t *bytes, size_t length) {
+	static const char hex[] = "0123456789abcdef";
+	kelimelik_json_literal(out, "\"");
+	size_t start = 0;
+	for (size_t i=0; i<length; i++) {
+		uint8_t byte = bytes[i];
+		if (byte >= 0x80) {
+			size_t sequence_length = kelimelik_json_utf8_length(bytes + i, length - i);
+			if (sequence_length) {
+				i += sequence_length - 1;
+				continue;
+			}
+		}
+		else if ((byte >= 0x20) && (byte != '"') && (byte != '\\')) {
+			continue;
+		}
+
+		// Write everything before this byte as it is, then escape it
+		kelimelik_json_write(out, bytes + start, i - start);
+		start = i + 1;
+		if (!kelimelik_json_reserve(out, 6)) {
+			return;
+		}
+		*(out->cursor++) = '\\';
+		switch (byte) {
+			case '"': *(out->cursor++) = '"'; break;
+			case '\\': *(out->cursor++) = '\\'; break;
+			case '\b': *(out->cursor++) = 'b'; break;
+			case '\f': *(out->cursor++) = 'f'; break;
+			case '\n': *(out->cursor++) = 'n'; break;
+			case '\r': *(out->cursor++) = 'r'; break;
+			case '\t': *(out->cursor++) = 't'; break;
+			default:
+				*(out->cursor++) = 'u';
+				*(out->cursor++) = (byte >= 0x80) ? 'd' : '0';
+				*(out->cursor++) = (byte >= 0x80) ? 'c' : '0';
+				*(out->cursor++) = hex[byte >> 4];
+				*(out->cursor++) = hex[byte & 0xF];
+				break;
+		}
+	}
+	kelimelik_json_write(out, bytes + start, length - start);
+	kelimelik_json_literal(out, "\"");
+}
+
+static void kelimelik_json_write_type(struct kelimelik_json_output *out, enum kelimelik_object_type type) {
+	const char *name = _kelimelik_json_type_name(type);
+	kelimelik_json_write_string(out, (const uint8_t *)name, strlen(name));
+}
+
+static void kelimelik_json_write_array(struct kelimelik_json_output *out, kelimelik_array *array, bool pretty) {
+	if (!array->item_count) {
+		kelimelik_json_literal(out, "[]");
+		return;
+	}
+	kelimelik_json_literal(out, "[");
+	for (uint64_t i=0; i<array->item_count; i++) {
+		if (i) {
+			kelimelik_json_literal(out, ",");
+		}
+		if (pretty) {
+			kelimelik_json_literal(out, "\n      ");
+		}
+		switch (array->type) {
+			case KELIMELIK_OBJECT_UINT64:
+				kelimelik_json_write_uint(out, array->uint64s[i]);
+				break;
+			case KELIMELIK_OBJECT_UINT32:
+				kelimelik_json_write_uint(out, array->uint32s[i]);
+				break;
+			case KELIMELIK_OBJECT_UINT8:
+				kelimelik_json_write_uint(out, array->uint8s[i]);
+				break;
+			case KELIMELIK_OBJECT_STRING:
+				kelimelik_json_write_string(out, array->strings[i]->string, array->strings[i]->length);
+				break;
+			default:
+				kelimelik_json_literal(out, "null");
+				break;
+		}
+	}
+	if (pretty) {
+		kelimelik_json_literal(out, "\n    ");
+	}
+	kelimelik_json_literal(out, "]");
+}
+
+static kelimelik_error kelimelik_json_write_packet(struct kelimelik_json_output *out, kelimelik_packet *self, int flags) {
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	bool pretty = (flags & KELIMELIK_JSON_PRETTY);
+	if (pretty) {
+		kelimelik_json_literal(out, "{\n  \"header\": ");
+	}
+	else {
+		kelimelik_json_literal(out, "{\"header\":");
+	}
+	kelimelik_json_write_string(out, self->header->string, self->header->length);
+	if (pretty) {
+		kelimelik_json_literal(out, ",\n  \"data\": [");
+	}
+	else {
+		kelimelik_json_literal(out, ",\"data\":[");
+	}
+	for (uint16_t i=0; i<self->object_count; i++) {
+		kelimelik_object *object = &self->objects[i];
+		if (i) {
+			kelimelik_json_literal(out, ",");
+		}
+		if (pretty) {
+			kelimelik_json_literal(out, "\n    {\"type\": ");
+		}
+		else {
+			kelimelik_json_literal(out, "{\"type\":");
+		}
+		kelimelik_json_write_type(out, object->type);
+		if (object->type == KELIMELIK_OBJECT_ARRAY) {
+			if (pretty) {
+				kelimelik_json_literal(out, ", \"item_type\": ");
+			}
+			else {
+				kelimelik_json_literal(out, ",\"item_type\":");
+			}
+			kelimelik_json_write_type(out, object->array->type);
+		}
+		if (pretty) {
+			kelimelik_json_literal(out, ", \"value\": ");
+		}
+		else {
+			kelimelik_json_literal(out, ",\"value\":");
+		}
+		switch (object->type) {
+			case KELIMELIK_OBJECT_UINT64:
+				kelimelik_json_write_uint(out, object->uint64);
+				break;
+			case KELIMELIK_OBJECT_UINT32:
+				kelimelik_json_write_uint(out, object->uint32);
+				break;
+			case KELIMELIK_OBJECT_UINT8:
+				kelimelik_json_write_uint(out, object->uint8);
+				break;
+			case KELIMELIK_OBJECT_STRING:
+				kelimelik_json_write_string(out, object->string->string, object->string->length);
+				break;
+			case KELIMELIK_OBJECT_ARRAY:
+				kelimelik_json_write_array(out, object->array, pretty);
+				break;
+			default:
+				kelimelik_json_literal(out, "null");
+				break;
+		}
+		kelimelik_json_literal(out, "}");
+	}
+	if (pretty) {
+		kelimelik_json_literal(out, self->object_count ? "\n  ]\n}" : "]\n}");
+	}
+	else {
+		kelimelik_json_literal(out, "]}");
+	}
+	if (!KELIMELIK_IS_ERROR(out->error)) {
+		kelimelik_json_flush(out);
+	}
+	return out->error;
+}
+
+kelimelik_error kelimelik_packet_write_json_v1(kelimelik_packet *self, kelimelik_buffer *buffer, int flags) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!buffer) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+
+	struct kelimelik_json_output out;
+	out.buffer = buffer;
+	out.cursor = buffer->bytes + buffer->length;
+	out.end = buffer->bytes + buffer->capacity;
+	out.error = _KELIMELIK_SUCCESS;
+	return kelimelik_json_write_packet(&out, self, flags);
+}
+
+kelimelik_error kelimelik_packet_write_json_v2(kelimelik_packet *self, FILE *file, int flags) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!file) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	struct kelimelik_json_output out;
+	out.buffer = NULL;
+	out.file = file;
+	out.cursor = out.chunk;
+	out.end = out.chunk + sizeof(out.chunk);
+	out.error = _KELIMELIK_SUCCESS;
+	return kelimelik_json_write_packet(&out, self, flags);
+}
+
+kelimelik_error kelimelik_packet_write_json_v3(kelimelik_packet *self, int fd, int flags) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (fd < 0) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	struct kelimelik_json_output out;
+	out.buffer = NULL;
+	out.file = NULL;
+	out.fd = fd;
+	out.cursor = out.chunk;
+	out.end = out.chunk + sizeof(out.chunk);
+	out.error = _KELIMELIK_SUCCESS;
+	return kelimelik_json_write_packet(&out, self, flags);
+}
+
+char *kelimelik_packet_description(kelimelik_packet *self) {
+	// The description is freed with free()
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	buffer.allocator = &kelimelik_default_allocator;
+	kelimelik_error error = kelimelik_packet_write_json_v1(self, &buffer, KELIMELIK_JSON_PRETTY);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_buffer_append(&buffer, "", 1);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		kelimelik_buffer_free(&buffer);
+		return NULL;
+	}
+	return (char *)buffer.bytes;
+}
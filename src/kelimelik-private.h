@@ -3,12 +3,13 @@
 
 #include <kelimelik.h>
 #include <errno.h>
+#include <arpa/inet.h>
 
 #ifndef htonll
 #if __BIG_ENDIAN__
 #define htonll(x) (x)
 #else
-#define htonll(x) ((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
+#define htonll(x) (((uint64_t)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
 #endif
 #define ntohll(x) htonll(x)
 #endif
@@ -26,19 +27,165 @@
 #define _KELIMELIK_CONCAT_2(x,y) x##y
 #define _KELIMELIK_ERROR_INVALID_ARGUMENT(x) _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_ARGUMENT, x)
 #define _KELIMELIK_ERROR_NOT_IMPLEMENTED _KELIMELIK_ERROR(KELIMELIK_ERROR_NOT_IMPLEMENTED, 0)
+#define _KELIMELIK_ERROR_FROZEN _KELIMELIK_ERROR(KELIMELIK_ERROR_FROZEN, 0)
 #define _KELIMELIK_ERROR_SYSCALL(x) _KELIMELIK_ERROR((_KELIMELIK_CONCAT_2(KELIMELIK_ERROR_, x)), errno)
 
 struct kelimelik_parser {
 	enum {
 		KELIMELIK_PARSER_WAITING_FOR_SIZE = 0,
-		KELIMELIK_PARSER_WAITING_FOR_DATA = 1
+		KELIMELIK_PARSER_WAITING_FOR_DATA = 1,
+		KELIMELIK_PARSER_STREAMING = 2,
+
+		// Skipping a frame that exceeds a limit. bytes_remaining bytes of
+		// it are left.
+		KELIMELIK_PARSER_SKIPPING = 3
 	} state;
 	uint8_t *packet_buffer;
 	uint8_t packet_size_buffer[4];
 	uint32_t bytes_remaining;
 	uint32_t index;
+	// packet_count is the capacity of packets, and the first packets_used
+	// items are the packets returned by the last call.
 	size_t packet_count;
+	size_t packets_used;
 	kelimelik_packet **packets;
+
+	// Used in framing-only mode. frame_buffer is the frame that was copied
+	// by the previous call, if there was one.
+	size_t frame_capacity;
+	kelimelik_frame *frames;
+	uint8_t *frame_buffer;
+
+	// Only set if a stream handler was set.
+	struct kelimelik_parser_stream *stream;
+
+	kelimelik_parser_limits limits;
+	kelimelik_parser_stats stats;
+	kelimelik_parser_group *group;
+	kelimelik_intern_pool *intern_pool;
+
+	// Bytes of frame buffers held by the parser, counted against the limits.
+	size_t buffered_bytes;
+
+	const kelimelik_allocator *allocator;
+	int options;
 };
 
+kelimelik_error kelimelik_parser_decode(
+	uint8_t *bytes,
+	size_t bytes_length,
+	kelimelik_packet **new_packet
+);
+
+// Same as kelimelik_parser_decode(), but the packet is created with the given
+// allocator. options are parser options, only KELIMELIK_PARSER_LAZY and
+// KELIMELIK_PARSER_TRUSTED are used. Lazy packets only get their header
+// decoded; the caller has to hand the frame over to the packet as its wire
+// bytes. Arrays with more than max_array_items items are rejected, 0 means no
+// limit.
+kelimelik_error _kelimelik_parser_decode(
+	const kelimelik_allocator *allocator,
+	uint8_t *bytes,
+	size_t bytes_length,
+	int options,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	kelimelik_packet **new_packet
+);
+
+// Creates an array from items in wire format. string_blob_size is the space
+// needed to pack the strings of a string array, see
+// _kelimelik_packed_string_array_new(). If intern_pool is set, the strings
+// are interned instead and string_blob_size is ignored.
+kelimelik_error _kelimelik_parser_decode_array(
+	const kelimelik_allocator *allocator,
+	kelimelik_array **out,
+	enum kelimelik_object_type item_type,
+	uint32_t count,
+	uint8_t *bytes,
+	size_t bytes_length,
+	size_t string_blob_size,
+	kelimelik_intern_pool *intern_pool
+);
+
+// Streaming decoder, see stream.c. Once a frame is being streamed, every
+// byte of it goes to _kelimelik_parser_stream(), which puts the parser back
+// into KELIMELIK_PARSER_WAITING_FOR_SIZE at the end of the frame.
+bool _kelimelik_parser_should_stream(kelimelik_parser *self, uint32_t packet_size);
+void _kelimelik_parser_stream_begin(kelimelik_parser *self, uint32_t packet_size);
+void _kelimelik_parser_stream(kelimelik_parser *self, uint8_t **bytes, size_t *bytes_length);
+void _kelimelik_parser_stream_free(kelimelik_parser *self);
+
+// Counts a limit being hit and returns the matching error.
+kelimelik_error _kelimelik_parser_limit_exceeded(kelimelik_parser *self, enum kelimelik_limit limit);
+
+// Allocation helpers. A NULL allocator means the global allocator.
+const kelimelik_allocator *_kelimelik_allocator(const kelimelik_allocator *allocator);
+void *_kelimelik_allocate(const kelimelik_allocator *allocator, size_t size);
+void *_kelimelik_reallocate(const kelimelik_allocator *allocator, void *pointer, size_t old_size, size_t new_size);
+void _kelimelik_release(const kelimelik_allocator *allocator, void *pointer, size_t size);
+
+// Variants of the public constructors and destructors that take the
+// allocator to use.
+void _kelimelik_string_free(const kelimelik_allocator *allocator, kelimelik_string *string);
+kelimelik_error _kelimelik_array_new(const kelimelik_allocator *allocator, kelimelik_array **out, enum kelimelik_object_type type, const void *values, const size_t size);
+kelimelik_error _kelimelik_array_free(const kelimelik_allocator *allocator, kelimelik_array *self);
+
+// Creates an empty string array with room for count strings that are stored
+// in the array's own block. blob_size is the sum of
+// _KELIMELIK_INLINE_STRING_SIZE() for every string. Exactly count strings
+// must be pushed before the array is used.
+kelimelik_error _kelimelik_packed_string_array_new(const kelimelik_allocator *allocator, kelimelik_array **out, uint32_t count, size_t blob_size);
+void _kelimelik_packed_string_array_push(kelimelik_array *self, uint32_t count, const void *bytes, uint16_t length);
+kelimelik_error _kelimelik_objects_free(const kelimelik_allocator *allocator, kelimelik_object *objects, size_t count);
+kelimelik_error _kelimelik_packet_new(const kelimelik_allocator *allocator, kelimelik_packet **out, kelimelik_string *header, uint8_t size, uint16_t string_arena_size);
+
+// Copies a string into the packet's string arena. Returns NULL if there is
+// not enough room left.
+kelimelik_string *_kelimelik_packet_inline_string(kelimelik_packet *self, const void *bytes, uint16_t length);
+
+// Stores a short string inline as the value of an object. Returns false if
+// the string is too long or doesn't fit, in which case nothing is changed.
+bool _kelimelik_packet_set_inline_string(kelimelik_packet *self, uint8_t index, const void *bytes, size_t length);
+
+// Headers up to this many bytes are stored inline in decoded packets.
+#define _KELIMELIK_INLINE_HEADER_MAX 255
+
+// The number of arena bytes a string with the given length takes up.
+#define _KELIMELIK_INLINE_STRING_SIZE(length) ((sizeof(kelimelik_string) + (length) + 2) & ~(size_t)1)
+
+kelimelik_error kelimelik_packet_encoded_size(kelimelik_packet *self, size_t *size_pt);
+
+// Formats a message and passes it to the log sink set with
+// kelimelik_set_log_sink().
+void _kelimelik_log(enum kelimelik_log_level level, const char *format, ...);
+
+// Returns the name used for the type in JSON descriptions.
+const char *_kelimelik_json_type_name(enum kelimelik_object_type type);
+
+// Maps header names to small sequential IDs. The first header that is
+// interned gets ID 0. Used wherever headers need to be grouped or counted
+// without keeping a copy of the name around for every packet.
+struct kelimelik_header_table {
+	uint32_t count;
+	uint32_t names_capacity;
+	uint32_t bucket_count;
+	uint32_t *buckets;
+	struct {
+		size_t offset;
+		uint32_t hash;
+		uint16_t length;
+	} *names;
+	uint8_t *blob;
+	size_t blob_length;
+	size_t blob_capacity;
+};
+
+uint32_t _kelimelik_hash(const void *bytes, uint16_t length);
+
+kelimelik_error _kelimelik_header_table_intern(struct kelimelik_header_table *self, const void *bytes, uint16_t length, uint32_t *id);
+bool _kelimelik_header_table_find(struct kelimelik_header_table *self, const void *bytes, uint16_t length, uint32_t *id);
+const uint8_t *_kelimelik_header_table_name(struct kelimelik_header_table *self, uint32_t id, uint16_t *length);
+void _kelimelik_header_table_destroy(struct kelimelik_header_table *self);
+
 #endif
\ No newline at end of file
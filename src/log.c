@@ -0,0 +1,536 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+// Library diagnostics go through a single sink. The default sink writes to
+// stderr like the library always did.
+
+static void kelimelik_default_log_sink(enum kelimelik_log_level level, const char *message, void *context) {
+	fprintf(stderr, "[libkelimelik] %s\n", message);
+}
+
+// The sink and its context are read and written together, so a sink is
+// never called with the context of another one
+static pthread_mutex_t log_sink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static kelimelik_log_sink log_sink = kelimelik_default_log_sink;
+static void *log_sink_context = NULL;
+
+void kelimelik_set_log_sink(kelimelik_log_sink sink, void *context) {
+	pthread_mutex_lock(&log_sink_mutex);
+	log_sink = sink ? sink : kelimelik_default_log_sink;
+	log_sink_context = context;
+	pthread_mutex_unlock(&log_sink_mutex);
+}
+
+void _kelimelik_log(enum kelimelik_log_level level, const char *format, ...) {
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	pthread_mutex_lock(&log_sink_mutex);
+	kelimelik_log_sink sink = log_sink;
+	void *context = log_sink_context;
+	pthread_mutex_unlock(&log_sink_mutex);
+	sink(level, message, context);
+}
+
+// Asynchronous logger. Every producer thread gets its own single-producer
+// single-consumer ring, so pushing a record is a couple of relaxed loads, a
+// copy into the ring and a release store. A background thread drains the
+// rings, formats the records and writes them out. Records are dropped
+// instead of blocking when a ring is full.
+
+#define KELIMELIK_LOG_FIELD_COUNT 4
+#define KELIMELIK_LOG_HEADER_SIZE 56
+#define KELIMELIK_LOG_SAMPLING_SLOTS 256
+#define KELIMELIK_CACHE_LINE 64
+
+enum kelimelik_log_record_kind {
+	KELIMELIK_LOG_RECORD_PACKET = 0,
+	KELIMELIK_LOG_RECORD_MESSAGE = 1
+};
+
+// A compact snapshot of a packet. Integers are copied; strings and arrays
+// are reduced to their lengths.
+struct kelimelik_log_record {
+	uint64_t timestamp;
+	uint32_t connection_id;
+	uint32_t frame_size;
+	uint8_t kind;
+	uint8_t level;
+	uint8_t direction;
+	uint8_t object_count;
+	uint8_t field_count;
+	uint8_t header_length;
+	int8_t field_types[KELIMELIK_LOG_FIELD_COUNT];
+	uint8_t field_item_types[KELIMELIK_LOG_FIELD_COUNT];
+	uint64_t fields[KELIMELIK_LOG_FIELD_COUNT];
+	union {
+		// Truncated header for packets
+		char header[KELIMELIK_LOG_HEADER_SIZE];
+
+		// Truncated text for messages, spills over the fields
+		char text[KELIMELIK_LOG_HEADER_SIZE + sizeof(uint64_t) * KELIMELIK_LOG_FIELD_COUNT];
+	};
+};
+
+struct kelimelik_log_ring {
+	_Alignas(KELIMELIK_CACHE_LINE) _Atomic uint64_t head;
+	_Alignas(KELIMELIK_CACHE_LINE) _Atomic uint64_t tail;
+	_Alignas(KELIMELIK_CACHE_LINE) _Atomic uint64_t dropped;
+	struct kelimelik_log_ring *next;
+	pthread_t owner;
+	size_t mask;
+	struct kelimelik_log_record records[];
+};
+
+struct kelimelik_logger {
+	// Unique for every logger ever created, used to tell apart loggers that
+	// were allocated at the same address in the thread ring cache.
+	uint64_t id;
+	FILE *file;
+	size_t ring_capacity;
+	pthread_t thread;
+	_Atomic bool running;
+	_Atomic int level;
+
+	// Rings are only ever added, and only with the mutex held. The consumer
+	// walks the list without the mutex.
+	pthread_mutex_t rings_mutex;
+	_Atomic(struct kelimelik_log_ring *) rings;
+
+	// Per-header sampling. Slots are claimed by writing the header hash and
+	// are never released, so lookups don't need a lock. The header is set
+	// before the hash and compared too, since different headers may have the
+	// same hash.
+	struct {
+		const uint8_t *header;
+		uint16_t header_length;
+		_Atomic uint32_t hash;
+		_Atomic uint32_t one_in;
+		_Atomic uint32_t counter;
+	} sampling[KELIMELIK_LOG_SAMPLING_SLOTS];
+	pthread_mutex_t sampling_mutex;
+};
+
+static _Atomic uint64_t logger_count = 0;
+
+static _Thread_local struct {
+	uint64_t logger_id;
+	struct kelimelik_log_ring *ring;
+} thread_ring;
+
+static const char *kelimelik_log_level_name(enum kelimelik_log_level level) {
+	switch (level) {
+		case KELIMELIK_LOG_DEBUG: return "DEBUG";
+		case KELIMELIK_LOG_INFO: return "INFO";
+		case KELIMELIK_LOG_WARNING: return "WARNING";
+		case KELIMELIK_LOG_ERROR: return "ERROR";
+		default: return "?";
+	}
+}
+
+static uint32_t kelimelik_log_hash(const uint8_t *bytes, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i=0; i<length; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	// 0 marks empty sampling slots
+	return hash ? hash : 1;
+}
+
+static uint64_t kelimelik_log_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static struct kelimelik_log_ring *kelimelik_logger_thread_ring(kelimelik_logger *self) {
+	if (thread_ring.logger_id == self->id) {
+		return thread_ring.ring;
+	}
+
+	// Threads that switch between loggers find their existing ring again
+	pthread_t thread = pthread_self();
+	struct kelimelik_log_ring *ring = atomic_load_explicit(&self->rings, memory_order_acquire);
+	for (; ring; ring = ring->next) {
+		if (pthread_equal(ring->owner, thread)) {
+			break;
+		}
+	}
+	if (!ring) {
+		size_t size = sizeof(*ring) + (self->ring_capacity * sizeof(*ring->records));
+		size = (size + KELIMELIK_CACHE_LINE - 1) & ~(size_t)(KELIMELIK_CACHE_LINE - 1);
+		if (!(ring = aligned_alloc(KELIMELIK_CACHE_LINE, size))) {
+			return NULL;
+		}
+		memset(ring, 0, sizeof(*ring));
+		ring->mask = self->ring_capacity - 1;
+		ring->owner = thread;
+		pthread_mutex_lock(&self->rings_mutex);
+		ring->next = atomic_load(&self->rings);
+		atomic_store_explicit(&self->rings, ring, memory_order_release);
+		pthread_mutex_unlock(&self->rings_mutex);
+	}
+	thread_ring.logger_id = self->id;
+	thread_ring.ring = ring;
+	return ring;
+}
+
+// Returns a slot to write the next record into, or NULL if the ring is full.
+static struct kelimelik_log_record *kelimelik_log_ring_reserve(struct kelimelik_log_ring *ring) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if ((head - tail) > ring->mask) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->records[head & ring->mask];
+}
+
+static void kelimelik_log_ring_commit(struct kelimelik_log_ring *ring) {
+	atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+static bool kelimelik_logger_sampling_slot_matches(kelimelik_logger *self, uint32_t slot, const uint8_t *header, uint16_t header_length) {
+	return (self->sampling[slot].header_length == header_length) &&
+		!memcmp(self->sampling[slot].header, header, header_length);
+}
+
+static bool kelimelik_logger_should_sample(kelimelik_logger *self, const uint8_t *header, uint16_t header_length) {
+	uint32_t hash = kelimelik_log_hash(header, header_length);
+	for (uint32_t i=0; i<KELIMELIK_LOG_SAMPLING_SLOTS; i++) {
+		uint32_t slot = (hash + i) % KELIMELIK_LOG_SAMPLING_SLOTS;
+		uint32_t slot_hash = atomic_load_explicit(&self->sampling[slot].hash, memory_order_acquire);
+		if (!slot_hash) {
+			// No sampling configured for this header
+			return true;
+		}
+		if ((slot_hash == hash) && kelimelik_logger_sampling_slot_matches(self, slot, header, header_length)) {
+			uint32_t one_in = atomic_load_explicit(&self->sampling[slot].one_in, memory_order_relaxed);
+			if (one_in <= 1) {
+				return (one_in == 1);
+			}
+			return !(atomic_fetch_add_explicit(&self->sampling[slot].counter, 1, memory_order_relaxed) % one_in);
+		}
+	}
+	return true;
+}
+
+kelimelik_error kelimelik_logger_set_sampling(kelimelik_logger *self, const char *header, uint32_t one_in) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!header || (strlen(header) > UINT16_MAX)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	uint16_t header_length = strlen(header);
+	uint32_t hash = kelimelik_log_hash((const uint8_t *)header, header_length);
+	kelimelik_error error = _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	pthread_mutex_lock(&self->sampling_mutex);
+	for (uint32_t i=0; i<KELIMELIK_LOG_SAMPLING_SLOTS; i++) {
+		uint32_t slot = (hash + i) % KELIMELIK_LOG_SAMPLING_SLOTS;
+		uint32_t slot_hash = atomic_load(&self->sampling[slot].hash);
+		if ((slot_hash == hash) && kelimelik_logger_sampling_slot_matches(self, slot, (const uint8_t *)header, header_length)) {
+			atomic_store(&self->sampling[slot].one_in, one_in);
+			error = _KELIMELIK_SUCCESS;
+			break;
+		}
+		if (!slot_hash) {
+			uint8_t *copy = malloc(header_length ? header_length : 1);
+			if (!copy) {
+				error = _KELIMELIK_ERROR_SYSCALL(malloc);
+				break;
+			}
+			memcpy(copy, header, header_length);
+			self->sampling[slot].header = copy;
+			self->sampling[slot].header_length = header_length;
+			atomic_store(&self->sampling[slot].one_in, one_in);
+			atomic_store_explicit(&self->sampling[slot].hash, hash, memory_order_release);
+			error = _KELIMELIK_SUCCESS;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&self->sampling_mutex);
+	return error;
+}
+
+void kelimelik_logger_set_level(kelimelik_logger *self, enum kelimelik_log_level level) {
+	atomic_store_explicit(&self->level, level, memory_order_relaxed);
+}
+
+static bool kelimelik_logger_enabled(kelimelik_logger *self, enum kelimelik_log_level level) {
+	return level >= atomic_load_explicit(&self->level, memory_order_relaxed);
+}
+
+// Reserves a packet record and fills in everything except the fields. Returns
+// NULL if the record shouldn't or couldn't be logged.
+static struct kelimelik_log_record *kelimelik_logger_packet_record(
+	kelimelik_logger *self,
+	struct kelimelik_log_ring **ring_pt,
+	enum kelimelik_log_level level,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const uint8_t *header,
+	uint16_t header_length,
+	uint32_t frame_size,
+	uint8_t object_count
+) {
+	if (!kelimelik_logger_should_sample(self, header, header_length)) {
+		return NULL;
+	}
+	struct kelimelik_log_ring *ring = kelimelik_logger_thread_ring(self);
+	struct kelimelik_log_record *record;
+	if (!ring || !(record = kelimelik_log_ring_reserve(ring))) {
+		return NULL;
+	}
+	record->timestamp = kelimelik_log_now();
+	record->kind = KELIMELIK_LOG_RECORD_PACKET;
+	record->level = level;
+	record->connection_id = connection_id;
+	record->direction = direction;
+	record->frame_size = frame_size;
+	record->object_count = object_count;
+	record->header_length = (header_length < sizeof(record->header)) ? header_length : sizeof(record->header);
+	memcpy(record->header, header, record->header_length);
+	record->field_count = 0;
+	*ring_pt = ring;
+	return record;
+}
+
+void kelimelik_logger_frame(
+	kelimelik_logger *self,
+	enum kelimelik_log_level level,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const kelimelik_frame *frame
+) {
+	if (!self || !frame || !kelimelik_logger_enabled(self, level)) {
+		return;
+	}
+	struct kelimelik_log_ring *ring;
+	if (kelimelik_logger_packet_record(
+		self, &ring, level, connection_id, direction,
+		frame->header, frame->header_length, frame->length, frame->object_count
+	)) {
+		kelimelik_log_ring_commit(ring);
+	}
+}
+
+void kelimelik_logger_packet(
+	kelimelik_logger *self,
+	enum kelimelik_log_level level,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	kelimelik_packet *packet
+) {
+	if (!self || !packet || !kelimelik_logger_enabled(self, level)) {
+		return;
+	}
+	struct kelimelik_log_ring *ring;
+	struct kelimelik_log_record *record = kelimelik_logger_packet_record(
+		self, &ring, level, connection_id, direction,
+		packet->header->string, packet->header->length, 0, packet->object_count
+	);
+	if (!record) {
+		return;
+	}
+	size_t frame_size = 0;
+	kelimelik_packet_encoded_size(packet, &frame_size);
+	record->frame_size = frame_size;
+
+	// Logging shouldn't be the reason a lazy packet gets decoded, so only
+	// the header is recorded for those
+	uint8_t field_limit = packet->lazy ? 0 : KELIMELIK_LOG_FIELD_COUNT;
+	for (uint8_t i=0; (i<packet->object_count) && (i<field_limit); i++) {
+		kelimelik_object *object = &packet->objects[i];
+		record->field_types[i] = object->type;
+		switch (object->type) {
+			case KELIMELIK_OBJECT_UINT8:
+				record->fields[i] = object->uint8;
+				break;
+			case KELIMELIK_OBJECT_UINT32:
+				record->fields[i] = object->uint32;
+				break;
+			case KELIMELIK_OBJECT_UINT64:
+				record->fields[i] = object->uint64;
+				break;
+			case KELIMELIK_OBJECT_STRING:
+				record->fields[i] = object->string->length;
+				break;
+			case KELIMELIK_OBJECT_ARRAY:
+				record->fields[i] = object->array->item_count;
+				record->field_item_types[i] = object->array->type;
+				break;
+			default:
+				record->fields[i] = 0;
+				break;
+		}
+		record->field_count++;
+	}
+	kelimelik_log_ring_commit(ring);
+}
+
+void kelimelik_logger_message(kelimelik_logger *self, enum kelimelik_log_level level, const char *format, ...) {
+	if (!self || !kelimelik_logger_enabled(self, level)) {
+		return;
+	}
+	struct kelimelik_log_ring *ring = kelimelik_logger_thread_ring(self);
+	struct kelimelik_log_record *record;
+	if (!ring || !(record = kelimelik_log_ring_reserve(ring))) {
+		return;
+	}
+	record->timestamp = kelimelik_log_now();
+	record->kind = KELIMELIK_LOG_RECORD_MESSAGE;
+	record->level = level;
+	va_list args;
+	va_start(args, format);
+	vsnprintf(record->text, sizeof(record->text), format, args);
+	va_end(args);
+	kelimelik_log_ring_commit(ring);
+}
+
+void kelimelik_logger_sink(enum kelimelik_log_level level, const char *message, void *context) {
+	kelimelik_logger_message(context, level, "%s", message);
+}
+
+static void kelimelik_logger_format(kelimelik_buffer *buffer, const struct kelimelik_log_record *record) {
+	char line[512];
+	int length = snprintf(line, sizeof(line), "%llu.%09llu [%s] ",
+		(unsigned long long)(record->timestamp / 1000000000),
+		(unsigned long long)(record->timestamp % 1000000000),
+		kelimelik_log_level_name(record->level)
+	);
+	if (record->kind == KELIMELIK_LOG_RECORD_MESSAGE) {
+		length += snprintf(line + length, sizeof(line) - length, "%s\n", record->text);
+	}
+	else {
+		length += snprintf(line + length, sizeof(line) - length, "[#%u] [%s] %.*s (%u bytes, %u objects)",
+			record->connection_id,
+			(record->direction == KELIMELIK_DIRECTION_SERVER_TO_CLIENT) ? "Server" : "Client",
+			record->header_length, record->header,
+			record->frame_size,
+			record->object_count
+		);
+		for (uint8_t i=0; (i<record->field_count) && (length < (int)sizeof(line)); i++) {
+			const char *separator = i ? ", " : " [";
+			switch (record->field_types[i]) {
+				case KELIMELIK_OBJECT_STRING:
+					length += snprintf(line + length, sizeof(line) - length, "%sstring(%llu)", separator, (unsigned long long)record->fields[i]);
+					break;
+				case KELIMELIK_OBJECT_ARRAY:
+					length += snprintf(line + length, sizeof(line) - length, "%s%s[%llu]", separator,
+						_kelimelik_json_type_name(record->field_item_types[i]),
+						(unsigned long long)record->fields[i]
+					);
+					break;
+				default:
+					length += snprintf(line + length, sizeof(line) - length, "%s%s %llu", separator,
+						_kelimelik_json_type_name(record->field_types[i]),
+						(unsigned long long)record->fields[i]
+					);
+					break;
+			}
+		}
+		if (length < (int)sizeof(line)) {
+			length += snprintf(line + length, sizeof(line) - length, "%s\n",
+				!record->field_count ? "" : ((record->field_count < record->object_count) ? ", ...]" : "]")
+			);
+		}
+	}
+	if (length >= (int)sizeof(line)) {
+		length = sizeof(line) - 1;
+		line[length - 1] = '\n';
+	}
+	kelimelik_buffer_append(buffer, line, length);
+}
+
+// Drains every ring once. Returns the number of records written.
+static size_t kelimelik_logger_drain(kelimelik_logger *self, kelimelik_buffer *buffer) {
+	size_t count = 0;
+	struct kelimelik_log_ring *ring = atomic_load_explicit(&self->rings, memory_order_acquire);
+	for (; ring; ring = ring->next) {
+		uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		for (; tail != head; tail++, count++) {
+			kelimelik_logger_format(buffer, &ring->records[tail & ring->mask]);
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		if (dropped) {
+			char line[64];
+			int length = snprintf(line, sizeof(line), "[libkelimelik] %llu log records dropped\n", (unsigned long long)dropped);
+			kelimelik_buffer_append(buffer, line, length);
+		}
+	}
+	if (buffer->length) {
+		fwrite(buffer->bytes, 1, buffer->length, self->file);
+		fflush(self->file);
+		kelimelik_buffer_reset(buffer);
+	}
+	return count;
+}
+
+static void *kelimelik_logger_thread(void *context) {
+	kelimelik_logger *self = context;
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	struct timespec delay = { 0, 0 };
+	while (atomic_load_explicit(&self->running, memory_order_acquire)) {
+		if (kelimelik_logger_drain(self, &buffer)) {
+			delay.tv_nsec = 0;
+			continue;
+		}
+
+		// Back off while there's nothing to do, up to 10ms
+		delay.tv_nsec = delay.tv_nsec ? ((delay.tv_nsec >= 5000000) ? 10000000 : (delay.tv_nsec * 2)) : 100000;
+		nanosleep(&delay, NULL);
+	}
+	kelimelik_logger_drain(self, &buffer);
+	kelimelik_buffer_free(&buffer);
+	return NULL;
+}
+
+kelimelik_error kelimelik_logger_new(kelimelik_logger **out, FILE *file, size_t ring_capacity) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!file) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (ring_capacity & (ring_capacity - 1)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	kelimelik_logger *logger = calloc(1, sizeof(*logger));
+	if (!logger) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	logger->id = atomic_fetch_add(&logger_count, 1) + 1;
+	logger->file = file;
+	logger->ring_capacity = ring_capacity ? ring_capacity : 4096;
+	atomic_init(&logger->level, KELIMELIK_LOG_INFO);
+	atomic_init(&logger->running, true);
+	pthread_mutex_init(&logger->rings_mutex, NULL);
+	pthread_mutex_init(&logger->sampling_mutex, NULL);
+	int result = pthread_create(&logger->thread, NULL, kelimelik_logger_thread, logger);
+	if (result) {
+		pthread_mutex_destroy(&logger->rings_mutex);
+		pthread_mutex_destroy(&logger->sampling_mutex);
+		free(logger);
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_pthread_create, result);
+	}
+	*out = logger;
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_logger_free(kelimelik_logger *self) {
+	if (!self) return;
+	atomic_store_explicit(&self->running, false, memory_order_release);
+	pthread_join(self->thread, NULL);
+	struct kelimelik_log_ring *ring = atomic_load(&self->rings);
+	while (ring) {
+		struct kelimelik_log_ring *next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	for (uint32_t i=0; i<KELIMELIK_LOG_SAMPLING_SLOTS; i++) {
+		free((void *)self->sampling[i].header);
+	}
+	pthread_mutex_destroy(&self->rings_mutex);
+	pthread_mutex_destroy(&self->sampling_mutex);
+	free(self);
+}
@@ -1,30 +1,57 @@
 #include "kelimelik-private.h"
 
-kelimelik_error kelimelik_object_free(kelimelik_object *object) {
+static void kelimelik_object_free_with(const kelimelik_allocator *allocator, kelimelik_object *object) {
 	switch (object->type) {
 		case KELIMELIK_OBJECT_UINT8:
 		case KELIMELIK_OBJECT_UINT32:
 		case KELIMELIK_OBJECT_UINT64:
 			break;
 		case KELIMELIK_OBJECT_STRING:
-			kelimelik_string_free(object->string);
+			if (object->storage == KELIMELIK_STORAGE_INTERNED) {
+				kelimelik_interned_release(object->string);
+			}
+			else if (object->storage != KELIMELIK_STORAGE_INLINE) {
+				_kelimelik_string_free(allocator, object->string);
+			}
 			break;
 		case KELIMELIK_OBJECT_ARRAY:
-			kelimelik_array_free(object->array);
+			_kelimelik_array_free(allocator, object->array);
 			break;
 		default:
-			fprintf(stderr, "[libkelimelik] Attempted to free an object of unknown type: %d\n", object->type);
+			_kelimelik_log(KELIMELIK_LOG_WARNING, "Attempted to free an object of unknown type: %d", object->type);
 			break;
 	}
+}
+
+kelimelik_error kelimelik_object_free(kelimelik_object *object) {
+	kelimelik_object_free_with(NULL, object);
 	return _KELIMELIK_SUCCESS;
 }
 
+kelimelik_error _kelimelik_objects_free(const kelimelik_allocator *allocator, kelimelik_object *objects, size_t count) {
+	if (!objects && count) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+	for (size_t i=0; i<count; i++) {
+		kelimelik_object_free_with(allocator, &objects[i]);
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_objects_free_v2(kelimelik_object *objects, size_t count) {
+	return _kelimelik_objects_free(NULL, objects, count);
+}
+
+#ifdef KELIMELIK_OBJECT_LINKS
 kelimelik_error kelimelik_objects_free(kelimelik_object *first_object) {
 	kelimelik_object *object = first_object;
 	if (!object) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
-	do kelimelik_object_free(object);
+	do kelimelik_object_free_with(NULL, object);
 	while ((object = object->next));
 	return _KELIMELIK_SUCCESS;
-}
\ No newline at end of file
+}
+#else
+_Static_assert(sizeof(kelimelik_object) == 16, "kelimelik_object should be 16 bytes");
+#endif
@@ -3,108 +3,200 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
-#include <stdarg.h>
-
-static void re_sprintf(char **buffer, char *format, ...) {
-	va_list args;
-  va_start(args, format);
-	size_t size = vsnprintf(NULL, 0, format, args);
-	va_end(args);
-	*buffer = realloc(*buffer, size+1+strlen(*buffer));
-  va_start(args, format);
-	vsnprintf((*buffer)+strlen(*buffer), size+1, format, args);
-	va_end(args);
+
+// The size of the block that holds the packet, its objects and the string
+// arena.
+static size_t kelimelik_packet_block_size(uint8_t object_count, uint16_t string_arena_size) {
+	return sizeof(kelimelik_packet) + (sizeof(kelimelik_object) * object_count) + string_arena_size;
+}
+
+// The wire bytes are only kept while the packet is unchanged, so the size of
+// the frame is always the cached encoded size.
+static void kelimelik_packet_release_wire(kelimelik_packet *self) {
+	if (self->wire) {
+		_kelimelik_release(self->allocator, (void *)self->wire, self->encoded_size);
+		self->wire = NULL;
+	}
+}
+
+void kelimelik_packet_free(kelimelik_packet *self) {
+	// Frozen packets may be released on several threads at once, and the
+	// last one has to see everything the others did before freeing
+	if (__atomic_sub_fetch(&self->references, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	const kelimelik_allocator *allocator = self->allocator;
+	kelimelik_packet_release_wire(self);
+	_kelimelik_objects_free(allocator, self->objects, self->object_count);
+	if (self->header_storage != KELIMELIK_STORAGE_INLINE) {
+		_kelimelik_string_free(allocator, self->header);
+	}
+	_kelimelik_release(allocator, self, kelimelik_packet_block_size(self->object_count, self->string_arena_size));
+}
+
+kelimelik_packet *kelimelik_packet_retain(kelimelik_packet *self) {
+	__atomic_add_fetch(&self->references, 1, __ATOMIC_RELAXED);
+	return self;
 }
 
-char *kelimelik_packet_description(kelimelik_packet *self) {
-	char *description = malloc(1);
-	description[0] = 0;
-	re_sprintf(
-		&description,
-		"{\n"
-		"  \"header\" = \"%s\",\n"
-		"  \"data\" = [\n",
-		self->header->string
+void kelimelik_packet_release(kelimelik_packet *self) {
+	kelimelik_packet_free(self);
+}
+
+kelimelik_string *_kelimelik_packet_inline_string(kelimelik_packet *self, const void *bytes, uint16_t length) {
+	size_t size = _KELIMELIK_INLINE_STRING_SIZE(length);
+	if ((self->string_arena_size - self->string_arena_used) < size) {
+		return NULL;
+	}
+	kelimelik_string *string = (kelimelik_string *)(
+		(uint8_t *)&self->objects[self->object_count] + self->string_arena_used
 	);
-	for (uint16_t i=0; i<self->object_count; i++) {
-		kelimelik_object *object = &self->objects[i];
-		re_sprintf(&description, "    ");
-		switch (object->type) {
-			case KELIMELIK_OBJECT_UINT64:
-				re_sprintf(&description, "%lu", object->uint64);
-				break;
-			case KELIMELIK_OBJECT_UINT32:
-				re_sprintf(&description, "%u", object->uint32);
-				break;
-			case KELIMELIK_OBJECT_UINT8:
-				re_sprintf(&description, "%hhu", object->uint8);
-				break;
-			case KELIMELIK_OBJECT_STRING:
-				re_sprintf(&description, "\"%s\"", object->string->string);
-				break;
-			case KELIMELIK_OBJECT_ARRAY:
-				if (object->array->item_count == 0) {
-					re_sprintf(&description, "[]");
+	self->string_arena_used += size;
+	memcpy(string + 1, bytes, length);
+	((uint8_t *)(string + 1))[length] = 0;
+	string->length = length;
+	return string;
+}
+
+// The number of bytes the object takes up when encoded, including the type
+// byte.
+static kelimelik_error kelimelik_object_encoded_size(kelimelik_object *object, size_t *size_pt) {
+	size_t size = 1; // Type byte
+	switch (object->type) {
+		case KELIMELIK_OBJECT_UINT64:
+			size += 8;
+			break;
+		case KELIMELIK_OBJECT_UINT32:
+			size += 4;
+			break;
+		case KELIMELIK_OBJECT_UINT8:
+			size += 1;
+			break;
+		case KELIMELIK_OBJECT_STRING:
+			size += object->string->length + 2; // Length (2 bytes) + Data (<=65535 bytes)
+			break;
+		case KELIMELIK_OBJECT_ARRAY:
+			size += 5; // Array type byte and array count bytes
+			switch (object->array->type) {
+				case KELIMELIK_OBJECT_UINT64:
+					size += object->array->item_count * 8;
 					break;
-				}
-				re_sprintf(&description, "[\n");
-				for (uint64_t i=0; i<object->array->item_count; i++) {
-					re_sprintf(&description, "      ");
-					switch (object->array->type) {
-						case KELIMELIK_OBJECT_UINT64:
-							re_sprintf(&description, "%lu,\n", object->array->uint64s[i]);
-							break;
-						case KELIMELIK_OBJECT_UINT32:
-							re_sprintf(&description, "%u,\n", object->array->uint32s[i]);
-							break;
-						case KELIMELIK_OBJECT_UINT8:
-							re_sprintf(&description, "%hhu,\n", object->array->uint8s[i]);
-							break;
-						case KELIMELIK_OBJECT_STRING:
-							re_sprintf(&description, "\"%s\",\n", object->array->strings[i]->string);
-							break;
-						default:
-							re_sprintf(&description, "?,\n");
-							break;
+				case KELIMELIK_OBJECT_UINT32:
+					size += object->array->item_count * 4;
+					break;
+				case KELIMELIK_OBJECT_UINT8:
+					size += object->array->item_count;
+					break;
+				case KELIMELIK_OBJECT_STRING:
+					size += object->array->item_count * 2;
+					for (uint64_t i=0; i<object->array->item_count; i++) {
+						size += object->array->strings[i]->length;
 					}
-				}
-				re_sprintf(&description, "    ]");
-				break;
-			default:
-				re_sprintf(&description, "?");
-				break;
-		}
-		re_sprintf(&description, " (%d),\n", (
-			(object->type == KELIMELIK_OBJECT_ARRAY) ?
-			object->array->type :
-			object->type
-		));
+					break;
+				case KELIMELIK_OBJECT_ARRAY:
+				default:
+					// Arrays can't contain arrays
+					return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
+			}
+			break;
+		default:
+			// Unknown type
+			return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
 	}
-	re_sprintf(&description, "  ]\n}");
-	return description;
+	*size_pt = size;
+	return _KELIMELIK_SUCCESS;
 }
 
-void kelimelik_packet_free(kelimelik_packet *self) {
-	if (self->object_count) kelimelik_objects_free(self->objects);
-	kelimelik_string_free(self->header);
-	free(self);
+// Must be called before an object in the packet is changed. Drops the wire
+// bytes and returns the current size of the object, which has to be passed
+// to kelimelik_packet_did_change() after the change.
+static size_t kelimelik_packet_will_change(kelimelik_packet *self, kelimelik_object *object) {
+	kelimelik_packet_release_wire(self);
+	size_t size = 0;
+	if (self->encoded_size && KELIMELIK_IS_ERROR(kelimelik_object_encoded_size(object, &size))) {
+		self->encoded_size = 0;
+	}
+	return size;
 }
 
-kelimelik_error kelimelik_packet_new_v2(kelimelik_packet **out, kelimelik_string *header, uint8_t size) {
+// Updates the cached encoded size after an object was changed. If the size
+// of the object can't be calculated, the cached size is dropped and it will
+// be calculated again when it's needed.
+static void kelimelik_packet_did_change(kelimelik_packet *self, kelimelik_object *object, size_t old_size) {
+	size_t size;
+	if (!self->encoded_size) {
+		return;
+	}
+	if (KELIMELIK_IS_ERROR(kelimelik_object_encoded_size(object, &size))) {
+		self->encoded_size = 0;
+	}
+	else {
+		self->encoded_size = self->encoded_size - old_size + size;
+	}
+}
+
+void kelimelik_packet_invalidate(kelimelik_packet *self) {
+	if (self->frozen) {
+		return;
+	}
+	kelimelik_packet_release_wire(self);
+	self->encoded_size = 0;
+}
+
+bool _kelimelik_packet_set_inline_string(kelimelik_packet *self, uint8_t index, const void *bytes, size_t length) {
+	if (length > KELIMELIK_INLINE_STRING_MAX) {
+		return false;
+	}
+	kelimelik_string *string = _kelimelik_packet_inline_string(self, bytes, length);
+	if (!string) {
+		return false;
+	}
+	kelimelik_object *object = &self->objects[index];
+	size_t old_size = kelimelik_packet_will_change(self, object);
+	object->type = KELIMELIK_OBJECT_STRING;
+	object->storage = KELIMELIK_STORAGE_INLINE;
+	object->string = string;
+	kelimelik_packet_did_change(self, object, old_size);
+	return true;
+}
+
+kelimelik_error _kelimelik_packet_new(
+	const kelimelik_allocator *allocator,
+	kelimelik_packet **out,
+	kelimelik_string *header,
+	uint8_t size,
+	uint16_t string_arena_size
+) {
 	if (!out) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
-	kelimelik_packet *packet = malloc(sizeof(*packet) + (sizeof(*(packet->objects)) * size));
+
+	// Resolve the allocator now, the global allocator might change before
+	// the packet is freed
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_packet *packet = _kelimelik_allocate(allocator, kelimelik_packet_block_size(size, string_arena_size));
 	if (!packet) {
 		return _KELIMELIK_ERROR_SYSCALL(malloc);
 	}
 	packet->header = header;
 	packet->object_count = size;
+	packet->header_storage = KELIMELIK_STORAGE_HEAP;
+	packet->string_arena_size = string_arena_size;
+	packet->string_arena_used = 0;
+	packet->lazy = false;
+	packet->frozen = false;
+	packet->encoded_size = 0;
+	packet->references = 1;
+	packet->wire = NULL;
+	packet->allocator = allocator;
 	for (uint8_t i=0; i<size; i++) {
 		kelimelik_object *object = &packet->objects[i];
 		object->type = KELIMELIK_OBJECT_UNSPECIFIED;
+		object->storage = KELIMELIK_STORAGE_HEAP;
+#ifdef KELIMELIK_OBJECT_LINKS
 		object->next = (i == (size - 1)) ? NULL : &packet->objects[i+1];
 		object->first = packet->objects;
+#endif
 
 		// On some systems, maybe sizeof(uint64_t) != sizeof(void *). Probably not
 		// but maybe
@@ -115,6 +207,10 @@ kelimelik_error kelimelik_packet_new_v2(kelimelik_packet **out, kelimelik_string
 	return _KELIMELIK_SUCCESS;
 }
 
+kelimelik_error kelimelik_packet_new_v2(kelimelik_packet **out, kelimelik_string *header, uint8_t size) {
+	return _kelimelik_packet_new(NULL, out, header, size, 0);
+}
+
 static kelimelik_error _kelimelik_packet_set_value(
 	kelimelik_packet *self,
 	uint8_t index,
@@ -124,8 +220,15 @@ static kelimelik_error _kelimelik_packet_set_value(
 ) {
 	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	if (self->object_count <= index) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
-	self->objects[index].type = object_type;
-	memcpy(&(self->objects[index].uint8), data, data_size);
+	if (self->frozen) return _KELIMELIK_ERROR_FROZEN;
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	kelimelik_object *object = &self->objects[index];
+	size_t old_size = kelimelik_packet_will_change(self, object);
+	object->type = object_type;
+	object->storage = KELIMELIK_STORAGE_HEAP;
+	memcpy(&(object->uint8), data, data_size);
+	kelimelik_packet_did_change(self, object, old_size);
 	return _KELIMELIK_SUCCESS;
 }
 
@@ -149,12 +252,44 @@ KELIMELIK_SETTER(kelimelik_packet_set_array, kelimelik_array *, KELIMELIK_OBJECT
 KELIMELIK_SETTER(kelimelik_packet_set_string_v2, kelimelik_string *, KELIMELIK_OBJECT_STRING)
 
 kelimelik_error kelimelik_packet_set_string_v1(kelimelik_packet *self, uint8_t index, const char *c_string) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!c_string) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	if (self->object_count <= index) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (self->frozen) return _KELIMELIK_ERROR_FROZEN;
+	size_t length = strlen(c_string);
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	if (_kelimelik_packet_set_inline_string(self, index, c_string, length)) {
+		return _KELIMELIK_SUCCESS;
+	}
 	kelimelik_string *string;
-	kelimelik_error error = kelimelik_string_new_v1(&string, c_string);
+	error = kelimelik_string_new_v3(&string, self->allocator, c_string, length);
 	if (KELIMELIK_IS_ERROR(error)) return error;
 	return kelimelik_packet_set_string_v2(self, index, string);
 }
 
+kelimelik_error kelimelik_packet_set_interned_string(kelimelik_packet *self, uint8_t index, kelimelik_string *string) {
+	if (!string) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	kelimelik_error error = kelimelik_packet_set_string_v2(self, index, string);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	self->objects[index].storage = KELIMELIK_STORAGE_INTERNED;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_get_string(kelimelik_packet *self, uint8_t index, const uint8_t **bytes, uint16_t *length) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (self->object_count <= index) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	if (self->objects[index].type != KELIMELIK_OBJECT_STRING) {
+		return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
+	}
+	if (bytes) *bytes = self->objects[index].string->string;
+	if (length) *length = self->objects[index].string->length;
+	return _KELIMELIK_SUCCESS;
+}
+
 kelimelik_error kelimelik_packet_encoded_size(kelimelik_packet *self, size_t *size_pt) {
 	// Packet size (4 bytes)
 	// Header size (2 bytes)
@@ -162,59 +297,27 @@ kelimelik_error kelimelik_packet_encoded_size(kelimelik_packet *self, size_t *si
 	// Object count (1 byte)
 	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	if (!size_pt) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (self->encoded_size) {
+		*size_pt = self->encoded_size;
+		return _KELIMELIK_SUCCESS;
+	}
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
 	size_t size = 4 + 2 + 1 + self->header->length;
-	if (self->object_count) {
-		kelimelik_object *object = &self->objects[0];
-		do {
-			size += 1; // Type byte
-			switch (object->type) {
-				case KELIMELIK_OBJECT_UINT64:
-					size += 8;
-					break;
-				case KELIMELIK_OBJECT_UINT32:
-					size += 4;
-					break;
-				case KELIMELIK_OBJECT_UINT8:
-					size += 1;
-					break;
-				case KELIMELIK_OBJECT_STRING:
-					size += object->string->length + 2; // Length (2 bytes) + Data (<=65535 bytes)
-					break;
-				case KELIMELIK_OBJECT_ARRAY:
-					size += 5; // Array type byte and array count bytes
-					switch (object->array->type) {
-						case KELIMELIK_OBJECT_UINT64:
-							size += object->array->item_count * 8;
-							break;
-						case KELIMELIK_OBJECT_UINT32:
-							size += object->array->item_count * 4;
-							break;
-						case KELIMELIK_OBJECT_UINT8:
-							size += object->array->item_count;
-							break;
-						case KELIMELIK_OBJECT_STRING:
-							size += object->array->item_count * 2;
-							for (uint64_t i=0; i<object->array->item_count; i++) {
-								size += object->array->strings[i]->length;
-							}
-							break;
-						case KELIMELIK_OBJECT_ARRAY:
-						default:
-							// Arrays can't contain arrays
-							return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
-					}
-					break;
-				default:
-					// Unknown type
-					return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
-			}
-		} while ((object = object->next));
+	for (uint16_t i=0; i<self->object_count; i++) {
+		size_t object_size;
+		error = kelimelik_object_encoded_size(&self->objects[i], &object_size);
+		if (KELIMELIK_IS_ERROR(error)) return error;
+		size += object_size;
 	}
+	self->encoded_size = size;
 	*size_pt = size;
 	return _KELIMELIK_SUCCESS;
 }
 
 kelimelik_error kelimelik_verify_packet(kelimelik_packet *self, const char *format) {
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
 	uint16_t i;
 	for (i=0; i<self->object_count; i++) {
 		enum kelimelik_object_type value_type;
@@ -269,16 +372,19 @@ kelimelik_error kelimelik_verify_packet(kelimelik_packet *self, const char *form
 	return _KELIMELIK_SUCCESS;
 }
 
-kelimelik_error kelimelik_packet_encode(kelimelik_packet *self, void **out_bytes, size_t *out_len) {
-	size_t size;
-	kelimelik_error error = kelimelik_packet_encoded_size(self, &size);
-	if (KELIMELIK_IS_ERROR(error)) return error;
-	uint8_t *encoded_packet_beginning = malloc(size);
-	if (!encoded_packet_beginning) {
-		return _KELIMELIK_ERROR_SYSCALL(malloc);
-	}
+// Writes the packet to encoded_packet_beginning, which must have room for
+// size bytes as returned by kelimelik_packet_encoded_size().
+static kelimelik_error kelimelik_packet_encode_to(kelimelik_packet *self, uint8_t *encoded_packet_beginning, size_t size) {
 	uint8_t *encoded_packet = encoded_packet_beginning;
 
+	// Unchanged packets are sent exactly as they were received
+	if (self->wire) {
+		memcpy(encoded_packet, self->wire, size);
+		return _KELIMELIK_SUCCESS;
+	}
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
 	// Packet size
 	*(uint32_t *)encoded_packet = htonl(size - 4);
 
@@ -340,20 +446,103 @@ kelimelik_error kelimelik_packet_encode(kelimelik_packet *self, void **out_bytes
 						case KELIMELIK_OBJECT_ARRAY:
 						default:
 							// Arrays can't contain arrays
-							free(encoded_packet_beginning);
 							return _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
 					}
 				}
 				break;
 			default:
-				free(encoded_packet_beginning);
 				return (kelimelik_error){
 					.kelimelik_errno = KELIMELIK_ERROR_INVALID_TYPE
 				};
 		}
 	}
 	assert((encoded_packet - encoded_packet_beginning) == size);
-	*out_bytes = encoded_packet_beginning;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_encode(kelimelik_packet *self, void **out_bytes, size_t *out_len) {
+	size_t size;
+	kelimelik_error error = kelimelik_packet_encoded_size(self, &size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	uint8_t *encoded_packet = malloc(size);
+	if (!encoded_packet) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	error = kelimelik_packet_encode_to(self, encoded_packet, size);
+	if (KELIMELIK_IS_ERROR(error)) {
+		free(encoded_packet);
+		return error;
+	}
+	*out_bytes = encoded_packet;
 	*out_len = size;
 	return _KELIMELIK_SUCCESS;
 }
+
+kelimelik_error kelimelik_packet_encode_v2(kelimelik_packet *self, kelimelik_buffer *buffer) {
+	if (!buffer) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	size_t size;
+	kelimelik_error error = kelimelik_packet_encoded_size(self, &size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_buffer_reserve(buffer, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_packet_encode_to(self, buffer->bytes + buffer->length, size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	buffer->length += size;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_freeze(kelimelik_packet *self) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (self->frozen) {
+		return _KELIMELIK_SUCCESS;
+	}
+
+	// Readers of a frozen packet must never have to decode or encode
+	// anything, since that would write to the packet
+	kelimelik_error error = kelimelik_packet_materialize(self);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	if (!self->wire) {
+		size_t size;
+		error = kelimelik_packet_encoded_size(self, &size);
+		if (KELIMELIK_IS_ERROR(error)) return error;
+		uint8_t *wire = _kelimelik_allocate(self->allocator, size);
+		if (!wire) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		error = kelimelik_packet_encode_to(self, wire, size);
+		if (KELIMELIK_IS_ERROR(error)) {
+			_kelimelik_release(self->allocator, wire, size);
+			return error;
+		}
+		self->wire = wire;
+	}
+	self->frozen = true;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_get_wire(kelimelik_packet *self, const uint8_t **bytes, size_t *length) {
+	if (!self || !self->frozen) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!bytes) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!length) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	*bytes = self->wire;
+	*length = self->encoded_size;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_clone(kelimelik_packet *self, const kelimelik_allocator *allocator, kelimelik_packet **out) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+
+	// Decoding the packet again copies every string and array, and lays the
+	// copy out the same way the parser would
+	if (self->wire) {
+		return _kelimelik_parser_decode(allocator, (uint8_t *)self->wire, self->encoded_size, 0, 0, NULL, out);
+	}
+	kelimelik_buffer buffer = KELIMELIK_BUFFER_INITIALIZER;
+	kelimelik_error error = kelimelik_packet_encode_v2(self, &buffer);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = _kelimelik_parser_decode(allocator, buffer.bytes, buffer.length, 0, 0, NULL, out);
+	}
+	kelimelik_buffer_free(&buffer);
+	return error;
+}
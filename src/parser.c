@@ -2,19 +2,116 @@
 #include <stdio.h>
 #include <string.h>
 
-void kelimelik_parser_free_old_packets(kelimelik_parser *self) {
-	for (size_t i=0; i<self->packet_count; i++) {
-		if (self->packets[i]) {
-			kelimelik_packet_free(self->packets[i]);
-			self->packets[i] = NULL;
+// The packets and frames arrays start at this many items. They grow by
+// doubling and shrink again once a call returns a quarter of their capacity
+// or less.
+#define KELIMELIK_PARSER_MIN_CAPACITY 8
+
+// Limits shared by a group of parsers. The parsers may be used on different
+// threads, so everything is updated atomically.
+struct kelimelik_parser_group {
+	size_t max_buffered_bytes;
+	size_t buffered_bytes;
+	kelimelik_parser_stats stats;
+};
+
+static uint64_t *kelimelik_parser_stats_counter(kelimelik_parser_stats *stats, enum kelimelik_limit limit) {
+	switch (limit) {
+		case KELIMELIK_LIMIT_FRAME_SIZE: return &stats->frames_too_big;
+		case KELIMELIK_LIMIT_ARRAY_ITEMS: return &stats->arrays_too_big;
+		default: return &stats->over_budget;
+	}
+}
+
+kelimelik_error _kelimelik_parser_limit_exceeded(kelimelik_parser *self, enum kelimelik_limit limit) {
+	(*kelimelik_parser_stats_counter(&self->stats, limit))++;
+	if (self->group) {
+		__atomic_add_fetch(kelimelik_parser_stats_counter(&self->group->stats, limit), 1, __ATOMIC_RELAXED);
+	}
+	return _KELIMELIK_ERROR(KELIMELIK_ERROR_LIMIT_EXCEEDED, limit);
+}
+
+// Accounts for a frame buffer of the given size. Returns false if that would
+// go over the budget of the parser or of its group.
+static bool kelimelik_parser_reserve(kelimelik_parser *self, size_t size) {
+	if (self->limits.max_buffered_bytes && ((self->buffered_bytes + size) > self->limits.max_buffered_bytes)) {
+		return false;
+	}
+	kelimelik_parser_group *group = self->group;
+	if (group) {
+		size_t buffered_bytes = __atomic_add_fetch(&group->buffered_bytes, size, __ATOMIC_RELAXED);
+		if (group->max_buffered_bytes && (buffered_bytes > group->max_buffered_bytes)) {
+			__atomic_sub_fetch(&group->buffered_bytes, size, __ATOMIC_RELAXED);
+			return false;
 		}
 	}
+	self->buffered_bytes += size;
+	return true;
+}
+
+static void kelimelik_parser_release(kelimelik_parser *self, size_t size) {
+	self->buffered_bytes -= size;
+	if (self->group) {
+		__atomic_sub_fetch(&self->group->buffered_bytes, size, __ATOMIC_RELAXED);
+	}
+}
+
+// Resizes the packets or the frames array. Returns NULL and leaves the array
+// as it is on failure.
+static void *kelimelik_parser_resize(kelimelik_parser *self, void *array, size_t *capacity, size_t new_capacity, size_t item_size) {
+	void *new_array = _kelimelik_reallocate(self->allocator, array, *capacity * item_size, new_capacity * item_size);
+	if (new_array) {
+		*capacity = new_capacity;
+	}
+	return new_array;
+}
+
+// Gives memory back after a burst, so that a parser that returned many
+// packets at once doesn't keep a big array around forever. Only the first
+// used items are kept.
+static void *kelimelik_parser_shrink(kelimelik_parser *self, void *array, size_t *capacity, size_t used, size_t item_size) {
+	if ((*capacity <= KELIMELIK_PARSER_MIN_CAPACITY) || (used > (*capacity / 4))) {
+		return array;
+	}
+	size_t new_capacity = used * 2;
+	if (new_capacity < KELIMELIK_PARSER_MIN_CAPACITY) {
+		new_capacity = KELIMELIK_PARSER_MIN_CAPACITY;
+	}
+	void *new_array = kelimelik_parser_resize(self, array, capacity, new_capacity, item_size);
+	return new_array ? new_array : array;
+}
+
+void kelimelik_parser_free_old_packets(kelimelik_parser *self) {
+	for (size_t i=0; i<self->packets_used; i++) {
+		kelimelik_packet_free(self->packets[i]);
+	}
+	self->packets_used = 0;
+}
+
+// Frees the frame that was assembled by the previous call to
+// kelimelik_parser_advance_frames(), if there was one.
+static void kelimelik_parser_free_old_frame(kelimelik_parser *self) {
+	if (self->frame_buffer) {
+		size_t frame_length = (size_t)ntohl(*(uint32_t *)self->frame_buffer) + 4;
+		_kelimelik_release(self->allocator, self->frame_buffer, frame_length);
+		kelimelik_parser_release(self, frame_length);
+		self->frame_buffer = NULL;
+	}
 }
 
 void kelimelik_parser_free(kelimelik_parser *self) {
-	if (self->packet_buffer) free(self->packet_buffer);
+	const kelimelik_allocator *allocator = self->allocator;
+	if (self->packet_buffer) {
+		size_t frame_length = (size_t)ntohl(*(uint32_t *)self->packet_size_buffer) + 4;
+		_kelimelik_release(allocator, self->packet_buffer, frame_length);
+		kelimelik_parser_release(self, frame_length);
+	}
 	kelimelik_parser_free_old_packets(self);
-	free(self);
+	kelimelik_parser_free_old_frame(self);
+	_kelimelik_parser_stream_free(self);
+	_kelimelik_release(allocator, self->packets, self->packet_count * sizeof(*(self->packets)));
+	_kelimelik_release(allocator, self->frames, self->frame_capacity * sizeof(*(self->frames)));
+	_kelimelik_release(allocator, self, sizeof(*self));
 }
 
 void kelimelik_parser_reset(kelimelik_parser *parser) {
@@ -24,57 +121,360 @@ void kelimelik_parser_reset(kelimelik_parser *parser) {
 	parser->index = 0;
 }
 
-kelimelik_error kelimelik_parser_new(kelimelik_parser **out) {
-	kelimelik_parser *parser = malloc(sizeof(**out));
+kelimelik_error kelimelik_parser_new_v2(kelimelik_parser **out, const kelimelik_allocator *allocator) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_parser *parser = _kelimelik_allocate(allocator, sizeof(**out));
+	if (!parser) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
 	parser->packet_count = 0;
+	parser->packets_used = 0;
 	parser->packets = NULL;
+	parser->frame_capacity = 0;
+	parser->frames = NULL;
+	parser->frame_buffer = NULL;
+	parser->stream = NULL;
+	memset(&parser->limits, 0, sizeof(parser->limits));
+	memset(&parser->stats, 0, sizeof(parser->stats));
+	parser->group = NULL;
+	parser->intern_pool = NULL;
+	parser->buffered_bytes = 0;
+	parser->allocator = allocator;
+	parser->options = 0;
 	kelimelik_parser_reset(parser);
 	*out = parser;
 	return _KELIMELIK_SUCCESS;
 }
 
+void kelimelik_parser_set_options(kelimelik_parser *self, int options) {
+	self->options = options;
+}
+
+kelimelik_error kelimelik_parser_new(kelimelik_parser **out) {
+	return kelimelik_parser_new_v2(out, NULL);
+}
+
+void kelimelik_parser_set_limits(kelimelik_parser *self, const kelimelik_parser_limits *limits) {
+	self->limits = *limits;
+}
+
+void kelimelik_parser_set_intern_pool(kelimelik_parser *self, kelimelik_intern_pool *pool) {
+	self->intern_pool = pool;
+}
+
+void kelimelik_parser_get_stats(kelimelik_parser *self, kelimelik_parser_stats *stats) {
+	*stats = self->stats;
+}
+
+kelimelik_error kelimelik_parser_group_new(kelimelik_parser_group **out, size_t max_buffered_bytes) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_parser_group *group = calloc(1, sizeof(*group));
+	if (!group) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	group->max_buffered_bytes = max_buffered_bytes;
+	*out = group;
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_parser_set_group(kelimelik_parser *self, kelimelik_parser_group *group) {
+	// Move the buffers that are already held to the new group
+	if (self->group) {
+		__atomic_sub_fetch(&self->group->buffered_bytes, self->buffered_bytes, __ATOMIC_RELAXED);
+	}
+	if (group) {
+		__atomic_add_fetch(&group->buffered_bytes, self->buffered_bytes, __ATOMIC_RELAXED);
+	}
+	self->group = group;
+}
+
+size_t kelimelik_parser_group_buffered_bytes(kelimelik_parser_group *self) {
+	return __atomic_load_n(&self->buffered_bytes, __ATOMIC_RELAXED);
+}
+
+void kelimelik_parser_group_get_stats(kelimelik_parser_group *self, kelimelik_parser_stats *stats) {
+	stats->frames_too_big = __atomic_load_n(&self->stats.frames_too_big, __ATOMIC_RELAXED);
+	stats->arrays_too_big = __atomic_load_n(&self->stats.arrays_too_big, __ATOMIC_RELAXED);
+	stats->over_budget = __atomic_load_n(&self->stats.over_budget, __ATOMIC_RELAXED);
+}
+
+void kelimelik_parser_group_free(kelimelik_parser_group *self) {
+	free(self);
+}
+
 kelimelik_error kelimelik_parser_decode(
 	uint8_t *bytes,
 	size_t bytes_length,
 	kelimelik_packet **new_packet
 ) {
+	return _kelimelik_parser_decode(NULL, bytes, bytes_length, 0, 0, NULL, new_packet);
+}
+
+static kelimelik_error kelimelik_parser_decode_objects(
+	kelimelik_packet *packet,
+	uint8_t *bytes,
+	size_t bytes_length,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	size_t *bytes_remaining
+);
+static kelimelik_error kelimelik_parser_decode_trusted_objects(
+	kelimelik_packet *packet,
+	uint8_t *bytes,
+	size_t bytes_length,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	size_t *bytes_remaining
+);
+
+kelimelik_error _kelimelik_parser_decode(
+	const kelimelik_allocator *allocator,
+	uint8_t *bytes,
+	size_t bytes_length,
+	int options,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	kelimelik_packet **new_packet
+) {
+	bool lazy = (options & KELIMELIK_PARSER_LAZY);
+
 	// Check the input
 	if (!bytes) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	if (bytes_length < 7) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
 	if (!new_packet) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
 
-	// Get the packet size and the header size
-	uint32_t packet_size = ntohl(*(uint32_t *)bytes);
+	// Get the header size
+	size_t frame_length = bytes_length;
 	uint16_t header_size = ntohs(*(uint16_t *)(bytes += 4));
 	bytes_length -= 7;
 	if (bytes_length < header_size) {
 		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
 
-	// Create the header object
-	kelimelik_string *header;
-	kelimelik_error error = kelimelik_string_new_v2(&header, (bytes += 2), header_size);
+	allocator = _kelimelik_allocator(allocator);
+	uint8_t *header_bytes = (bytes += 2);
 	bytes += header_size;
 	bytes_length -= header_size;
+	uint8_t object_count = *(bytes++);
+
+	// Reserve room for short strings in the packet's block. An inline string
+	// takes up at most one byte more than it does on the wire, so this is
+	// always enough for every short string in the packet. Interned strings
+	// don't need any room.
+	size_t string_arena_size = bytes_length + object_count;
+	if (string_arena_size > (object_count * _KELIMELIK_INLINE_STRING_SIZE(KELIMELIK_INLINE_STRING_MAX))) {
+		string_arena_size = object_count * _KELIMELIK_INLINE_STRING_SIZE(KELIMELIK_INLINE_STRING_MAX);
+	}
+	if (intern_pool && !lazy) {
+		string_arena_size = 0;
+	}
+	if (header_size <= _KELIMELIK_INLINE_HEADER_MAX) {
+		string_arena_size += _KELIMELIK_INLINE_STRING_SIZE(header_size);
+	}
 
 	// Create the packet object
 	kelimelik_packet *packet;
-	uint8_t object_count = *(bytes++);
-	error = kelimelik_packet_new_v2(&packet, header, object_count);
+	kelimelik_error error = _kelimelik_packet_new(allocator, &packet, NULL, object_count, string_arena_size);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// Create the header object
+	if (header_size <= _KELIMELIK_INLINE_HEADER_MAX) {
+		packet->header = _kelimelik_packet_inline_string(packet, header_bytes, header_size);
+		packet->header_storage = KELIMELIK_STORAGE_INLINE;
+	}
+	else {
+		error = kelimelik_string_new_v3(&packet->header, allocator, header_bytes, header_size);
+		if (KELIMELIK_IS_ERROR(error)) {
+			kelimelik_packet_free(packet);
+			return error;
+		}
+	}
+
+	// Lazy packets are done here, the objects are decoded from the frame
+	// once they are needed
+	if (lazy) {
+		if (frame_length > UINT32_MAX) {
+			// The size of the frame has to fit in encoded_size
+			kelimelik_packet_free(packet);
+			return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+		}
+		packet->lazy = true;
+		packet->encoded_size = frame_length;
+		*new_packet = packet;
+		return _KELIMELIK_SUCCESS;
+	}
+	if (options & KELIMELIK_PARSER_TRUSTED) {
+		error = kelimelik_parser_decode_trusted_objects(packet, bytes, bytes_length, max_array_items, intern_pool, &bytes_length);
+	}
+	else {
+		error = kelimelik_parser_decode_objects(packet, bytes, bytes_length, max_array_items, intern_pool, &bytes_length);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		kelimelik_packet_free(packet);
+		return error;
+	}
+	if (bytes_length > 0) {
+		_kelimelik_log(KELIMELIK_LOG_WARNING, "%zu bytes remaining after parsing", bytes_length);
+	}
+	else if (frame_length <= UINT32_MAX) {
+		// The packet encodes to exactly the same bytes
+		packet->encoded_size = frame_length;
+	}
+	*new_packet = packet;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_packet_materialize(kelimelik_packet *self) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!self->lazy) {
+		return _KELIMELIK_SUCCESS;
+	}
+	if (!self->wire) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+
+	// The objects are decoded from the wire bytes, which the setters used by
+	// the decoder would otherwise drop
+	const uint8_t *wire = self->wire;
+	uint32_t encoded_size = self->encoded_size;
+	self->wire = NULL;
+	self->encoded_size = 0;
+	self->lazy = false;
+	size_t body_offset = 4 + 2 + self->header->length + 1;
+	size_t bytes_remaining;
+	kelimelik_error error = kelimelik_parser_decode_objects(
+		self,
+		(uint8_t *)wire + body_offset,
+		encoded_size - body_offset,
+		0,
+		NULL,
+		&bytes_remaining
+	);
+	self->wire = wire;
+	self->encoded_size = encoded_size;
+	if (KELIMELIK_IS_ERROR(error)) {
+		// Go back to the lazy state, so that the packet can still be freed
+		// or forwarded as it is
+		_kelimelik_objects_free(self->allocator, self->objects, self->object_count);
+		for (uint16_t i=0; i<self->object_count; i++) {
+			self->objects[i].type = KELIMELIK_OBJECT_UNSPECIFIED;
+			self->objects[i].storage = KELIMELIK_STORAGE_HEAP;
+			self->objects[i].uint64 = 0;
+		}
+		self->string_arena_used = (self->header_storage == KELIMELIK_STORAGE_INLINE) ?
+			_KELIMELIK_INLINE_STRING_SIZE(self->header->length) : 0;
+		self->lazy = true;
+		return error;
+	}
+	if (bytes_remaining > 0) {
+		// Encoding the objects wouldn't give back the same bytes
+		_kelimelik_log(KELIMELIK_LOG_WARNING, "%zu bytes remaining after parsing", bytes_remaining);
+		kelimelik_packet_invalidate(self);
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error _kelimelik_parser_decode_array(
+	const kelimelik_allocator *allocator,
+	kelimelik_array **out,
+	enum kelimelik_object_type item_type,
+	uint32_t count,
+	uint8_t *bytes,
+	size_t bytes_length,
+	size_t string_blob_size,
+	kelimelik_intern_pool *intern_pool
+) {
+	kelimelik_array *array = NULL;
+	kelimelik_error error;
+	switch (item_type) {
+		case KELIMELIK_OBJECT_UINT8:
+		case KELIMELIK_OBJECT_UINT32:
+		case KELIMELIK_OBJECT_UINT64:
+			error = _kelimelik_array_new(allocator, &array, item_type, bytes, bytes_length);
+			break;
+		case KELIMELIK_OBJECT_STRING:
+		default: {
+			if (intern_pool) {
+				// Only the pointer table is allocated
+				error = _kelimelik_packed_string_array_new(allocator, &array, count, 0);
+				if (KELIMELIK_IS_ERROR(error)) break;
+				array->storage = KELIMELIK_STORAGE_INTERNED;
+				uint8_t *string_bytes = bytes;
+				for (uint32_t j=0; j<count; j++) {
+					uint16_t len = ntohs(*(uint16_t *)string_bytes);
+					error = kelimelik_intern_string(intern_pool, string_bytes + 2, len, &array->strings[j]);
+					if (KELIMELIK_IS_ERROR(error)) {
+						for (uint32_t k=0; k<j; k++) {
+							kelimelik_interned_release(array->strings[k]);
+						}
+						_kelimelik_release(allocator, array, sizeof(*array) + (count * sizeof(kelimelik_string *)));
+						break;
+					}
+					array->item_count++;
+					string_bytes += len + 2;
+				}
+				break;
+			}
+
+			// The lengths were already checked, copy the strings in one pass
+			error = _kelimelik_packed_string_array_new(allocator, &array, count, string_blob_size);
+			if (KELIMELIK_IS_ERROR(error)) break;
+			uint8_t *string_bytes = bytes;
+			for (uint32_t j=0; j<count; j++) {
+				uint16_t len = ntohs(*(uint16_t *)string_bytes);
+				_kelimelik_packed_string_array_push(array, count, string_bytes + 2, len);
+				string_bytes += len + 2;
+			}
+		}
+	}
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	switch (array->type) {
+		case KELIMELIK_OBJECT_UINT32:
+			for (uint64_t i=0; i<array->item_count; i++) {
+				array->uint32s[i] = ntohl(array->uint32s[i]);
+			}
+			break;
+		case KELIMELIK_OBJECT_UINT64:
+			for (uint64_t i=0; i<array->item_count; i++) {
+				array->uint64s[i] = ntohll(array->uint64s[i]);
+			}
+		default:
+			break;
+	}
+	*out = array;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Decodes the objects of a packet. bytes points to the first object, right
+// after the object count. On failure, the objects that were already decoded
+// are left in the packet.
+//
+// This is the only implementation of the decoder. It is always inlined into
+// the two functions below with trusted as a constant, so the compiler drops
+// the checks that the trusted variant doesn't make. When trusted is set,
+// every length is taken as it is and the frame length is only checked once
+// at the end; a malformed frame can make it read past the frame.
+static inline __attribute__((always_inline)) kelimelik_error kelimelik_parser_decode_objects_impl(
+	kelimelik_packet *packet,
+	uint8_t *bytes,
+	size_t bytes_length,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	size_t *bytes_remaining,
+	const bool trusted
+) {
+	const kelimelik_allocator *allocator = packet->allocator;
+	uint8_t object_count = packet->object_count;
+	kelimelik_error error = _KELIMELIK_SUCCESS;
+	uint8_t *end = bytes + bytes_length;
 
 	// Starting parsing the other objects in the packet
 	uint16_t i;
-	struct {
-		uint32_t item_count;
-		struct {
-			uint16_t length;
-			size_t offset;
-		} items[];
-	} *string_array_data = NULL;
 	for (i=0; i<object_count; i++) {
 		// If no bytes are left, break, since we can't safely read
 		// the type byte
-		if (!bytes_length) break;
+		if (!trusted && !bytes_length) break;
 		bytes_length--;
 
 		// Get the type value
@@ -83,6 +483,7 @@ kelimelik_error kelimelik_parser_decode(
 		// First switch: Calculate the size of the object in bytes.
 		// This is needed to avoid out-of-bounds reads.
 		size_t bytes_needed = 0;
+		size_t string_blob_size = 0;
 		switch (type) {
 			// Integers are easy, the bytes needed is always the same.
 			case KELIMELIK_OBJECT_UINT8:
@@ -98,7 +499,7 @@ kelimelik_error kelimelik_parser_decode(
 			// Strings are a bit more complicated, the size depends on
 			// the next 2 bytes.
 			case KELIMELIK_OBJECT_STRING:
-				if (bytes_length < 2) bytes_needed = 2;
+				if (!trusted && (bytes_length < 2)) bytes_needed = 2;
 				else bytes_needed = ntohs(*(uint16_t *)bytes) + 2;
 				break;
 
@@ -107,9 +508,13 @@ kelimelik_error kelimelik_parser_decode(
 				// First 4 bytes is the number of items in the array. The
 				// next byte represents the types of those items.
 				bytes_needed = 5;
-				if (bytes_length < 5) break;
+				if (!trusted && (bytes_length < 5)) break;
 				uint32_t count = ntohl(*(uint32_t *)bytes);
 				uint8_t type_in_array = *(uint8_t *)(bytes + 4);
+				if (max_array_items && (count > max_array_items)) {
+					error = _KELIMELIK_ERROR(KELIMELIK_ERROR_LIMIT_EXCEEDED, KELIMELIK_LIMIT_ARRAY_ITEMS);
+					break;
+				}
 
 				// What we do next depends on the item type.
 				switch (type_in_array) {
@@ -121,11 +526,13 @@ kelimelik_error kelimelik_parser_decode(
 
 					// Integers are easy, since the size can be easily calculated
 					// by multiplying the count with the size of the integer type.
+					// This must not wrap around, or huge counts would pass the
+					// length check.
 					case KELIMELIK_OBJECT_UINT32:
-						bytes_needed += (count * 4);
+						bytes_needed += ((size_t)count * 4);
 						break;
 					case KELIMELIK_OBJECT_UINT64:
-						bytes_needed += (count * 8);
+						bytes_needed += ((size_t)count * 8);
 						break;
 					case KELIMELIK_OBJECT_UINT8:
 						bytes_needed += count;
@@ -133,36 +540,45 @@ kelimelik_error kelimelik_parser_decode(
 
 					// When an array contains strings, things get much more complicated.
 					// Since it is basically impossible to know the number of bytes needed
-					// for String arrays without parsing, half of the parsing is done here.
+					// for String arrays without parsing, the lengths are walked here. The
+					// size of the packed strings is added up along the way so that the
+					// array can be allocated at once.
 					case KELIMELIK_OBJECT_STRING:
-						if (string_array_data) free(string_array_data);
-						string_array_data = malloc(sizeof(*string_array_data) + (sizeof(*(string_array_data->items)) * count));
-						string_array_data->item_count = count;
 						for (uint64_t i=0; i<count; i++) {
-							size_t bytes_remaining = bytes_length - bytes_needed;
-							if ((bytes_remaining > bytes_length) || (bytes_remaining < 2)) {
-								bytes_needed = 0;
-								break;
+							if (!trusted) {
+								size_t bytes_remaining = bytes_length - bytes_needed;
+								if ((bytes_remaining > bytes_length) || (bytes_remaining < 2)) {
+									bytes_needed = 0;
+									break;
+								}
 							}
 							uint16_t len = ntohs(*(uint16_t *)(bytes + bytes_needed));
-							string_array_data->items[i].length = len;
-							string_array_data->items[i].offset = bytes_needed + 2;
+							string_blob_size += _KELIMELIK_INLINE_STRING_SIZE(len);
 							bytes_needed += len + 2;
 						}
 						break;
+
+					// Anything else would be decoded as a string array
+					// without room for the strings
+					default:
+						bytes_needed = 0;
+						break;
 				}
 				break;
 			}
 			default:
-				fprintf(stderr, "[libkelimelik] Attempted to parse unknown type: %u\n", type);
+				_kelimelik_log(KELIMELIK_LOG_WARNING, "Attempted to parse unknown type: %u", type);
 				break;
 		}
-		if (!bytes_needed) {
+		if (KELIMELIK_IS_ERROR(error)) {
+			break;
+		}
+		else if (!bytes_needed) {
 			// Invalid type
 			error = _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, 0);
 			break;
 		} 
-		else if (bytes_needed > bytes_length) {
+		else if (!trusted && (bytes_needed > bytes_length)) {
 			// Not enough bytes left
 			error = _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 			break;
@@ -183,80 +599,156 @@ kelimelik_error kelimelik_parser_decode(
 				break;
 			case KELIMELIK_OBJECT_STRING: {
 				bytes += 2;
-				kelimelik_string *header_str;
-				error = kelimelik_string_new_v2(&header_str, bytes, bytes_needed - 2);
+				if (intern_pool) {
+					kelimelik_string *string;
+					error = kelimelik_intern_string(intern_pool, bytes, bytes_needed - 2, &string);
+					if (!KELIMELIK_IS_ERROR(error)) {
+						kelimelik_packet_set_interned_string(packet, i, string);
+					}
+				}
+				else if (!_kelimelik_packet_set_inline_string(packet, i, bytes, bytes_needed - 2)) {
+					kelimelik_string *string;
+					error = kelimelik_string_new_v3(&string, allocator, bytes, bytes_needed - 2);
+					kelimelik_packet_set_string_v2(packet, i, string);
+				}
 				bytes += bytes_needed - 2;
-				kelimelik_packet_set_string_v2(packet, i, header_str);
 				break;
 			}
 			case KELIMELIK_OBJECT_ARRAY: {
-				//FIXME: Arrays not implemented
 				kelimelik_array *array = NULL;
-				uint32_t count = ntohl(*(uint32_t *)bytes);
-				uint8_t swapped_bytes[8];
-				switch (*(bytes + 4)) {
-					case KELIMELIK_OBJECT_UINT8:
-					case KELIMELIK_OBJECT_UINT32:
-					case KELIMELIK_OBJECT_UINT64:
-						error = kelimelik_array_new(
-							&array,
-							*(bytes + 4), 
-							(void *)&bytes[5],
-							bytes_needed - 5
-						);
-						break;
-					case KELIMELIK_OBJECT_STRING:
-					default: {
-						kelimelik_string **strings = malloc(sizeof(*strings) * count);
-						for (size_t i=0; i<string_array_data->item_count; i++) {
-							error = kelimelik_string_new_v2(
-								&strings[i],
-								bytes + string_array_data->items[i].offset,
-								string_array_data->items[i].length
-							);
-						}
-						error = kelimelik_string_array_new_v4(
-							&array,
-							strings,
-							count
-						);
-						free(string_array_data);
-						string_array_data = NULL;
-						free(strings);
-					}
-				}
-				switch (array->type) {
-					case KELIMELIK_OBJECT_UINT32:
-						for (uint64_t i=0; i<array->item_count; i++) {
-							array->uint32s[i] = ntohl(array->uint32s[i]);
-						}
-						break;
-					case KELIMELIK_OBJECT_UINT64:
-						for (uint64_t i=0; i<array->item_count; i++) {
-							array->uint64s[i] = ntohll(array->uint64s[i]);
-						}
-					default:
-						break;
-				}
+				error = _kelimelik_parser_decode_array(
+					allocator,
+					&array,
+					*(bytes + 4),
+					ntohl(*(uint32_t *)bytes),
+					bytes + 5,
+					bytes_needed - 5,
+					string_blob_size,
+					intern_pool
+				);
+				if (KELIMELIK_IS_ERROR(error)) break;
 				bytes += bytes_needed;
 				kelimelik_packet_set_array(packet, i, array);
 				break;
 			}
 		}
+		if (KELIMELIK_IS_ERROR(error)) break;
 		bytes_length -= bytes_needed;
 	}
-	if (string_array_data) free(string_array_data);
 	if (i != object_count) {
-		kelimelik_packet_free(packet);
-		return error;
+		return KELIMELIK_IS_ERROR(error) ? error : _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
-	if (bytes_length > 0) {
-		fprintf(stderr, "[libkelimelik] %zu bytes remaining after parsing\n", bytes_length);
+	if (trusted && (bytes > end)) {
+		// The frame was shorter than its objects
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	}
-	*new_packet = packet;
+	*bytes_remaining = end - bytes;
 	return _KELIMELIK_SUCCESS;
 }
 
+static kelimelik_error kelimelik_parser_decode_objects(
+	kelimelik_packet *packet,
+	uint8_t *bytes,
+	size_t bytes_length,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	size_t *bytes_remaining
+) {
+	return kelimelik_parser_decode_objects_impl(packet, bytes, bytes_length, max_array_items, intern_pool, bytes_remaining, false);
+}
+
+static kelimelik_error kelimelik_parser_decode_trusted_objects(
+	kelimelik_packet *packet,
+	uint8_t *bytes,
+	size_t bytes_length,
+	uint32_t max_array_items,
+	kelimelik_intern_pool *intern_pool,
+	size_t *bytes_remaining
+) {
+	return kelimelik_parser_decode_objects_impl(packet, bytes, bytes_length, max_array_items, intern_pool, bytes_remaining, true);
+}
+
+// Skips the rest of a frame that can't be accepted.
+static void kelimelik_parser_skip(kelimelik_parser *self, uint32_t packet_size, kelimelik_error error) {
+	char error_message[100];
+	_kelimelik_log(KELIMELIK_LOG_ERROR, "Parser error: %s Skipping %u bytes.", kelimelik_strerror_buf(error, error_message, sizeof(error_message)), packet_size);
+	self->state = packet_size ? KELIMELIK_PARSER_SKIPPING : KELIMELIK_PARSER_WAITING_FOR_SIZE;
+	self->bytes_remaining = packet_size ? packet_size : 4;
+	self->index = 0;
+}
+
+// Copies bytes into the frame that is being assembled and advances bytes
+// past them. Returns true once a whole frame is in self->packet_buffer.
+// Frames that exceed a limit are skipped and the error is stored in error.
+static bool kelimelik_parser_fill(kelimelik_parser *self, uint8_t **bytes, size_t *bytes_length, kelimelik_error *error) {
+	if (self->state == KELIMELIK_PARSER_STREAMING) {
+		// Streamed frames are never complete here, they are delivered to
+		// the stream handler instead
+		_kelimelik_parser_stream(self, bytes, bytes_length);
+		return false;
+	}
+	if (self->state == KELIMELIK_PARSER_SKIPPING) {
+		uint32_t skipped = (*bytes_length > self->bytes_remaining) ? self->bytes_remaining : *bytes_length;
+		*bytes += skipped;
+		*bytes_length -= skipped;
+		if (!(self->bytes_remaining -= skipped)) {
+			self->state = KELIMELIK_PARSER_WAITING_FOR_SIZE;
+			self->bytes_remaining = 4;
+		}
+		return false;
+	}
+	uint8_t *target_buffer = (
+		(self->state == KELIMELIK_PARSER_WAITING_FOR_SIZE) ?
+		self->packet_size_buffer :
+		self->packet_buffer
+	);
+	uint32_t bytes_to_read = (
+		(*bytes_length > self->bytes_remaining) ?
+		self->bytes_remaining :
+		*bytes_length
+	);
+	*bytes_length -= bytes_to_read;
+	memcpy(target_buffer + self->index, *bytes, bytes_to_read);
+	*bytes += bytes_to_read;
+	self->bytes_remaining -= bytes_to_read;
+	if (self->bytes_remaining) {
+		self->index += bytes_to_read;
+		return false;
+	}
+	uint32_t packet_size = ntohl(*(uint32_t *)&self->packet_size_buffer[0]);
+	if (self->state == KELIMELIK_PARSER_WAITING_FOR_SIZE) {
+		if (self->limits.max_frame_size && (((size_t)packet_size + 4) > self->limits.max_frame_size)) {
+			*error = _kelimelik_parser_limit_exceeded(self, KELIMELIK_LIMIT_FRAME_SIZE);
+			kelimelik_parser_skip(self, packet_size, *error);
+			return false;
+		}
+		if (_kelimelik_parser_should_stream(self, packet_size)) {
+			_kelimelik_parser_stream_begin(self, packet_size);
+			return false;
+		}
+		if (!kelimelik_parser_reserve(self, (size_t)packet_size + 4)) {
+			*error = _kelimelik_parser_limit_exceeded(self, KELIMELIK_LIMIT_BUFFERED_BYTES);
+			kelimelik_parser_skip(self, packet_size, *error);
+			return false;
+		}
+		if (!(self->packet_buffer = _kelimelik_allocate(self->allocator, (size_t)packet_size + 4))) {
+			kelimelik_parser_release(self, (size_t)packet_size + 4);
+			*error = _KELIMELIK_ERROR_SYSCALL(malloc);
+			kelimelik_parser_skip(self, packet_size, *error);
+			return false;
+		}
+		self->state = KELIMELIK_PARSER_WAITING_FOR_DATA;
+		self->bytes_remaining = packet_size;
+		self->index = 4;
+		memcpy(self->packet_buffer, self->packet_size_buffer, 4);
+		return false;
+	}
+	self->state = KELIMELIK_PARSER_WAITING_FOR_SIZE;
+	self->index = 0;
+	self->bytes_remaining = 4;
+	return true;
+}
+
 kelimelik_error kelimelik_parser_advance(
 	kelimelik_parser *self,
 	uint8_t *bytes,
@@ -266,69 +758,151 @@ kelimelik_error kelimelik_parser_advance(
 ) {
 	size_t new_packets_count = 0;
 	kelimelik_error error = _KELIMELIK_SUCCESS;
+	kelimelik_parser_free_old_packets(self);
 	while (bytes_length) {
-		uint8_t *target_buffer = (
-			(self->state == KELIMELIK_PARSER_WAITING_FOR_SIZE) ?
-			self->packet_size_buffer :
-			self->packet_buffer
-		);
-		uint32_t bytes_to_read = (
-			(bytes_length > self->bytes_remaining) ?
-			self->bytes_remaining :
-			bytes_length
+		if (!kelimelik_parser_fill(self, &bytes, &bytes_length, &error)) {
+			continue;
+		}
+		// Size prefixes of 0xFFFFFFFC and up don't fit in 32 bits once the
+		// prefix itself is added
+		size_t frame_length = (size_t)ntohl(*(uint32_t *)&self->packet_size_buffer[0]) + 4;
+		kelimelik_packet *packet;
+		kelimelik_error frame_error = _kelimelik_parser_decode(
+			self->allocator,
+			self->packet_buffer,
+			frame_length,
+			self->options,
+			self->limits.max_array_items,
+			self->intern_pool,
+			&packet
 		);
-		bytes_length -= bytes_to_read;
-		memcpy(target_buffer + self->index, bytes, bytes_to_read);
-		bytes += bytes_to_read;
-		self->bytes_remaining -= bytes_to_read;
-		if (!self->bytes_remaining) {
-			uint32_t packet_size = ntohl(*(uint32_t *)&self->packet_size_buffer[0]);
-			if ((self->state = !self->state) == KELIMELIK_PARSER_WAITING_FOR_SIZE) {
-				self->index = 0;
-				kelimelik_packet *packet;
-				kelimelik_parser_free_old_packets(self);
-				error = kelimelik_parser_decode(
-					self->packet_buffer,
-					packet_size + 4,
-					&packet
-				);
-				free(self->packet_buffer);
-				self->packet_buffer = NULL;
-				if (!KELIMELIK_IS_ERROR(error)) {
-					new_packets_count++;
-					if (new_packets_count > self->packet_count) {
-						size_t size = new_packets_count * sizeof(*(self->packets));
-						if (!self->packets) {
-							self->packets = malloc(size);
-						}
-						else {
-							self->packets = realloc(self->packets, size);
-						}
-						self->packet_count = new_packets_count;
-					}
-					self->packets[new_packets_count-1] = packet;
-				}
-				else {
-					fprintf(stderr, "[libkelimelik] Parser error: %s\n", kelimelik_strerror(error));
-				}
-				self->bytes_remaining = 4;
+		if (frame_error.kelimelik_errno == KELIMELIK_ERROR_LIMIT_EXCEEDED) {
+			frame_error = _kelimelik_parser_limit_exceeded(self, frame_error.details);
+		}
+		if (
+			!KELIMELIK_IS_ERROR(frame_error) &&
+			(self->options & (KELIMELIK_PARSER_KEEP_WIRE | KELIMELIK_PARSER_LAZY)) &&
+			(packet->encoded_size == frame_length)
+		) {
+			// Hand the frame over to the packet
+			packet->wire = self->packet_buffer;
+		}
+		else {
+			_kelimelik_release(self->allocator, self->packet_buffer, frame_length);
+		}
+		kelimelik_parser_release(self, frame_length);
+		self->packet_buffer = NULL;
+		if (!KELIMELIK_IS_ERROR(frame_error) && (new_packets_count == self->packet_count)) {
+			kelimelik_packet **packets = kelimelik_parser_resize(
+				self,
+				self->packets,
+				&self->packet_count,
+				self->packet_count ? (self->packet_count * 2) : KELIMELIK_PARSER_MIN_CAPACITY,
+				sizeof(*packets)
+			);
+			if (packets) {
+				self->packets = packets;
 			}
 			else {
-				self->packet_buffer = malloc(packet_size+4);
-				self->bytes_remaining = packet_size;
-				self->index = 4;
-				memcpy(self->packet_buffer, self->packet_size_buffer, 4);
+				kelimelik_packet_free(packet);
+				frame_error = _KELIMELIK_ERROR_SYSCALL(malloc);
 			}
 		}
+		if (!KELIMELIK_IS_ERROR(frame_error)) {
+			self->packets[new_packets_count++] = packet;
+		}
 		else {
-			self->index += bytes_to_read;
+			char error_message[100];
+			_kelimelik_log(KELIMELIK_LOG_ERROR, "Parser error: %s", kelimelik_strerror_buf(frame_error, error_message, sizeof(error_message)));
+			error = frame_error;
 		}
 	}
+	self->packets = kelimelik_parser_shrink(self, self->packets, &self->packet_count, new_packets_count, sizeof(*(self->packets)));
+	self->packets_used = new_packets_count;
 	*new_packets_length_pt = new_packets_count;
 	*new_packets_pt = self->packets;
 	return error;
 }
 
+// Adds a complete frame to self->frames. Returns false if the frame is
+// malformed or if the array couldn't be grown.
+static bool kelimelik_parser_add_frame(kelimelik_parser *self, const uint8_t *bytes, size_t length, size_t index, kelimelik_error *error) {
+	if (index == self->frame_capacity) {
+		kelimelik_frame *frames = kelimelik_parser_resize(
+			self,
+			self->frames,
+			&self->frame_capacity,
+			self->frame_capacity ? (self->frame_capacity * 2) : KELIMELIK_PARSER_MIN_CAPACITY,
+			sizeof(*frames)
+		);
+		if (!frames) {
+			*error = _KELIMELIK_ERROR_SYSCALL(malloc);
+			return false;
+		}
+		self->frames = frames;
+	}
+	kelimelik_error frame_error = kelimelik_frame_peek_header(bytes, length, &self->frames[index]);
+	if (KELIMELIK_IS_ERROR(frame_error)) {
+		char error_message[100];
+		_kelimelik_log(KELIMELIK_LOG_ERROR, "Parser error: %s", kelimelik_strerror_buf(frame_error, error_message, sizeof(error_message)));
+		*error = frame_error;
+		return false;
+	}
+	return true;
+}
+
+kelimelik_error kelimelik_parser_advance_frames(
+	kelimelik_parser *self,
+	uint8_t *bytes,
+	size_t bytes_length,
+	const kelimelik_frame **new_frames_pt,
+	size_t *new_frames_length_pt
+) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!bytes && bytes_length) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!new_frames_pt) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	if (!new_frames_length_pt) return _KELIMELIK_ERROR_INVALID_ARGUMENT(4);
+	kelimelik_parser_free_old_frame(self);
+	size_t new_frames_count = 0;
+	kelimelik_error error = _KELIMELIK_SUCCESS;
+	while (bytes_length) {
+		// Frames that are completely in the input are used where they are
+		if ((self->state == KELIMELIK_PARSER_WAITING_FOR_SIZE) && !self->index && (bytes_length >= 4)) {
+			size_t frame_length = (size_t)ntohl(*(uint32_t *)bytes) + 4;
+			if ((frame_length <= bytes_length) && !_kelimelik_parser_should_stream(self, frame_length - 4)) {
+				if (self->limits.max_frame_size && (frame_length > self->limits.max_frame_size)) {
+					error = _kelimelik_parser_limit_exceeded(self, KELIMELIK_LIMIT_FRAME_SIZE);
+					char error_message[100];
+					_kelimelik_log(KELIMELIK_LOG_ERROR, "Parser error: %s Skipping %zu bytes.", kelimelik_strerror_buf(error, error_message, sizeof(error_message)), frame_length - 4);
+				}
+				else if (kelimelik_parser_add_frame(self, bytes, frame_length, new_frames_count, &error)) {
+					new_frames_count++;
+				}
+				bytes += frame_length;
+				bytes_length -= frame_length;
+				continue;
+			}
+		}
+
+		// Everything else is copied until the frame is complete. This can
+		// only happen once per call, since every frame after it starts in
+		// the input.
+		if (!kelimelik_parser_fill(self, &bytes, &bytes_length, &error)) {
+			continue;
+		}
+		self->frame_buffer = self->packet_buffer;
+		self->packet_buffer = NULL;
+		size_t frame_length = (size_t)ntohl(*(uint32_t *)self->frame_buffer) + 4;
+		if (kelimelik_parser_add_frame(self, self->frame_buffer, frame_length, new_frames_count, &error)) {
+			new_frames_count++;
+		}
+	}
+	self->frames = kelimelik_parser_shrink(self, self->frames, &self->frame_capacity, new_frames_count, sizeof(*(self->frames)));
+	*new_frames_length_pt = new_frames_count;
+	*new_frames_pt = self->frames;
+	return error;
+}
+
 kelimelik_error kelimelik_parser_advance_single(
 	kelimelik_parser *self,
 	uint8_t byte,
@@ -350,4 +924,44 @@ kelimelik_error kelimelik_parser_advance_single(
 		*new_packet = NULL;
 	}
 	return error;
-}
\ No newline at end of file
+}
+
+kelimelik_error kelimelik_frame_peek_header(const void *bytes_pt, size_t length, kelimelik_frame *frame) {
+	const uint8_t *bytes = bytes_pt;
+	if (!bytes && length) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!frame) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	frame->length = 0;
+	if (length < 4) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	}
+	uint32_t packet_size = ntohl(*(uint32_t *)bytes);
+	if (packet_size > (UINT32_MAX - 4)) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+	frame->length = packet_size + 4;
+	if (length < frame->length) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	}
+
+	// Size prefix, header size, header and object count
+	if (packet_size < 3) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+	uint16_t header_length = ntohs(*(uint16_t *)(bytes + 4));
+	if (header_length > (packet_size - 3)) {
+		return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+	frame->bytes = bytes;
+	frame->header = bytes + 6;
+	frame->header_length = header_length;
+	frame->object_count = bytes[6 + header_length];
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_frame_decode(const kelimelik_frame *frame, const kelimelik_allocator *allocator, kelimelik_packet **out) {
+	if (!frame || !frame->bytes) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+
+	// The decoder only reads from the frame
+	return _kelimelik_parser_decode(allocator, (uint8_t *)frame->bytes, frame->length, 0, 0, NULL, out);
+}
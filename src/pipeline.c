@@ -0,0 +1,415 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Decode pipeline. The submitting thread only frames the bytes with a parser
+// in framing-only mode and copies every frame into a job. Jobs are queued on
+// the deque of the worker that owns the connection, so that frames of one
+// connection are usually decoded in order by the same thread. Workers that
+// run out of jobs steal from the others. Finished jobs go into a list on
+// their connection that is sorted by sequence number, and whichever worker
+// finishes the next job in sequence delivers it along with every job that
+// was waiting for it.
+
+#define KELIMELIK_PIPELINE_MAX_WORKERS 256
+#define KELIMELIK_PIPELINE_MIN_CAPACITY 64
+
+struct kelimelik_pipeline_job {
+	struct kelimelik_pipeline_job *next;
+	kelimelik_pipeline_connection *connection;
+	uint64_t sequence;
+	kelimelik_frame frame;
+	kelimelik_packet *packet;
+	kelimelik_error error;
+	uint8_t bytes[];
+};
+
+// A ring of jobs. Both the owner and thieves take the oldest job, since that
+// is the one that is holding up delivery on its connection.
+struct kelimelik_pipeline_deque {
+	pthread_mutex_t mutex;
+	struct kelimelik_pipeline_job **jobs;
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+struct kelimelik_pipeline_worker {
+	kelimelik_pipeline *pipeline;
+	unsigned int index;
+	pthread_t thread;
+	struct kelimelik_pipeline_deque deque;
+};
+
+struct kelimelik_pipeline {
+	const kelimelik_allocator *allocator;
+	kelimelik_pipeline_callback callback;
+	void *context;
+	kelimelik_parser_limits limits;
+	kelimelik_intern_pool *intern_pool;
+	int options;
+
+	unsigned int worker_count;
+	struct kelimelik_pipeline_worker *workers;
+
+	// Connections are assigned to workers round robin.
+	_Atomic unsigned int next_worker;
+
+	// queued is the number of jobs in the deques. in_flight also counts the
+	// jobs that are being decoded or waiting to be delivered.
+	_Atomic size_t queued;
+	_Atomic size_t in_flight;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_available;
+	pthread_cond_t idle;
+	bool stopping;
+};
+
+struct kelimelik_pipeline_connection {
+	kelimelik_pipeline *pipeline;
+	void *context;
+	unsigned int worker;
+
+	// Only used by the submitting thread.
+	kelimelik_parser *parser;
+	uint64_t next_sequence;
+
+	// Finished jobs that are waiting for earlier ones, sorted by sequence.
+	pthread_mutex_t mutex;
+	struct kelimelik_pipeline_job *finished;
+	uint64_t next_delivery;
+	bool delivering;
+
+	// One reference for the owner and one for every job in flight.
+	_Atomic size_t references;
+};
+
+static size_t kelimelik_pipeline_job_size(uint32_t frame_length) {
+	return sizeof(struct kelimelik_pipeline_job) + frame_length;
+}
+
+static bool kelimelik_pipeline_push(kelimelik_pipeline *pipeline, struct kelimelik_pipeline_deque *deque, struct kelimelik_pipeline_job *job) {
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->count == deque->capacity) {
+		size_t new_capacity = deque->capacity ? (deque->capacity * 2) : KELIMELIK_PIPELINE_MIN_CAPACITY;
+		struct kelimelik_pipeline_job **jobs = _kelimelik_allocate(pipeline->allocator, new_capacity * sizeof(*jobs));
+		if (!jobs) {
+			pthread_mutex_unlock(&deque->mutex);
+			return false;
+		}
+		for (size_t i=0; i<deque->count; i++) {
+			jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+		}
+		_kelimelik_release(pipeline->allocator, deque->jobs, deque->capacity * sizeof(*jobs));
+		deque->jobs = jobs;
+		deque->head = 0;
+		deque->capacity = new_capacity;
+	}
+	deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+	deque->count++;
+	pthread_mutex_unlock(&deque->mutex);
+	return true;
+}
+
+static struct kelimelik_pipeline_job *kelimelik_pipeline_pop(struct kelimelik_pipeline_deque *deque) {
+	struct kelimelik_pipeline_job *job = NULL;
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->count) {
+		job = deque->jobs[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+		deque->count--;
+	}
+	pthread_mutex_unlock(&deque->mutex);
+	return job;
+}
+
+static void kelimelik_pipeline_connection_release(kelimelik_pipeline_connection *self) {
+	if (atomic_fetch_sub(&self->references, 1) != 1) {
+		return;
+	}
+	pthread_mutex_destroy(&self->mutex);
+	_kelimelik_release(self->pipeline->allocator, self, sizeof(*self));
+}
+
+static void kelimelik_pipeline_job_free(kelimelik_pipeline *pipeline, struct kelimelik_pipeline_job *job) {
+	if (job->packet) {
+		kelimelik_packet_free(job->packet);
+	}
+	kelimelik_pipeline_connection_release(job->connection);
+	_kelimelik_release(pipeline->allocator, job, kelimelik_pipeline_job_size(job->frame.length));
+	if (atomic_fetch_sub(&pipeline->in_flight, 1) == 1) {
+		pthread_mutex_lock(&pipeline->mutex);
+		pthread_cond_broadcast(&pipeline->idle);
+		pthread_mutex_unlock(&pipeline->mutex);
+	}
+}
+
+static void kelimelik_pipeline_deliver(kelimelik_pipeline *pipeline, struct kelimelik_pipeline_job *job) {
+	kelimelik_pipeline_connection *connection = job->connection;
+	pthread_mutex_lock(&connection->mutex);
+	struct kelimelik_pipeline_job **link = &connection->finished;
+	while (*link && ((*link)->sequence < job->sequence)) {
+		link = &(*link)->next;
+	}
+	job->next = *link;
+	*link = job;
+
+	// Another worker is already delivering and will pick the job up
+	if (connection->delivering) {
+		pthread_mutex_unlock(&connection->mutex);
+		return;
+	}
+	connection->delivering = true;
+
+	// Delivered jobs give up their references, so hold one until the end
+	atomic_fetch_add(&connection->references, 1);
+	while (connection->finished && (connection->finished->sequence == connection->next_delivery)) {
+		struct kelimelik_pipeline_job *next = connection->finished;
+		connection->finished = next->next;
+		connection->next_delivery++;
+		pthread_mutex_unlock(&connection->mutex);
+		pipeline->callback(connection->context, &next->frame, next->packet, next->error, pipeline->context);
+		kelimelik_pipeline_job_free(pipeline, next);
+		pthread_mutex_lock(&connection->mutex);
+	}
+	connection->delivering = false;
+	pthread_mutex_unlock(&connection->mutex);
+	kelimelik_pipeline_connection_release(connection);
+}
+
+static struct kelimelik_pipeline_job *kelimelik_pipeline_take(struct kelimelik_pipeline_worker *worker) {
+	kelimelik_pipeline *pipeline = worker->pipeline;
+	for (unsigned int i=0; i<pipeline->worker_count; i++) {
+		struct kelimelik_pipeline_worker *victim = &pipeline->workers[(worker->index + i) % pipeline->worker_count];
+		struct kelimelik_pipeline_job *job = kelimelik_pipeline_pop(&victim->deque);
+		if (job) {
+			atomic_fetch_sub(&pipeline->queued, 1);
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void *kelimelik_pipeline_thread(void *context) {
+	struct kelimelik_pipeline_worker *worker = context;
+	kelimelik_pipeline *pipeline = worker->pipeline;
+	for (;;) {
+		struct kelimelik_pipeline_job *job = kelimelik_pipeline_take(worker);
+		if (job) {
+			job->error = _kelimelik_parser_decode(
+				pipeline->allocator,
+				job->bytes,
+				job->frame.length,
+				pipeline->options,
+				pipeline->limits.max_array_items,
+				pipeline->intern_pool,
+				&job->packet
+			);
+			if (KELIMELIK_IS_ERROR(job->error)) {
+				job->packet = NULL;
+			}
+			kelimelik_pipeline_deliver(pipeline, job);
+			continue;
+		}
+
+		// Jobs are counted before they are pushed and the submitter signals
+		// afterwards, so a job can't be missed between the check and the wait
+		pthread_mutex_lock(&pipeline->mutex);
+		while (!atomic_load(&pipeline->queued) && !pipeline->stopping) {
+			pthread_cond_wait(&pipeline->work_available, &pipeline->mutex);
+		}
+		bool done = pipeline->stopping && !atomic_load(&pipeline->queued);
+		pthread_mutex_unlock(&pipeline->mutex);
+		if (done) {
+			return NULL;
+		}
+	}
+}
+
+static void kelimelik_pipeline_stop(kelimelik_pipeline *self, unsigned int started) {
+	pthread_mutex_lock(&self->mutex);
+	self->stopping = true;
+	pthread_cond_broadcast(&self->work_available);
+	pthread_mutex_unlock(&self->mutex);
+	for (unsigned int i=0; i<started; i++) {
+		pthread_join(self->workers[i].thread, NULL);
+	}
+	for (unsigned int i=0; i<self->worker_count; i++) {
+		struct kelimelik_pipeline_deque *deque = &self->workers[i].deque;
+		_kelimelik_release(self->allocator, deque->jobs, deque->capacity * sizeof(*deque->jobs));
+		pthread_mutex_destroy(&deque->mutex);
+	}
+	_kelimelik_release(self->allocator, self->workers, self->worker_count * sizeof(*self->workers));
+	pthread_mutex_destroy(&self->mutex);
+	pthread_cond_destroy(&self->work_available);
+	pthread_cond_destroy(&self->idle);
+	_kelimelik_release(self->allocator, self, sizeof(*self));
+}
+
+kelimelik_error kelimelik_pipeline_new(
+	kelimelik_pipeline **out,
+	unsigned int worker_count,
+	const kelimelik_allocator *allocator,
+	kelimelik_pipeline_callback callback,
+	void *context
+) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!worker_count || (worker_count > KELIMELIK_PIPELINE_MAX_WORKERS)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!callback) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_pipeline *pipeline = _kelimelik_allocate(allocator, sizeof(*pipeline));
+	if (!pipeline) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->workers = _kelimelik_allocate(allocator, worker_count * sizeof(*pipeline->workers));
+	if (!pipeline->workers) {
+		_kelimelik_release(allocator, pipeline, sizeof(*pipeline));
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	pipeline->allocator = allocator;
+	pipeline->callback = callback;
+	pipeline->context = context;
+	pipeline->worker_count = worker_count;
+	atomic_init(&pipeline->next_worker, 0);
+	atomic_init(&pipeline->queued, 0);
+	atomic_init(&pipeline->in_flight, 0);
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->work_available, NULL);
+	pthread_cond_init(&pipeline->idle, NULL);
+	for (unsigned int i=0; i<worker_count; i++) {
+		struct kelimelik_pipeline_worker *worker = &pipeline->workers[i];
+		worker->pipeline = pipeline;
+		worker->index = i;
+		worker->deque.jobs = NULL;
+		worker->deque.head = 0;
+		worker->deque.count = 0;
+		worker->deque.capacity = 0;
+		pthread_mutex_init(&worker->deque.mutex, NULL);
+	}
+	for (unsigned int i=0; i<worker_count; i++) {
+		int result = pthread_create(&pipeline->workers[i].thread, NULL, kelimelik_pipeline_thread, &pipeline->workers[i]);
+		if (result != 0) {
+			kelimelik_pipeline_stop(pipeline, i);
+			return _KELIMELIK_ERROR(KELIMELIK_ERROR_pthread_create, result);
+		}
+	}
+	*out = pipeline;
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_pipeline_set_limits(kelimelik_pipeline *self, const kelimelik_parser_limits *limits) {
+	self->limits = *limits;
+}
+
+void kelimelik_pipeline_set_intern_pool(kelimelik_pipeline *self, kelimelik_intern_pool *pool) {
+	self->intern_pool = pool;
+}
+
+void kelimelik_pipeline_set_options(kelimelik_pipeline *self, int options) {
+	self->options = options & KELIMELIK_PARSER_TRUSTED;
+}
+
+kelimelik_error kelimelik_pipeline_connection_new(
+	kelimelik_pipeline *self,
+	kelimelik_pipeline_connection **out,
+	void *connection_context
+) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_pipeline_connection *connection = _kelimelik_allocate(self->allocator, sizeof(*connection));
+	if (!connection) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	kelimelik_error error = kelimelik_parser_new_v2(&connection->parser, self->allocator);
+	if (KELIMELIK_IS_ERROR(error)) {
+		_kelimelik_release(self->allocator, connection, sizeof(*connection));
+		return error;
+	}
+	kelimelik_parser_set_limits(connection->parser, &self->limits);
+	connection->pipeline = self;
+	connection->context = connection_context;
+	connection->worker = atomic_fetch_add(&self->next_worker, 1) % self->worker_count;
+	connection->next_sequence = 0;
+	pthread_mutex_init(&connection->mutex, NULL);
+	connection->finished = NULL;
+	connection->next_delivery = 0;
+	connection->delivering = false;
+	atomic_init(&connection->references, 1);
+	*out = connection;
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_pipeline_submit(kelimelik_pipeline_connection *self, uint8_t *bytes, size_t bytes_length) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_pipeline *pipeline = self->pipeline;
+	const kelimelik_frame *frames;
+	size_t frame_count;
+	kelimelik_error error = kelimelik_parser_advance_frames(self->parser, bytes, bytes_length, &frames, &frame_count);
+	size_t submitted = 0;
+	for (size_t i=0; i<frame_count; i++) {
+		const kelimelik_frame *frame = &frames[i];
+		struct kelimelik_pipeline_job *job = _kelimelik_allocate(pipeline->allocator, kelimelik_pipeline_job_size(frame->length));
+		if (!job) {
+			error = _KELIMELIK_ERROR_SYSCALL(malloc);
+			_kelimelik_log(KELIMELIK_LOG_ERROR, "Pipeline dropped a frame: %s", kelimelik_strerror(error));
+			continue;
+		}
+		memcpy(job->bytes, frame->bytes, frame->length);
+		job->frame = *frame;
+		job->frame.bytes = job->bytes;
+		job->frame.header = job->bytes + (frame->header - frame->bytes);
+		job->connection = self;
+		job->packet = NULL;
+		job->error = _KELIMELIK_SUCCESS;
+
+		// Sequence numbers are only taken once the job can't fail anymore,
+		// since a gap would stall delivery on the connection
+		atomic_fetch_add(&self->references, 1);
+		atomic_fetch_add(&pipeline->in_flight, 1);
+		atomic_fetch_add(&pipeline->queued, 1);
+		job->sequence = self->next_sequence;
+		if (!kelimelik_pipeline_push(pipeline, &pipeline->workers[self->worker].deque, job)) {
+			atomic_fetch_sub(&pipeline->queued, 1);
+			atomic_fetch_sub(&pipeline->in_flight, 1);
+			atomic_fetch_sub(&self->references, 1);
+			_kelimelik_release(pipeline->allocator, job, kelimelik_pipeline_job_size(frame->length));
+			error = _KELIMELIK_ERROR_SYSCALL(malloc);
+			_kelimelik_log(KELIMELIK_LOG_ERROR, "Pipeline dropped a frame: %s", kelimelik_strerror(error));
+			continue;
+		}
+		self->next_sequence++;
+		submitted++;
+	}
+	if (submitted) {
+		pthread_mutex_lock(&pipeline->mutex);
+		if (submitted == 1) {
+			pthread_cond_signal(&pipeline->work_available);
+		}
+		else {
+			pthread_cond_broadcast(&pipeline->work_available);
+		}
+		pthread_mutex_unlock(&pipeline->mutex);
+	}
+	return error;
+}
+
+void kelimelik_pipeline_connection_free(kelimelik_pipeline_connection *self) {
+	kelimelik_parser_free(self->parser);
+	self->parser = NULL;
+	kelimelik_pipeline_connection_release(self);
+}
+
+void kelimelik_pipeline_flush(kelimelik_pipeline *self) {
+	pthread_mutex_lock(&self->mutex);
+	while (atomic_load(&self->in_flight)) {
+		pthread_cond_wait(&self->idle, &self->mutex);
+	}
+	pthread_mutex_unlock(&self->mutex);
+}
+
+void kelimelik_pipeline_free(kelimelik_pipeline *self) {
+	kelimelik_pipeline_flush(self);
+	kelimelik_pipeline_stop(self, self->worker_count);
+}
@@ -0,0 +1,171 @@
+#include "kelimelik-private.h"
+
+// Size classes. Blocks up to 512 bytes are rounded up to a multiple of 16 and
+// carved out of 64 KB slabs. Packet blocks include the arena for their
+// inline strings, so a class holds packets of many different object counts
+// and string lengths, and a freed block is reused by any packet that rounds
+// up to the same size. Bigger blocks such as frame buffers use power of two
+// classes up to 64 KB and are allocated from the parent one at a time.
+// Anything bigger goes straight to the parent.
+#define KELIMELIK_POOL_SMALL_STEP 16
+#define KELIMELIK_POOL_SMALL_MAX 512
+#define KELIMELIK_POOL_SMALL_CLASSES (KELIMELIK_POOL_SMALL_MAX / KELIMELIK_POOL_SMALL_STEP)
+#define KELIMELIK_POOL_LARGE_MIN_SHIFT 10
+#define KELIMELIK_POOL_LARGE_MAX_SHIFT 16
+#define KELIMELIK_POOL_CLASSES (KELIMELIK_POOL_SMALL_CLASSES + KELIMELIK_POOL_LARGE_MAX_SHIFT - KELIMELIK_POOL_LARGE_MIN_SHIFT + 1)
+#define KELIMELIK_POOL_SLAB_SIZE (64 * 1024)
+#define KELIMELIK_POOL_DEFAULT_MAX_CACHED (1024 * 1024)
+
+struct kelimelik_pool_block {
+	struct kelimelik_pool_block *next;
+};
+
+// Placed at the beginning of every slab. The padding keeps the blocks that
+// follow it 16-byte aligned.
+struct kelimelik_pool_slab {
+	struct kelimelik_pool_slab *next;
+	uint8_t padding[KELIMELIK_POOL_SMALL_STEP - sizeof(void *)];
+};
+
+struct kelimelik_pool {
+	kelimelik_allocator allocator;
+	const kelimelik_allocator *parent;
+	struct kelimelik_pool_block *free_lists[KELIMELIK_POOL_CLASSES];
+	struct kelimelik_pool_slab *slabs;
+	uint8_t *slab_cursor;
+	uint8_t *slab_end;
+
+	// Bytes in the freelists of the large classes. Small blocks can't be
+	// given back to the parent individually, so they are always kept.
+	size_t cached_bytes;
+	size_t max_cached_bytes;
+};
+
+// Returns -1 for blocks that are too big to be pooled.
+static int kelimelik_pool_class(size_t size) {
+	if (size <= KELIMELIK_POOL_SMALL_MAX) {
+		return size ? ((size - 1) / KELIMELIK_POOL_SMALL_STEP) : 0;
+	}
+	int shift = KELIMELIK_POOL_LARGE_MIN_SHIFT;
+	while (((size_t)1 << shift) < size) {
+		if (++shift > KELIMELIK_POOL_LARGE_MAX_SHIFT) {
+			return -1;
+		}
+	}
+	return KELIMELIK_POOL_SMALL_CLASSES + shift - KELIMELIK_POOL_LARGE_MIN_SHIFT;
+}
+
+static size_t kelimelik_pool_class_size(int class) {
+	if (class < KELIMELIK_POOL_SMALL_CLASSES) {
+		return (class + 1) * KELIMELIK_POOL_SMALL_STEP;
+	}
+	return (size_t)1 << (class - KELIMELIK_POOL_SMALL_CLASSES + KELIMELIK_POOL_LARGE_MIN_SHIFT);
+}
+
+static void *kelimelik_pool_allocate(void *context, size_t size) {
+	kelimelik_pool *self = context;
+	int class = kelimelik_pool_class(size);
+	if (class == -1) {
+		return _kelimelik_allocate(self->parent, size);
+	}
+	size_t class_size = kelimelik_pool_class_size(class);
+	struct kelimelik_pool_block *block = self->free_lists[class];
+	if (block) {
+		self->free_lists[class] = block->next;
+		if (class >= KELIMELIK_POOL_SMALL_CLASSES) {
+			self->cached_bytes -= class_size;
+		}
+		return block;
+	}
+	if (class >= KELIMELIK_POOL_SMALL_CLASSES) {
+		return _kelimelik_allocate(self->parent, class_size);
+	}
+
+	// Carve a new small block out of the current slab. Whatever is left in
+	// the old slab is wasted, which is at most 496 bytes.
+	if ((size_t)(self->slab_end - self->slab_cursor) < class_size) {
+		struct kelimelik_pool_slab *slab = _kelimelik_allocate(self->parent, KELIMELIK_POOL_SLAB_SIZE);
+		if (!slab) {
+			return NULL;
+		}
+		slab->next = self->slabs;
+		self->slabs = slab;
+		self->slab_cursor = (uint8_t *)(slab + 1);
+		self->slab_end = (uint8_t *)slab + KELIMELIK_POOL_SLAB_SIZE;
+	}
+	void *pointer = self->slab_cursor;
+	self->slab_cursor += class_size;
+	return pointer;
+}
+
+static void kelimelik_pool_release(void *context, void *pointer, size_t size) {
+	kelimelik_pool *self = context;
+	int class = kelimelik_pool_class(size);
+	if (class == -1) {
+		_kelimelik_release(self->parent, pointer, size);
+		return;
+	}
+	size_t class_size = kelimelik_pool_class_size(class);
+	if (class >= KELIMELIK_POOL_SMALL_CLASSES) {
+		if ((self->cached_bytes + class_size) > self->max_cached_bytes) {
+			_kelimelik_release(self->parent, pointer, class_size);
+			return;
+		}
+		self->cached_bytes += class_size;
+	}
+	struct kelimelik_pool_block *block = pointer;
+	block->next = self->free_lists[class];
+	self->free_lists[class] = block;
+}
+
+kelimelik_error kelimelik_pool_new(kelimelik_pool **out, const kelimelik_allocator *parent, size_t max_cached_bytes) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	parent = _kelimelik_allocator(parent);
+	kelimelik_pool *pool = _kelimelik_allocate(parent, sizeof(*pool));
+	if (!pool) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	pool->allocator.allocate = kelimelik_pool_allocate;
+	pool->allocator.reallocate = NULL;
+	pool->allocator.release = kelimelik_pool_release;
+	pool->allocator.context = pool;
+	pool->parent = parent;
+	for (int i=0; i<KELIMELIK_POOL_CLASSES; i++) {
+		pool->free_lists[i] = NULL;
+	}
+	pool->slabs = NULL;
+	pool->slab_cursor = NULL;
+	pool->slab_end = NULL;
+	pool->cached_bytes = 0;
+	pool->max_cached_bytes = max_cached_bytes ? max_cached_bytes : KELIMELIK_POOL_DEFAULT_MAX_CACHED;
+	*out = pool;
+	return _KELIMELIK_SUCCESS;
+}
+
+const kelimelik_allocator *kelimelik_pool_allocator(kelimelik_pool *self) {
+	return &self->allocator;
+}
+
+void kelimelik_pool_trim(kelimelik_pool *self) {
+	for (int class=KELIMELIK_POOL_SMALL_CLASSES; class<KELIMELIK_POOL_CLASSES; class++) {
+		struct kelimelik_pool_block *block = self->free_lists[class];
+		while (block) {
+			struct kelimelik_pool_block *next = block->next;
+			_kelimelik_release(self->parent, block, kelimelik_pool_class_size(class));
+			block = next;
+		}
+		self->free_lists[class] = NULL;
+	}
+	self->cached_bytes = 0;
+}
+
+void kelimelik_pool_free(kelimelik_pool *self) {
+	kelimelik_pool_trim(self);
+	struct kelimelik_pool_slab *slab = self->slabs;
+	while (slab) {
+		struct kelimelik_pool_slab *next = slab->next;
+		_kelimelik_release(self->parent, slab, KELIMELIK_POOL_SLAB_SIZE);
+		slab = next;
+	}
+	_kelimelik_release(self->parent, self, sizeof(*self));
+}
@@ -0,0 +1,388 @@
+#include "kelimelik-private.h"
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define KELIMELIK_SEND_QUEUE_ZEROCOPY 1
+#else
+#define KELIMELIK_SEND_QUEUE_ZEROCOPY 0
+#endif
+
+// Send queues are rings of frozen packets. The first packet may have been
+// written partially, head_offset is the number of its bytes that are already
+// out. Flushing hands up to KELIMELIK_SEND_QUEUE_IOV_COUNT packets to the
+// kernel per call.
+//
+// Every successful MSG_ZEROCOPY send gets the next ID from a counter the
+// kernel keeps for the socket, and the kernel later reports ranges of IDs
+// that it is done with on the socket's error queue. Each send pins its packet
+// with an extra reference until its ID is reported. Pins are kept in the
+// order of their IDs, so the ID of a pin is first_pin_id plus its index.
+
+#define KELIMELIK_SEND_QUEUE_IOV_COUNT 64
+#define KELIMELIK_SEND_QUEUE_MIN_CAPACITY 16
+
+// macOS has no MSG_NOSIGNAL, SO_NOSIGPIPE is set on the socket instead
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct kelimelik_send_queue_pin {
+	kelimelik_packet *packet;
+	size_t length;
+	bool done;
+};
+
+struct kelimelik_send_queue {
+	int fd;
+	const kelimelik_allocator *allocator;
+	pthread_mutex_t mutex;
+	kelimelik_packet **packets;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	size_t head_offset;
+	size_t pending_bytes;
+
+	// 0 if zerocopy sends are off.
+	size_t zerocopy_threshold;
+	struct kelimelik_send_queue_pin *pins;
+	size_t pins_head;
+	size_t pins_count;
+	size_t pins_capacity;
+	uint32_t first_pin_id;
+	size_t pinned_bytes;
+
+	kelimelik_send_queue_stats stats;
+};
+
+kelimelik_error kelimelik_send_queue_new(kelimelik_send_queue **out, int fd, const kelimelik_allocator *allocator) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (fd < 0) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_send_queue *queue = _kelimelik_allocate(allocator, sizeof(*queue));
+	if (!queue) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+#ifdef SO_NOSIGPIPE
+	int enabled = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+	queue->fd = fd;
+	queue->allocator = allocator;
+	pthread_mutex_init(&queue->mutex, NULL);
+	queue->packets = NULL;
+	queue->head = 0;
+	queue->count = 0;
+	queue->capacity = 0;
+	queue->head_offset = 0;
+	queue->pending_bytes = 0;
+	queue->zerocopy_threshold = 0;
+	queue->pins = NULL;
+	queue->pins_head = 0;
+	queue->pins_count = 0;
+	queue->pins_capacity = 0;
+	queue->first_pin_id = 0;
+	queue->pinned_bytes = 0;
+	memset(&queue->stats, 0, sizeof(queue->stats));
+	*out = queue;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Must be called with the mutex held.
+static bool kelimelik_send_queue_grow(kelimelik_send_queue *self) {
+	size_t new_capacity = self->capacity ? (self->capacity * 2) : KELIMELIK_SEND_QUEUE_MIN_CAPACITY;
+	kelimelik_packet **packets = _kelimelik_allocate(self->allocator, new_capacity * sizeof(*packets));
+	if (!packets) {
+		return false;
+	}
+	for (size_t i=0; i<self->count; i++) {
+		packets[i] = self->packets[(self->head + i) % self->capacity];
+	}
+	_kelimelik_release(self->allocator, self->packets, self->capacity * sizeof(*packets));
+	self->packets = packets;
+	self->head = 0;
+	self->capacity = new_capacity;
+	return true;
+}
+
+kelimelik_error kelimelik_send_queue_push(kelimelik_send_queue *self, kelimelik_packet *packet) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!packet) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	kelimelik_error error = kelimelik_packet_freeze(packet);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	pthread_mutex_lock(&self->mutex);
+	if ((self->count == self->capacity) && !kelimelik_send_queue_grow(self)) {
+		pthread_mutex_unlock(&self->mutex);
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	self->packets[(self->head + self->count) % self->capacity] = kelimelik_packet_retain(packet);
+	self->count++;
+	self->pending_bytes += packet->encoded_size;
+	pthread_mutex_unlock(&self->mutex);
+	return _KELIMELIK_SUCCESS;
+}
+
+kelimelik_error kelimelik_send_queue_set_zerocopy(kelimelik_send_queue *self, size_t threshold) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+#if KELIMELIK_SEND_QUEUE_ZEROCOPY
+	if (threshold) {
+		int enabled = 1;
+		if (setsockopt(self->fd, SOL_SOCKET, SO_ZEROCOPY, &enabled, sizeof(enabled)) == -1) {
+			if ((errno == EOPNOTSUPP) || (errno == ENOPROTOOPT)) {
+				return _KELIMELIK_ERROR_NOT_IMPLEMENTED;
+			}
+			return _KELIMELIK_ERROR_SYSCALL(setsockopt);
+		}
+	}
+	pthread_mutex_lock(&self->mutex);
+	self->zerocopy_threshold = threshold;
+	pthread_mutex_unlock(&self->mutex);
+	return _KELIMELIK_SUCCESS;
+#else
+	return threshold ? _KELIMELIK_ERROR_NOT_IMPLEMENTED : _KELIMELIK_SUCCESS;
+#endif
+}
+
+#if KELIMELIK_SEND_QUEUE_ZEROCOPY
+
+// Makes room for one more pin, so that pinning can't fail once the bytes
+// are handed to the kernel. Must be called with the mutex held.
+static bool kelimelik_send_queue_reserve_pin(kelimelik_send_queue *self) {
+	if ((self->pins_head + self->pins_count) == self->pins_capacity) {
+		// Move the pins to the front before growing the array
+		if (self->pins_head) {
+			memmove(self->pins, self->pins + self->pins_head, self->pins_count * sizeof(*self->pins));
+			self->pins_head = 0;
+		}
+		else {
+			size_t new_capacity = self->pins_capacity ? (self->pins_capacity * 2) : KELIMELIK_SEND_QUEUE_MIN_CAPACITY;
+			struct kelimelik_send_queue_pin *pins = _kelimelik_reallocate(
+				self->allocator,
+				self->pins,
+				self->pins_capacity * sizeof(*pins),
+				new_capacity * sizeof(*pins)
+			);
+			if (!pins) {
+				return false;
+			}
+			self->pins = pins;
+			self->pins_capacity = new_capacity;
+		}
+	}
+	return true;
+}
+
+// Takes a reference to the packet. Room must have been reserved with
+// kelimelik_send_queue_reserve_pin().
+static void kelimelik_send_queue_pin(kelimelik_send_queue *self, kelimelik_packet *packet, size_t length) {
+	struct kelimelik_send_queue_pin *pin = &self->pins[self->pins_head + self->pins_count];
+	pin->packet = kelimelik_packet_retain(packet);
+	pin->length = length;
+	pin->done = false;
+	self->pins_count++;
+	self->pinned_bytes += length;
+}
+
+// Reads the completion notifications from the error queue and releases the
+// pins that the kernel is done with. Must be called with the mutex held.
+static void kelimelik_send_queue_reap(kelimelik_send_queue *self) {
+	while (self->pins_count) {
+		uint8_t control[128];
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		if (recvmsg(self->fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			bool is_error = (
+				((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+				((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))
+			);
+			if (!is_error) {
+				continue;
+			}
+			struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if ((error->ee_errno != 0) || (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+				continue;
+			}
+			uint32_t first_id = error->ee_info;
+			uint32_t last_id = error->ee_data;
+			if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				self->stats.zerocopy_copied += (uint32_t)(last_id - first_id) + 1;
+			}
+			for (uint32_t id=first_id;; id++) {
+				uint32_t index = id - self->first_pin_id;
+				if (index < self->pins_count) {
+					self->pins[self->pins_head + index].done = true;
+				}
+				if (id == last_id) {
+					break;
+				}
+			}
+		}
+
+		// Completions usually arrive in order, but a pin can only be
+		// released once every pin before it is done
+		while (self->pins_count && self->pins[self->pins_head].done) {
+			struct kelimelik_send_queue_pin *pin = &self->pins[self->pins_head];
+			self->pinned_bytes -= pin->length;
+			kelimelik_packet_release(pin->packet);
+			self->pins_head++;
+			self->pins_count--;
+			self->first_pin_id++;
+		}
+	}
+}
+
+#endif
+
+kelimelik_error kelimelik_send_queue_flush(kelimelik_send_queue *self) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	kelimelik_error error = _KELIMELIK_SUCCESS;
+	pthread_mutex_lock(&self->mutex);
+	bool copy_only = false;
+	while (self->count) {
+		struct iovec iov[KELIMELIK_SEND_QUEUE_IOV_COUNT];
+		size_t iov_count = 0;
+		bool zerocopy = false;
+
+		// Big packets are sent on their own, everything else is gathered
+		// until the next big packet
+		size_t threshold = copy_only ? 0 : self->zerocopy_threshold;
+		while ((iov_count < self->count) && (iov_count < KELIMELIK_SEND_QUEUE_IOV_COUNT)) {
+			kelimelik_packet *packet = self->packets[(self->head + iov_count) % self->capacity];
+			size_t offset = iov_count ? 0 : self->head_offset;
+			size_t length = packet->encoded_size - offset;
+			if (threshold && (length >= threshold)) {
+				zerocopy = !iov_count;
+				if (iov_count) {
+					break;
+				}
+			}
+			iov[iov_count].iov_base = (uint8_t *)packet->wire + offset;
+			iov[iov_count].iov_len = length;
+			iov_count++;
+			if (zerocopy) {
+				break;
+			}
+		}
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+#if KELIMELIK_SEND_QUEUE_ZEROCOPY
+		if (zerocopy) {
+			if (!kelimelik_send_queue_reserve_pin(self)) {
+				copy_only = true;
+				continue;
+			}
+			flags |= MSG_ZEROCOPY;
+		}
+#endif
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = iov_count;
+		ssize_t written = sendmsg(self->fd, &message, flags);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (zerocopy && (errno == ENOBUFS)) {
+				// Out of memory for pinning pages, copy until the next flush
+				copy_only = true;
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				error = _KELIMELIK_ERROR_SYSCALL(sendmsg);
+			}
+			break;
+		}
+		self->pending_bytes -= written;
+		self->stats.bytes_sent += written;
+#if KELIMELIK_SEND_QUEUE_ZEROCOPY
+		if (zerocopy) {
+			// The packet has to outlive the send even if the queue held the
+			// last reference
+			kelimelik_send_queue_pin(self, self->packets[self->head], written);
+			self->stats.zerocopy_sends++;
+		}
+		else {
+			self->stats.copy_sends++;
+		}
+#else
+		self->stats.copy_sends++;
+#endif
+
+		// Release the packets that are out completely
+		size_t done = self->head_offset + written;
+		while (self->count && (done >= self->packets[self->head]->encoded_size)) {
+			done -= self->packets[self->head]->encoded_size;
+			kelimelik_packet_release(self->packets[self->head]);
+			self->head = (self->head + 1) % self->capacity;
+			self->count--;
+		}
+		self->head_offset = done;
+	}
+#if KELIMELIK_SEND_QUEUE_ZEROCOPY
+	kelimelik_send_queue_reap(self);
+#endif
+	pthread_mutex_unlock(&self->mutex);
+	return error;
+}
+
+size_t kelimelik_send_queue_pending_bytes(kelimelik_send_queue *self) {
+	pthread_mutex_lock(&self->mutex);
+	size_t pending_bytes = self->pending_bytes;
+	pthread_mutex_unlock(&self->mutex);
+	return pending_bytes;
+}
+
+size_t kelimelik_send_queue_pinned_bytes(kelimelik_send_queue *self) {
+	pthread_mutex_lock(&self->mutex);
+	size_t pinned_bytes = self->pinned_bytes;
+	pthread_mutex_unlock(&self->mutex);
+	return pinned_bytes;
+}
+
+void kelimelik_send_queue_get_stats(kelimelik_send_queue *self, kelimelik_send_queue_stats *stats) {
+	pthread_mutex_lock(&self->mutex);
+	*stats = self->stats;
+	pthread_mutex_unlock(&self->mutex);
+}
+
+void kelimelik_send_queue_free(kelimelik_send_queue *self) {
+	for (size_t i=0; i<self->count; i++) {
+		kelimelik_packet_release(self->packets[(self->head + i) % self->capacity]);
+	}
+	for (size_t i=0; i<self->pins_count; i++) {
+		kelimelik_packet_release(self->pins[self->pins_head + i].packet);
+	}
+	_kelimelik_release(self->allocator, self->packets, self->capacity * sizeof(*self->packets));
+	_kelimelik_release(self->allocator, self->pins, self->pins_capacity * sizeof(*self->pins));
+	pthread_mutex_destroy(&self->mutex);
+	_kelimelik_release(self->allocator, self, sizeof(*self));
+}
+
+kelimelik_error kelimelik_broadcast(kelimelik_packet *packet, kelimelik_send_queue **queues, size_t queue_count) {
+	if (!packet) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!queues && queue_count) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+
+	// Freezing encodes the packet, every queue then shares the same bytes
+	kelimelik_error error = kelimelik_packet_freeze(packet);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	for (size_t i=0; i<queue_count; i++) {
+		kelimelik_error queue_error = kelimelik_send_queue_push(queues[i], packet);
+		if (KELIMELIK_IS_ERROR(queue_error)) {
+			error = queue_error;
+		}
+	}
+	return error;
+}
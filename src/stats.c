@@ -0,0 +1,405 @@
+#include "kelimelik-private.h"
+#include <string.h>
+
+// Histograms are HDR-style: every power of two is split into the same number
+// of linear sub-buckets, so a recorded value is off by less than 1/64 of
+// itself no matter how big it is, and every histogram has the same fixed
+// size. Values are counted with relaxed atomic adds, so threads can record
+// into a histogram without locks while another one reads it.
+
+#define KELIMELIK_HISTOGRAM_SUB_BUCKET_BITS 7
+#define KELIMELIK_HISTOGRAM_HALF_BUCKETS (1 << (KELIMELIK_HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+// Bigger values are recorded as the biggest one, about 4.9 hours in
+// nanoseconds.
+#define KELIMELIK_HISTOGRAM_VALUE_BITS 44
+#define KELIMELIK_HISTOGRAM_MAX_VALUE ((UINT64_C(1) << KELIMELIK_HISTOGRAM_VALUE_BITS) - 1)
+#define KELIMELIK_HISTOGRAM_BUCKET_COUNT \
+	((KELIMELIK_HISTOGRAM_VALUE_BITS - KELIMELIK_HISTOGRAM_SUB_BUCKET_BITS + 2) * KELIMELIK_HISTOGRAM_HALF_BUCKETS)
+
+struct kelimelik_histogram {
+	const kelimelik_allocator *allocator;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[KELIMELIK_HISTOGRAM_BUCKET_COUNT];
+};
+
+// Values below the sub-bucket count get a bucket each. Above that, the value
+// is shifted until it has as many bits as half the sub-buckets, and the shift
+// selects the group of buckets.
+static uint32_t kelimelik_histogram_index(uint64_t value) {
+	if (value < (2 * KELIMELIK_HISTOGRAM_HALF_BUCKETS)) {
+		return (uint32_t)value;
+	}
+	int shift = (63 - __builtin_clzll(value)) - (KELIMELIK_HISTOGRAM_SUB_BUCKET_BITS - 1);
+	return (shift * KELIMELIK_HISTOGRAM_HALF_BUCKETS) + (uint32_t)(value >> shift);
+}
+
+// The biggest value that is recorded in the bucket.
+static uint64_t kelimelik_histogram_bucket_max(uint32_t index) {
+	if (index < (2 * KELIMELIK_HISTOGRAM_HALF_BUCKETS)) {
+		return index;
+	}
+	int shift = (index / KELIMELIK_HISTOGRAM_HALF_BUCKETS) - 1;
+	uint64_t sub_bucket = index - (shift * KELIMELIK_HISTOGRAM_HALF_BUCKETS);
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+kelimelik_error kelimelik_histogram_new(kelimelik_histogram **out, const kelimelik_allocator *allocator) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_histogram *histogram = _kelimelik_allocate(allocator, sizeof(*histogram));
+	if (!histogram) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	memset(histogram, 0, sizeof(*histogram));
+	histogram->allocator = allocator;
+	*out = histogram;
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_histogram_record(kelimelik_histogram *self, uint64_t value) {
+	if (value > KELIMELIK_HISTOGRAM_MAX_VALUE) {
+		value = KELIMELIK_HISTOGRAM_MAX_VALUE;
+	}
+	__atomic_add_fetch(&self->buckets[kelimelik_histogram_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&self->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&self->count, 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+	while ((value > max) && !__atomic_compare_exchange_n(&self->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void kelimelik_histogram_merge(kelimelik_histogram *self, kelimelik_histogram *other) {
+	for (uint32_t i=0; i<KELIMELIK_HISTOGRAM_BUCKET_COUNT; i++) {
+		uint64_t count = __atomic_load_n(&other->buckets[i], __ATOMIC_RELAXED);
+		if (count) {
+			__atomic_add_fetch(&self->buckets[i], count, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&self->sum, __atomic_load_n(&other->sum, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&self->count, __atomic_load_n(&other->count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	uint64_t value = __atomic_load_n(&other->max, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+	while ((value > max) && !__atomic_compare_exchange_n(&self->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void kelimelik_histogram_reset(kelimelik_histogram *self) {
+	for (uint32_t i=0; i<KELIMELIK_HISTOGRAM_BUCKET_COUNT; i++) {
+		__atomic_store_n(&self->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&self->sum, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->max, 0, __ATOMIC_RELAXED);
+}
+
+uint64_t kelimelik_histogram_count(kelimelik_histogram *self) {
+	return __atomic_load_n(&self->count, __ATOMIC_RELAXED);
+}
+
+uint64_t kelimelik_histogram_max(kelimelik_histogram *self) {
+	return __atomic_load_n(&self->max, __ATOMIC_RELAXED);
+}
+
+double kelimelik_histogram_mean(kelimelik_histogram *self) {
+	uint64_t count = kelimelik_histogram_count(self);
+	return count ? ((double)__atomic_load_n(&self->sum, __ATOMIC_RELAXED) / count) : 0;
+}
+
+uint64_t kelimelik_histogram_percentile(kelimelik_histogram *self, double percentile) {
+	uint64_t count = kelimelik_histogram_count(self);
+	if (!count) {
+		return 0;
+	}
+	uint64_t target = (uint64_t)((percentile / 100) * count + 0.5);
+	if (target < 1) target = 1;
+	if (target > count) target = count;
+	uint64_t max = kelimelik_histogram_max(self);
+	uint64_t seen = 0;
+	for (uint32_t i=0; i<KELIMELIK_HISTOGRAM_BUCKET_COUNT; i++) {
+		seen += __atomic_load_n(&self->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			uint64_t value = kelimelik_histogram_bucket_max(i);
+			return (value > max) ? max : value;
+		}
+	}
+	return max;
+}
+
+void kelimelik_histogram_free(kelimelik_histogram *self) {
+	_kelimelik_release(self->allocator, self, sizeof(*self));
+}
+
+// Traffic statistics. Headers are mapped to IDs with a header table and the
+// counters of every header are kept in an array indexed by ID. Requests that
+// are waiting for a response are kept in arrival order, so the oldest one of a
+// session is found first.
+
+#define KELIMELIK_TRAFFIC_MAX_HEADERS 4096
+#define KELIMELIK_TRAFFIC_MAX_PENDING 1024
+
+struct kelimelik_traffic_counters {
+	uint64_t packets[2];
+	uint64_t bytes[2];
+	uint64_t decodes;
+	uint64_t decode_time;
+	uint64_t encodes;
+	uint64_t encode_time;
+};
+
+struct kelimelik_traffic_pair {
+	uint32_t request;
+	uint32_t response;
+	kelimelik_histogram *latency;
+	uint64_t unanswered;
+};
+
+struct kelimelik_traffic_request {
+	uint32_t connection_id;
+	uint32_t pair;
+	uint64_t time;
+};
+
+struct kelimelik_traffic_stats {
+	const kelimelik_allocator *allocator;
+	struct kelimelik_header_table headers;
+	struct kelimelik_traffic_counters *counters;
+	uint32_t counters_capacity;
+
+	// Frames with headers past KELIMELIK_TRAFFIC_MAX_HEADERS
+	struct kelimelik_traffic_counters other;
+
+	struct kelimelik_traffic_pair *pairs;
+	uint32_t pair_count;
+	struct kelimelik_traffic_request pending[KELIMELIK_TRAFFIC_MAX_PENDING];
+	uint32_t pending_count;
+
+	kelimelik_histogram *decode_time;
+	kelimelik_histogram *encode_time;
+};
+
+kelimelik_error kelimelik_traffic_stats_new(kelimelik_traffic_stats **out, const kelimelik_allocator *allocator) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	allocator = _kelimelik_allocator(allocator);
+	kelimelik_traffic_stats *stats = _kelimelik_allocate(allocator, sizeof(*stats));
+	if (!stats) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	memset(stats, 0, sizeof(*stats));
+	stats->allocator = allocator;
+	kelimelik_error error = kelimelik_histogram_new(&stats->decode_time, allocator);
+	if (!KELIMELIK_IS_ERROR(error)) {
+		error = kelimelik_histogram_new(&stats->encode_time, allocator);
+	}
+	if (KELIMELIK_IS_ERROR(error)) {
+		kelimelik_traffic_stats_free(stats);
+		return error;
+	}
+	*out = stats;
+	return _KELIMELIK_SUCCESS;
+}
+
+// Returns the counters of a header, adding it if it wasn't seen before.
+static struct kelimelik_traffic_counters *kelimelik_traffic_counters(kelimelik_traffic_stats *self, const void *header, uint16_t header_length, uint32_t *id) {
+	if (!_kelimelik_header_table_find(&self->headers, header, header_length, id)) {
+		if (self->headers.count >= KELIMELIK_TRAFFIC_MAX_HEADERS) {
+			*id = UINT32_MAX;
+			return &self->other;
+		}
+		if (KELIMELIK_IS_ERROR(_kelimelik_header_table_intern(&self->headers, header, header_length, id))) {
+			*id = UINT32_MAX;
+			return &self->other;
+		}
+	}
+	if (*id >= self->counters_capacity) {
+		uint32_t capacity = self->counters_capacity ? (self->counters_capacity * 2) : 32;
+		while (capacity <= *id) capacity *= 2;
+		struct kelimelik_traffic_counters *counters = _kelimelik_reallocate(
+			self->allocator,
+			self->counters,
+			self->counters_capacity * sizeof(*counters),
+			capacity * sizeof(*counters)
+		);
+		if (!counters) {
+			return &self->other;
+		}
+		memset(counters + self->counters_capacity, 0, (capacity - self->counters_capacity) * sizeof(*counters));
+		self->counters = counters;
+		self->counters_capacity = capacity;
+	}
+	return &self->counters[*id];
+}
+
+kelimelik_error kelimelik_traffic_stats_add_pair(kelimelik_traffic_stats *self, const char *request, const char *response) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!request || (strlen(request) > UINT16_MAX)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	if (!response || (strlen(response) > UINT16_MAX)) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	struct kelimelik_traffic_pair pair = { 0 };
+	kelimelik_error error = _kelimelik_header_table_intern(&self->headers, request, strlen(request), &pair.request);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = _kelimelik_header_table_intern(&self->headers, response, strlen(response), &pair.response);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+	error = kelimelik_histogram_new(&pair.latency, self->allocator);
+	if (KELIMELIK_IS_ERROR(error)) return error;
+
+	// pair_count has to match the size of the block, so the histogram is
+	// created before the array grows
+	struct kelimelik_traffic_pair *pairs = _kelimelik_reallocate(
+		self->allocator,
+		self->pairs,
+		self->pair_count * sizeof(*pairs),
+		(self->pair_count + 1) * sizeof(*pairs)
+	);
+	if (!pairs) {
+		kelimelik_histogram_free(pair.latency);
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	self->pairs = pairs;
+	self->pairs[self->pair_count++] = pair;
+	return _KELIMELIK_SUCCESS;
+}
+
+static void kelimelik_traffic_stats_remove_pending(kelimelik_traffic_stats *self, uint32_t index) {
+	memmove(&self->pending[index], &self->pending[index + 1], (self->pending_count - index - 1) * sizeof(*self->pending));
+	self->pending_count--;
+}
+
+void kelimelik_traffic_stats_frame(
+	kelimelik_traffic_stats *self,
+	uint32_t connection_id,
+	enum kelimelik_direction direction,
+	const kelimelik_frame *frame,
+	uint64_t time
+) {
+	uint32_t id;
+	struct kelimelik_traffic_counters *counters = kelimelik_traffic_counters(self, frame->header, frame->header_length, &id);
+	counters->packets[direction]++;
+	counters->bytes[direction] += frame->length;
+	for (uint32_t i=0; (i<self->pair_count) && (id != UINT32_MAX); i++) {
+		struct kelimelik_traffic_pair *pair = &self->pairs[i];
+		if ((direction == KELIMELIK_DIRECTION_CLIENT_TO_SERVER) && (pair->request == id)) {
+			if (self->pending_count == KELIMELIK_TRAFFIC_MAX_PENDING) {
+				// Give up on the oldest request
+				self->pairs[self->pending[0].pair].unanswered++;
+				kelimelik_traffic_stats_remove_pending(self, 0);
+			}
+			self->pending[self->pending_count++] = (struct kelimelik_traffic_request){
+				.connection_id = connection_id,
+				.pair = i,
+				.time = time
+			};
+		}
+		else if ((direction == KELIMELIK_DIRECTION_SERVER_TO_CLIENT) && (pair->response == id)) {
+			for (uint32_t j=0; j<self->pending_count; j++) {
+				if ((self->pending[j].pair == i) && (self->pending[j].connection_id == connection_id)) {
+					kelimelik_histogram_record(pair->latency, time - self->pending[j].time);
+					kelimelik_traffic_stats_remove_pending(self, j);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void kelimelik_traffic_stats_decode_time(kelimelik_traffic_stats *self, const void *header, uint16_t header_length, uint64_t nanoseconds) {
+	uint32_t id;
+	struct kelimelik_traffic_counters *counters = kelimelik_traffic_counters(self, header, header_length, &id);
+	counters->decodes++;
+	counters->decode_time += nanoseconds;
+	kelimelik_histogram_record(self->decode_time, nanoseconds);
+}
+
+void kelimelik_traffic_stats_encode_time(kelimelik_traffic_stats *self, const void *header, uint16_t header_length, uint64_t nanoseconds) {
+	uint32_t id;
+	struct kelimelik_traffic_counters *counters = kelimelik_traffic_counters(self, header, header_length, &id);
+	counters->encodes++;
+	counters->encode_time += nanoseconds;
+	kelimelik_histogram_record(self->encode_time, nanoseconds);
+}
+
+void kelimelik_traffic_stats_end_connection(kelimelik_traffic_stats *self, uint32_t connection_id) {
+	for (uint32_t i=self->pending_count; i>0; i--) {
+		if (self->pending[i - 1].connection_id == connection_id) {
+			self->pairs[self->pending[i - 1].pair].unanswered++;
+			kelimelik_traffic_stats_remove_pending(self, i - 1);
+		}
+	}
+}
+
+static void kelimelik_traffic_write_counters(FILE *file, const uint8_t *header, uint16_t header_length, struct kelimelik_traffic_counters *counters) {
+	fprintf(file, "%-40.*s %10llu %12llu %10llu %12llu %10.1f %10.1f\n",
+		(int)header_length, header,
+		(unsigned long long)counters->packets[KELIMELIK_DIRECTION_CLIENT_TO_SERVER],
+		(unsigned long long)counters->bytes[KELIMELIK_DIRECTION_CLIENT_TO_SERVER],
+		(unsigned long long)counters->packets[KELIMELIK_DIRECTION_SERVER_TO_CLIENT],
+		(unsigned long long)counters->bytes[KELIMELIK_DIRECTION_SERVER_TO_CLIENT],
+		counters->decodes ? ((counters->decode_time / 1e3) / counters->decodes) : 0,
+		counters->encodes ? ((counters->encode_time / 1e3) / counters->encodes) : 0
+	);
+}
+
+// Percentiles in microseconds
+static void kelimelik_traffic_write_histogram(FILE *file, kelimelik_histogram *histogram) {
+	fprintf(file, "%llu samples, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+		(unsigned long long)kelimelik_histogram_count(histogram),
+		kelimelik_histogram_mean(histogram) / 1e3,
+		kelimelik_histogram_percentile(histogram, 50) / 1e3,
+		kelimelik_histogram_percentile(histogram, 90) / 1e3,
+		kelimelik_histogram_percentile(histogram, 99) / 1e3,
+		kelimelik_histogram_percentile(histogram, 99.9) / 1e3,
+		kelimelik_histogram_max(histogram) / 1e3
+	);
+}
+
+kelimelik_error kelimelik_traffic_stats_write(kelimelik_traffic_stats *self, FILE *file) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!file) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	fprintf(file, "%-40s %10s %12s %10s %12s %10s %10s\n",
+		"header", "c>s pkts", "c>s bytes", "s>c pkts", "s>c bytes", "decode us", "encode us");
+	// Headers that were only named by a pair have no counters yet
+	struct kelimelik_traffic_counters empty = { 0 };
+	for (uint32_t id=0; id<self->headers.count; id++) {
+		uint16_t length;
+		const uint8_t *name = _kelimelik_header_table_name(&self->headers, id, &length);
+		kelimelik_traffic_write_counters(file, name, length, (id < self->counters_capacity) ? &self->counters[id] : &empty);
+	}
+	if (self->other.packets[0] || self->other.packets[1]) {
+		kelimelik_traffic_write_counters(file, (const uint8_t *)"(other)", 7, &self->other);
+	}
+	for (uint32_t i=0; i<self->pair_count; i++) {
+		struct kelimelik_traffic_pair *pair = &self->pairs[i];
+		uint16_t request_length, response_length;
+		const uint8_t *request = _kelimelik_header_table_name(&self->headers, pair->request, &request_length);
+		const uint8_t *response = _kelimelik_header_table_name(&self->headers, pair->response, &response_length);
+		fprintf(file, "latency %.*s -> %.*s (us): %llu unanswered, ",
+			(int)request_length, request,
+			(int)response_length, response,
+			(unsigned long long)pair->unanswered
+		);
+		kelimelik_traffic_write_histogram(file, pair->latency);
+	}
+	fprintf(file, "decode time (us): ");
+	kelimelik_traffic_write_histogram(file, self->decode_time);
+	fprintf(file, "encode time (us): ");
+	kelimelik_traffic_write_histogram(file, self->encode_time);
+	if (fflush(file) || ferror(file)) {
+		return _KELIMELIK_ERROR_SYSCALL(fwrite);
+	}
+	return _KELIMELIK_SUCCESS;
+}
+
+void kelimelik_traffic_stats_free(kelimelik_traffic_stats *self) {
+	for (uint32_t i=0; i<self->pair_count; i++) {
+		kelimelik_histogram_free(self->pairs[i].latency);
+	}
+	_kelimelik_release(self->allocator, self->pairs, self->pair_count * sizeof(*self->pairs));
+	_kelimelik_release(self->allocator, self->counters, self->counters_capacity * sizeof(*self->counters));
+	if (self->decode_time) {
+		kelimelik_histogram_free(self->decode_time);
+	}
+	if (self->encode_time) {
+		kelimelik_histogram_free(self->encode_time);
+	}
+	_kelimelik_header_table_destroy(&self->headers);
+	_kelimelik_release(self->allocator, self, sizeof(*self));
+}
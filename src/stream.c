@@ -0,0 +1,416 @@
+#include "kelimelik-private.h"
+#include <string.h>
+
+// Streaming decoder for frames that are too big to be buffered. The frame is
+// decoded as it arrives, one field at a time. Every field is collected in a
+// scratch buffer until it is complete, and array items are collected until
+// KELIMELIK_STREAM_CHUNK_SIZE bytes have been read, so the memory used by a
+// parser is bounded by the chunk size plus the biggest possible string no
+// matter how big the frame is.
+
+#define KELIMELIK_STREAM_CHUNK_SIZE (64 * 1024)
+
+// The biggest the scratch buffer gets: a chunk of array items, followed by
+// the biggest string and its null terminator
+#define KELIMELIK_STREAM_SCRATCH_LIMIT (KELIMELIK_STREAM_CHUNK_SIZE + sizeof(kelimelik_string) + UINT16_MAX + 1)
+
+enum kelimelik_stream_state {
+	KELIMELIK_STREAM_HEADER_LENGTH,
+	KELIMELIK_STREAM_HEADER, // Header and object count
+	KELIMELIK_STREAM_TYPE,
+	KELIMELIK_STREAM_VALUE,
+	KELIMELIK_STREAM_STRING_LENGTH,
+	KELIMELIK_STREAM_STRING,
+	KELIMELIK_STREAM_ARRAY_HEADER,
+	KELIMELIK_STREAM_ARRAY_ITEM, // Integer or string length
+	KELIMELIK_STREAM_ARRAY_STRING,
+
+	// Every object has been read, or the frame is malformed. The rest of the
+	// frame is skipped.
+	KELIMELIK_STREAM_DONE,
+	KELIMELIK_STREAM_SKIP
+};
+
+struct kelimelik_parser_stream {
+	kelimelik_stream_handler handler;
+	size_t threshold;
+	enum kelimelik_stream_state state;
+	kelimelik_error error;
+	uint32_t frame_length;
+	uint32_t frame_remaining;
+	uint16_t header_length;
+	uint8_t object_count;
+	uint8_t object_index;
+	uint8_t type;
+
+	// The array that is being read. Items are collected in the scratch
+	// buffer in wire format and handed over in chunks.
+	uint8_t item_type;
+	uint32_t items_remaining;
+	uint32_t chunk_first_item;
+	uint32_t chunk_item_count;
+	size_t chunk_blob_size;
+
+	// The field that is being read starts at field_start in the scratch
+	// buffer. needed is the number of bytes of it that are still missing.
+	size_t field_start;
+	uint32_t needed;
+	uint8_t *scratch;
+	size_t scratch_length;
+	size_t scratch_capacity;
+};
+
+static void kelimelik_stream_fail(struct kelimelik_parser_stream *stream, kelimelik_error error) {
+	stream->error = error;
+	stream->state = KELIMELIK_STREAM_SKIP;
+}
+
+// Starts reading a field of the given size.
+static void kelimelik_stream_expect(kelimelik_parser *self, enum kelimelik_stream_state state, uint32_t size) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	size_t needed = stream->scratch_length + size + 1;
+	if (needed > stream->scratch_capacity) {
+		// Array items are collected one at a time, so the buffer grows
+		// geometrically. Allocators without reallocate copy the buffer on
+		// every grow.
+		size_t capacity = stream->scratch_capacity * 2;
+		if (capacity > KELIMELIK_STREAM_SCRATCH_LIMIT) {
+			capacity = KELIMELIK_STREAM_SCRATCH_LIMIT;
+		}
+		if (capacity < needed) {
+			capacity = needed;
+		}
+		uint8_t *scratch = _kelimelik_reallocate(self->allocator, stream->scratch, stream->scratch_capacity, capacity);
+		if (!scratch) {
+			kelimelik_stream_fail(stream, _KELIMELIK_ERROR_SYSCALL(malloc));
+			return;
+		}
+		stream->scratch = scratch;
+		stream->scratch_capacity = capacity;
+	}
+	stream->state = state;
+	stream->field_start = stream->scratch_length;
+	stream->needed = size;
+}
+
+static void kelimelik_stream_next_object(kelimelik_parser *self) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	stream->scratch_length = 0;
+	if (++stream->object_index == stream->object_count) {
+		stream->state = KELIMELIK_STREAM_DONE;
+		return;
+	}
+	kelimelik_stream_expect(self, KELIMELIK_STREAM_TYPE, 1);
+}
+
+// Hands the collected array items over to the handler. The items are
+// everything in the scratch buffer before end.
+static void kelimelik_stream_flush_items(kelimelik_parser *self, size_t end) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	if (stream->handler.array_items) {
+		kelimelik_array *array;
+		kelimelik_error error = _kelimelik_parser_decode_array(
+			self->allocator,
+			&array,
+			stream->item_type,
+			stream->chunk_item_count,
+			stream->scratch,
+			end,
+			stream->chunk_blob_size,
+			NULL
+		);
+		if (KELIMELIK_IS_ERROR(error)) {
+			kelimelik_stream_fail(stream, error);
+			return;
+		}
+		stream->handler.array_items(stream->handler.context, stream->object_index, array, stream->chunk_first_item);
+		_kelimelik_array_free(self->allocator, array);
+	}
+	stream->chunk_first_item += stream->chunk_item_count;
+	stream->chunk_item_count = 0;
+	stream->chunk_blob_size = 0;
+	memmove(stream->scratch, stream->scratch + end, stream->scratch_length - end);
+	stream->scratch_length -= end;
+}
+
+static void kelimelik_stream_next_item(kelimelik_parser *self) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	if (!stream->items_remaining) {
+		if (stream->chunk_item_count) {
+			kelimelik_stream_flush_items(self, stream->scratch_length);
+			if (stream->state == KELIMELIK_STREAM_SKIP) return;
+		}
+		kelimelik_stream_next_object(self);
+		return;
+	}
+	uint32_t item_size;
+	switch (stream->item_type) {
+		case KELIMELIK_OBJECT_UINT8: item_size = 1; break;
+		case KELIMELIK_OBJECT_UINT32: item_size = 4; break;
+		case KELIMELIK_OBJECT_UINT64: item_size = 8; break;
+		default: item_size = 2; break; // String length
+	}
+	if (stream->chunk_item_count && ((stream->scratch_length + item_size) > KELIMELIK_STREAM_CHUNK_SIZE)) {
+		kelimelik_stream_flush_items(self, stream->scratch_length);
+		if (stream->state == KELIMELIK_STREAM_SKIP) return;
+	}
+	kelimelik_stream_expect(self, KELIMELIK_STREAM_ARRAY_ITEM, item_size);
+}
+
+static void kelimelik_stream_item_done(kelimelik_parser *self) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	stream->chunk_item_count++;
+	stream->items_remaining--;
+	kelimelik_stream_next_item(self);
+}
+
+static void kelimelik_stream_object(kelimelik_parser *self, const kelimelik_object *object) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	if (stream->handler.object) {
+		stream->handler.object(stream->handler.context, stream->object_index, object);
+	}
+	kelimelik_stream_next_object(self);
+}
+
+// Called once the current field is complete.
+static void kelimelik_stream_process(kelimelik_parser *self) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	uint8_t *field = stream->scratch + stream->field_start;
+	kelimelik_object object = { .type = stream->type, .storage = KELIMELIK_STORAGE_HEAP };
+	switch (stream->state) {
+		case KELIMELIK_STREAM_HEADER_LENGTH:
+			stream->header_length = ntohs(*(uint16_t *)field);
+			stream->scratch_length = 0;
+			if (((uint32_t)stream->header_length + 1) > stream->frame_remaining) {
+				kelimelik_stream_fail(stream, _KELIMELIK_ERROR_INVALID_ARGUMENT(0));
+				break;
+			}
+			kelimelik_stream_expect(self, KELIMELIK_STREAM_HEADER, stream->header_length + 1);
+			break;
+		case KELIMELIK_STREAM_HEADER: {
+			stream->object_count = field[stream->header_length];
+			kelimelik_frame frame = {
+				.bytes = NULL,
+				.length = stream->frame_length,
+				.header = field,
+				.header_length = stream->header_length,
+				.object_count = stream->object_count
+			};
+			if (stream->handler.begin) {
+				stream->handler.begin(stream->handler.context, &frame);
+			}
+			stream->scratch_length = 0;
+			if (!stream->object_count) {
+				stream->state = KELIMELIK_STREAM_DONE;
+				break;
+			}
+			stream->object_index = 0;
+			kelimelik_stream_expect(self, KELIMELIK_STREAM_TYPE, 1);
+			break;
+		}
+		case KELIMELIK_STREAM_TYPE:
+			stream->type = *field;
+			stream->scratch_length = 0;
+			switch (stream->type) {
+				case KELIMELIK_OBJECT_UINT8:
+					kelimelik_stream_expect(self, KELIMELIK_STREAM_VALUE, 1);
+					break;
+				case KELIMELIK_OBJECT_UINT32:
+					kelimelik_stream_expect(self, KELIMELIK_STREAM_VALUE, 4);
+					break;
+				case KELIMELIK_OBJECT_UINT64:
+					kelimelik_stream_expect(self, KELIMELIK_STREAM_VALUE, 8);
+					break;
+				case KELIMELIK_OBJECT_STRING:
+					kelimelik_stream_expect(self, KELIMELIK_STREAM_STRING_LENGTH, 2);
+					break;
+				case KELIMELIK_OBJECT_ARRAY:
+					kelimelik_stream_expect(self, KELIMELIK_STREAM_ARRAY_HEADER, 5);
+					break;
+				default:
+					kelimelik_stream_fail(stream, _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, stream->type));
+					break;
+			}
+			break;
+		case KELIMELIK_STREAM_VALUE:
+			switch (stream->type) {
+				case KELIMELIK_OBJECT_UINT8:
+					object.uint8 = *field;
+					break;
+				case KELIMELIK_OBJECT_UINT32:
+					object.uint32 = ntohl(*(uint32_t *)field);
+					break;
+				default:
+					object.uint64 = ntohll(*(uint64_t *)field);
+					break;
+			}
+			kelimelik_stream_object(self, &object);
+			break;
+		case KELIMELIK_STREAM_STRING_LENGTH: {
+			// Read the string right after a kelimelik_string structure, so
+			// that the scratch buffer can be passed on as it is
+			uint16_t length = ntohs(*(uint16_t *)field);
+			stream->scratch_length = sizeof(kelimelik_string);
+			((kelimelik_string *)stream->scratch)->length = length;
+			kelimelik_stream_expect(self, KELIMELIK_STREAM_STRING, length);
+			break;
+		}
+		case KELIMELIK_STREAM_STRING:
+			stream->scratch[stream->scratch_length] = 0;
+			object.string = (kelimelik_string *)stream->scratch;
+			kelimelik_stream_object(self, &object);
+			break;
+		case KELIMELIK_STREAM_ARRAY_HEADER:
+			stream->item_type = field[4];
+			stream->items_remaining = ntohl(*(uint32_t *)field);
+			stream->scratch_length = 0;
+			switch (stream->item_type) {
+				case KELIMELIK_OBJECT_UINT8:
+				case KELIMELIK_OBJECT_UINT32:
+				case KELIMELIK_OBJECT_UINT64:
+				case KELIMELIK_OBJECT_STRING:
+					break;
+				default:
+					kelimelik_stream_fail(stream, _KELIMELIK_ERROR(KELIMELIK_ERROR_INVALID_TYPE, stream->item_type));
+					return;
+			}
+			if (self->limits.max_array_items && (stream->items_remaining > self->limits.max_array_items)) {
+				kelimelik_stream_fail(stream, _kelimelik_parser_limit_exceeded(self, KELIMELIK_LIMIT_ARRAY_ITEMS));
+				return;
+			}
+			if (stream->handler.array_begin) {
+				stream->handler.array_begin(stream->handler.context, stream->object_index, stream->item_type, stream->items_remaining);
+			}
+			stream->chunk_first_item = 0;
+			stream->chunk_item_count = 0;
+			stream->chunk_blob_size = 0;
+			kelimelik_stream_next_item(self);
+			break;
+		case KELIMELIK_STREAM_ARRAY_ITEM: {
+			if (stream->item_type != KELIMELIK_OBJECT_STRING) {
+				kelimelik_stream_item_done(self);
+				break;
+			}
+			uint16_t length = ntohs(*(uint16_t *)field);
+			if (stream->chunk_item_count && ((stream->scratch_length + length) > KELIMELIK_STREAM_CHUNK_SIZE)) {
+				// Hand over the items before this one. The length stays
+				// in the scratch buffer.
+				kelimelik_stream_flush_items(self, stream->field_start);
+				if (stream->state == KELIMELIK_STREAM_SKIP) break;
+			}
+			stream->chunk_blob_size += _KELIMELIK_INLINE_STRING_SIZE(length);
+			kelimelik_stream_expect(self, KELIMELIK_STREAM_ARRAY_STRING, length);
+			break;
+		}
+		case KELIMELIK_STREAM_ARRAY_STRING:
+			kelimelik_stream_item_done(self);
+			break;
+		default:
+			break;
+	}
+}
+
+// Ends the current frame and gets the parser ready for the next one.
+static void kelimelik_stream_end(kelimelik_parser *self) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	if ((stream->state != KELIMELIK_STREAM_DONE) && (stream->state != KELIMELIK_STREAM_SKIP)) {
+		// The frame ended in the middle of an object
+		stream->error = _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	}
+	if (KELIMELIK_IS_ERROR(stream->error)) {
+		char error_message[100];
+		_kelimelik_log(KELIMELIK_LOG_ERROR, "Parser error: %s", kelimelik_strerror_buf(stream->error, error_message, sizeof(error_message)));
+	}
+	if (stream->handler.end) {
+		stream->handler.end(stream->handler.context, stream->error);
+	}
+	stream->scratch_length = 0;
+	self->state = KELIMELIK_PARSER_WAITING_FOR_SIZE;
+	self->bytes_remaining = 4;
+	self->index = 0;
+}
+
+bool _kelimelik_parser_should_stream(kelimelik_parser *self, uint32_t packet_size) {
+	return self->stream && (((size_t)packet_size + 4) > self->stream->threshold);
+}
+
+void _kelimelik_parser_stream_begin(kelimelik_parser *self, uint32_t packet_size) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	self->state = KELIMELIK_PARSER_STREAMING;
+	stream->error = _KELIMELIK_SUCCESS;
+	stream->scratch_length = 0;
+	stream->frame_remaining = packet_size;
+	stream->frame_length = packet_size + 4;
+	if (packet_size > (UINT32_MAX - 4)) {
+		stream->frame_length = 0;
+		kelimelik_stream_fail(stream, _KELIMELIK_ERROR_INVALID_ARGUMENT(0));
+		return;
+	}
+	kelimelik_stream_expect(self, KELIMELIK_STREAM_HEADER_LENGTH, 2);
+}
+
+void _kelimelik_parser_stream(kelimelik_parser *self, uint8_t **bytes, size_t *bytes_length) {
+	struct kelimelik_parser_stream *stream = self->stream;
+	size_t available = (*bytes_length < stream->frame_remaining) ? *bytes_length : stream->frame_remaining;
+	size_t consumed = 0;
+	for (;;) {
+		if ((stream->state == KELIMELIK_STREAM_DONE) || (stream->state == KELIMELIK_STREAM_SKIP)) {
+			if ((stream->state == KELIMELIK_STREAM_DONE) && (consumed < stream->frame_remaining)) {
+				// Skip the rest without logging this again
+				_kelimelik_log(KELIMELIK_LOG_WARNING, "%u bytes remaining after parsing", stream->frame_remaining - (uint32_t)consumed);
+				stream->state = KELIMELIK_STREAM_SKIP;
+			}
+			consumed = available;
+			break;
+		}
+		if (stream->needed) {
+			size_t part = available - consumed;
+			if (part > stream->needed) {
+				part = stream->needed;
+			}
+			memcpy(stream->scratch + stream->scratch_length, *bytes + consumed, part);
+			stream->scratch_length += part;
+			stream->needed -= part;
+			consumed += part;
+			if (stream->needed) {
+				break;
+			}
+		}
+		kelimelik_stream_process(self);
+	}
+	*bytes += consumed;
+	*bytes_length -= consumed;
+	stream->frame_remaining -= consumed;
+	if (!stream->frame_remaining) {
+		kelimelik_stream_end(self);
+	}
+}
+
+kelimelik_error kelimelik_parser_set_stream_handler(kelimelik_parser *self, const kelimelik_stream_handler *handler, size_t threshold) {
+	if (!self) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (self->state == KELIMELIK_PARSER_STREAMING) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	if (!handler) {
+		_kelimelik_parser_stream_free(self);
+		return _KELIMELIK_SUCCESS;
+	}
+	if (!self->stream) {
+		struct kelimelik_parser_stream *stream = _kelimelik_allocate(self->allocator, sizeof(*stream));
+		if (!stream) {
+			return _KELIMELIK_ERROR_SYSCALL(malloc);
+		}
+		memset(stream, 0, sizeof(*stream));
+		self->stream = stream;
+	}
+	self->stream->handler = *handler;
+	self->stream->threshold = threshold;
+	return _KELIMELIK_SUCCESS;
+}
+
+void _kelimelik_parser_stream_free(kelimelik_parser *self) {
+	if (!self->stream) {
+		return;
+	}
+	_kelimelik_release(self->allocator, self->stream->scratch, self->stream->scratch_capacity);
+	_kelimelik_release(self->allocator, self->stream, sizeof(*self->stream));
+	self->stream = NULL;
+}
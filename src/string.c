@@ -1,28 +1,40 @@
 #include <string.h>
 #include "kelimelik-private.h"
 
+void _kelimelik_string_free(const kelimelik_allocator *allocator, kelimelik_string *string) {
+	if (!string) return;
+	_kelimelik_release(allocator, string, sizeof(*string) + string->length + 1);
+}
+
 void kelimelik_string_free(kelimelik_string *string) {
-	free(string);
+	_kelimelik_string_free(NULL, string);
 }
 
-kelimelik_error kelimelik_string_new_v1(kelimelik_string **out, const char *c_string) {
+kelimelik_error kelimelik_string_new_v3(kelimelik_string **out, const kelimelik_allocator *allocator, const void *bytes, size_t len) {
 	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
-	unsigned long c_string_len = strlen(c_string);
-	if (c_string_len > 0xFFFF) _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
-	kelimelik_string *string = malloc(sizeof(*string) + c_string_len + 1);
-	memcpy(string + 1, c_string, c_string_len + 1);
-	string->length = c_string_len;
+	if (len && !bytes) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	if (len > 0xFFFF) return _KELIMELIK_ERROR_INVALID_ARGUMENT(3);
+	kelimelik_string *string = _kelimelik_allocate(allocator, sizeof(*string) + len + 1);
+	if (!string) {
+		return _KELIMELIK_ERROR_SYSCALL(malloc);
+	}
+	memcpy(string + 1, bytes, len);
+	((uint8_t *)(string + 1))[len] = 0;
+	string->length = len;
 	*out = string;
 	return _KELIMELIK_SUCCESS;
 }
 
+kelimelik_error kelimelik_string_new_v1(kelimelik_string **out, const char *c_string) {
+	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
+	unsigned long c_string_len = strlen(c_string);
+	if (c_string_len > 0xFFFF) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
+	return kelimelik_string_new_v3(out, NULL, c_string, c_string_len);
+}
+
 kelimelik_error kelimelik_string_new_v2(kelimelik_string **out, void *bytes, size_t len) {
 	if (!out) return _KELIMELIK_ERROR_INVALID_ARGUMENT(0);
 	if (len && !bytes) return _KELIMELIK_ERROR_INVALID_ARGUMENT(1);
-	kelimelik_string *string = malloc(sizeof(*string) + len + 1);
-	memcpy(string + 1, bytes, len);
-	((uint8_t *)(string + 1))[len] = 0;
-	string->length = len;
-	*out = string;
-	return _KELIMELIK_SUCCESS;
-}
\ No newline at end of file
+	if (len > 0xFFFF) return _KELIMELIK_ERROR_INVALID_ARGUMENT(2);
+	return kelimelik_string_new_v3(out, NULL, bytes, len);
+}
@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+// Turns a schema file into a header with a struct and specialized decode and
+// encode functions for every message, see schema/game-module.schema for the
+// format. The functions work on wire bytes directly and only depend on
+// kelimelik.h:
+//
+//   ./schema-gen schema/game-module.schema headers/kelimelik-game-module.h
+//
+// Strings and arrays in decoded structs point into the frame. Objects with a
+// fixed size that follow each other are checked and read at constant offsets.
+
+#define MAX_FIELDS 255
+#define MAX_NAME 128
+
+enum field_kind {
+	FIELD_UINT8,
+	FIELD_UINT32,
+	FIELD_UINT64,
+	FIELD_STRING,
+	FIELD_ANY,
+	FIELD_UINT8_ARRAY,
+	FIELD_UINT32_ARRAY,
+	FIELD_UINT64_ARRAY,
+	FIELD_STRING_ARRAY
+};
+
+static const struct {
+	const char *name;
+	const char *c_type;
+	const char *wire_type; // The type byte, or the item type for arrays
+	int size; // Size of the value, or of an array item. 0 if it varies.
+} kinds[] = {
+	[FIELD_UINT8] = { "uint8", "uint8_t", "KELIMELIK_OBJECT_UINT8", 1 },
+	[FIELD_UINT32] = { "uint32", "uint32_t", "KELIMELIK_OBJECT_UINT32", 4 },
+	[FIELD_UINT64] = { "uint64", "uint64_t", "KELIMELIK_OBJECT_UINT64", 8 },
+	[FIELD_STRING] = { "string", "kelimelik_schema_string", "KELIMELIK_OBJECT_STRING", 0 },
+	[FIELD_ANY] = { "any", "kelimelik_schema_raw", NULL, 0 },
+	[FIELD_UINT8_ARRAY] = { "uint8[]", "kelimelik_schema_array", "KELIMELIK_OBJECT_UINT8", 1 },
+	[FIELD_UINT32_ARRAY] = { "uint32[]", "kelimelik_schema_array", "KELIMELIK_OBJECT_UINT32", 4 },
+	[FIELD_UINT64_ARRAY] = { "uint64[]", "kelimelik_schema_array", "KELIMELIK_OBJECT_UINT64", 8 },
+	[FIELD_STRING_ARRAY] = { "string[]", "kelimelik_schema_array", "KELIMELIK_OBJECT_STRING", 0 }
+};
+
+struct field {
+	enum field_kind kind;
+	char name[MAX_NAME];
+};
+
+struct message {
+	char header[MAX_NAME];
+	char name[MAX_NAME];
+	struct field fields[MAX_FIELDS];
+	int field_count;
+
+	// More objects may follow the fields
+	bool has_rest;
+};
+
+static bool is_fixed(enum field_kind kind) {
+	return (kind == FIELD_UINT8) || (kind == FIELD_UINT32) || (kind == FIELD_UINT64);
+}
+
+static bool is_array(enum field_kind kind) {
+	return kind >= FIELD_UINT8_ARRAY;
+}
+
+static bool is_identifier(const char *string) {
+	if (!*string || isdigit((unsigned char)*string)) {
+		return false;
+	}
+	for (; *string; string++) {
+		if (!isalnum((unsigned char)*string) && (*string != '_')) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// GameModule_requestLogin becomes game_module_request_login
+static void derive_name(const char *header, char *name) {
+	size_t length = 0;
+	for (size_t i=0; header[i] && (length < (MAX_NAME - 2)); i++) {
+		char c = header[i];
+		if (isupper((unsigned char)c)) {
+			if (i && (length && (name[length - 1] != '_')) && !isupper((unsigned char)header[i - 1])) {
+				name[length++] = '_';
+			}
+			c = tolower((unsigned char)c);
+		}
+		else if (!isalnum((unsigned char)c)) {
+			c = '_';
+		}
+		name[length++] = c;
+	}
+	name[length] = 0;
+}
+
+// The frame up to the objects: size prefix, header length, header and object
+// count.
+static size_t prefix_size(const struct message *message) {
+	return 4 + 2 + strlen(message->header) + 1;
+}
+
+// The size of a fixed object on the wire, including the type byte.
+static int fixed_size(enum field_kind kind) {
+	return 1 + kinds[kind].size;
+}
+
+// Writes bytes + offset, or just bytes if the offset is 0.
+static const char *at(size_t offset) {
+	static char buffer[64];
+	if (!offset) {
+		return "bytes";
+	}
+	snprintf(buffer, sizeof(buffer), "bytes + %zu", offset);
+	return buffer;
+}
+
+static void write_prelude(FILE *out) {
+	fputs(
+		"#ifndef KELIMELIK_SCHEMA_PRELUDE\n"
+		"#define KELIMELIK_SCHEMA_PRELUDE\n"
+		"\n"
+		"#include <kelimelik.h>\n"
+		"#include <string.h>\n"
+		"\n"
+		"// A string in wire format. It isn't null terminated.\n"
+		"typedef struct {\n"
+		"\tconst uint8_t *bytes;\n"
+		"\tuint16_t length;\n"
+		"} kelimelik_schema_string;\n"
+		"\n"
+		"#define KELIMELIK_SCHEMA_STRING(c_string) ((kelimelik_schema_string){ (const uint8_t *)(c_string), (uint16_t)strlen(c_string) })\n"
+		"\n"
+		"// The items of an array in wire format, so integers are big endian and\n"
+		"// strings are prefixed with their length. length is in bytes.\n"
+		"typedef struct {\n"
+		"\tconst uint8_t *bytes;\n"
+		"\tuint32_t count;\n"
+		"\tsize_t length;\n"
+		"} kelimelik_schema_array;\n"
+		"\n"
+		"// Objects that are passed through as they are, including the type byte.\n"
+		"typedef struct {\n"
+		"\tconst uint8_t *bytes;\n"
+		"\tsize_t length;\n"
+		"} kelimelik_schema_raw;\n"
+		"\n"
+		"#define KELIMELIK_SCHEMA_RESULT(value) ((kelimelik_error){ .kelimelik_errno = (value) })\n"
+		"\n"
+		"static inline uint16_t kelimelik_schema_get_u16(const uint8_t *bytes) {\n"
+		"\treturn ((uint16_t)bytes[0] << 8) | bytes[1];\n"
+		"}\n"
+		"\n"
+		"static inline uint32_t kelimelik_schema_get_u32(const uint8_t *bytes) {\n"
+		"\treturn ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];\n"
+		"}\n"
+		"\n"
+		"static inline uint64_t kelimelik_schema_get_u64(const uint8_t *bytes) {\n"
+		"\treturn ((uint64_t)kelimelik_schema_get_u32(bytes) << 32) | kelimelik_schema_get_u32(bytes + 4);\n"
+		"}\n"
+		"\n"
+		"static inline void kelimelik_schema_put_u16(uint8_t *bytes, uint16_t value) {\n"
+		"\tbytes[0] = value >> 8;\n"
+		"\tbytes[1] = value;\n"
+		"}\n"
+		"\n"
+		"static inline void kelimelik_schema_put_u32(uint8_t *bytes, uint32_t value) {\n"
+		"\tbytes[0] = value >> 24;\n"
+		"\tbytes[1] = value >> 16;\n"
+		"\tbytes[2] = value >> 8;\n"
+		"\tbytes[3] = value;\n"
+		"}\n"
+		"\n"
+		"static inline void kelimelik_schema_put_u64(uint8_t *bytes, uint64_t value) {\n"
+		"\tkelimelik_schema_put_u32(bytes, value >> 32);\n"
+		"\tkelimelik_schema_put_u32(bytes + 4, value);\n"
+		"}\n"
+		"\n"
+		"// Items of integer arrays\n"
+		"static inline uint8_t kelimelik_schema_uint8_at(const kelimelik_schema_array *array, uint32_t index) {\n"
+		"\treturn array->bytes[index];\n"
+		"}\n"
+		"\n"
+		"static inline uint32_t kelimelik_schema_uint32_at(const kelimelik_schema_array *array, uint32_t index) {\n"
+		"\treturn kelimelik_schema_get_u32(array->bytes + ((size_t)index * 4));\n"
+		"}\n"
+		"\n"
+		"static inline uint64_t kelimelik_schema_uint64_at(const kelimelik_schema_array *array, uint32_t index) {\n"
+		"\treturn kelimelik_schema_get_u64(array->bytes + ((size_t)index * 8));\n"
+		"}\n"
+		"\n"
+		"// Walks the items of a string array. cursor starts at array->bytes and is\n"
+		"// moved to the next string.\n"
+		"static inline kelimelik_schema_string kelimelik_schema_next_string(const uint8_t **cursor) {\n"
+		"\tkelimelik_schema_string string = { *cursor + 2, kelimelik_schema_get_u16(*cursor) };\n"
+		"\t*cursor += 2 + string.length;\n"
+		"\treturn string;\n"
+		"}\n"
+		"\n"
+		"// Returns the end of count strings in wire format, or NULL if they don't fit.\n"
+		"static inline const uint8_t *kelimelik_schema_skip_strings(const uint8_t *bytes, const uint8_t *end, uint32_t count) {\n"
+		"\tfor (uint32_t i=0; i<count; i++) {\n"
+		"\t\tif ((end - bytes) < 2) return NULL;\n"
+		"\t\tsize_t length = kelimelik_schema_get_u16(bytes);\n"
+		"\t\tbytes += 2;\n"
+		"\t\tif ((size_t)(end - bytes) < length) return NULL;\n"
+		"\t\tbytes += length;\n"
+		"\t}\n"
+		"\treturn bytes;\n"
+		"}\n"
+		"\n"
+		"// Returns the end of an object of any type, or NULL if it doesn't fit.\n"
+		"static inline const uint8_t *kelimelik_schema_skip_object(const uint8_t *bytes, const uint8_t *end) {\n"
+		"\tif (bytes >= end) return NULL;\n"
+		"\tsize_t size;\n"
+		"\tswitch (*(bytes++)) {\n"
+		"\t\tcase KELIMELIK_OBJECT_UINT8: size = 1; break;\n"
+		"\t\tcase KELIMELIK_OBJECT_UINT32: size = 4; break;\n"
+		"\t\tcase KELIMELIK_OBJECT_UINT64: size = 8; break;\n"
+		"\t\tcase KELIMELIK_OBJECT_STRING:\n"
+		"\t\t\treturn kelimelik_schema_skip_strings(bytes, end, 1);\n"
+		"\t\tcase KELIMELIK_OBJECT_ARRAY: {\n"
+		"\t\t\tif ((end - bytes) < 5) return NULL;\n"
+		"\t\t\tuint32_t count = kelimelik_schema_get_u32(bytes);\n"
+		"\t\t\tuint8_t item_type = bytes[4];\n"
+		"\t\t\tbytes += 5;\n"
+		"\t\t\tswitch (item_type) {\n"
+		"\t\t\t\tcase KELIMELIK_OBJECT_UINT8: size = 1; break;\n"
+		"\t\t\t\tcase KELIMELIK_OBJECT_UINT32: size = 4; break;\n"
+		"\t\t\t\tcase KELIMELIK_OBJECT_UINT64: size = 8; break;\n"
+		"\t\t\t\tcase KELIMELIK_OBJECT_STRING:\n"
+		"\t\t\t\t\treturn kelimelik_schema_skip_strings(bytes, end, count);\n"
+		"\t\t\t\tdefault:\n"
+		"\t\t\t\t\treturn NULL;\n"
+		"\t\t\t}\n"
+		"\t\t\tif (((size_t)(end - bytes) / size) < count) return NULL;\n"
+		"\t\t\treturn bytes + ((size_t)count * size);\n"
+		"\t\t}\n"
+		"\t\tdefault:\n"
+		"\t\t\treturn NULL;\n"
+		"\t}\n"
+		"\tif ((size_t)(end - bytes) < size) return NULL;\n"
+		"\treturn bytes + size;\n"
+		"}\n"
+		"\n"
+		"#endif\n"
+		"\n",
+		out
+	);
+}
+
+// Writes the header length, header and object count as a string literal.
+// Hex escapes are split off so that they don't swallow the next characters.
+static void write_prefix_literal(FILE *out, const struct message *message) {
+	size_t length = strlen(message->header);
+	fprintf(out, "\"\\x%02zX\\x%02zX\" \"%s\" \"\\x%02X\"", length >> 8, length & 0xFF, message->header, message->field_count);
+}
+
+static void write_struct(FILE *out, const struct message *message) {
+	fprintf(out, "#define ");
+	for (const char *c = message->name; *c; c++) {
+		fputc(toupper((unsigned char)*c), out);
+	}
+	fprintf(out, "_HEADER \"%s\"\n\n", message->header);
+	fprintf(out, "typedef struct {\n");
+	for (int i=0; i<message->field_count; i++) {
+		fprintf(out, "\t%s %s;\n", kinds[message->fields[i].kind].c_type, message->fields[i].name);
+	}
+	if (message->has_rest) {
+		fprintf(out, message->field_count ? "\n\t// The objects after the known ones\n" : "\t// The objects after the known ones\n");
+		fprintf(out, "\tuint8_t rest_count;\n");
+		fprintf(out, "\tkelimelik_schema_raw rest;\n");
+	}
+	if (!message->field_count && !message->has_rest) {
+		fprintf(out, "\tchar unused;\n");
+	}
+	fprintf(out, "} %s;\n\n", message->name);
+}
+
+static void write_decode(FILE *out, const struct message *message) {
+	const char *mismatch = "KELIMELIK_SCHEMA_RESULT(KELIMELIK_ERROR_DIFFERENT_FORMAT)";
+	size_t header_length = strlen(message->header);
+	fprintf(out, "// Decodes a whole frame, including the size prefix. Returns\n");
+	fprintf(out, "// KELIMELIK_ERROR_DIFFERENT_FORMAT if the frame is a different message.\n");
+	fprintf(out, "static inline kelimelik_error %s_decode(const uint8_t *frame, size_t length, %s *out) {\n", message->name, message->name);
+	fprintf(out, "\tconst uint8_t *end = frame + length;\n");
+	fprintf(out, "\tif (\n");
+	fprintf(out, "\t\t(length < %zu) ||\n", prefix_size(message));
+	fprintf(out, "\t\t(kelimelik_schema_get_u32(frame) != (length - 4)) ||\n");
+	if (message->has_rest) {
+		fprintf(out, "\t\tmemcmp(frame + 4, \"\\x%02zX\\x%02zX\" \"%s\", %zu)", header_length >> 8, header_length & 0xFF, message->header, header_length + 2);
+		if (message->field_count) {
+			fprintf(out, " ||\n\t\t(frame[%zu] < %d)", prefix_size(message) - 1, message->field_count);
+		}
+		fprintf(out, "\n");
+	}
+	else {
+		fprintf(out, "\t\tmemcmp(frame + 4, ");
+		write_prefix_literal(out, message);
+		fprintf(out, ", %zu)\n", header_length + 3);
+	}
+	fprintf(out, "\t) {\n");
+	fprintf(out, "\t\treturn %s;\n", mismatch);
+	fprintf(out, "\t}\n");
+	if (message->field_count || message->has_rest) {
+		fprintf(out, "\tconst uint8_t *bytes = frame + %zu;\n", prefix_size(message));
+	}
+	for (int i=0; i<message->field_count;) {
+		const struct field *field = &message->fields[i];
+		if (is_fixed(field->kind)) {
+			// A run of fixed objects is checked at once and read at
+			// constant offsets
+			int run_end = i;
+			int run_size = 0;
+			while ((run_end < message->field_count) && is_fixed(message->fields[run_end].kind)) {
+				run_size += fixed_size(message->fields[run_end++].kind);
+			}
+			fprintf(out, "\tif (\n");
+			fprintf(out, "\t\t((end - bytes) < %d)", run_size);
+			for (int j=i, offset=0; j<run_end; offset += fixed_size(message->fields[j++].kind)) {
+				fprintf(out, " ||\n\t\t(bytes[%d] != %s)", offset, kinds[message->fields[j].kind].wire_type);
+			}
+			fprintf(out, "\n\t) {\n\t\treturn %s;\n\t}\n", mismatch);
+			for (int j=i, offset=0; j<run_end; offset += fixed_size(message->fields[j++].kind)) {
+				const struct field *run_field = &message->fields[j];
+				switch (run_field->kind) {
+					case FIELD_UINT8:
+						fprintf(out, "\tout->%s = bytes[%d];\n", run_field->name, offset + 1);
+						break;
+					case FIELD_UINT32:
+						fprintf(out, "\tout->%s = kelimelik_schema_get_u32(bytes + %d);\n", run_field->name, offset + 1);
+						break;
+					default:
+						fprintf(out, "\tout->%s = kelimelik_schema_get_u64(bytes + %d);\n", run_field->name, offset + 1);
+						break;
+				}
+			}
+			fprintf(out, "\tbytes += %d;\n", run_size);
+			i = run_end;
+			continue;
+		}
+		const char *name = field->name;
+		switch (field->kind) {
+			case FIELD_STRING:
+				fprintf(out, "\tif (((end - bytes) < 3) || (bytes[0] != KELIMELIK_OBJECT_STRING)) {\n\t\treturn %s;\n\t}\n", mismatch);
+				fprintf(out, "\tout->%s.length = kelimelik_schema_get_u16(bytes + 1);\n", name);
+				fprintf(out, "\tout->%s.bytes = bytes + 3;\n", name);
+				fprintf(out, "\tif ((size_t)(end - out->%s.bytes) < out->%s.length) {\n\t\treturn %s;\n\t}\n", name, name, mismatch);
+				fprintf(out, "\tbytes = out->%s.bytes + out->%s.length;\n", name, name);
+				break;
+			case FIELD_ANY:
+				fprintf(out, "\tout->%s.bytes = bytes;\n", name);
+				fprintf(out, "\tif (!(bytes = kelimelik_schema_skip_object(bytes, end))) {\n\t\treturn %s;\n\t}\n", mismatch);
+				fprintf(out, "\tout->%s.length = bytes - out->%s.bytes;\n", name, name);
+				break;
+			default:
+				fprintf(out, "\tif (((end - bytes) < 6) || (bytes[0] != KELIMELIK_OBJECT_ARRAY) || (bytes[5] != %s)) {\n\t\treturn %s;\n\t}\n", kinds[field->kind].wire_type, mismatch);
+				fprintf(out, "\tout->%s.count = kelimelik_schema_get_u32(bytes + 1);\n", name);
+				fprintf(out, "\tout->%s.bytes = bytes + 6;\n", name);
+				if (field->kind == FIELD_STRING_ARRAY) {
+					fprintf(out, "\tif (!(bytes = kelimelik_schema_skip_strings(out->%s.bytes, end, out->%s.count))) {\n\t\treturn %s;\n\t}\n", name, name, mismatch);
+					fprintf(out, "\tout->%s.length = bytes - out->%s.bytes;\n", name, name);
+				}
+				else {
+					int size = kinds[field->kind].size;
+					fprintf(out, "\tif (((size_t)(end - out->%s.bytes) / %d) < out->%s.count) {\n\t\treturn %s;\n\t}\n", name, size, name, mismatch);
+					fprintf(out, "\tout->%s.length = (size_t)out->%s.count * %d;\n", name, name, size);
+					fprintf(out, "\tbytes = out->%s.bytes + out->%s.length;\n", name, name);
+				}
+				break;
+		}
+		i++;
+	}
+	if (message->has_rest) {
+		if (message->field_count) {
+			fprintf(out, "\tout->rest_count = frame[%zu] - %d;\n", prefix_size(message) - 1, message->field_count);
+		}
+		else {
+			fprintf(out, "\tout->rest_count = frame[%zu];\n", prefix_size(message) - 1);
+		}
+		fprintf(out, "\tout->rest.bytes = bytes;\n");
+		fprintf(out, "\tout->rest.length = end - bytes;\n");
+	}
+	else if (message->field_count) {
+		fprintf(out, "\tif (bytes != end) {\n\t\treturn %s;\n\t}\n", mismatch);
+	}
+	else {
+		fprintf(out, "\tif (length != %zu) {\n\t\treturn %s;\n\t}\n", prefix_size(message), mismatch);
+	}
+	fprintf(out, "\treturn KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);\n");
+	fprintf(out, "}\n\n");
+}
+
+static void write_encode(FILE *out, const struct message *message) {
+	// Encoded size
+	size_t constant_size = prefix_size(message);
+	for (int i=0; i<message->field_count; i++) {
+		enum field_kind kind = message->fields[i].kind;
+		if (is_fixed(kind)) constant_size += fixed_size(kind);
+		else if (kind == FIELD_STRING) constant_size += 3;
+		else if (is_array(kind)) constant_size += 6;
+	}
+	fprintf(out, "static inline size_t %s_encoded_size(const %s *message) {\n", message->name, message->name);
+	fprintf(out, "\treturn %zu", constant_size);
+	for (int i=0; i<message->field_count; i++) {
+		if (!is_fixed(message->fields[i].kind)) {
+			fprintf(out, " + message->%s.length", message->fields[i].name);
+		}
+	}
+	if (message->has_rest) {
+		fprintf(out, " + message->rest.length");
+	}
+	fprintf(out, ";\n}\n\n");
+
+	// Encoder
+	fprintf(out, "// Appends the frame to the buffer.\n");
+	fprintf(out, "static inline kelimelik_error %s_encode(const %s *message, kelimelik_buffer *buffer) {\n", message->name, message->name);
+	fprintf(out, "\tsize_t size = %s_encoded_size(message);\n", message->name);
+	fprintf(out, "\tkelimelik_error error = kelimelik_buffer_reserve(buffer, size);\n");
+	fprintf(out, "\tif (KELIMELIK_IS_ERROR(error)) return error;\n");
+	fprintf(out, "\tuint8_t *bytes = buffer->bytes + buffer->length;\n");
+	fprintf(out, "\tkelimelik_schema_put_u32(bytes, size - 4);\n");
+	fprintf(out, "\tmemcpy(bytes + 4, ");
+	write_prefix_literal(out, message);
+	fprintf(out, ", %zu);\n", prefix_size(message) - 4);
+	if (message->has_rest) {
+		fprintf(out, "\tbytes[%zu] += message->rest_count;\n", prefix_size(message) - 1);
+	}
+	size_t offset = prefix_size(message);
+	for (int i=0; i<message->field_count; i++) {
+		const struct field *field = &message->fields[i];
+		const char *name = field->name;
+		switch (field->kind) {
+			case FIELD_UINT8:
+				fprintf(out, "\tbytes[%zu] = %s;\n", offset, kinds[field->kind].wire_type);
+				fprintf(out, "\tbytes[%zu] = message->%s;\n", offset + 1, name);
+				offset += 2;
+				break;
+			case FIELD_UINT32:
+			case FIELD_UINT64:
+				fprintf(out, "\tbytes[%zu] = %s;\n", offset, kinds[field->kind].wire_type);
+				fprintf(out, "\tkelimelik_schema_put_u%d(bytes + %zu, message->%s);\n", kinds[field->kind].size * 8, offset + 1, name);
+				offset += fixed_size(field->kind);
+				break;
+			case FIELD_STRING:
+				fprintf(out, "\tbytes[%zu] = KELIMELIK_OBJECT_STRING;\n", offset);
+				fprintf(out, "\tkelimelik_schema_put_u16(bytes + %zu, message->%s.length);\n", offset + 1, name);
+				fprintf(out, "\tmemcpy(bytes + %zu, message->%s.bytes, message->%s.length);\n", offset + 3, name, name);
+				fprintf(out, "\tbytes += %zu + message->%s.length;\n", offset + 3, name);
+				offset = 0;
+				break;
+			case FIELD_ANY:
+				fprintf(out, "\tmemcpy(%s, message->%s.bytes, message->%s.length);\n", at(offset), name, name);
+				if (offset) {
+					fprintf(out, "\tbytes += %zu + message->%s.length;\n", offset, name);
+				}
+				else {
+					fprintf(out, "\tbytes += message->%s.length;\n", name);
+				}
+				offset = 0;
+				break;
+			default:
+				fprintf(out, "\tbytes[%zu] = KELIMELIK_OBJECT_ARRAY;\n", offset);
+				fprintf(out, "\tkelimelik_schema_put_u32(bytes + %zu, message->%s.count);\n", offset + 1, name);
+				fprintf(out, "\tbytes[%zu] = %s;\n", offset + 5, kinds[field->kind].wire_type);
+				fprintf(out, "\tmemcpy(bytes + %zu, message->%s.bytes, message->%s.length);\n", offset + 6, name, name);
+				fprintf(out, "\tbytes += %zu + message->%s.length;\n", offset + 6, name);
+				offset = 0;
+				break;
+		}
+	}
+	if (message->has_rest) {
+		fprintf(out, "\tmemcpy(%s, message->rest.bytes, message->rest.length);\n", at(offset));
+	}
+	fprintf(out, "\tbuffer->length += size;\n");
+	fprintf(out, "\treturn KELIMELIK_SCHEMA_RESULT(KELIMELIK_SUCCESS);\n");
+	fprintf(out, "}\n\n");
+}
+
+static int fail(const char *path, int line, const char *message) {
+	fprintf(stderr, "%s:%d: %s\n", path, line, message);
+	return EXIT_FAILURE;
+}
+
+static bool find_kind(const char *name, enum field_kind *kind) {
+	for (size_t i=0; i<(sizeof(kinds) / sizeof(*kinds)); i++) {
+		if (!strcmp(kinds[i].name, name)) {
+			*kind = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <schema> <output header>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	FILE *input = fopen(argv[1], "r");
+	if (!input) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	static struct message messages[256];
+	int message_count = 0;
+	struct message *message = NULL;
+	char line[1024];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), input)) {
+		line_number++;
+		char *comment = strchr(line, '#');
+		if (comment) {
+			*comment = 0;
+		}
+		char *words[4];
+		int word_count = 0;
+		for (char *word = strtok(line, " \t\r\n"); word; word = strtok(NULL, " \t\r\n")) {
+			if (word_count == 4) {
+				return fail(argv[1], line_number, "Too many words");
+			}
+			words[word_count++] = word;
+		}
+		if (!word_count) {
+			continue;
+		}
+		if (!message) {
+			if (strcmp(words[0], "message") || ((word_count != 2) && (word_count != 4))) {
+				return fail(argv[1], line_number, "Expected message <header> [as <name>]");
+			}
+			if ((word_count == 4) && strcmp(words[2], "as")) {
+				return fail(argv[1], line_number, "Expected message <header> [as <name>]");
+			}
+			if ((message_count == 256) || (strlen(words[1]) >= MAX_NAME)) {
+				return fail(argv[1], line_number, "Too many messages or header is too long");
+			}
+			message = &messages[message_count++];
+			memset(message, 0, sizeof(*message));
+			strcpy(message->header, words[1]);
+			if (word_count == 4) {
+				if (!is_identifier(words[3]) || (strlen(words[3]) >= MAX_NAME)) {
+					return fail(argv[1], line_number, "Invalid name");
+				}
+				strcpy(message->name, words[3]);
+			}
+			else {
+				derive_name(message->header, message->name);
+			}
+			for (const char *c = message->header; *c; c++) {
+				if ((*c == '"') || (*c == '\\') || !isprint((unsigned char)*c)) {
+					return fail(argv[1], line_number, "Headers can only contain printable characters other than quotes and backslashes");
+				}
+			}
+			continue;
+		}
+		if (!strcmp(words[0], "end") && (word_count == 1)) {
+			message = NULL;
+			continue;
+		}
+		if (message->has_rest) {
+			return fail(argv[1], line_number, "... must be the last line of a message");
+		}
+		if (!strcmp(words[0], "...") && (word_count == 1)) {
+			message->has_rest = true;
+			continue;
+		}
+		struct field *field = &message->fields[message->field_count];
+		if ((word_count != 2) || !find_kind(words[0], &field->kind)) {
+			return fail(argv[1], line_number, "Expected <type> <name>");
+		}
+		if (!is_identifier(words[1]) || (strlen(words[1]) >= MAX_NAME) || !strcmp(words[1], "rest") || !strcmp(words[1], "rest_count")) {
+			return fail(argv[1], line_number, "Invalid field name");
+		}
+		if (message->field_count == MAX_FIELDS) {
+			return fail(argv[1], line_number, "Too many fields");
+		}
+		strcpy(field->name, words[1]);
+		message->field_count++;
+	}
+	fclose(input);
+	if (message) {
+		return fail(argv[1], line_number, "Missing end");
+	}
+
+	FILE *out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	const char *schema_name = strrchr(argv[1], '/') ? (strrchr(argv[1], '/') + 1) : argv[1];
+	const char *output_name = strrchr(argv[2], '/') ? (strrchr(argv[2], '/') + 1) : argv[2];
+	char guard[MAX_NAME];
+	size_t guard_length = 0;
+	for (; *output_name && (guard_length < (MAX_NAME - 1)); output_name++) {
+		guard[guard_length++] = isalnum((unsigned char)*output_name) ? toupper((unsigned char)*output_name) : '_';
+	}
+	guard[guard_length] = 0;
+	fprintf(out, "// Generated by tools/schema-gen from %s. Don't edit.\n\n", schema_name);
+	fprintf(out, "#ifndef __%s\n#define __%s\n\n", guard, guard);
+	write_prelude(out);
+	for (int i=0; i<message_count; i++) {
+		write_struct(out, &messages[i]);
+		write_decode(out, &messages[i]);
+		write_encode(out, &messages[i]);
+	}
+	fprintf(out, "#endif\n");
+	if (fclose(out)) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}